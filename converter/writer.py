@@ -8,12 +8,18 @@ class FloatType:
     F16 = 1
     Q40 = 2
     Q80 = 3
+    Q4K = 4
+    Q6K = 5
+    Q2K = 6
 
 floatTypeMap = {
     'f32': FloatType.F32,
     'f16': FloatType.F16,
     'q40': FloatType.Q40,
     'q80': FloatType.Q80,
+    'q4k': FloatType.Q4K,
+    'q6k': FloatType.Q6K,
+    'q2k': FloatType.Q2K,
 }
 floatTypeNames = list(floatTypeMap.keys())
 
@@ -73,6 +79,147 @@ def writeQuantizedQ80Tensor(file, x):
         nBytes += len(buffer)
     return nBytes
 
+# Super-blocks quantized at once, it limits the memory used by the temporary arrays
+SUPER_BLOCKS_PER_CHUNK = 16384
+
+def fitScaleMin(x, w, nMax, rMin, nSteps):
+    # x ~ scale * q - min, the same search as fitScaleMin in nn-quants.cpp
+    xMin = np.minimum(np.min(x, axis=-1, keepdims=True), 0)
+    xMax = np.max(x, axis=-1, keepdims=True)
+    sumW = np.sum(w, axis=-1, keepdims=True)
+    sumX = np.sum(w * x, axis=-1, keepdims=True)
+    valid = xMax > xMin
+    span = np.where(valid, xMax - xMin, 1)
+
+    bestScale = span / nMax
+    bestXMin = xMin
+    bestError = np.sum(w * (bestScale * np.rint((x - xMin) / bestScale) + xMin - x) ** 2, axis=-1, keepdims=True)
+    for step in range(0, nSteps + 1):
+        iscale = (rMin + 0.1 * step + nMax) / span
+        l = np.clip(np.rint(iscale * (x - xMin)), 0, nMax)
+        sumL = np.sum(w * l, axis=-1, keepdims=True)
+        sumL2 = np.sum(w * l * l, axis=-1, keepdims=True)
+        sumXL = np.sum(w * l * x, axis=-1, keepdims=True)
+        det = sumW * sumL2 - sumL * sumL
+        ok = det > 0
+        det = np.where(ok, det, 1)
+        scale = (sumW * sumXL - sumX * sumL) / det
+        minValue = (sumL2 * sumX - sumL * sumXL) / det
+        positive = minValue > 0
+        scale = np.where(positive, sumXL / np.where(sumL2 > 0, sumL2, 1), scale)
+        minValue = np.where(positive, 0, minValue)
+        error = np.sum(w * (scale * l + minValue - x) ** 2, axis=-1, keepdims=True)
+        better = ok & (error < bestError)
+        bestError = np.where(better, error, bestError)
+        bestScale = np.where(better, scale, bestScale)
+        bestXMin = np.where(better, minValue, bestXMin)
+    scales = np.where(valid, bestScale, 0)[..., 0]
+    mins = -np.where(valid, bestXMin, xMin)[..., 0]
+    return scales.astype(np.float32), mins.astype(np.float32)
+
+def fitScale(x, nMax):
+    # x ~ scale * q, the same search as fitScale in nn-quants.cpp
+    maxValue = np.take_along_axis(x, np.argmax(np.abs(x), axis=-1)[..., np.newaxis], axis=-1)
+    valid = maxValue != 0
+    maxValue = np.where(valid, maxValue, 1)
+    bestScale = maxValue / -nMax
+    bestError = np.full(maxValue.shape, np.inf, dtype=np.float32)
+    for step in range(-9, 10):
+        iscale = -(nMax + 0.1 * step) / maxValue
+        l = np.clip(np.rint(iscale * x), -nMax, nMax - 1)
+        sumXL = np.sum(x * l, axis=-1, keepdims=True)
+        sumL2 = np.sum(l * l, axis=-1, keepdims=True)
+        ok = sumL2 > 0
+        scale = sumXL / np.where(ok, sumL2, 1)
+        error = np.sum((x - scale * l) ** 2, axis=-1, keepdims=True)
+        better = ok & (error < bestError)
+        bestError = np.where(better, error, bestError)
+        bestScale = np.where(better, scale, bestScale)
+    return np.where(valid, bestScale, 0)[..., 0].astype(np.float32)
+
+def quantizeQ4K(x):
+    # The layout of NnBlockQ4K: 8 sub-blocks of 32 weights with 6-bit scales and mins
+    blocks = x.reshape(-1, 8, 32)
+    avX = np.sqrt(np.mean(blocks * blocks, axis=-1, keepdims=True))
+    scales, mins = fitScaleMin(blocks, avX + np.abs(blocks), 15, -1, 20)
+    maxScale = np.max(scales, axis=1)
+    maxMin = np.max(mins, axis=1)
+    iscale = np.where(maxScale > 0, 63 / np.where(maxScale > 0, maxScale, 1), 0)
+    imin = np.where(maxMin > 0, 63 / np.where(maxMin > 0, maxMin, 1), 0)
+    ls = np.clip(np.rint(iscale[:, np.newaxis] * scales), 0, 63).astype(np.uint8)
+    lm = np.clip(np.rint(imin[:, np.newaxis] * mins), 0, 63).astype(np.uint8)
+
+    out = np.zeros(len(blocks), dtype=[('d', '<f2'), ('dmin', '<f2'), ('scales', 'u1', 12), ('qs', 'u1', 128)])
+    out['d'] = (maxScale / 63).astype(np.float16)
+    out['dmin'] = (maxMin / 63).astype(np.float16)
+    out['scales'][:, 0:4] = ls[:, 0:4] | ((ls[:, 4:8] >> 4) << 6)
+    out['scales'][:, 4:8] = lm[:, 0:4] | ((lm[:, 4:8] >> 4) << 6)
+    out['scales'][:, 8:12] = (ls[:, 4:8] & 0xF) | ((lm[:, 4:8] & 0xF) << 4)
+
+    # The weights are quantized with the scales as they are stored
+    dl = out['d'].astype(np.float32)[:, np.newaxis] * ls
+    ml = out['dmin'].astype(np.float32)[:, np.newaxis] * lm
+    q = np.rint((blocks + ml[..., np.newaxis]) / np.where(dl != 0, dl, 1)[..., np.newaxis])
+    q = np.where(dl[..., np.newaxis] != 0, np.clip(q, 0, 15), 0).astype(np.uint8)
+    out['qs'] = (q[:, 0::2, :] | (q[:, 1::2, :] << 4)).reshape(-1, 128)
+    return out.tobytes()
+
+def quantizeQ6K(x):
+    # The layout of NnBlockQ6K: 16 sub-blocks of 16 weights with 8-bit scales
+    blocks = x.reshape(-1, 16, 16)
+    scales = fitScale(blocks, 32)
+    maxScale = np.take_along_axis(scales, np.argmax(np.abs(scales), axis=1)[:, np.newaxis], axis=1)[:, 0]
+    iscale = np.where(maxScale != 0, -128 / np.where(maxScale != 0, maxScale, 1), 0)
+
+    out = np.zeros(len(blocks), dtype=[('ql', 'u1', 128), ('qh', 'u1', 64), ('scales', 'i1', 16), ('d', '<f2')])
+    out['scales'] = np.clip(np.rint(iscale[:, np.newaxis] * scales), -128, 127).astype(np.int8)
+    out['d'] = np.where(iscale != 0, 1 / np.where(iscale != 0, iscale, 1), 0).astype(np.float16)
+
+    dl = out['d'].astype(np.float32)[:, np.newaxis] * out['scales']
+    q = np.rint(blocks / np.where(dl != 0, dl, 1)[..., np.newaxis])
+    q = (np.where(dl[..., np.newaxis] != 0, np.clip(q, -32, 31), 0) + 32).astype(np.uint8)
+    chunks = q.reshape(-1, 8, 32)
+    out['ql'] = ((chunks[:, :, 0:16] & 0xF) | ((chunks[:, :, 16:32] & 0xF) << 4)).reshape(-1, 128)
+    high = (chunks >> 4).reshape(-1, 8, 4, 8)
+    out['qh'] = (high[:, :, 0, :] | (high[:, :, 1, :] << 2) | (high[:, :, 2, :] << 4) | (high[:, :, 3, :] << 6)).reshape(-1, 64)
+    return out.tobytes()
+
+def quantizeQ2K(x):
+    # The layout of NnBlockQ2K: 16 sub-blocks of 16 weights with 4-bit scales and mins
+    blocks = x.reshape(-1, 16, 16)
+    scales, mins = fitScaleMin(blocks, np.abs(blocks), 3, -0.5, 15)
+    maxScale = np.max(scales, axis=1)
+    maxMin = np.max(mins, axis=1)
+    iscale = np.where(maxScale > 0, 15 / np.where(maxScale > 0, maxScale, 1), 0)
+    imin = np.where(maxMin > 0, 15 / np.where(maxMin > 0, maxMin, 1), 0)
+    ls = np.clip(np.rint(iscale[:, np.newaxis] * scales), 0, 15).astype(np.uint8)
+    lm = np.clip(np.rint(imin[:, np.newaxis] * mins), 0, 15).astype(np.uint8)
+
+    out = np.zeros(len(blocks), dtype=[('scales', 'u1', 16), ('qs', 'u1', 64), ('d', '<f2'), ('dmin', '<f2')])
+    out['scales'] = ls | (lm << 4)
+    out['d'] = (maxScale / 15).astype(np.float16)
+    out['dmin'] = (maxMin / 15).astype(np.float16)
+
+    dl = out['d'].astype(np.float32)[:, np.newaxis] * ls
+    ml = out['dmin'].astype(np.float32)[:, np.newaxis] * lm
+    q = np.rint((blocks + ml[..., np.newaxis]) / np.where(dl != 0, dl, 1)[..., np.newaxis])
+    q = np.where(dl[..., np.newaxis] != 0, np.clip(q, 0, 3), 0).astype(np.uint8)
+    chunks = q.reshape(-1, 8, 4, 8)
+    out['qs'] = (chunks[:, :, 0, :] | (chunks[:, :, 1, :] << 2) | (chunks[:, :, 2, :] << 4) | (chunks[:, :, 3, :] << 6)).reshape(-1, 64)
+    return out.tobytes()
+
+def writeQuantizedSuperBlockTensor(file, x, quantize):
+    x = x.to(torch.float32).numpy().astype(np.float32)
+    blockSize = 256
+    assert(x.shape[0] % blockSize == 0)
+    chunkSize = SUPER_BLOCKS_PER_CHUNK * blockSize
+    nBytes = 0
+    for i in range(0, len(x), chunkSize):
+        buffer = quantize(x[i:i+chunkSize])
+        file.write(buffer)
+        nBytes += len(buffer)
+    return nBytes
+
 def writeF32Tensor(file, d):
     chunkSize = 10000
     nBytes = 0
@@ -101,6 +248,12 @@ def writeTensor(file, tensor, floatType):
         nBytes = writeQuantizedQ40Tensor(file, d)
     elif (floatType == FloatType.Q80):
         nBytes = writeQuantizedQ80Tensor(file, d)
+    elif (floatType == FloatType.Q4K):
+        nBytes = writeQuantizedSuperBlockTensor(file, d, quantizeQ4K)
+    elif (floatType == FloatType.Q6K):
+        nBytes = writeQuantizedSuperBlockTensor(file, d, quantizeQ6K)
+    elif (floatType == FloatType.Q2K):
+        nBytes = writeQuantizedSuperBlockTensor(file, d, quantizeQ2K)
     else:
         raise Exception(f'Unknown float type')
     t1 = time.time()
@@ -1,4 +1,5 @@
 #include "app.hpp"
+#include "nn/nn-topology.hpp"
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
@@ -14,9 +15,31 @@ static NnFloatType parseFloatType(char *val) {
     if (std::strcmp(val, "f16") == 0) return F_16;
     if (std::strcmp(val, "q40") == 0) return F_Q40;
     if (std::strcmp(val, "q80") == 0) return F_Q80;
+    if (std::strcmp(val, "q4k") == 0) return F_Q4K;
+    if (std::strcmp(val, "q6k") == 0) return F_Q6K;
+    if (std::strcmp(val, "q2k") == 0) return F_Q2K;
     throw std::runtime_error("Invalid float type: " + std::string(val));
 }
 
+static NnCpuSplitMode parseCpuSplitMode(char *val) {
+    if (std::strcmp(val, "static") == 0) return SPLIT_STATIC;
+    if (std::strcmp(val, "chunked") == 0) return SPLIT_CHUNKED;
+    throw std::runtime_error("Invalid CPU split mode: " + std::string(val));
+}
+
+static NnSyncType parseAllReduceType(char *val) {
+    if (std::strcmp(val, "gather") == 0) return SYNC_NODE_SLICES;
+    if (std::strcmp(val, "ring") == 0) return SYNC_ALL_REDUCE_RING;
+    if (std::strcmp(val, "halving") == 0) return SYNC_ALL_REDUCE_HALVING;
+    throw std::runtime_error("Invalid all-reduce type: " + std::string(val));
+}
+
+static NnAttentionType parseAttentionType(char *val) {
+    if (std::strcmp(val, "full") == 0) return ATT_FULL_SCORES;
+    if (std::strcmp(val, "flash") == 0) return ATT_FLASH;
+    throw std::runtime_error("Invalid attention type: " + std::string(val));
+}
+
 static ChatTemplateType parseChatTemplateType(char *val) {
     if (std::strcmp(val, "llama2") == 0) return TEMPLATE_LLAMA2;
     if (std::strcmp(val, "llama3") == 0) return TEMPLATE_LLAMA3;
@@ -46,6 +69,19 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
     args.maxSeqLen = 0;
     args.netTurbo = true;
     args.gpuIndex = -1;
+    args.spinBudget = DEFAULT_SPIN_BUDGET_US;
+    args.tracePath = nullptr;
+    args.cpuSplitMode = SPLIT_CHUNKED;
+    args.pinCpus = nullptr;
+    args.pinSkipSmt = false;
+    args.pinExclude = nullptr;
+    args.netIoThreads = false;
+    args.fuseOps = true;
+    args.repackWeights = true;
+    args.allReduce = SYNC_NODE_SLICES;
+    bool hasAttention = false;
+    args.kvCacheType = F_32;
+    args.verbose = false;
     int i = 1;
     if (requireMode && argc > 1) {
         args.mode = argv[1];
@@ -113,10 +149,42 @@ AppCliArgs AppCliArgs::parse(int argc, char* *argv, bool requireMode) {
             args.gpuIndex = atoi(value);
         } else if (std::strcmp(name, "--net-turbo") == 0) {
             args.netTurbo = atoi(value) == 1;
+        } else if (std::strcmp(name, "--spin-budget") == 0) {
+            args.spinBudget = atoi(value);
+        } else if (std::strcmp(name, "--trace") == 0) {
+            args.tracePath = value;
+        } else if (std::strcmp(name, "--cpu-split") == 0) {
+            args.cpuSplitMode = parseCpuSplitMode(value);
+        } else if (std::strcmp(name, "--pin-cpus") == 0) {
+            args.pinCpus = value;
+        } else if (std::strcmp(name, "--pin-skip-smt") == 0) {
+            args.pinSkipSmt = atoi(value) == 1;
+        } else if (std::strcmp(name, "--pin-exclude") == 0) {
+            args.pinExclude = value;
+        } else if (std::strcmp(name, "--net-io-threads") == 0) {
+            args.netIoThreads = atoi(value) == 1;
+        } else if (std::strcmp(name, "--fuse-ops") == 0) {
+            args.fuseOps = atoi(value) == 1;
+        } else if (std::strcmp(name, "--repack-weights") == 0) {
+            args.repackWeights = atoi(value) == 1;
+        } else if (std::strcmp(name, "--all-reduce") == 0) {
+            args.allReduce = parseAllReduceType(value);
+        } else if (std::strcmp(name, "--attention") == 0) {
+            args.attention = parseAttentionType(value);
+            hasAttention = true;
+        } else if (std::strcmp(name, "--kv-cache-type") == 0) {
+            args.kvCacheType = parseFloatType(value);
+        } else if (std::strcmp(name, "--verbose") == 0) {
+            args.verbose = atoi(value) == 1;
         } else {
             throw std::runtime_error("Unknown option: " + std::string(name));
         }
     }
+    if (!hasAttention) {
+        // The flash attention reads each KV head once per group of query heads and prefills
+        // all batches in one pass, Vulkan supports only the full-score attention
+        args.attention = args.gpuIndex >= 0 ? ATT_FULL_SCORES : ATT_FLASH;
+    }
     return args;
 }
 
@@ -130,6 +198,36 @@ AppCliArgs::~AppCliArgs() {
         delete[] workerPorts;
 }
 
+static std::vector<NnUint> resolveExecutorCpus(AppCliArgs *args) {
+    std::vector<NnUint> cpus;
+    if (args->pinCpus == nullptr)
+        return cpus;
+
+    NnCpuTopology topology = detectCpuTopology();
+    printCpuTopology(&topology);
+    if (std::strcmp(args->pinCpus, "auto") == 0) {
+        NnCpuSelectionPolicy policy;
+        policy.skipSmtSiblings = args->pinSkipSmt;
+        if (args->pinExclude != nullptr)
+            policy.excludedCpus = parseCpuList(args->pinExclude);
+        cpus = selectExecutorCpus(&topology, args->nThreads, &policy);
+    } else {
+        cpus = parseCpuList(args->pinCpus);
+        if (cpus.size() < args->nThreads)
+            throw std::invalid_argument("--pin-cpus lists " + std::to_string(cpus.size()) + " CPUs for " + std::to_string(args->nThreads) + " threads");
+    }
+
+    // The device allocates and locks its buffers on this thread, so first-touch places them on the node of the first CPU
+    pinCurrentThread(cpus[0]);
+    return cpus;
+}
+
+static NnNodeSynchronizer *createSynchronizer(AppCliArgs *args, NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
+    if (args->netIoThreads)
+        return new NnIoNodeSynchronizer(network, execution, netConfig, nodeConfig);
+    return new NnNetworkNodeSynchronizer(network, execution, netConfig, nodeConfig);
+}
+
 static NnDevice *createDevice(AppCliArgs *args, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution) {
     if (args->gpuIndex >= 0) {
 #if defined(DLLAMA_VULKAN)
@@ -138,7 +236,11 @@ static NnDevice *createDevice(AppCliArgs *args, NnNetConfig *netConfig, NnNodeCo
         throw std::runtime_error("This build does not support GPU");
 #endif
     }
-    return new NnCpuDevice(netConfig, nodeConfig, netExecution);
+    if (args->fuseOps) {
+        NnUint nRemovedOps = fuseCpuOps(nodeConfig);
+        printf("🔗 Fused ops: %u ops removed\n", nRemovedOps);
+    }
+    return new NnCpuDevice(netConfig, nodeConfig, netExecution, args->cpuSplitMode, args->repackWeights);
 }
 
 RootLlmInference::RootLlmInference(LlmNet *net, NnDevice *device, NnNetExecution *execution, NnExecutor *executor, NnNetwork *network) {
@@ -219,8 +321,8 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     close(model_fd);
     if (nNodes > header.nKvHeads)
         throw std::runtime_error("This version does not support more nodes than the number of KV heads in the model");
-    if (header.weightType == F_Q40 && header.syncType != F_Q80)
-        throw std::runtime_error("This version supports only Q40 weights with Q80 sync type");
+    if (header.weightType != F_32 && header.weightType != F_16 && header.syncType != F_Q80 && header.syncType != F_Q40)
+        throw std::runtime_error("This version supports quantized weights only with Q80 or Q40 sync type");
 
     // Load tokenizer using mmap
     int tokenizer_fd = open(args->tokenizerPath, O_RDONLY);
@@ -235,7 +337,7 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
 
     Sampler sampler(header.vocabSize, args->temperature, args->topp, args->seed);
 
-    LlmNet net = buildLlmNet(&header, nNodes, args->nBatches);
+    LlmNet net = buildLlmNet(&header, nNodes, args->nBatches, args->allReduce, args->attention, args->kvCacheType);
     std::unique_ptr<LlmNet, void(*)(LlmNet *)> netPtr(&net, releaseLlmNet);
 
     NnNodeConfig *rootNodeConfig = &net.nodeConfigs[0];
@@ -254,14 +356,20 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     } else {
         networkPtr = NnNetwork::connect(args->nWorkers, args->workerHosts, args->workerPorts);
         network = networkPtr.get();
-        synchronizer.reset(new NnNetworkNodeSynchronizer(network, &execution, &net.netConfig, rootNodeConfig));
+        synchronizer.reset(createSynchronizer(args, network, &execution, &net.netConfig, rootNodeConfig));
 
         NnRootConfigWriter configWriter(network);
         configWriter.writeToWorkers(&net.netConfig, net.nodeConfigs);
     }
 
+    std::vector<NnUint> executorCpus = resolveExecutorCpus(args);
     std::unique_ptr<NnDevice> device(createDevice(args, &net.netConfig, rootNodeConfig, &execution));
     NnExecutor executor(&net.netConfig, rootNodeConfig, device.get(), &execution, synchronizer.get(), args->benchmark);
+    executor.setSpinBudget(args->spinBudget);
+    if (!executorCpus.empty())
+        executor.pinThreads(executorCpus);
+    if (args->verbose)
+        printf("🚧 Barriers: %u per token, %u removed\n", executor.getNBarriers(), executor.getNElidedBarriers());
 
     // Load weights locally
     NnRootWeightLoader weightLoader(&executor, network, nNodes);
@@ -287,9 +395,17 @@ void runInferenceApp(AppCliArgs *args, void (*handler)(AppInferenceContext *cont
     context.network = network;
     context.executor = &executor;
 
+    if (args->tracePath != nullptr)
+        executor.startTrace(DEFAULT_MAX_TRACE_EVENTS_PER_THREAD);
+
     handler(&context);
 
     inference.finish();
+
+    if (args->tracePath != nullptr) {
+        executor.writeChromeTrace(args->tracePath);
+        printf("⏱️ Trace saved to %s\n", args->tracePath);
+    }
 }
 
 void runWorkerApp(AppCliArgs *args) {
@@ -316,10 +432,16 @@ void runWorkerApp(AppCliArgs *args) {
 
         NnNetExecution execution(args->nThreads, &netConfig);
 
+        std::vector<NnUint> executorCpus = resolveExecutorCpus(args);
         std::unique_ptr<NnDevice> device(createDevice(args, &netConfig, &nodeConfig, &execution));
 
-        NnNetworkNodeSynchronizer synchronizer(network, &execution, &netConfig, &nodeConfig);
-        NnExecutor executor(&netConfig, &nodeConfig, device.get(), &execution, &synchronizer, false);
+        std::unique_ptr<NnNodeSynchronizer> synchronizer(createSynchronizer(args, network, &execution, &netConfig, &nodeConfig));
+        NnExecutor executor(&netConfig, &nodeConfig, device.get(), &execution, synchronizer.get(), false);
+        executor.setSpinBudget(args->spinBudget);
+        if (!executorCpus.empty())
+            executor.pinThreads(executorCpus);
+        if (args->verbose)
+            printf("🚧 Barriers: %u per token, %u removed\n", executor.getNBarriers(), executor.getNElidedBarriers());
 
         // Load weights locally
         NnWorkerWeightReader weightReader(&executor, network);
@@ -327,6 +449,8 @@ void runWorkerApp(AppCliArgs *args) {
         munmap(model_data, model_size);
 
         WorkerLlmInference inference(&execution, network);
+        if (args->tracePath != nullptr)
+            executor.startTrace(DEFAULT_MAX_TRACE_EVENTS_PER_THREAD);
         bool isFirstAttempt = true;
         bool isTurboEnabled = false;
         clock_t startTime;
@@ -362,5 +486,10 @@ void runWorkerApp(AppCliArgs *args) {
                 break;
             }
         }
+
+        if (args->tracePath != nullptr) {
+            executor.writeChromeTrace(args->tracePath);
+            printf("⏱️ Trace saved to %s\n", args->tracePath);
+        }
     }
 }
\ No newline at end of file
@@ -59,13 +59,30 @@ struct AppCliArgs {
     bool verbose;
     InferenceMode mode;
     ChatTemplateType chatTemplateType;
+    unsigned int spinBudget;
+    const char* tracePath;
+    NnCpuSplitMode cpuSplitMode;
+    const char* pinCpus;
+    bool pinSkipSmt;
+    const char* pinExclude;
+    bool netIoThreads;
+    bool fuseOps;
+    bool repackWeights;
+    NnSyncType allReduce;
+    NnAttentionType attention;
+    NnFloatType kvCacheType;
 
     AppCliArgs()
         : modelPath(nullptr), tokenizerPath(nullptr), prompt(nullptr),
           roles(nullptr), messages(nullptr), nMessages(0), steps(0),
           temperature(1.0f), topp(0.9f), rngSeed(0),
           bufferFloatType(F_32), maxSeqLen(0), verbose(false),
-          mode(INFERENCE_TEXT), chatTemplateType(TEMPLATE_UNKNOWN) {}
+          mode(INFERENCE_TEXT), chatTemplateType(TEMPLATE_UNKNOWN),
+          spinBudget(DEFAULT_SPIN_BUDGET_US), tracePath(nullptr),
+          cpuSplitMode(SPLIT_CHUNKED), pinCpus(nullptr), pinSkipSmt(false),
+          pinExclude(nullptr), netIoThreads(false),
+          fuseOps(true), repackWeights(true), allReduce(SYNC_NODE_SLICES), attention(ATT_FLASH),
+          kvCacheType(F_32) {}
 
     static AppCliArgs parse(int argc, char* argv[]) {
         AppCliArgs args;
@@ -90,9 +107,48 @@ struct AppCliArgs {
                 std::string type = argv[++i];
                 if (type == "f32") args.bufferFloatType = F_32;
                 else if (type == "q80") args.bufferFloatType = Q_80;
+                else if (type == "q40") args.bufferFloatType = F_Q40;
                 else throw std::runtime_error("Unsupported buffer float type");
             } else if (arg == "--max-seq-len" && i + 1 < argc) {
                 args.maxSeqLen = std::stoi(argv[++i]);
+            } else if (arg == "--spin-budget" && i + 1 < argc) {
+                args.spinBudget = std::stoi(argv[++i]);
+            } else if (arg == "--trace" && i + 1 < argc) {
+                args.tracePath = argv[++i];
+            } else if (arg == "--cpu-split" && i + 1 < argc) {
+                std::string mode = argv[++i];
+                if (mode == "static") args.cpuSplitMode = SPLIT_STATIC;
+                else if (mode == "chunked") args.cpuSplitMode = SPLIT_CHUNKED;
+                else throw std::runtime_error("Unsupported CPU split mode");
+            } else if (arg == "--pin-cpus" && i + 1 < argc) {
+                args.pinCpus = argv[++i];
+            } else if (arg == "--pin-skip-smt" && i + 1 < argc) {
+                args.pinSkipSmt = std::stoi(argv[++i]) == 1;
+            } else if (arg == "--pin-exclude" && i + 1 < argc) {
+                args.pinExclude = argv[++i];
+            } else if (arg == "--net-io-threads" && i + 1 < argc) {
+                args.netIoThreads = std::stoi(argv[++i]) == 1;
+            } else if (arg == "--fuse-ops" && i + 1 < argc) {
+                args.fuseOps = std::stoi(argv[++i]) == 1;
+            } else if (arg == "--repack-weights" && i + 1 < argc) {
+                args.repackWeights = std::stoi(argv[++i]) == 1;
+            } else if (arg == "--all-reduce" && i + 1 < argc) {
+                std::string type = argv[++i];
+                if (type == "gather") args.allReduce = SYNC_NODE_SLICES;
+                else if (type == "ring") args.allReduce = SYNC_ALL_REDUCE_RING;
+                else if (type == "halving") args.allReduce = SYNC_ALL_REDUCE_HALVING;
+                else throw std::runtime_error("Unsupported all-reduce type");
+            } else if (arg == "--attention" && i + 1 < argc) {
+                std::string type = argv[++i];
+                if (type == "full") args.attention = ATT_FULL_SCORES;
+                else if (type == "flash") args.attention = ATT_FLASH;
+                else throw std::runtime_error("Unsupported attention type");
+            } else if (arg == "--kv-cache-type" && i + 1 < argc) {
+                std::string type = argv[++i];
+                if (type == "f32") args.kvCacheType = F_32;
+                else if (type == "f16") args.kvCacheType = F_16;
+                else if (type == "q80") args.kvCacheType = F_Q80;
+                else throw std::runtime_error("Unsupported KV cache type");
             } else if (arg == "--verbose") {
                 args.verbose = true;
             } else if (arg == "--mode" && i + 1 < argc) {
@@ -126,7 +182,7 @@ struct AppInferenceContext {
 
         tokenizer = new Tokenizer(args->tokenizerPath);
         header = new LlmHeader(loadLlmHeader(args->modelPath, args->maxSeqLen, args->bufferFloatType));
-        net = new LlmNet(buildLlmNet(header, 1, 1)); // Single node, single batch
+        net = new LlmNet(buildLlmNet(header, 1, 1, SYNC_NODE_SLICES, args->attention, args->kvCacheType)); // Single node, single batch
 
         NnRootWeightLoader loader(&net->netConfig, net->nodeConfigs, 0);
         loadLlmNetWeight(args->modelPath, net, &loader);
@@ -123,13 +123,27 @@ void printLlmHeader(LlmHeader *header) {
     }
 }
 
-LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
+LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches, NnSyncType zqSyncType, NnAttentionType attentionType, NnFloatType kvCacheType) {
+    if (zqSyncType == SYNC_ALL_REDUCE_HALVING && (nNodes & (nNodes - 1)) != 0)
+        throw std::invalid_argument("Recursive halving all-reduce requires a power of two nodes");
+    // With all-reduce every node keeps the summed row instead of the partial rows of all nodes
+    const bool isAllReduce = zqSyncType == SYNC_ALL_REDUCE_RING || zqSyncType == SYNC_ALL_REDUCE_HALVING;
+
     LlmNet n;
     n.tokenEmbeddingSize = size2D(F_32, h->vocabSize, h->dim);
     n.rmsNormSize = size1D(F_32, h->dim);
 
-    NnKvCacheSlice kvCacheSlice = sliceKvCache(h->kvDim, h->seqLen, nNodes);
-    NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(h->nHeads, h->seqLen, nNodes, nBatches);
+    // The Q40 sync type shrinks only the partial sums exchanged between nodes, the matmuls keep reading Q80 inputs
+    const NnFloatType activationType = h->syncType == F_Q40 ? F_Q80 : h->syncType;
+
+    NnKvCacheSlice kvCacheSlice = sliceKvCache(kvCacheType, h->kvDim, h->seqLen, nNodes);
+    // The attention reads every head from its own blocks
+    if (h->headSize % getBlockSize(kvCacheType) != 0)
+        throw std::invalid_argument("The head size must be a multiple of the KV cache block size");
+    if (attentionType == ATT_FLASH && kvCacheType != F_32 && h->headSize > ATT_FLASH_MAX_HEAD_SIZE)
+        throw std::invalid_argument("The flash attention supports a quantized KV cache only up to a head size of " +
+            std::to_string(ATT_FLASH_MAX_HEAD_SIZE) + ", use the full-score attention or the F32 KV cache");
+    NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(h->nHeads, h->headSize, h->seqLen, nNodes, nBatches);
 
     n.qSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->dim);
     n.kSlice = sliceRowMatmul(h->weightType, nNodes, h->dim, h->kvDim);
@@ -147,7 +161,10 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
     n.tokenPipeIndex = netBuilder.addPipe("TOK", size2D(F_32, nBatches, 1));
     n.xPipeIndex = netBuilder.addPipe("X", size2D(F_32, nBatches, h->dim));
     n.logitsPipeIndex = netBuilder.addPipe("LG", size2D(F_32, nBatches, h->vocabSize));
-    const NnUint zqPipeIndex = netBuilder.addPipe("ZQ", size2D(h->syncType, nBatches, h->dim * nNodes));
+    const NnUint zqPipeIndex = netBuilder.addPipe("ZQ", size2D(h->syncType, nBatches, isAllReduce ? h->dim : h->dim * nNodes));
+    const NnPointerConfig zqOutput = isAllReduce
+        ? pointerBatchConfig(SRC_PIPE, zqPipeIndex)
+        : pointerBatchedSliceConfig(SRC_PIPE, zqPipeIndex);
 
     netBuilder.addPreSync(n.positionPipeIndex);
 
@@ -162,23 +179,25 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
         const NnUint xBufferIndex = nodeBuilder.addBuffer("x", size2D(F_32, nBatches, h->dim));
         
         const NnUint yBufferIndex = nodeBuilder.addBuffer("y", size2D(F_32, nBatches, h->dim));
-        const NnUint yqBufferIndex = h->syncType == F_32
+        const NnUint yqBufferIndex = activationType == F_32
             ? yBufferIndex
-            : nodeBuilder.addBuffer("yq", size2D(h->syncType, nBatches, h->dim));
-        const NnUint yqSliceIndex = nodeBuilder.addBuffer("yq_slice", size2D(h->syncType, nBatches, h->dim / nNodes));
+            : nodeBuilder.addBuffer("yq", size2D(activationType, nBatches, h->dim));
+        const NnUint yqSliceIndex = nodeBuilder.addBuffer("yq_slice", size2D(activationType, nBatches, h->dim / nNodes));
 
         const NnUint qBufferIndex = nodeBuilder.addBuffer("q", size2D(F_32, nBatches, n.qSlice.d0));
         const NnUint kTempBufferIndex = nodeBuilder.addBuffer("k_temp", size2D(F_32, nBatches, n.kSlice.d0));
         const NnUint vTempBufferIndex = nodeBuilder.addBuffer("v_temp", size2D(F_32, nBatches, n.vSlice.d0));
 
         const NnUint dBufferIndex = nodeBuilder.addBuffer("d", size2D(F_32, nBatches, n.w1Slice.d0));
-        const NnUint dqBufferIndex = h->syncType == F_32
+        const NnUint dqBufferIndex = activationType == F_32
             ? dBufferIndex
-            : nodeBuilder.addBuffer("d", size2D(h->syncType, nBatches, n.w1Slice.d0));
+            : nodeBuilder.addBuffer("d", size2D(activationType, nBatches, n.w1Slice.d0));
         const NnUint lBufferIndex = nodeBuilder.addBuffer("l", size2D(F_32, nBatches, n.w3Slice.d0));
         const NnUint invRmsBufferIndex = nodeBuilder.addBuffer("inv_rms", size2D(F_32, nBatches, 1));
         const NnUint ropeCacheBufferIndex = nodeBuilder.addBuffer("rope_cache", ropeSlice.cacheSize);
-        const NnUint attBufferIndex = nodeBuilder.addBuffer("att", multiHeadAttSlice.attSize);
+        const NnUint attBufferIndex = nodeBuilder.addBuffer("att", attentionType == ATT_FULL_SCORES
+            ? multiHeadAttSlice.attSize
+            : multiHeadAttSlice.flashAttSize);
         const NnUint logitsSliceBufferIndex = nodeBuilder.addBuffer("lg", size2D(F_32, nBatches, h->vocabSize / nNodes));
 
         NnSegmentConfigBuilder start;
@@ -237,25 +256,13 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
                     size0(),
                     NnCastOpCodeConfig{});
             }
+            // Every rope follows its matmul, the CPU fusion pass merges them (and the shift of k) into one op
             att.addOp(
                 OP_MATMUL, "block_matmul_q", layerIndex,
                 pointerBatchConfig(SRC_BUFFER, yqBufferIndex),
                 pointerBatchConfig(SRC_BUFFER, qBufferIndex),
                 size2D(h->weightType, n.qSlice.n, n.qSlice.d0),
                 NnMatmulOpConfig{});
-            att.addOp(
-                OP_MATMUL, "block_matmul_k", layerIndex,
-                pointerBatchConfig(SRC_BUFFER, yqBufferIndex),
-                pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
-                size2D(h->weightType, n.kSlice.n, n.kSlice.d0),
-                NnMatmulOpConfig{});
-            att.addOp(
-                OP_MATMUL, "block_matmul_v", layerIndex,
-                pointerBatchConfig(SRC_BUFFER, yqBufferIndex),
-                pointerBatchConfig(SRC_BUFFER, vTempBufferIndex),
-                size2D(h->weightType, n.vSlice.n, n.vSlice.d0),
-                NnMatmulOpConfig{});
-
             att.addOp(
                 OP_ROPE_LLAMA, "block_rope_q", layerIndex,
                 pointerBatchConfig(SRC_BUFFER, qBufferIndex),
@@ -264,6 +271,12 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
                 NnRopeLlamaOpConfig{true, n.positionPipeIndex, ropeCacheBufferIndex, 
                     h->ropeScalingFactor, h->ropeScalingLowFreqFactor, h->ropeScalingHighFreqFactory, h->ropeScalingOrigMaxSeqLen,
                     ropeSlice});
+            att.addOp(
+                OP_MATMUL, "block_matmul_k", layerIndex,
+                pointerBatchConfig(SRC_BUFFER, yqBufferIndex),
+                pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
+                size2D(h->weightType, n.kSlice.n, n.kSlice.d0),
+                NnMatmulOpConfig{});
             att.addOp(
                 OP_ROPE_LLAMA, "block_rope_k", layerIndex,
                 pointerBatchConfig(SRC_BUFFER, kTempBufferIndex),
@@ -278,6 +291,12 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
                 pointerRawConfig(SRC_BUFFER, kBufferIndex),
                 size0(),
                 NnShiftOpCodeConfig{n.positionPipeIndex});
+            att.addOp(
+                OP_MATMUL, "block_matmul_v", layerIndex,
+                pointerBatchConfig(SRC_BUFFER, yqBufferIndex),
+                pointerBatchConfig(SRC_BUFFER, vTempBufferIndex),
+                size2D(h->weightType, n.vSlice.n, n.vSlice.d0),
+                NnMatmulOpConfig{});
             att.addOp(
                 OP_SHIFT, "block_shift_v", layerIndex,
                 pointerBatchConfig(SRC_BUFFER, vTempBufferIndex),
@@ -292,7 +311,7 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
                 NnMultiHeadAttOpConfig{
                     multiHeadAttSlice.nHeads, multiHeadAttSlice.nHeads0,
                     h->nKvHeads, h->headSize, h->seqLen, n.qSlice.d0, kvCacheSlice.kvDim0,
-                    n.positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex});
+                    n.positionPipeIndex, qBufferIndex, kBufferIndex, vBufferIndex, attBufferIndex, attentionType});
             att.addOp(
                 OP_CAST, "block_cast_y2", layerIndex,
                 pointerBatchedSliceConfig(SRC_BUFFER, yBufferIndex),
@@ -308,10 +327,10 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
             att.addOp(
                 OP_CAST, "block_cast_d", layerIndex,
                 pointerBatchConfig(SRC_BUFFER, yBufferIndex),
-                pointerBatchedSliceConfig(SRC_PIPE, zqPipeIndex),
+                zqOutput,
                 size0(),
                 NnCastOpCodeConfig{});
-            att.addSync(zqPipeIndex, SYNC_NODE_SLICES);
+            att.addSync(zqPipeIndex, zqSyncType);
 
             // ff
             ff.addOp(
@@ -381,10 +400,10 @@ LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches) {
             ff.addOp(
                 OP_CAST, "block_cast_d3", layerIndex,
                 pointerBatchConfig(SRC_BUFFER, yBufferIndex),
-                pointerBatchedSliceConfig(SRC_PIPE, zqPipeIndex),
+                zqOutput,
                 size0(),
                 NnCastOpCodeConfig{});
-            ff.addSync(zqPipeIndex, SYNC_NODE_SLICES);
+            ff.addSync(zqPipeIndex, zqSyncType);
 
             nodeBuilder.addSegment(att.build());
             nodeBuilder.addSegment(ff.build());
@@ -88,7 +88,8 @@ typedef struct {
 
 LlmHeader loadLlmHeader(const char* path, const unsigned int maxSeqLen, NnFloatType syncType);
 void printLlmHeader(LlmHeader *header);
-LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches);
+LlmNet buildLlmNet(LlmHeader *h, NnUint nNodes, NnUint nBatches, NnSyncType zqSyncType = SYNC_NODE_SLICES, NnAttentionType attentionType = ATT_FLASH,
+    NnFloatType kvCacheType = F_32);
 void releaseLlmNet(LlmNet *net);
 void loadLlmNetWeight(const char* path, LlmNet *net, NnRootWeightLoader *loader);
 
@@ -49,7 +49,7 @@
 #include <cassert>
 #if defined(__ARM_NEON)
     #include <arm_neon.h>
-#elif defined(__AVX2__)
+#elif defined(__SSE__)
     #include <immintrin.h>
 #endif
 #include "sgemm.hpp"
@@ -856,6 +856,16 @@ bool llamafile_sgemm(int64_t m, int64_t n, int64_t k, const void *A, int64_t lda
             ith, nth};
         tb.matmul(m, n, task);
         return true;
+#elif defined(__SSE__)
+        if (k % 4)
+            return false;
+        tinyBLAS<4, __m128, __m128, float, float, float> tb{
+            k, (const float *)A, lda,
+            (const float *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n, task);
+        return true;
 #elif defined(__ARM_NEON)
         if (n < 4)
             return false;
@@ -898,21 +908,23 @@ bool llamafile_sgemm(int64_t m, int64_t n, int64_t k, const void *A, int64_t lda
             ith, nth};
         tb.matmul(m, n, task);
         return true;
-#elif defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC) && !defined(_MSC_VER)
-        if (n < 8)
-            return false;
-        if (k % 8)
-            return false;
-        if (Btype != F_16)
-            return false;
-        tinyBLAS<8, float16x8_t, float16x8_t, NnFp16, NnFp16, float> tb{
-            k, (const NnFp16 *)A, lda,
-            (const NnFp16 *)B, ldb,
-            (float *)C, ldc,
-            ith, nth};
-        tb.matmul(m, n, task);
-        return true;
 #elif defined(__ARM_NEON) && !defined(_MSC_VER)
+#if defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+        if (Btype == F_16) {
+            if (n < 8)
+                return false;
+            if (k % 8)
+                return false;
+            tinyBLAS<8, float16x8_t, float16x8_t, NnFp16, NnFp16, float> tb{
+                k, (const NnFp16 *)A, lda,
+                (const NnFp16 *)B, ldb,
+                (float *)C, ldc,
+                ith, nth};
+            tb.matmul(m, n, task);
+            return true;
+        }
+#endif
+        // F32 inputs keep F32 accumulators, the F16 weights are widened while loading
         if (k % 4)
             return false;
         if (Btype != F_32)
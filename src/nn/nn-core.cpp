@@ -2,6 +2,7 @@
     #define _USE_MATH_DEFINES
 #endif
 #include "nn-core.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <cmath>
@@ -22,6 +23,18 @@ NnSize getBytes(NnFloatType floatType, NnSize n) {
         assert(n % Q80_BLOCK_SIZE == 0);
         return (n / Q80_BLOCK_SIZE) * sizeof(NnBlockQ80);
     }
+    if (floatType == F_Q4K) {
+        assert(n % Q4K_BLOCK_SIZE == 0);
+        return (n / Q4K_BLOCK_SIZE) * sizeof(NnBlockQ4K);
+    }
+    if (floatType == F_Q6K) {
+        assert(n % Q6K_BLOCK_SIZE == 0);
+        return (n / Q6K_BLOCK_SIZE) * sizeof(NnBlockQ6K);
+    }
+    if (floatType == F_Q2K) {
+        assert(n % Q2K_BLOCK_SIZE == 0);
+        return (n / Q2K_BLOCK_SIZE) * sizeof(NnBlockQ2K);
+    }
     throw std::invalid_argument("Unsupported float type: " + std::to_string(floatType));
 }
 
@@ -34,6 +47,12 @@ NnSize getBlockSize(NnFloatType floatType) {
         return Q40_BLOCK_SIZE;
     if (floatType == F_Q80)
         return Q80_BLOCK_SIZE;
+    if (floatType == F_Q4K)
+        return Q4K_BLOCK_SIZE;
+    if (floatType == F_Q6K)
+        return Q6K_BLOCK_SIZE;
+    if (floatType == F_Q2K)
+        return Q2K_BLOCK_SIZE;
     throw std::invalid_argument("Unsupported float type");
 }
 
@@ -45,6 +64,8 @@ NnOpQuantType getOpQuantType(NnFloatType input, NnFloatType weight, NnFloatType
             return F32_F32_F32;
         if (weight == F_Q40)
             return F32_Q40_F32;
+        if (weight == F_16)
+            return F32_F16_F32;
     }
     if (input == F_32 && output == F_Q80) {
         if (weight == F_UNK || weight == F_32)
@@ -52,6 +73,24 @@ NnOpQuantType getOpQuantType(NnFloatType input, NnFloatType weight, NnFloatType
         if (weight == F_Q40)
             return F32_Q40_Q80;
     }
+    if (input == F_32 && output == F_16) {
+        if (weight == F_UNK || weight == F_32)
+            return F32_F32_F16;
+    }
+    if (input == F_32 && output == F_Q40) {
+        if (weight == F_UNK || weight == F_32)
+            return F32_F32_Q40;
+    }
+    if (input == F_Q40 && output == F_32) {
+        if (weight == F_UNK || weight == F_Q40)
+            return Q40_Q40_F32;
+        if (weight == F_32)
+            return Q40_F32_F32;
+    }
+    if (input == F_Q40 && output == F_Q80) {
+        if (weight == F_32)
+            return Q40_F32_Q80;
+    }
     if (input == F_Q80 && output == F_32) {
         if (weight == F_UNK || weight == F_Q80)
             return Q80_Q80_F32;
@@ -59,10 +98,20 @@ NnOpQuantType getOpQuantType(NnFloatType input, NnFloatType weight, NnFloatType
             return Q80_F32_F32;
         if (weight == F_Q40)
             return Q80_Q40_F32;
+        if (weight == F_16)
+            return Q80_F16_F32;
+        if (weight == F_Q4K)
+            return Q80_Q4K_F32;
+        if (weight == F_Q6K)
+            return Q80_Q6K_F32;
+        if (weight == F_Q2K)
+            return Q80_Q2K_F32;
     }
     if (input == F_Q80 && output == F_Q80) {
         if (weight == F_UNK || weight == F_Q80)
             return Q80_Q80_Q80;
+        if (weight == F_32)
+            return Q80_F32_Q80;
     }
     throw std::invalid_argument("Unsupported op quant: " + 
         std::string(floatTypeToString(input)) + "/" +
@@ -82,6 +131,10 @@ const char *opCodeToString(NnOpCode code) {
     if (code == OP_SILU) return "SILU";
     if (code == OP_MUL) return "MUL";
     if (code == OP_CAST) return "CAST";
+    if (code == OP_SHIFT) return "SHIFT";
+    if (code == OP_MERGE_ADD_RMS_NORM) return "MERGE_ADD_RMS_NORM";
+    if (code == OP_SILU_MUL) return "SILU_MUL";
+    if (code == OP_MATMUL_ROPE) return "MATMUL_ROPE";
     throw std::invalid_argument("Unknown op code");
 }
 
@@ -94,6 +147,17 @@ const char *opQuantTypeToString(NnOpQuantType type) {
     if (type == Q80_Q80_F32) return "Q80_Q80_F32";
     if (type == Q80_Q40_F32) return "Q80_Q40_F32";
     if (type == Q80_F32_F32) return "Q80_F32_F32";
+    if (type == Q80_F32_Q80) return "Q80_F32_Q80";
+    if (type == F32_F16_F32) return "F32_F16_F32";
+    if (type == Q80_F16_F32) return "Q80_F16_F32";
+    if (type == Q80_Q4K_F32) return "Q80_Q4K_F32";
+    if (type == Q80_Q6K_F32) return "Q80_Q6K_F32";
+    if (type == Q80_Q2K_F32) return "Q80_Q2K_F32";
+    if (type == F32_F32_F16) return "F32_F32_F16";
+    if (type == F32_F32_Q40) return "F32_F32_Q40";
+    if (type == Q40_Q40_F32) return "Q40_Q40_F32";
+    if (type == Q40_F32_F32) return "Q40_F32_F32";
+    if (type == Q40_F32_Q80) return "Q40_F32_Q80";
     throw std::invalid_argument("Unknown op quant type");
 }
 
@@ -172,7 +236,259 @@ void printNodeRequiredMemory(NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
             total += segment->ops[opIndex].configSize;
         }
     }
-    printf("📀 RequiredMemory: %lu kB\n", total / 1024);
+    unsigned long buffersTotal = 0;
+    for (NnUint bufferIndex = 0; bufferIndex < nodeConfig->nBuffers; bufferIndex++)
+        buffersTotal += nodeConfig->buffers[bufferIndex].size.nBytes;
+    // Only the CPU device places the buffers in the planned arena, other devices allocate every buffer
+    NnBufferPlan plan = planNodeBuffers(nodeConfig, BUFFER_ALIGNMENT);
+    printf("📀 RequiredMemory: %lu kB, with the CPU buffer arena: %lu kB (buffers: %lu kB -> %lu kB, %u aliased)\n",
+        total / 1024,
+        (total - buffersTotal + plan.nBytes) / 1024,
+        buffersTotal / 1024,
+        (unsigned long)(plan.nBytes / 1024),
+        plan.nAliasedBuffers);
+}
+
+// buffer planner
+
+enum NnBufferAccessType {
+    BUFFER_READ,
+    BUFFER_WRITE, // partial or accumulating write, the previous value must be kept
+    BUFFER_KILL, // the op overwrites all rows it processes without reading the previous value
+    BUFFER_SCRATCH, // the value does not outlive the op
+};
+
+typedef struct {
+    NnUint bufferIndex;
+    NnBufferAccessType type;
+} NnBufferAccess;
+
+typedef struct {
+    NnUint start;
+    NnUint end; // inclusive
+} NnLiveInterval;
+
+static void addBufferAccess(std::vector<NnBufferAccess> *accesses, NnPointerConfig *pointer, NnBufferAccessType type) {
+    if (pointer->source == SRC_BUFFER)
+        accesses->push_back(NnBufferAccess{ pointer->pointerIndex, type });
+}
+
+static void addBufferAccess(std::vector<NnBufferAccess> *accesses, NnUint bufferIndex, NnBufferAccessType type) {
+    accesses->push_back(NnBufferAccess{ bufferIndex, type });
+}
+
+static bool getOpBufferAccesses(NnOpConfig *op, std::vector<NnBufferAccess> *accesses) {
+    // Only a batch pointer covers whole rows, a slice or a raw pointer leaves the rest of the buffer untouched
+    const NnBufferAccessType outputType = op->output.type == PNTR_BATCH ? BUFFER_KILL : BUFFER_WRITE;
+    accesses->clear();
+    addBufferAccess(accesses, &op->input, BUFFER_READ);
+
+    switch (op->code) {
+    case OP_EMBEDDING:
+    case OP_INV_RMS:
+    case OP_MATMUL:
+    case OP_CAST:
+        addBufferAccess(accesses, &op->output, outputType);
+        return true;
+    case OP_RMS_NORM:
+        addBufferAccess(accesses, ((NnRmsNormOpConfig *)op->config)->invRmsBufferIndex, BUFFER_READ);
+        addBufferAccess(accesses, &op->output, outputType);
+        return true;
+    case OP_MUL:
+        addBufferAccess(accesses, ((NnMulOpCodeConfig *)op->config)->multiplierBufferIndex, BUFFER_READ);
+        addBufferAccess(accesses, &op->output, outputType);
+        return true;
+    case OP_GELU:
+    case OP_SILU:
+    case OP_MERGE_ADD:
+    case OP_SHIFT:
+        // These ops work in place or accumulate into the output
+        addBufferAccess(accesses, &op->output, BUFFER_WRITE);
+        return true;
+    case OP_ROPE_LLAMA:
+        addBufferAccess(accesses, ((NnRopeLlamaOpConfig *)op->config)->ropeCacheBufferIndex, BUFFER_READ);
+        addBufferAccess(accesses, &op->output, BUFFER_WRITE);
+        return true;
+    case OP_MULTIHEAD_ATT: {
+        NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)op->config;
+        addBufferAccess(accesses, config->queryBufferIndex, BUFFER_READ);
+        addBufferAccess(accesses, config->keyCacheBufferIndex, BUFFER_READ);
+        addBufferAccess(accesses, config->valueCacheBufferIndex, BUFFER_READ);
+        addBufferAccess(accesses, config->attBufferIndex, BUFFER_SCRATCH);
+        addBufferAccess(accesses, &op->output, BUFFER_WRITE);
+        return true;
+    }
+    case OP_MERGE_ADD_RMS_NORM: {
+        NnMergeAddRmsNormOpConfig *config = (NnMergeAddRmsNormOpConfig *)op->config;
+        addBufferAccess(accesses, config->xBufferIndex, config->hasMergeAdd ? BUFFER_WRITE : BUFFER_READ);
+        addBufferAccess(accesses, config->invRmsBufferIndex, BUFFER_KILL);
+        addBufferAccess(accesses, config->normBufferIndex, BUFFER_KILL);
+        addBufferAccess(accesses, &op->output, outputType);
+        return true;
+    }
+    case OP_SILU_MUL: {
+        NnSiluMulOpConfig *config = (NnSiluMulOpConfig *)op->config;
+        addBufferAccess(accesses, config->multiplierBufferIndex, BUFFER_READ);
+        addBufferAccess(accesses, config->activationBufferIndex, BUFFER_KILL);
+        addBufferAccess(accesses, &op->output, outputType);
+        return true;
+    }
+    case OP_MATMUL_ROPE: {
+        NnMatmulRopeOpConfig *config = (NnMatmulRopeOpConfig *)op->config;
+        addBufferAccess(accesses, config->rope.ropeCacheBufferIndex, BUFFER_READ);
+        if (config->hasShift)
+            addBufferAccess(accesses, config->shiftBufferIndex, BUFFER_WRITE);
+        addBufferAccess(accesses, &op->output, outputType);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+static bool hasIntervalOverlap(const std::vector<NnLiveInterval> &a, const std::vector<NnLiveInterval> &b) {
+    for (const NnLiveInterval &x : a) {
+        for (const NnLiveInterval &y : b) {
+            if (x.start <= y.end && y.start <= x.end)
+                return true;
+        }
+    }
+    return false;
+}
+
+static bool computeLiveIntervals(NnNodeConfig *nodeConfig, std::vector<std::vector<NnLiveInterval>> *intervals) {
+    // Ops run in the same order in every forward, so the op index is the time axis. A value lives from
+    // the op that writes it to the last op that reads it, a buffer read before its first kill carries
+    // a value between forwards (caches, rope tables, inputs written by the caller) and is never shared.
+    const NnUint nBuffers = nodeConfig->nBuffers;
+    std::vector<bool> isLive(nBuffers, false);
+    std::vector<bool> isPinned(nBuffers, false);
+    std::vector<bool> isRead(nBuffers, false);
+    std::vector<bool> isUsed(nBuffers, false);
+    std::vector<NnLiveInterval> current(nBuffers);
+    std::vector<NnBufferAccess> accesses;
+
+    intervals->assign(nBuffers, std::vector<NnLiveInterval>());
+    NnUint position = 0;
+    for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segment = &nodeConfig->segments[segmentIndex];
+        for (NnUint opIndex = 0; opIndex < segment->nOps; opIndex++, position++) {
+            if (!getOpBufferAccesses(&segment->ops[opIndex], &accesses))
+                return false;
+
+            // An op reads its inputs before it overwrites its outputs, so kills are applied last
+            for (const NnBufferAccess &access : accesses) {
+                const NnUint i = access.bufferIndex;
+                isUsed[i] = true;
+                if (access.type == BUFFER_SCRATCH) {
+                    (*intervals)[i].push_back(NnLiveInterval{ position, position });
+                } else if (access.type != BUFFER_KILL) {
+                    isRead[i] = true;
+                    if (isLive[i])
+                        current[i].end = position;
+                    else
+                        isPinned[i] = true;
+                }
+            }
+            for (const NnBufferAccess &access : accesses) {
+                const NnUint i = access.bufferIndex;
+                if (access.type != BUFFER_KILL)
+                    continue;
+                if (isLive[i])
+                    (*intervals)[i].push_back(current[i]);
+                current[i] = NnLiveInterval{ position, position };
+                isLive[i] = true;
+            }
+        }
+    }
+
+    const NnUint lastPosition = position > 0 ? position - 1 : 0;
+    for (NnUint i = 0; i < nBuffers; i++) {
+        if (isLive[i]) {
+            // A buffer that no op reads is an output for the caller, it must survive until the end
+            if (!isRead[i])
+                current[i].end = lastPosition;
+            (*intervals)[i].push_back(current[i]);
+        }
+        if (isPinned[i] || !isUsed[i]) {
+            (*intervals)[i].clear();
+            (*intervals)[i].push_back(NnLiveInterval{ 0, lastPosition });
+        }
+    }
+    return true;
+}
+
+static NnSize alignSize(NnSize size, NnSize alignment) {
+    return ((size + alignment - 1) / alignment) * alignment;
+}
+
+NnBufferPlan planNodeBuffers(NnNodeConfig *nodeConfig, NnSize alignment) {
+    const NnUint nBuffers = nodeConfig->nBuffers;
+    NnBufferPlan plan;
+    plan.nBytes = 0;
+    plan.offsets.resize(nBuffers);
+    plan.nAliasedBuffers = 0;
+
+    std::vector<std::vector<NnLiveInterval>> intervals;
+    if (!computeLiveIntervals(nodeConfig, &intervals)) {
+        // Unknown op, every buffer gets its own memory
+        for (NnUint i = 0; i < nBuffers; i++) {
+            plan.offsets[i] = plan.nBytes;
+            plan.nBytes += alignSize(nodeConfig->buffers[i].size.nBytes, alignment);
+        }
+        return plan;
+    }
+
+    // First fit, the largest buffers are placed first
+    std::vector<NnUint> order(nBuffers);
+    for (NnUint i = 0; i < nBuffers; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](NnUint a, NnUint b) {
+        return nodeConfig->buffers[a].size.nBytes > nodeConfig->buffers[b].size.nBytes;
+    });
+
+    std::vector<NnUint> placed;
+    std::vector<bool> isAliased(nBuffers, false);
+    for (NnUint i : order) {
+        const NnSize size = alignSize(nodeConfig->buffers[i].size.nBytes, alignment);
+        std::vector<NnUint> conflicts;
+        for (NnUint j : placed) {
+            if (hasIntervalOverlap(intervals[i], intervals[j]))
+                conflicts.push_back(j);
+        }
+        std::sort(conflicts.begin(), conflicts.end(), [&](NnUint a, NnUint b) {
+            return plan.offsets[a] < plan.offsets[b];
+        });
+
+        NnSize offset = 0;
+        for (NnUint j : conflicts) {
+            if (offset + size <= plan.offsets[j])
+                break;
+            const NnSize end = plan.offsets[j] + alignSize(nodeConfig->buffers[j].size.nBytes, alignment);
+            if (end > offset)
+                offset = end;
+        }
+        plan.offsets[i] = offset;
+        if (offset + size > plan.nBytes)
+            plan.nBytes = offset + size;
+        placed.push_back(i);
+    }
+
+    for (NnUint i = 0; i < nBuffers; i++) {
+        const NnSize iEnd = plan.offsets[i] + nodeConfig->buffers[i].size.nBytes;
+        for (NnUint j = i + 1; j < nBuffers; j++) {
+            const NnSize jEnd = plan.offsets[j] + nodeConfig->buffers[j].size.nBytes;
+            if (plan.offsets[i] < jEnd && plan.offsets[j] < iEnd) {
+                isAliased[i] = true;
+                isAliased[j] = true;
+            }
+        }
+    }
+    for (NnUint i = 0; i < nBuffers; i++) {
+        if (isAliased[i])
+            plan.nAliasedBuffers++;
+    }
+    return plan;
 }
 
 Timer::Timer() {
@@ -195,18 +511,26 @@ NnUint Timer::elapsedMicroseconds() {
 
 // slicers
 
-NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes) {
+NnKvCacheSlice sliceKvCache(NnFloatType type, NnUint kvDim, NnUint seqLen, NnUint nNodes) {
     NnKvCacheSlice s;
     assert(kvDim % nNodes == 0);
+    if (type != F_32 && type != F_16 && type != F_Q80)
+        throw std::invalid_argument("Unsupported KV cache type: " + std::string(floatTypeToString(type)));
+    s.type = type;
     s.kvDim0 = kvDim / nNodes;
-    s.keySize = size2D(F_32, seqLen, s.kvDim0);
-    s.valueSize = size2D(F_32, seqLen, s.kvDim0);
+    // A cached row is quantized in whole blocks
+    if (s.kvDim0 % getBlockSize(type) != 0)
+        throw std::invalid_argument("The KV cache row of a node must be a multiple of the " + std::string(floatTypeToString(type)) + " block size");
+    s.keySize = size2D(type, seqLen, s.kvDim0);
+    s.valueSize = size2D(type, seqLen, s.kvDim0);
     return s;
 }
 
 NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUint d) {
     NnRowMatmulSlice s;
     assert(d % nNodes == 0);
+    if (n % getBlockSize(type) != 0)
+        throw std::invalid_argument("The row length of a " + std::string(floatTypeToString(type)) + " matmul must be a multiple of its block size");
     s.type = type;
     s.nNodes = nNodes;
     s.d0 = d / nNodes;
@@ -223,6 +547,9 @@ NnColMatmulSlice sliceColMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUin
     s.nNodes = nNodes;
     s.n = n;
     s.n0 = n / nNodes;
+    // A super-block cannot be split between nodes
+    if (s.n0 % getBlockSize(type) != 0)
+        throw std::invalid_argument("The row slice of a " + std::string(floatTypeToString(type)) + " matmul must be a multiple of its block size");
     s.d = d;
     s.size = size2D(type, n, d);
     s.sliceSize = size2D(type, s.n0, d);
@@ -256,12 +583,14 @@ NnRopeSlice sliceRope(NnUint dim, NnUint kvDim, NnUint nKvHeads, NnUint nNodes,
     return s;
 }
 
-NnMultiHeadAttSlice sliceMultiHeadAtt(NnUint nHeads, NnUint seqLen, NnUint nNodes, NnUint nBatches) {
+NnMultiHeadAttSlice sliceMultiHeadAtt(NnUint nHeads, NnUint headSize, NnUint seqLen, NnUint nNodes, NnUint nBatches) {
     NnMultiHeadAttSlice s;
     assert(nHeads % nNodes == 0);
     s.nHeads = nHeads;
     s.nHeads0 = nHeads / nNodes;
     s.attSize = size2D(F_32, nBatches, s.nHeads0 * seqLen);
+    const NnUint nSpans = (seqLen + ATT_FLASH_SPAN - 1) / ATT_FLASH_SPAN;
+    s.flashAttSize = size2D(F_32, nBatches, nSpans * s.nHeads0 * (headSize + 2));
     return s;
 }
 
@@ -5,8 +5,11 @@
 #include <list>
 #include <memory>
 #include <cstdint>
+#include <vector>
 #include "nn-quants.hpp"
 
+#define BUFFER_ALIGNMENT 64
+
 // primitives
 
 typedef struct {
@@ -20,6 +23,7 @@ typedef struct {
 // slices
 
 typedef struct {
+    NnFloatType type; // F_32, F_16 or F_Q80, the shift op converts the rows on write and the attention reads them in place
     NnUint kvDim0;
     NnSize2D keySize;
     NnSize2D valueSize;
@@ -60,10 +64,16 @@ typedef struct {
     NnSize2D cacheSize;
 } NnRopeSlice;
 
+// Positions of the sequence attended by one work item of the flash attention
+#define ATT_FLASH_SPAN 512
+// The K and V tiles of a quantized cache are widened into a stack buffer of this many values per position
+#define ATT_FLASH_MAX_HEAD_SIZE 256
+
 typedef struct {
     NnUint nHeads;
     NnUint nHeads0;
     NnSize2D attSize;
+    NnSize2D flashAttSize; // output, max and sum of every head for every span
 } NnMultiHeadAttSlice;
 
 // base enums
@@ -81,6 +91,10 @@ enum NnOpCode {
     OP_MUL,
     OP_CAST,
     OP_SHIFT,
+    // fused ops, created by the CPU fusion pass
+    OP_MERGE_ADD_RMS_NORM,
+    OP_SILU_MUL,
+    OP_MATMUL_ROPE,
 };
 
 enum NnOpQuantType {
@@ -93,10 +107,21 @@ enum NnOpQuantType {
     Q80_Q80_F32,
     Q80_Q40_F32,
     Q80_F32_F32,
+    Q80_F32_Q80,
+    F32_F16_F32,
+    Q80_F16_F32,
+    Q80_Q4K_F32,
+    Q80_Q6K_F32,
+    Q80_Q2K_F32,
+    F32_F32_F16,
+    F32_F32_Q40,
+    Q40_Q40_F32,
+    Q40_F32_F32,
+    Q40_F32_Q80,
 };
 
-#define N_OP_CODES (OP_SHIFT + 1)
-#define N_OP_QUANTS (Q80_F32_F32 + 1)
+#define N_OP_CODES (OP_MATMUL_ROPE + 1)
+#define N_OP_QUANTS (Q40_F32_Q80 + 1)
 
 enum NnPointerSource {
     SRC_PIPE,
@@ -113,6 +138,8 @@ enum NnSyncType {
     SYNC_WITH_ROOT, // whole pipe to all nodes
     SYNC_NODE_SLICES, // my slice of pipe to all nodes
     SYNC_NODE_SLICES_EXCEPT_ROOT, // only workers send slices to root, root does not send
+    SYNC_ALL_REDUCE_RING, // every node ends with the sum of the pipes of all nodes, reduce-scatter + all-gather over a ring
+    SYNC_ALL_REDUCE_HALVING, // the same by recursive halving and doubling, needs a power of two nodes
 };
 
 enum NnRopeType {
@@ -121,6 +148,12 @@ enum NnRopeType {
     ROPE_LLAMA3_1 = 2,
 };
 
+enum NnAttentionType {
+    ATT_FULL_SCORES, // all scores of a head are stored in the att buffer, softmax, then a second pass over V
+    ATT_FLASH, // K and V are streamed in tiles with an online softmax, the att buffer keeps only partial results of spans,
+               // all batches of a prefill chunk run in one pass, the default of the app on CPU
+};
+
 // base configs
 
 typedef struct {
@@ -225,6 +258,7 @@ typedef struct {
     NnUint keyCacheBufferIndex;
     NnUint valueCacheBufferIndex;
     NnUint attBufferIndex;
+    NnAttentionType attentionType;
 } NnMultiHeadAttOpConfig;
 
 typedef struct {
@@ -247,6 +281,25 @@ typedef struct {
     NnUint indexPipeIndex;
 } NnShiftOpCodeConfig;
 
+typedef struct {
+    bool hasMergeAdd; // if true the input is merged into the x buffer first, otherwise the input is the x buffer
+    float epsilon;
+    NnUint xBufferIndex;
+    NnUint invRmsBufferIndex;
+    NnUint normBufferIndex; // F32 output of the norm, written even if the op output is quantized
+} NnMergeAddRmsNormOpConfig;
+
+typedef struct {
+    NnUint multiplierBufferIndex;
+    NnUint activationBufferIndex; // F32 silu(x) * m, written even if the op output is quantized
+} NnSiluMulOpConfig;
+
+typedef struct {
+    NnRopeLlamaOpConfig rope;
+    bool hasShift; // if true the rotated rows are copied into the shift buffer too
+    NnUint shiftBufferIndex; // F32, F16 or Q80 cache written at the row of the position, e.g. the key cache
+} NnMatmulRopeOpConfig;
+
 // utility functions
 
 const char *opCodeToString(NnOpCode code);
@@ -268,6 +321,16 @@ void releaseNodeConfig(NnNodeConfig *nodeConfig);
 
 void printNodeRequiredMemory(NnNetConfig *netConfig, NnNodeConfig *nodeConfig);
 
+// buffer planner
+
+typedef struct {
+    NnSize nBytes; // size of the arena holding all buffers of the node
+    std::vector<NnSize> offsets; // offset of every buffer in the arena
+    NnUint nAliasedBuffers; // buffers that share memory with another buffer
+} NnBufferPlan;
+
+NnBufferPlan planNodeBuffers(NnNodeConfig *nodeConfig, NnSize alignment);
+
 class Timer {
 private:
     std::chrono::time_point<std::chrono::high_resolution_clock> startTime;
@@ -280,11 +343,11 @@ public:
 
 // slicers
 
-NnKvCacheSlice sliceKvCache(NnUint kvDim, NnUint seqLen, NnUint nNodes);
+NnKvCacheSlice sliceKvCache(NnFloatType type, NnUint kvDim, NnUint seqLen, NnUint nNodes);
 NnRowMatmulSlice sliceRowMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUint d);
 NnColMatmulSlice sliceColMatmul(NnFloatType type, NnUint nNodes, NnUint n, NnUint d);
 NnRopeSlice sliceRope(NnUint dim, NnUint kvDim, NnUint nKvHeads, NnUint nNodes, NnUint seqLen, NnUint headSize, float ropeTheta, NnUint nodeIndex);
-NnMultiHeadAttSlice sliceMultiHeadAtt(NnUint nHeads, NnUint seqLen, NnUint nNodes, NnUint nBatches);
+NnMultiHeadAttSlice sliceMultiHeadAtt(NnUint nHeads, NnUint headSize, NnUint seqLen, NnUint nNodes, NnUint nBatches);
 
 // splitters
 
@@ -1,4 +1,6 @@
 #include "nn-cpu-ops.cpp"
+#include <cstdlib>
+#include <thread>
 #include <vector>
 
 // framework
@@ -11,6 +13,34 @@ void rand(float *o, const NnUint n, const NnUint seed) {
     }
 }
 
+// A repacked weight is read with aligned loads like from the weight buffers of the device
+NnByte *allocAligned(const NnSize size) {
+    return (NnByte *)std::aligned_alloc(BUFFER_ALIGNMENT, (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT);
+}
+
+// Converts F32 values into a KV cache of the type, and back
+void convertKvCache(const NnFloatType type, const float *x, NnByte *cache, const NnUint n) {
+    if (type == F_Q80) {
+        quantizeF32toQ80(x, (NnBlockQ80 *)cache, n, 1, 0);
+    } else if (type == F_16) {
+        for (NnUint i = 0; i < n; i++)
+            ((NnFp16 *)cache)[i] = CONVERT_F32_TO_F16(x[i]);
+    } else {
+        std::memcpy(cache, x, n * sizeof(float));
+    }
+}
+
+void widenKvCache(const NnFloatType type, const NnByte *cache, float *y, const NnUint n) {
+    if (type == F_Q80) {
+        dequantizeQ80toF32((const NnBlockQ80 *)cache, y, n, 1, 0);
+    } else if (type == F_16) {
+        for (NnUint i = 0; i < n; i++)
+            y[i] = CONVERT_F16_TO_F32(((const NnFp16 *)cache)[i]);
+    } else {
+        std::memcpy(y, cache, n * sizeof(float));
+    }
+}
+
 void compare_F32(const char *name, const float *a, const float *b, const NnUint n, const float epsilon) {
     for (NnUint i = 0; i < n; i++) {
         float error = fabs(a[i] - b[i]);
@@ -96,6 +126,22 @@ void testQuantization(const NnUint m) {
     dequantizeQ80toF32(aQ80.data(), aTemp.data(), m * Q80_BLOCK_SIZE, 1, 0);
 
     compare_F32("testQuantization_Q80", a.data(), aTemp.data(), m * Q80_BLOCK_SIZE, 0.01);
+
+    // A Q40 block keeps its largest magnitude exactly, every other value is off by at most one step of amax / 8
+    for (NnUint i = 0; i < m * Q40_BLOCK_SIZE; i++)
+        a[i] = sinf(i * 0.61f) * (1.0f + (i / Q40_BLOCK_SIZE) % 5);
+    quantizeF32toQ40(a.data(), aQ40.data(), m * Q40_BLOCK_SIZE, 1, 0);
+    dequantizeQ40toF32(aQ40.data(), aTemp.data(), m * Q40_BLOCK_SIZE, 1, 0);
+    for (NnUint b = 0; b < m; b++) {
+        float amax = 0.0f;
+        for (NnUint j = 0; j < Q40_BLOCK_SIZE; j++)
+            amax = std::max(amax, fabsf(a[b * Q40_BLOCK_SIZE + j]));
+        for (NnUint j = 0; j < Q40_BLOCK_SIZE; j++) {
+            a[b * Q40_BLOCK_SIZE + j] /= amax;
+            aTemp[b * Q40_BLOCK_SIZE + j] /= amax;
+        }
+    }
+    compare_F32("testQuantization_Q40.steps", a.data(), aTemp.data(), m * Q40_BLOCK_SIZE, 1.0f / 8.0f + 0.001f);
 }
 
 // invRms
@@ -175,6 +221,17 @@ void testAdd(const NnUint m) {
     add_Q80_F32(yTemp.data(), xQ80.data(), n, 1, 0);
 
     compare_F32("add_Q80_F32", y.data(), yTemp.data(), n, 0.01);
+
+    std::vector<NnBlockQ40> xQ40(n / Q40_BLOCK_SIZE);
+    for (NnUint i = 0; i < n; i++)
+        x[i] = cosf(i * 0.17f);
+    quantizeF32toQ40(x.data(), xQ40.data(), n, 1, 0);
+    dequantizeQ40toF32(xQ40.data(), x.data(), n, 1, 0);
+    std::copy(yTemp.begin(), yTemp.end(), y.begin());
+    add_F32(y.data(), x.data(), n, 1, 0);
+    add_Q40_F32(yTemp.data(), xQ40.data(), n, 1, 0);
+
+    compare_F32("add_Q40_F32", y.data(), yTemp.data(), n, 0.00001f);
 }
 
 void testSoftmax() {
@@ -217,6 +274,455 @@ void testSilu() {
     compare_F32("silu_F32", y.data(), expectedOutput, 8, 0.001);
 }
 
+void testRope() {
+    const NnUint n = 38;
+    std::vector<float> x0(n);
+    std::vector<float> x1(n);
+    std::vector<float> c(n);
+    for (NnUint i = 0; i < n; i++) {
+        x0[i] = sinf(i * 0.29f);
+        c[i] = (i % 2 == 0) ? cosf(i * 0.13f) : sinf((i - 1) * 0.13f);
+    }
+    x1 = x0;
+
+    // The first pair is skipped, the vector loop starts unaligned and leaves a tail
+    for (NnUint i = 2; i < n; i += 2) {
+        const float v0 = x0[i];
+        const float v1 = x0[i + 1];
+        x0[i] = v0 * c[i] - v1 * c[i + 1];
+        x0[i + 1] = v0 * c[i + 1] + v1 * c[i];
+    }
+    rope_F32(x1.data(), c.data(), 2, n);
+    compare_F32("rope_F32", x0.data(), x1.data(), n, 0.00001f);
+}
+
+// fused ops must match the chain of ops they replace
+void testMergeAddRmsNorm(const NnUint m) {
+    const NnUint n = Q80_BLOCK_SIZE * m;
+    const NnUint nSlices = 3;
+    const float epsilon = 1e-5f;
+
+    std::vector<float> x(n);
+    std::vector<float> input(n * nSlices);
+    std::vector<NnBlockQ80> inputQ80((n * nSlices) / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> inputQ40((n * nSlices) / Q40_BLOCK_SIZE);
+    std::vector<float> w(n);
+    for (NnUint i = 0; i < n; i++) {
+        x[i] = sinf(i * 0.37f);
+        w[i] = 0.5f + cosf(i * 0.11f);
+    }
+    for (NnUint i = 0; i < n * nSlices; i++)
+        input[i] = cosf(i * 0.23f);
+    quantizeF32toQ80(input.data(), inputQ80.data(), n * nSlices, 1, 0);
+    quantizeF32toQ40(input.data(), inputQ40.data(), n * nSlices, 1, 0);
+
+    const NnFloatType inputTypes[] = { F_32, F_Q80, F_Q40 };
+    const char *names[][4] = {
+        { "mergeAddRmsNorm_F32.x", "mergeAddRmsNorm_F32.rms", "mergeAddRmsNorm_F32.y", "mergeAddRmsNorm_F32.yq" },
+        { "mergeAddRmsNorm_Q80.x", "mergeAddRmsNorm_Q80.rms", "mergeAddRmsNorm_Q80.y", "mergeAddRmsNorm_Q80.yq" },
+        { "mergeAddRmsNorm_Q40.x", "mergeAddRmsNorm_Q40.rms", "mergeAddRmsNorm_Q40.y", "mergeAddRmsNorm_Q40.yq" },
+    };
+    for (NnUint t = 0; t < 3; t++) {
+        const NnFloatType inputType = inputTypes[t];
+        std::vector<float> x0(x);
+        std::vector<float> y0(n);
+        std::vector<NnBlockQ80> yq0(n / Q80_BLOCK_SIZE);
+        for (NnUint s = 0; s < nSlices; s++) {
+            if (inputType == F_Q80)
+                add_Q80_F32(x0.data(), &inputQ80[s * n / Q80_BLOCK_SIZE], n, 1, 0);
+            else if (inputType == F_Q40)
+                add_Q40_F32(x0.data(), &inputQ40[s * n / Q40_BLOCK_SIZE], n, 1, 0);
+            else
+                add_F32(x0.data(), &input[s * n], n, 1, 0);
+        }
+        const float rms0 = invRms_F32(x0.data(), n, epsilon);
+        rmsNorm_F32(y0.data(), x0.data(), rms0, w.data(), n, 1, 0);
+        quantizeF32toQ80(y0.data(), yq0.data(), n, 1, 0);
+
+        std::vector<float> x1(x);
+        std::vector<float> y1(n);
+        std::vector<NnBlockQ80> yq1(n / Q80_BLOCK_SIZE);
+        const float sum = inputType == F_Q80
+            ? mergeAddSquares_Q80_F32(x1.data(), inputQ80.data(), nSlices, n, n)
+            : inputType == F_Q40
+                ? mergeAddSquares_Q40_F32(x1.data(), inputQ40.data(), nSlices, n, n)
+                : mergeAddSquares_F32(x1.data(), input.data(), nSlices, n, n);
+        const float rms1 = 1.0f / sqrtf(sum / n + epsilon);
+        rmsNormQuantize_F32_Q80(yq1.data(), y1.data(), x1.data(), rms1, w.data(), n);
+
+        std::vector<float> yd0(n);
+        std::vector<float> yd1(n);
+        dequantizeQ80toF32(yq0.data(), yd0.data(), n, 1, 0);
+        dequantizeQ80toF32(yq1.data(), yd1.data(), n, 1, 0);
+        compare_F32(names[t][0], x0.data(), x1.data(), n, 0.00001f);
+        compare_F32(names[t][1], &rms0, &rms1, 1, 0.00001f);
+        compare_F32(names[t][2], y0.data(), y1.data(), n, 0.00001f);
+        compare_F32(names[t][3], yd0.data(), yd1.data(), n, 0.00001f);
+    }
+}
+
+// The forward split by columns (fewer rows than threads) must match the forward split by rows
+void testMergeAddRmsNormForward(const NnUint nThreads, const NnUint nBatches) {
+    const NnUint dim = Q80_BLOCK_SIZE * 5;
+    const NnUint nSlices = 2;
+    const NnUint nRounds = 3;
+
+    std::vector<float> input(nBatches * nSlices * dim);
+    std::vector<NnBlockQ80> inputQ80(input.size() / Q80_BLOCK_SIZE);
+    std::vector<float> w(dim);
+    for (NnUint i = 0; i < input.size(); i++)
+        input[i] = cosf(i * 0.23f);
+    for (NnUint i = 0; i < dim; i++)
+        w[i] = 0.5f + cosf(i * 0.11f);
+    quantizeF32toQ80(input.data(), inputQ80.data(), input.size(), 1, 0);
+
+    std::vector<float> x[2];
+    std::vector<float> invRms[2];
+    std::vector<float> norm[2];
+    std::vector<NnBlockQ80> output[2];
+    for (NnUint r = 0; r < 2; r++) {
+        x[r].resize(nBatches * dim);
+        for (NnUint i = 0; i < x[r].size(); i++)
+            x[r][i] = sinf(i * 0.37f);
+        invRms[r].resize(nBatches);
+        norm[r].resize(nBatches * dim);
+        output[r].resize(nBatches * dim / Q80_BLOCK_SIZE);
+
+        NnByte *buffers[3] = { (NnByte *)x[r].data(), (NnByte *)invRms[r].data(), (NnByte *)norm[r].data() };
+        std::vector<NnByte *> inputRows(nBatches);
+        std::vector<NnByte *> outputRows(nBatches);
+        for (NnUint b = 0; b < nBatches; b++) {
+            inputRows[b] = (NnByte *)&inputQ80[b * nSlices * dim / Q80_BLOCK_SIZE];
+            outputRows[b] = (NnByte *)&output[r][b * dim / Q80_BLOCK_SIZE];
+        }
+        NnMergeAddRmsNormOpConfig config = { true, 1e-5f, 0, 1, 2 };
+        NnCpuChunkCounter counter;
+        counter.nextChunk.store(0);
+        counter.nDoneThreads.store(0);
+        counter.nComputedChunks.store(0);
+        counter.generation.store(0);
+        const NnUint n = r == 0 ? 1 : nThreads;
+        std::vector<float> threadSums(nBatches * n);
+
+        NnCpuOpContext context;
+        context.name = "merge_add_rms_norm";
+        context.nBatches = nBatches;
+        context.buffers = buffers;
+        context.opConfig = &config;
+        context.input = inputRows.data();
+        context.inputSize = size2D(F_Q80, nBatches, nSlices * dim);
+        context.output = outputRows.data();
+        context.outputSize = size2D(F_Q80, nBatches, dim);
+        context.weight = (NnByte *)w.data();
+        context.weightSize = size1D(F_32, dim);
+        context.chunkCounters = &counter;
+        context.threadSums = threadSums.data();
+
+        // The op runs a few times to reuse the barrier
+        for (NnUint round = 0; round < nRounds; round++) {
+            std::vector<std::thread> threads;
+            for (NnUint threadIndex = 0; threadIndex < n; threadIndex++)
+                threads.emplace_back([&, threadIndex] { mergeAddRmsNormForward_ANY(n, threadIndex, nBatches, &context); });
+            for (std::thread &thread : threads)
+                thread.join();
+        }
+        assert(counter.nDoneThreads.load() == 0);
+    }
+
+    std::vector<float> yd[2];
+    for (NnUint r = 0; r < 2; r++) {
+        yd[r].resize(nBatches * dim);
+        dequantizeQ80toF32(output[r].data(), yd[r].data(), nBatches * dim, 1, 0);
+    }
+    compare_F32("mergeAddRmsNormForward.x", x[0].data(), x[1].data(), nBatches * dim, 0.0001f);
+    compare_F32("mergeAddRmsNormForward.rms", invRms[0].data(), invRms[1].data(), nBatches, 0.00001f);
+    compare_F32("mergeAddRmsNormForward.y", norm[0].data(), norm[1].data(), nBatches * dim, 0.0001f);
+    compare_F32("mergeAddRmsNormForward.yq", yd[0].data(), yd[1].data(), nBatches * dim, 0.001f);
+}
+
+// Quantizes a row to the sync type and back, as sending it does
+static void roundTripSyncType(const NnFloatType type, float *x, const NnUint n) {
+    if (type == F_Q80) {
+        std::vector<NnBlockQ80> q(n / Q80_BLOCK_SIZE);
+        quantizeF32toQ80(x, q.data(), n, 1, 0);
+        dequantizeQ80toF32(q.data(), x, n, 1, 0);
+    } else if (type == F_Q40) {
+        std::vector<NnBlockQ40> q(n / Q40_BLOCK_SIZE);
+        quantizeF32toQ40(x, q.data(), n, 1, 0);
+        dequantizeQ40toF32(q.data(), x, n, 1, 0);
+    }
+}
+
+// The sum of the partial rows as an all-reduce computes it, the running sum is requantized after every addition.
+// The ring adds the rows one by one (nNodes - 1 requantizations), the recursive halving adds them in pairs (log2 nNodes)
+static void allReduceSyncType(const NnFloatType type, const bool isRing, const float *partials, float *sum, const NnUint nNodes, const NnUint dim) {
+    std::vector<float> rows(partials, partials + nNodes * dim);
+    for (NnUint k = 0; k < nNodes; k++)
+        roundTripSyncType(type, &rows[k * dim], dim);
+    for (NnUint step = 1; step < nNodes; step = isRing ? step + 1 : step * 2) {
+        for (NnUint k = 0; k + step < nNodes; k += isRing ? nNodes : 2 * step) {
+            float *row = isRing ? &rows[0] : &rows[k * dim];
+            add_F32(row, &rows[(k + step) * dim], dim, 1, 0);
+            roundTripSyncType(type, row, dim);
+        }
+    }
+    std::copy(rows.begin(), rows.begin() + dim, sum);
+}
+
+// What every sync type of the partial sums costs on the wire and what it loses: every node quantizes its own partial sum
+// of a block and merges the partial sums of all nodes into the residual stream, once after the attention and once after the ffn
+void benchmarkSyncTypes() {
+    const NnUint dim = 4096;
+    const NnUint nNodes = 8;
+    const NnUint nRounds = 200;
+
+    std::vector<float> x(dim);
+    std::vector<float> partials(dim * nNodes);
+    for (NnUint i = 0; i < dim; i++)
+        x[i] = cosf(i * 0.07f);
+    // A few channels carry outliers, as the partial sums of real models do
+    for (NnUint i = 0; i < dim * nNodes; i++)
+        partials[i] = sinf(i * 0.013f + (i / dim)) * ((i % 97) == 0 ? 8.0f : 0.25f);
+    std::vector<float> expected(x);
+    for (NnUint k = 0; k < nNodes; k++)
+        add_F32(expected.data(), &partials[k * dim], dim, 1, 0);
+
+    for (NnFloatType type : { F_32, F_Q80, F_Q40 }) {
+        const NnSize rowBytes = getBytes(type, dim);
+        std::vector<NnByte> zq(rowBytes * nNodes);
+        std::vector<float> x1(dim);
+        for (NnUint k = 0; k < nNodes; k++) {
+            if (type == F_Q80)
+                quantizeF32toQ80(&partials[k * dim], (NnBlockQ80 *)&zq[k * rowBytes], dim, 1, 0);
+            else if (type == F_Q40)
+                quantizeF32toQ40(&partials[k * dim], (NnBlockQ40 *)&zq[k * rowBytes], dim, 1, 0);
+            else
+                std::memcpy(&zq[k * rowBytes], &partials[k * dim], rowBytes);
+        }
+
+        Timer timer;
+        for (NnUint r = 0; r < nRounds; r++) {
+            std::copy(x.begin(), x.end(), x1.begin());
+            if (type == F_Q80) {
+                quantizeF32toQ80(partials.data(), (NnBlockQ80 *)zq.data(), dim, 1, 0);
+                mergeAddSquares_Q80_F32(x1.data(), (NnBlockQ80 *)zq.data(), nNodes, dim, dim);
+            } else if (type == F_Q40) {
+                quantizeF32toQ40(partials.data(), (NnBlockQ40 *)zq.data(), dim, 1, 0);
+                mergeAddSquares_Q40_F32(x1.data(), (NnBlockQ40 *)zq.data(), nNodes, dim, dim);
+            } else {
+                std::memcpy(zq.data(), partials.data(), rowBytes);
+                mergeAddSquares_F32(x1.data(), (float *)zq.data(), nNodes, dim, dim);
+            }
+        }
+        const NnUint us = timer.elapsedMicroseconds();
+
+        float errorSum = 0.0f;
+        float deltaSum = 0.0f;
+        for (NnUint i = 0; i < dim; i++) {
+            errorSum += (x1[i] - expected[i]) * (x1[i] - expected[i]);
+            deltaSum += (expected[i] - x[i]) * (expected[i] - x[i]);
+        }
+        // SYNC_NODE_SLICES: every node sends its row to every other node, twice per layer
+        const NnSize layerBytes = 2 * (nNodes - 1) * rowBytes;
+        printf("⏱️ %24s %s: %4zu kB/layer sent by a node, %5.0f us/layer at 1 GbE, rel. error %.5f, cast+merge %.1f us/layer (dim %u, %u nodes)\n",
+            "syncType", floatTypeToString(type), layerBytes / 1024, layerBytes * 8.0f / 1000.0f,
+            sqrtf(errorSum / deltaSum), 2.0f * us / nRounds, dim, nNodes);
+
+        // SYNC_ALL_REDUCE_*: a node sends 2 * (nNodes - 1) / nNodes rows per sync, but the sum is requantized on the way
+        const NnSize allReduceBytes = 2 * (2 * (nNodes - 1) * rowBytes) / nNodes;
+        float allReduceErrors[2];
+        for (NnUint r = 0; r < 2; r++) {
+            allReduceSyncType(type, r == 0, partials.data(), x1.data(), nNodes, dim);
+            add_F32(x1.data(), x.data(), dim, 1, 0);
+            errorSum = 0.0f;
+            for (NnUint i = 0; i < dim; i++)
+                errorSum += (x1[i] - expected[i]) * (x1[i] - expected[i]);
+            allReduceErrors[r] = sqrtf(errorSum / deltaSum);
+        }
+        printf("⏱️ %24s %s: %4zu kB/layer sent by a node, %5.0f us/layer at 1 GbE, rel. error ring %.5f, halving %.5f\n",
+            "allReduce", floatTypeToString(type), allReduceBytes / 1024, allReduceBytes * 8.0f / 1000.0f,
+            allReduceErrors[0], allReduceErrors[1]);
+    }
+}
+
+void testSiluMul(const NnUint m) {
+    const NnUint n = Q80_BLOCK_SIZE * m;
+
+    std::vector<float> d0(n);
+    std::vector<float> l(n);
+    for (NnUint i = 0; i < n; i++) {
+        d0[i] = 4.0f * sinf(i * 0.31f);
+        l[i] = cosf(i * 0.17f);
+    }
+    std::vector<float> d1(d0);
+    std::vector<NnBlockQ80> dq0(n / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ80> dq1(n / Q80_BLOCK_SIZE);
+
+    silu_F32(d0.data(), n, 1, 0);
+    mul_F32(d0.data(), d0.data(), l.data(), n, 1, 0);
+    quantizeF32toQ80(d0.data(), dq0.data(), n, 1, 0);
+
+    for (NnUint b = 0; b < n / Q80_BLOCK_SIZE; b++) {
+        const NnUint k = b * Q80_BLOCK_SIZE;
+        siluMul_F32(&d1[k], &d1[k], &l[k], Q80_BLOCK_SIZE);
+        quantizeF32toQ80(&d1[k], &dq1[b], Q80_BLOCK_SIZE, 1, 0);
+    }
+
+    std::vector<float> dd0(n);
+    std::vector<float> dd1(n);
+    dequantizeQ80toF32(dq0.data(), dd0.data(), n, 1, 0);
+    dequantizeQ80toF32(dq1.data(), dd1.data(), n, 1, 0);
+    compare_F32("siluMul_F32", d0.data(), d1.data(), n, 0.00001f);
+    compare_F32("siluMul_F32_Q80", dd0.data(), dd1.data(), n, 0.00001f);
+}
+
+void testMatmulRope(const NnUint nThreads) {
+    const NnUint n = 64;
+    const NnUint nBatches = 3;
+    const NnUint seqLen = 8;
+    const float positions[nBatches] = { 5.0f, 0.0f, 7.0f };
+    // The second node of two, the q slice is shifted in the rope cache. The kv slice is one Q80 block
+    const NnRopeSlice slice = sliceRope(128, 64, 2, 2, seqLen, 32, 10000.0f, 1);
+    std::vector<float> cache(slice.cacheSize.length);
+    std::vector<float> x(nBatches * n);
+    std::vector<NnBlockQ80> xQ80((nBatches * n) / Q80_BLOCK_SIZE);
+    rand(x.data(), nBatches * n, 3);
+    quantizeF32toQ80(x.data(), xQ80.data(), nBatches * n, 1, 0);
+
+    for (NnUint q = 0; q < 2; q++) {
+        const bool isQ = q == 1;
+        const NnUint d = isQ ? slice.qDim0 : slice.kvDim0;
+        std::vector<float> w(n * d);
+        std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+        NnByte *repacked = allocAligned(wQ40.size() * sizeof(NnBlockQ40));
+        std::vector<float> y0(nBatches * d);
+        std::vector<float> y1(nBatches * d);
+        std::vector<float> kv0(seqLen * d);
+        std::vector<float> kv1(seqLen * d);
+        rand(w.data(), n * d, 4 + q);
+        quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+
+        NnMatmulRopeOpConfig config;
+        config.rope = NnRopeLlamaOpConfig{isQ, 0, 0, 1.0f, 1.0f, 1.0f, 0, slice};
+        config.hasShift = !isQ;
+        config.shiftBufferIndex = 1;
+
+        float *x0[nBatches];
+        NnBlockQ80 *xQ0[nBatches];
+        float *o0[nBatches];
+        float *o1[nBatches];
+        for (NnUint b = 0; b < nBatches; b++) {
+            x0[b] = &x[b * n];
+            xQ0[b] = &xQ80[(b * n) / Q80_BLOCK_SIZE];
+            o0[b] = &y0[b * d];
+            o1[b] = &y1[b * d];
+        }
+
+        // The F32 weight, the Q40 weight as it is stored and the repacked Q40 weight
+        for (NnUint wt = 0; wt < 3; wt++) {
+            const bool isQ40 = wt > 0;
+#if defined(NN_Q40_REPACK)
+            const NnCpuWeightRepack repack = wt == 2 ? repackWeight_Q40 : nullptr;
+#else
+            const NnCpuWeightRepack repack = nullptr;
+            if (wt == 2)
+                continue;
+#endif
+            const char *opName = wt == 0 ? "matmulRope_F32" : (wt == 1 ? "matmulRope_Q80_Q40" : "matmulRope_Q80_Q40.repacked");
+
+            if (isQ40) {
+                for (NnUint b = 0; b < nBatches; b++)
+                    matmulRows_Q80_Q40_F32_ref(o0[b], xQ0[b], wQ40.data(), n, 0, d);
+            } else {
+                matmulBatchRows_F32_F32_F32(o0, x0, w.data(), n, nBatches, 0, d);
+            }
+            fullfillRopeLlama3Cache(&config.rope, cache.data());
+            for (NnUint b = 0; b < nBatches; b++) {
+                const NnUint pos = (NnUint)positions[b];
+                const float *posCache = &cache[pos * slice.sliceDim + (isQ ? slice.qShift : 0)];
+                for (NnUint i = 0; i < d; i += 2) {
+                    const float v0 = o0[b][i];
+                    const float v1 = o0[b][i + 1];
+                    o0[b][i] = v0 * posCache[i] - v1 * posCache[i + 1];
+                    o0[b][i + 1] = v0 * posCache[i + 1] + v1 * posCache[i];
+                }
+            }
+            if (repack != nullptr) {
+                NnSize2D wSize = size2D(F_Q40, n, d);
+                repack(repacked, (NnByte *)wQ40.data(), &wSize);
+            }
+
+            // The shift buffer is a KV cache of every type, the rows written into it are converted
+            for (NnFloatType kvType : isQ ? std::vector<NnFloatType>{ F_32 } : std::vector<NnFloatType>{ F_32, F_16, F_Q80 }) {
+                const NnSize2D kvSize = size2D(kvType, seqLen, d);
+                std::vector<NnByte> kvExpected(kvSize.nBytes);
+                std::vector<NnByte> kvBuffer(kvSize.nBytes);
+                std::vector<float> kvExpectedF32(seqLen * d);
+
+                NnByte bufferFlags[2] = { 0, 0 };
+                NnByte *buffers[2] = { (NnByte *)cache.data(), kvBuffer.data() };
+                NnBufferConfig bufferConfigs[2] = { { (char *)"rope", slice.cacheSize }, { (char *)"kv", kvSize } };
+                NnByte *pipes[1] = { (NnByte *)positions };
+                NnCpuChunkCounter counter;
+                counter.nextChunk.store(0);
+                counter.nDoneThreads.store(0);
+                counter.nComputedChunks.store(0);
+
+                NnCpuOpContext context;
+                context.name = "matmul_rope";
+                context.nBatches = nBatches;
+                context.bufferFlags = bufferFlags;
+                context.buffers = buffers;
+                context.bufferConfigs = bufferConfigs;
+                context.pipes = pipes;
+                context.pipeConfigs = nullptr;
+                context.opConfig = &config;
+                context.input = isQ40 ? (NnByte **)xQ0 : (NnByte **)x0;
+                context.inputSize = size2D(isQ40 ? F_Q80 : F_32, nBatches, n);
+                context.hasInputContinuousMemory = true;
+                context.output = (NnByte **)o1;
+                context.outputSize = size2D(F_32, nBatches, d);
+                context.hasOutputContinuousMemory = true;
+                context.weight = wt == 0 ? (NnByte *)w.data() : (wt == 1 ? (NnByte *)wQ40.data() : repacked);
+                context.weightSize = size2D(isQ40 ? F_Q40 : F_32, n, d);
+                context.weightRepack = repack;
+                context.chunkCounters = &counter;
+                std::fill(cache.begin(), cache.end(), 0.0f);
+                initMatmulRopeForward(&context);
+
+                for (NnUint m = 0; m < 2; m++) {
+                    context.splitMode = m == 0 ? SPLIT_STATIC : SPLIT_CHUNKED;
+                    std::fill(y1.begin(), y1.end(), 0.0f);
+                    std::fill(kvBuffer.begin(), kvBuffer.end(), 0);
+                    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+                        if (isQ40)
+                            matmulRopeForward_Q80_Q40_F32(nThreads, threadIndex, nBatches, &context);
+                        else
+                            matmulRopeForward_F32_F32_F32(nThreads, threadIndex, nBatches, &context);
+                    }
+                    char name[64];
+                    snprintf(name, sizeof(name), "%s.%s", opName, isQ ? "q" : "k");
+                    compare_F32(name, y0.data(), y1.data(), nBatches * d, isQ40 ? 0.0001f : 0.00001f);
+                    if (!isQ) {
+                        // The Q40 kernels round differently than the reference, so a converted row is
+                        // expected to match the conversion of the row the op has just computed
+                        const std::vector<float> &rows = isQ40 ? y1 : y0;
+                        std::fill(kv0.begin(), kv0.end(), 0.0f);
+                        for (NnUint b = 0; b < nBatches; b++)
+                            std::memcpy(&kv0[(NnUint)positions[b] * d], &rows[b * d], d * sizeof(float));
+                        convertKvCache(kvType, kv0.data(), kvExpected.data(), seqLen * d);
+                        widenKvCache(kvType, kvExpected.data(), kvExpectedF32.data(), seqLen * d);
+                        widenKvCache(kvType, kvBuffer.data(), kv1.data(), seqLen * d);
+                        snprintf(name, sizeof(name), "%s.shift.%s", opName, floatTypeToString(kvType));
+                        compare_F32(name, kvExpectedF32.data(), kv1.data(), seqLen * d, 0.00001f);
+                    }
+                }
+            }
+        }
+        std::free(repacked);
+    }
+}
+
 // matmul
 void testMatmul_F32_Q40_F32(const NnUint m = 2) {
     const NnUint n = Q80_BLOCK_SIZE * m;
@@ -240,6 +746,744 @@ void testMatmul_F32_Q40_F32(const NnUint m = 2) {
     compare_F32("matmul_Q80_Q40_F32", o.data(), oTemp.data(), d, 4.0f);
 }
 
+void testMatmul_F16(const NnUint m) {
+    const NnUint n = Q80_BLOCK_SIZE * m;
+    const NnUint d = 7;
+
+    std::vector<float> x(n);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d);
+    std::vector<float> oTemp(d);
+    std::vector<NnBlockQ80> xQ80(n / Q80_BLOCK_SIZE);
+    std::vector<NnFp16> wF16(n * d);
+
+    rand(x.data(), n, m);
+    rand(w.data(), n * d, m + 1);
+    for (NnUint i = 0; i < n * d; i++) {
+        wF16[i] = CONVERT_F32_TO_F16(w[i]);
+        w[i] = CONVERT_F16_TO_F32(wF16[i]);
+    }
+    quantizeF32toQ80(x.data(), xQ80.data(), n, 1, 0);
+
+    matmul_F32_F32_F32(o.data(), x.data(), w.data(), n, d, 1, 0);
+
+    matmulRows_F32_F16_F32(oTemp.data(), x.data(), wF16.data(), n, 0, d);
+    compare_F32("matmul_F32_F16_F32", o.data(), oTemp.data(), d, 0.0001f);
+
+    matmulRows_Q80_F16_F32(oTemp.data(), xQ80.data(), wF16.data(), n, 0, d);
+    compare_F32("matmul_Q80_F16_F32", o.data(), oTemp.data(), d, 0.05f * m);
+}
+
+void testChunkedMatmul_Q80_Q40_F32(const NnUint nThreads) {
+    const NnUint n = 256;
+    const NnUint d = 100;
+
+    std::vector<float> x(n);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d);
+    std::vector<float> oTemp(d);
+    std::vector<NnBlockQ80> xQ80(n / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+
+    rand(x.data(), n, 1);
+    rand(w.data(), n * d, 2);
+    quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+    quantizeF32toQ80(x.data(), xQ80.data(), n, 1, 0);
+
+    matmul_Q80_Q40_F32(o.data(), xQ80.data(), wQ40.data(), n, d, 1, 0);
+
+    // Threads run one after another, the first one claims all chunks
+    NnCpuChunkCounter counter;
+    counter.nextChunk.store(0);
+    counter.nDoneThreads.store(0);
+    counter.nComputedChunks.store(0);
+    for (NnUint round = 0; round < 2; round++) {
+        std::fill(oTemp.begin(), oTemp.end(), 0.0f);
+        for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+            NnUint start, end;
+            while (claimChunk(&counter, d, getChunkSize(d, nThreads), nThreads, &start, &end))
+                matmulRows_Q80_Q40_F32(oTemp.data(), xQ80.data(), wQ40.data(), n, start, end);
+        }
+        assert(counter.nextChunk.load() == 0);
+        assert(counter.nDoneThreads.load() == 0);
+        compare_F32("chunkedMatmul_Q80_Q40_F32", o.data(), oTemp.data(), d, 0.00001f);
+    }
+}
+
+typedef void (*MatmulRows_Q80_Q40_F32)(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint start, const NnUint end);
+
+static std::vector<std::pair<const char *, MatmulRows_Q80_Q40_F32>> getMatmulKernels_Q80_Q40_F32() {
+    std::vector<std::pair<const char *, MatmulRows_Q80_Q40_F32>> kernels;
+    kernels.push_back({ "matmul_Q80_Q40_F32_ref", matmulRows_Q80_Q40_F32_ref });
+#if defined(__SSSE3__)
+    kernels.push_back({ "matmul_Q80_Q40_F32_ssse3", matmulRows_Q80_Q40_F32_ssse3 });
+#endif
+#if defined(__AVX2__)
+    kernels.push_back({ "matmul_Q80_Q40_F32_avx2", matmulRows_Q80_Q40_F32_avx2 });
+#if defined(NN_AVX_VNNI)
+    if (hasAvxVnni())
+        kernels.push_back({ "matmul_Q80_Q40_F32_avxvnni", matmulRows_Q80_Q40_F32_avxvnni });
+#endif
+#endif
+    kernels.push_back({ "matmul_Q80_Q40_F32_dispatch", matmulRows_Q80_Q40_F32 });
+    return kernels;
+}
+
+void testMatmulKernels_Q80_Q40_F32(const NnUint nBlocks) {
+    const NnUint n = Q80_BLOCK_SIZE * nBlocks;
+    const NnUint d = 7;
+
+    std::vector<float> x(n);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d);
+    std::vector<float> oTemp(d);
+    std::vector<NnBlockQ80> xQ80(n / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+    for (NnUint i = 0; i < n; i++)
+        x[i] = sinf(i * 0.37f) * 3.0f;
+    for (NnUint i = 0; i < n * d; i++)
+        w[i] = cosf(i * 0.011f + (i % 7));
+    quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+    quantizeF32toQ80(x.data(), xQ80.data(), n, 1, 0);
+
+    matmulRows_Q80_Q40_F32_ref(o.data(), xQ80.data(), wQ40.data(), n, 0, d);
+    for (auto &kernel : getMatmulKernels_Q80_Q40_F32()) {
+        std::fill(oTemp.begin(), oTemp.end(), 0.0f);
+        kernel.second(oTemp.data(), xQ80.data(), wQ40.data(), n, 0, d);
+        compare_F32(kernel.first, o.data(), oTemp.data(), d, 0.0001f);
+    }
+}
+
+void benchmarkMatmulKernels_Q80_Q40_F32() {
+    const NnUint n = 4096;
+    const NnUint d = 4096;
+    const NnUint nRounds = 8;
+
+    std::vector<float> x(n);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d);
+    std::vector<NnBlockQ80> xQ80(n / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+    for (NnUint i = 0; i < n; i++)
+        x[i] = sinf(i * 0.37f);
+    for (NnUint i = 0; i < n * d; i++)
+        w[i] = cosf(i * 0.011f);
+    quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+    quantizeF32toQ80(x.data(), xQ80.data(), n, 1, 0);
+
+    const NnSize weightBytes = wQ40.size() * sizeof(NnBlockQ40);
+    for (auto &kernel : getMatmulKernels_Q80_Q40_F32()) {
+        kernel.second(o.data(), xQ80.data(), wQ40.data(), n, 0, d);
+        Timer timer;
+        for (NnUint round = 0; round < nRounds; round++)
+            kernel.second(o.data(), xQ80.data(), wQ40.data(), n, 0, d);
+        NnUint us = timer.elapsedMicroseconds() / nRounds;
+        printf("⏱️ %32s: %u us/matmul, %.2f GB/s (%ux%u, 1 thread)\n",
+            kernel.first, us, weightBytes / (us * 1000.0f), n, d);
+    }
+}
+
+// Runs the flash attention items like the op forward does in the chunked mode
+static void multiheadAttFlash_F32(
+    float *const *x, const float *q, float *partials, const NnUint partialsStride, const NnByte *keyCache, const NnByte *valueCache,
+    const NnFloatType kvType, const float *positions, const NnUint nBatches, const NnUint nHeads, const NnUint nKvHeads, const NnUint headSize,
+    const NnUint nThreads)
+{
+    NnCpuChunkCounter counter;
+    counter.nextChunk.store(0);
+    counter.nDoneThreads.store(0);
+    counter.nComputedChunks.store(0);
+    const NnUint nItems = nKvHeads * getFlashAttSpans(getMaxPosition(positions, nBatches));
+
+    std::vector<std::thread> threads;
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+        threads.emplace_back([&] {
+            NnUint itemStart, itemEnd;
+            while (claimChunk(&counter, nItems, 1, nThreads, &itemStart, &itemEnd))
+                multiheadAttFlashItems_F32(x, q, partials, keyCache, valueCache, kvType, positions, nBatches, nHeads * headSize, partialsStride,
+                    nHeads, nHeads, nKvHeads, nKvHeads * headSize, headSize, &counter, itemStart, itemEnd);
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    assert(counter.nComputedChunks.load() == 0);
+}
+
+void testMatmulKernels_Q80_Q80_F32(const NnUint nBlocks) {
+    const NnUint nBatches = 3;
+    const NnUint n = Q80_BLOCK_SIZE * nBlocks;
+    const NnUint d = 7;
+
+    std::vector<float> x(nBatches * n);
+    std::vector<float> w(n * d);
+    std::vector<float> o(nBatches * d);
+    std::vector<float> oTemp(nBatches * d);
+    std::vector<NnBlockQ80> xQ80((nBatches * n) / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ80> wQ80((n * d) / Q80_BLOCK_SIZE);
+    for (NnUint i = 0; i < nBatches * n; i++)
+        x[i] = sinf(i * 0.37f) * 3.0f;
+    for (NnUint i = 0; i < n * d; i++)
+        w[i] = cosf(i * 0.011f + (i % 7));
+    quantizeF32toQ80(w.data(), wQ80.data(), n * d, 1, 0);
+    quantizeF32toQ80(x.data(), xQ80.data(), nBatches * n, 1, 0);
+
+    NnBlockQ80 *input[nBatches];
+    float *output[nBatches];
+    for (NnUint b = 0; b < nBatches; b++) {
+        input[b] = &xQ80[b * nBlocks];
+        output[b] = &oTemp[b * d];
+        matmulRows_Q80_Q80_F32_ref(&o[b * d], input[b], wQ80.data(), n, 0, d);
+    }
+
+    std::vector<std::pair<const char *, void (*)(float *, const NnBlockQ80 *, const NnBlockQ80 *, const NnUint, const NnUint, const NnUint)>> kernels;
+#if defined(__SSSE3__)
+    kernels.push_back({ "matmul_Q80_Q80_F32_ssse3", matmulRows_Q80_Q80_F32_ssse3 });
+#endif
+#if defined(__AVX2__)
+    kernels.push_back({ "matmul_Q80_Q80_F32_avx2", matmulRows_Q80_Q80_F32_avx2 });
+#if defined(NN_AVX_VNNI)
+    if (hasAvxVnni())
+        kernels.push_back({ "matmul_Q80_Q80_F32_avxvnni", matmulRows_Q80_Q80_F32_avxvnni });
+#endif
+#endif
+    kernels.push_back({ "matmul_Q80_Q80_F32_dispatch", matmulRows_Q80_Q80_F32 });
+    for (auto &kernel : kernels) {
+        std::fill(oTemp.begin(), oTemp.end(), 0.0f);
+        kernel.second(oTemp.data(), xQ80.data(), wQ80.data(), n, 0, d);
+        compare_F32(kernel.first, o.data(), oTemp.data(), d, 0.0001f);
+    }
+
+    std::fill(oTemp.begin(), oTemp.end(), 0.0f);
+    matmulBatchRows_Q80_Q80_F32(output, input, wQ80.data(), n, nBatches, 0, d);
+    compare_F32("batchMatmul_Q80_Q80_F32", o.data(), oTemp.data(), nBatches * d, 0.0001f);
+}
+
+void testMatmul_Q80_QK_F32(const NnUint nBlocks) {
+    const NnUint n = Q4K_BLOCK_SIZE * nBlocks;
+    const NnUint d = 7;
+
+    std::vector<float> x(n);
+    std::vector<float> w(n * d);
+    std::vector<float> wTemp(n * d);
+    std::vector<float> o(d);
+    std::vector<float> oTemp(d);
+    std::vector<NnBlockQ80> xQ80(n / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ4K> wQ4K((n * d) / Q4K_BLOCK_SIZE);
+    std::vector<NnBlockQ6K> wQ6K((n * d) / Q6K_BLOCK_SIZE);
+    std::vector<NnBlockQ2K> wQ2K((n * d) / Q2K_BLOCK_SIZE);
+    for (NnUint i = 0; i < n; i++)
+        x[i] = sinf(i * 0.37f) * 3.0f;
+    for (NnUint i = 0; i < n * d; i++)
+        w[i] = cosf(i * 0.011f + (i % 7)) * (1.0f + (i / 64) % 3);
+    quantizeF32toQ80(x.data(), xQ80.data(), n, 1, 0);
+
+    quantizeF32toQ4K(w.data(), wQ4K.data(), n * d, 1, 0);
+    dequantizeQ4KtoF32(wQ4K.data(), wTemp.data(), n * d, 1, 0);
+    compare_F32("quantizeF32toQ4K", w.data(), wTemp.data(), n * d, 0.3f);
+
+    matmulRows_Q80_Q4K_F32_ref(o.data(), xQ80.data(), wQ4K.data(), n, 0, d);
+    matmul_F32_F32_F32(oTemp.data(), x.data(), wTemp.data(), n, d, 1, 0);
+    compare_F32("matmul_Q80_Q4K_F32_ref", o.data(), oTemp.data(), d, 0.5f * nBlocks);
+    matmulRows_Q80_Q4K_F32(oTemp.data(), xQ80.data(), wQ4K.data(), n, 0, d);
+    compare_F32("matmul_Q80_Q4K_F32", o.data(), oTemp.data(), d, 0.001f * nBlocks);
+
+    quantizeF32toQ6K(w.data(), wQ6K.data(), n * d, 1, 0);
+    dequantizeQ6KtoF32(wQ6K.data(), wTemp.data(), n * d, 1, 0);
+    compare_F32("quantizeF32toQ6K", w.data(), wTemp.data(), n * d, 0.1f);
+
+    matmulRows_Q80_Q6K_F32_ref(o.data(), xQ80.data(), wQ6K.data(), n, 0, d);
+    matmul_F32_F32_F32(oTemp.data(), x.data(), wTemp.data(), n, d, 1, 0);
+    compare_F32("matmul_Q80_Q6K_F32_ref", o.data(), oTemp.data(), d, 0.5f * nBlocks);
+    matmulRows_Q80_Q6K_F32(oTemp.data(), xQ80.data(), wQ6K.data(), n, 0, d);
+    compare_F32("matmul_Q80_Q6K_F32", o.data(), oTemp.data(), d, 0.001f * nBlocks);
+
+    quantizeF32toQ2K(w.data(), wQ2K.data(), n * d, 1, 0);
+    dequantizeQ2KtoF32(wQ2K.data(), wTemp.data(), n * d, 1, 0);
+    compare_F32("quantizeF32toQ2K", w.data(), wTemp.data(), n * d, 1.0f);
+
+    matmulRows_Q80_Q2K_F32_ref(o.data(), xQ80.data(), wQ2K.data(), n, 0, d);
+    matmul_F32_F32_F32(oTemp.data(), x.data(), wTemp.data(), n, d, 1, 0);
+    compare_F32("matmul_Q80_Q2K_F32_ref", o.data(), oTemp.data(), d, 0.5f * nBlocks);
+    matmulRows_Q80_Q2K_F32(oTemp.data(), xQ80.data(), wQ2K.data(), n, 0, d);
+    compare_F32("matmul_Q80_Q2K_F32", o.data(), oTemp.data(), d, 0.001f * nBlocks);
+}
+
+void testMultiheadAttFlash(const NnUint nThreads) {
+    const NnUint nHeads = 8;
+    const NnUint nKvHeads = 2;
+    const NnUint headSize = 32;
+    const NnUint seqLen = ATT_FLASH_SPAN * 2 + 300;
+    const NnUint kvDim0 = nKvHeads * headSize;
+    const NnUint maxBatches = ATT_FLASH_QUERIES + 4;
+    const NnUint qDim = nHeads * headSize;
+    const NnSize2D partialsSize = sliceMultiHeadAtt(nHeads, headSize, seqLen, 1, maxBatches).flashAttSize;
+
+    std::vector<float> q(maxBatches * qDim);
+    std::vector<float> keyCache(seqLen * kvDim0);
+    std::vector<float> valueCache(seqLen * kvDim0);
+    std::vector<float> att(nHeads * seqLen);
+    std::vector<float> partials(partialsSize.length);
+    std::vector<float> expectedOutput(maxBatches * qDim);
+    std::vector<float> output(maxBatches * qDim);
+    std::vector<float *> outputs(maxBatches);
+    for (NnUint b = 0; b < maxBatches; b++)
+        outputs[b] = &output[b * qDim];
+    for (NnUint i = 0; i < maxBatches * qDim; i++)
+        q[i] = sinf(i * 0.29f);
+    // Scores drift with the position so the running maximum moves between tiles and spans
+    for (NnUint i = 0; i < seqLen * kvDim0; i++) {
+        keyCache[i] = cosf(i * 0.13f) * (1.0f + (i / kvDim0) * 0.002f);
+        valueCache[i] = sinf(i * 0.07f);
+    }
+
+    std::vector<std::vector<float>> cases = {
+        { 0.0f }, { 5.0f }, { ATT_FLASH_TILE - 1.0f }, { (float)ATT_FLASH_TILE },
+        { ATT_FLASH_SPAN - 1.0f }, { (float)ATT_FLASH_SPAN }, { seqLen - 1.0f },
+        { 700.0f, 3.0f, ATT_FLASH_SPAN - 1.0f, (float)ATT_FLASH_SPAN },
+    };
+    // Prefill chunks, one crosses a span and one has more batches than queries scored together
+    cases.push_back({});
+    for (NnUint b = 0; b < 10; b++)
+        cases.back().push_back(ATT_FLASH_SPAN - 5.0f + b);
+    cases.push_back({});
+    for (NnUint b = 0; b < maxBatches; b++)
+        cases.back().push_back((float)b);
+
+    for (std::vector<float> &positions : cases) {
+        const NnUint nBatches = positions.size();
+        multiheadAttFlash_F32(outputs.data(), q.data(), partials.data(), partialsSize.x, (NnByte *)keyCache.data(), (NnByte *)valueCache.data(),
+            F_32, positions.data(), nBatches, nHeads, nKvHeads, headSize, nThreads);
+        for (NnUint b = 0; b < nBatches; b++)
+            multiheadAttHeads_F32(&expectedOutput[b * qDim], &q[b * qDim], att.data(), (NnByte *)keyCache.data(), (NnByte *)valueCache.data(),
+                F_32, (NnUint)positions[b], nHeads, nKvHeads, kvDim0, headSize, seqLen, 0, nHeads);
+        compare_F32("multiheadAttFlash", expectedOutput.data(), output.data(), nBatches * qDim, 0.0001f);
+    }
+}
+
+// The shift op converts the rows of a quantized KV cache, the attention reads them in place
+void testMultiheadAttKvCache(const NnUint nThreads) {
+    const NnUint nHeads = 8;
+    const NnUint nKvHeads = 2;
+    const NnUint headSize = 64;
+    const NnUint seqLen = ATT_FLASH_SPAN + 100;
+    const NnUint kvDim0 = nKvHeads * headSize;
+    const NnUint qDim = nHeads * headSize;
+    const NnUint nBatches = 3;
+    float positions[nBatches] = { 5.0f, ATT_FLASH_SPAN + 20.0f, seqLen - 1.0f };
+    const NnSize2D partialsSize = sliceMultiHeadAtt(nHeads, headSize, seqLen, 1, nBatches).flashAttSize;
+
+    std::vector<float> q(nBatches * qDim);
+    std::vector<float> keyCache(seqLen * kvDim0);
+    std::vector<float> valueCache(seqLen * kvDim0);
+    std::vector<float> widenedKeyCache(seqLen * kvDim0);
+    std::vector<float> widenedValueCache(seqLen * kvDim0);
+    std::vector<float> att(nHeads * seqLen);
+    std::vector<float> partials(partialsSize.length);
+    std::vector<float> expectedOutput(nBatches * qDim);
+    std::vector<float> output(nBatches * qDim);
+    std::vector<float *> outputs(nBatches);
+    for (NnUint b = 0; b < nBatches; b++)
+        outputs[b] = &output[b * qDim];
+    for (NnUint i = 0; i < nBatches * qDim; i++)
+        q[i] = sinf(i * 0.29f);
+    for (NnUint i = 0; i < seqLen * kvDim0; i++) {
+        keyCache[i] = cosf(i * 0.13f) * (1.0f + (i / kvDim0) * 0.002f);
+        valueCache[i] = sinf(i * 0.07f);
+    }
+
+    for (NnFloatType kvType : { F_16, F_Q80 }) {
+        const NnKvCacheSlice kvSlice = sliceKvCache(kvType, kvDim0, seqLen, 1);
+        std::vector<NnByte> quantKeyCache(kvSlice.keySize.nBytes);
+        std::vector<NnByte> quantValueCache(kvSlice.valueSize.nBytes);
+
+        // The shift op writes one position per forward here
+        float index;
+        NnByte *pipes[1] = { (NnByte *)&index };
+        NnShiftOpCodeConfig shiftConfig = { 0 };
+        const NnCpuOpForward shiftForward = getCpuOpForward(OP_SHIFT, getOpQuantType(F_32, F_UNK, kvType));
+        for (NnUint c = 0; c < 2; c++) {
+            float *cache = c == 0 ? keyCache.data() : valueCache.data();
+            NnByte *quantCache = c == 0 ? quantKeyCache.data() : quantValueCache.data();
+            NnCpuOpContext context;
+            context.name = "shift";
+            context.nBatches = 1;
+            context.pipes = pipes;
+            context.opConfig = &shiftConfig;
+            context.inputSize = size2D(F_32, 1, kvDim0);
+            context.hasInputContinuousMemory = true;
+            context.output = &quantCache;
+            context.outputSize = size2D(kvType, 1, seqLen * kvDim0);
+            context.hasOutputContinuousMemory = true;
+            for (NnUint t = 0; t < seqLen; t++) {
+                NnByte *input = (NnByte *)&cache[t * kvDim0];
+                context.input = &input;
+                index = (float)t;
+                for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+                    shiftForward(nThreads, threadIndex, 1, &context);
+            }
+        }
+        widenKvCache(kvType, quantKeyCache.data(), widenedKeyCache.data(), seqLen * kvDim0);
+        widenKvCache(kvType, quantValueCache.data(), widenedValueCache.data(), seqLen * kvDim0);
+        const float shiftEpsilon = kvType == F_Q80 ? 0.01f : 0.001f;
+        compare_F32(kvType == F_Q80 ? "shift_F32_Q80.k" : "shift_F32_F16.k", keyCache.data(), widenedKeyCache.data(), seqLen * kvDim0, shiftEpsilon);
+        compare_F32(kvType == F_Q80 ? "shift_F32_Q80.v" : "shift_F32_F16.v", valueCache.data(), widenedValueCache.data(), seqLen * kvDim0, shiftEpsilon);
+
+        // Both attention kernels over the quantized cache give the output of the attention over the widened cache
+        for (NnUint b = 0; b < nBatches; b++)
+            multiheadAttHeads_F32(&expectedOutput[b * qDim], &q[b * qDim], att.data(), (NnByte *)widenedKeyCache.data(), (NnByte *)widenedValueCache.data(),
+                F_32, (NnUint)positions[b], nHeads, nKvHeads, kvDim0, headSize, seqLen, 0, nHeads);
+        for (NnUint b = 0; b < nBatches; b++)
+            multiheadAttHeads_F32(outputs[b], &q[b * qDim], att.data(), quantKeyCache.data(), quantValueCache.data(),
+                kvType, (NnUint)positions[b], nHeads, nKvHeads, kvDim0, headSize, seqLen, 0, nHeads);
+        compare_F32(kvType == F_Q80 ? "multiheadAtt.kvQ80" : "multiheadAtt.kvF16", expectedOutput.data(), output.data(), nBatches * qDim, 0.0001f);
+        multiheadAttFlash_F32(outputs.data(), q.data(), partials.data(), partialsSize.x, quantKeyCache.data(), quantValueCache.data(),
+            kvType, positions, nBatches, nHeads, nKvHeads, headSize, nThreads);
+        compare_F32(kvType == F_Q80 ? "multiheadAttFlash.kvQ80" : "multiheadAttFlash.kvF16", expectedOutput.data(), output.data(), nBatches * qDim, 0.0001f);
+    }
+}
+
+void benchmarkMultiheadAtt() {
+    const NnUint nHeads = 32;
+    const NnUint nKvHeads = 8;
+    const NnUint headSize = 128;
+    const NnUint seqLen = 8192;
+    const NnUint kvDim0 = nKvHeads * headSize;
+    const NnUint qDim = nHeads * headSize;
+    const NnUint nRounds = 2;
+
+    std::vector<float> keyCache(seqLen * kvDim0);
+    std::vector<float> valueCache(seqLen * kvDim0);
+    for (NnUint i = 0; i < seqLen * kvDim0; i++) {
+        keyCache[i] = cosf(i * 0.13f);
+        valueCache[i] = sinf(i * 0.07f);
+    }
+
+    // A decoded token at the end of the context and a prefill chunk, over every KV cache type
+    for (NnFloatType kvType : { F_32, F_16, F_Q80 })
+    for (NnUint nBatches : { 1, 32 }) {
+        const NnKvCacheSlice kvSlice = sliceKvCache(kvType, kvDim0, seqLen, 1);
+        std::vector<NnByte> quantKeyCache(kvSlice.keySize.nBytes);
+        std::vector<NnByte> quantValueCache(kvSlice.valueSize.nBytes);
+        convertKvCache(kvType, keyCache.data(), quantKeyCache.data(), seqLen * kvDim0);
+        convertKvCache(kvType, valueCache.data(), quantValueCache.data(), seqLen * kvDim0);
+
+        const NnSize2D partialsSize = sliceMultiHeadAtt(nHeads, headSize, seqLen, 1, nBatches).flashAttSize;
+        std::vector<float> q(nBatches * qDim);
+        std::vector<float> att(nHeads * seqLen);
+        std::vector<float> partials(partialsSize.length);
+        std::vector<float> output(nBatches * qDim);
+        std::vector<float *> outputs(nBatches);
+        std::vector<float> positions(nBatches);
+        for (NnUint i = 0; i < nBatches * qDim; i++)
+            q[i] = sinf(i * 0.29f);
+        for (NnUint b = 0; b < nBatches; b++) {
+            outputs[b] = &output[b * qDim];
+            positions[b] = (float)(seqLen - nBatches + b);
+        }
+
+        for (NnAttentionType type : { ATT_FULL_SCORES, ATT_FLASH }) {
+            Timer timer;
+            for (NnUint round = 0; round < nRounds; round++) {
+                if (type == ATT_FULL_SCORES) {
+                    for (NnUint b = 0; b < nBatches; b++)
+                        multiheadAttHeads_F32(outputs[b], &q[b * qDim], att.data(), quantKeyCache.data(), quantValueCache.data(),
+                            kvType, (NnUint)positions[b], nHeads, nKvHeads, kvDim0, headSize, seqLen, 0, nHeads);
+                } else {
+                    multiheadAttFlash_F32(outputs.data(), q.data(), partials.data(), partialsSize.x, quantKeyCache.data(), quantValueCache.data(),
+                        kvType, positions.data(), nBatches, nHeads, nKvHeads, headSize, 1);
+                }
+            }
+            printf("⏱️ %24s %s, kv %s: %u us/token (batch %u at pos %u, %u heads, %u kv heads, kv cache %zu kB, att buffer %zu kB, 1 thread)\n",
+                "multiheadAtt_F32", type == ATT_FLASH ? "flash" : "full-scores", floatTypeToString(kvType),
+                timer.elapsedMicroseconds() / (nRounds * nBatches),
+                nBatches, seqLen - 1, nHeads, nKvHeads, (kvSlice.keySize.nBytes + kvSlice.valueSize.nBytes) / 1024,
+                (type == ATT_FLASH ? partials.size() : att.size() * nBatches) * sizeof(float) / 1024);
+        }
+    }
+}
+
+// One thread starts late (a loaded core), the others have to absorb its work
+void benchmarkSplitModes_Q80_Q40_F32() {
+    const NnUint nThreads = 4;
+    const NnUint n = 4096;
+    const NnUint d = 4096;
+    const NnUint slowThreadDelayUs = 2000;
+    const NnUint nRounds = 8;
+
+    std::vector<float> x(n);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d);
+    std::vector<NnBlockQ80> xQ80(n / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+    rand(x.data(), n, 3);
+    rand(w.data(), n * d, 4);
+    quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+    quantizeF32toQ80(x.data(), xQ80.data(), n, 1, 0);
+
+    NnCpuChunkCounter counter;
+    counter.nextChunk.store(0);
+    counter.nDoneThreads.store(0);
+    counter.nComputedChunks.store(0);
+
+    for (NnCpuSplitMode mode : { SPLIT_STATIC, SPLIT_CHUNKED }) {
+        Timer timer;
+        for (NnUint round = 0; round < nRounds; round++) {
+            std::vector<std::thread> threads;
+            for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+                threads.emplace_back([&, threadIndex] {
+                    if (threadIndex == 0) {
+                        Timer delay;
+                        while (delay.elapsedMicroseconds() < slowThreadDelayUs);
+                    }
+                    if (mode == SPLIT_STATIC) {
+                        matmul_Q80_Q40_F32(o.data(), xQ80.data(), wQ40.data(), n, d, nThreads, threadIndex);
+                    } else {
+                        NnUint start, end;
+                        while (claimChunk(&counter, d, getChunkSize(d, nThreads), nThreads, &start, &end))
+                            matmulRows_Q80_Q40_F32(o.data(), xQ80.data(), wQ40.data(), n, start, end);
+                    }
+                });
+            }
+            for (std::thread &thread : threads)
+                thread.join();
+        }
+        printf("⏱️ %24s %s: %u us/matmul (%u threads, one delayed by %u us)\n",
+            "matmul_Q80_Q40_F32", splitModeToString(mode), timer.elapsedMicroseconds() / nRounds, nThreads, slowThreadDelayUs);
+    }
+}
+
+// The batches lay apart from each other like slices of a larger pipe, so llamafile_sgemm cannot take them
+void testBatchMatmul(const NnUint nBatches) {
+    const NnUint n = 96;
+    const NnUint d = 11;
+    const NnUint stride = n + 3 * Q80_BLOCK_SIZE;
+
+    std::vector<float> x(stride * nBatches);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d * nBatches);
+    std::vector<float> oTemp(d * nBatches);
+    std::vector<NnBlockQ80> xQ80((stride * nBatches) / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+    for (NnUint i = 0; i < stride * nBatches; i++)
+        x[i] = sinf(i * 0.37f) * 3.0f;
+    for (NnUint i = 0; i < n * d; i++)
+        w[i] = cosf(i * 0.011f + (i % 7));
+    quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+    quantizeF32toQ80(x.data(), xQ80.data(), stride * nBatches, 1, 0);
+
+    std::vector<float *> output(nBatches);
+    std::vector<float *> input(nBatches);
+    std::vector<NnBlockQ80 *> inputQ80(nBatches);
+    for (NnUint b = 0; b < nBatches; b++) {
+        output[b] = &oTemp[b * d];
+        input[b] = &x[b * stride];
+        inputQ80[b] = &xQ80[(b * stride) / Q80_BLOCK_SIZE];
+    }
+
+    // f32
+
+    for (NnUint b = 0; b < nBatches; b++)
+        matmulRows_F32_F32_F32(&o[b * d], input[b], w.data(), n, 0, d);
+    std::fill(oTemp.begin(), oTemp.end(), 0.0f);
+    matmulBatchRows_F32_F32_F32(output.data(), input.data(), w.data(), n, nBatches, 0, 5);
+    matmulBatchRows_F32_F32_F32(output.data(), input.data(), w.data(), n, nBatches, 5, d);
+    compare_F32("batchMatmul_F32_F32_F32", o.data(), oTemp.data(), d * nBatches, 0.0001f);
+
+    // q80 * q40
+
+    for (NnUint b = 0; b < nBatches; b++)
+        matmulRows_Q80_Q40_F32_ref(&o[b * d], inputQ80[b], wQ40.data(), n, 0, d);
+    std::fill(oTemp.begin(), oTemp.end(), 0.0f);
+    matmulBatchRows_Q80_Q40_F32(output.data(), inputQ80.data(), wQ40.data(), n, nBatches, 0, 5);
+    matmulBatchRows_Q80_Q40_F32(output.data(), inputQ80.data(), wQ40.data(), n, nBatches, 5, d);
+    compare_F32("batchMatmul_Q80_Q40_F32", o.data(), oTemp.data(), d * nBatches, 0.0001f);
+}
+
+// Prefill of one 4096x4096 Q40 matmul on one thread: one blocked pass over all batches vs one pass per batch
+void benchmarkBatchMatmul_Q80_Q40_F32() {
+    const NnUint n = 4096;
+    const NnUint d = 4096;
+    const NnUint maxBatches = 64;
+
+    std::vector<float> x(n * maxBatches);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d * maxBatches);
+    std::vector<NnBlockQ80> xQ80((n * maxBatches) / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+    for (NnUint i = 0; i < n * maxBatches; i++)
+        x[i] = sinf(i * 0.37f);
+    for (NnUint i = 0; i < n * d; i++)
+        w[i] = cosf(i * 0.011f);
+    quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+    quantizeF32toQ80(x.data(), xQ80.data(), n * maxBatches, 1, 0);
+
+    std::vector<float *> output(maxBatches);
+    std::vector<NnBlockQ80 *> input(maxBatches);
+    for (NnUint b = 0; b < maxBatches; b++) {
+        output[b] = &o[b * d];
+        input[b] = &xQ80[(b * n) / Q80_BLOCK_SIZE];
+    }
+
+    for (NnUint nBatches = 1; nBatches <= maxBatches; nBatches *= 2) {
+        Timer gemvTimer;
+        for (NnUint b = 0; b < nBatches; b++)
+            matmulRows_Q80_Q40_F32(output[b], input[b], wQ40.data(), n, 0, d);
+        const NnUint gemvUs = gemvTimer.elapsedMicroseconds();
+
+        Timer gemmTimer;
+        matmulBatchRows_Q80_Q40_F32(output.data(), input.data(), wQ40.data(), n, nBatches, 0, d);
+        const NnUint gemmUs = gemmTimer.elapsedMicroseconds();
+
+        Timer sgemmTimer;
+        const bool hasSgemm = nBatches > 1 && llamafile_sgemm(
+            d, nBatches, n / Q80_BLOCK_SIZE,
+            wQ40.data(), n / Q80_BLOCK_SIZE,
+            xQ80.data(), n / Q80_BLOCK_SIZE,
+            o.data(), d,
+            0, 1, 0,
+            F_Q40, F_Q80, F_32);
+        const NnUint sgemmUs = sgemmTimer.elapsedMicroseconds();
+
+        printf("⏱️ %24s batch %2u: %6.0f tokens/s (per-batch gemv %6.0f tokens/s, llamafile ",
+            "batchMatmul_Q80_Q40_F32", nBatches, nBatches * 1e6f / gemmUs, nBatches * 1e6f / gemvUs);
+        if (hasSgemm)
+            printf("%6.0f tokens/s)\n", nBatches * 1e6f / sgemmUs);
+        else
+            printf("declined)\n");
+    }
+}
+
+#if defined(NN_Q40_REPACK)
+static void initMatmulContext_Q80_Q40_F32(NnCpuOpContext *context, NnCpuChunkCounter *counter, NnBlockQ80 **input, float **output,
+    NnByte *weight, const NnUint n, const NnUint d, const NnUint nBatches)
+{
+    counter->nextChunk.store(0);
+    counter->nDoneThreads.store(0);
+    counter->nComputedChunks.store(0);
+    context->name = "matmul";
+    context->nBatches = nBatches;
+    context->opConfig = nullptr;
+    context->input = (NnByte **)input;
+    context->inputSize = size2D(F_Q80, nBatches, n);
+    context->hasInputContinuousMemory = true;
+    context->output = (NnByte **)output;
+    context->outputSize = size2D(F_32, nBatches, d);
+    context->hasOutputContinuousMemory = true;
+    context->weight = weight;
+    context->weightSize = size2D(F_Q40, n, d);
+    context->weightRepack = getCpuWeightRepack(OP_MATMUL, Q80_Q40_F32, context->weightSize);
+    context->chunkCounters = counter;
+}
+
+// The forward over a repacked weight against the kernel that reads the weight as it is stored
+void testRepackedMatmul_Q80_Q40_F32(const NnUint nThreads) {
+    const NnUint nBatches = 5;
+    const NnUint n = 96;
+    const NnUint d = 44;
+
+    std::vector<float> x(nBatches * n);
+    std::vector<float> w(n * d);
+    std::vector<NnBlockQ80> xQ80((nBatches * n) / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+    NnByte *repacked = allocAligned(wQ40.size() * sizeof(NnBlockQ40));
+    std::vector<float> o(nBatches * d);
+    std::vector<float> oTemp(nBatches * d);
+    for (NnUint i = 0; i < nBatches * n; i++)
+        x[i] = sinf(i * 0.37f) * 3.0f;
+    for (NnUint i = 0; i < n * d; i++)
+        w[i] = cosf(i * 0.011f + (i % 7));
+    quantizeF32toQ80(x.data(), xQ80.data(), nBatches * n, 1, 0);
+    quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+
+    NnBlockQ80 *input[nBatches];
+    float *output[nBatches];
+    for (NnUint b = 0; b < nBatches; b++) {
+        input[b] = &xQ80[b * n / Q80_BLOCK_SIZE];
+        output[b] = &oTemp[b * d];
+        matmulRows_Q80_Q40_F32_ref(&o[b * d], input[b], wQ40.data(), n, 0, d);
+    }
+
+    NnCpuChunkCounter counter;
+    NnCpuOpContext context;
+    initMatmulContext_Q80_Q40_F32(&context, &counter, input, output, repacked, n, d, nBatches);
+    assert(context.weightRepack != nullptr);
+    context.weightRepack(repacked, (NnByte *)wQ40.data(), &context.weightSize);
+
+    for (NnCpuSplitMode mode : { SPLIT_STATIC, SPLIT_CHUNKED }) {
+        context.splitMode = mode;
+        for (NnUint batchSize : { 1u, 2u, nBatches }) {
+            std::fill(oTemp.begin(), oTemp.end(), 0.0f);
+            for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++)
+                matmulForward_Q80_Q40_F32(nThreads, threadIndex, batchSize, &context);
+            compare_F32("repackedMatmul_Q80_Q40_F32", o.data(), oTemp.data(), batchSize * d, 0.0001f);
+        }
+    }
+    std::free(repacked);
+}
+
+// One 4096x4096 Q40 matmul on one thread: the weight as it is stored vs the repacked weight
+void benchmarkRepackedMatmul_Q80_Q40_F32() {
+    const NnUint n = 4096;
+    const NnUint d = 4096;
+    const NnUint maxBatches = 32;
+    const NnUint nRounds = 8;
+
+    std::vector<float> x(n * maxBatches);
+    std::vector<float> w(n * d);
+    std::vector<float> o(d * maxBatches);
+    std::vector<NnBlockQ80> xQ80((n * maxBatches) / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ40((n * d) / Q40_BLOCK_SIZE);
+    const NnSize weightBytes = wQ40.size() * sizeof(NnBlockQ40);
+    NnByte *repacked = allocAligned(weightBytes);
+    for (NnUint i = 0; i < n * maxBatches; i++)
+        x[i] = sinf(i * 0.37f);
+    for (NnUint i = 0; i < n * d; i++)
+        w[i] = cosf(i * 0.011f);
+    quantizeF32toQ40(w.data(), wQ40.data(), n * d, 1, 0);
+    quantizeF32toQ80(x.data(), xQ80.data(), n * maxBatches, 1, 0);
+
+    NnBlockQ80 *input[maxBatches];
+    float *output[maxBatches];
+    for (NnUint b = 0; b < maxBatches; b++) {
+        input[b] = &xQ80[(b * n) / Q80_BLOCK_SIZE];
+        output[b] = &o[b * d];
+    }
+
+    NnCpuChunkCounter counter;
+    NnCpuOpContext context;
+    initMatmulContext_Q80_Q40_F32(&context, &counter, input, output, (NnByte *)wQ40.data(), n, d, maxBatches);
+    context.splitMode = SPLIT_STATIC;
+    NnCpuWeightRepack repack = context.weightRepack;
+
+    // Both loads write into fresh memory like the device does
+    NnByte *stored = allocAligned(weightBytes);
+    Timer copyTimer;
+    std::memcpy(stored, wQ40.data(), weightBytes);
+    const NnUint copyUs = copyTimer.elapsedMicroseconds();
+    Timer repackTimer;
+    repack(repacked, (NnByte *)wQ40.data(), &context.weightSize);
+    const NnUint repackUs = repackTimer.elapsedMicroseconds();
+    printf("⏱️ %24s: %u us, %.2f GB/s (memcpy %u us, %ux%u)\n", "repackWeight_Q40", repackUs, weightBytes / (repackUs * 1000.0f), copyUs, n, d);
+
+    for (NnUint nBatches = 1; nBatches <= maxBatches; nBatches *= 4) {
+        NnUint us[2];
+        for (NnUint r = 0; r < 2; r++) {
+            context.weight = r == 0 ? stored : repacked;
+            context.weightRepack = r == 0 ? nullptr : repack;
+            matmulForward_Q80_Q40_F32(1, 0, nBatches, &context);
+            Timer timer;
+            for (NnUint round = 0; round < nRounds; round++)
+                matmulForward_Q80_Q40_F32(1, 0, nBatches, &context);
+            us[r] = timer.elapsedMicroseconds() / nRounds;
+        }
+        printf("⏱️ %24s batch %2u: %6u us/matmul, repacked %6u us/matmul (%.2fx)\n",
+            "matmul_Q80_Q40_F32", nBatches, us[0], us[1], (float)us[0] / us[1]);
+    }
+    std::free(stored);
+    std::free(repacked);
+}
+#endif
+
 void testLlamafileSgemm() {
     const NnUint batchSize = 8;
     const NnUint n = 256;
@@ -275,6 +1519,26 @@ void testLlamafileSgemm() {
 
     compare_F32("llamafileSgemm_F32", o.data(), oTemp.data(), d * batchSize, 0.01f);
 
+#if (defined(__AVX2__) && defined(__F16C__)) || defined(__AVX512F__) || defined(__ARM_NEON)
+    // f16ᵀ * f32
+
+    std::vector<NnFp16> wF16(n * d);
+    for (NnUint i = 0; i < n * d; i++)
+        wF16[i] = CONVERT_F32_TO_F16(w[i]);
+
+    assert(llamafile_sgemm(
+        d, batchSize, n,
+        wF16.data(), n,
+        x.data(), n,
+        oTemp.data(), d,
+        0, 1, 0,
+        F_16, F_32, F_32
+    ));
+
+    compare_F32("llamafileSgemm_F16", o.data(), oTemp.data(), d * batchSize, 0.05f);
+#endif
+
+#if defined(__AVX2__) || defined(__ARM_FEATURE_DOTPROD)
     // q40ᵀ * q80
 
     assert(llamafile_sgemm(
@@ -287,7 +1551,207 @@ void testLlamafileSgemm() {
     ));
 
     compare_F32("llamafileSgemm_Q80_Q40", o.data(), oTemp.data(), d * batchSize, 1.5f);
+
+    // q80ᵀ * q80
+
+    std::vector<NnBlockQ80> wQ80((n * d) / Q80_BLOCK_SIZE);
+    quantizeF32toQ80(w.data(), wQ80.data(), n * d, 1, 0);
+
+    assert(llamafile_sgemm(
+        d, batchSize, n / Q80_BLOCK_SIZE,
+        wQ80.data(), n / Q80_BLOCK_SIZE,
+        xQ.data(), n / Q80_BLOCK_SIZE,
+        oTemp.data(), d,
+        0, 1, 0,
+        F_Q80, F_Q80, F_32
+    ));
+
+    compare_F32("llamafileSgemm_Q80_Q80", o.data(), oTemp.data(), d * batchSize, 0.5f);
+#endif
+}
+
+#if defined(NN_CPU_VARIANTS)
+// Runs the op of every supported variant on the same context and compares its output against the base variant
+static void compareCpuVariants(const char *opName, const NnOpCode code, const NnOpQuantType quantType, NnCpuOpContext *context,
+    float *output, const NnUint n, const float epsilon)
+{
+    std::vector<float> expected(n);
+    for (NnUint v = 0; v <= sizeof(cpuVariants) / sizeof(cpuVariants[0]); v++) {
+        const bool isBase = v == 0;
+        const NnCpuVariant *variant = isBase ? nullptr : &cpuVariants[v - 1];
+        if (!isBase && !variant->isSupported())
+            continue;
+        for (NnUint b = 0; b < context->nBatches; b++) {
+            context->chunkCounters[b].nextChunk.store(0);
+            context->chunkCounters[b].nDoneThreads.store(0);
+            context->chunkCounters[b].nComputedChunks.store(0);
+        }
+        std::fill(output, output + n, 0.0f);
+        NnCpuOpForward forward = isBase ? getCpuOpForward_base(code, quantType) : variant->getOpForward(code, quantType);
+        forward(1, 0, context->nBatches, context);
+        if (isBase) {
+            std::copy(output, output + n, expected.begin());
+            continue;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "cpuVariant_%s.%s", variant->name, opName);
+        compare_F32(name, expected.data(), output, n, epsilon);
+    }
+}
+
+// Every variant supported by this CPU must compute the same matmuls and attention as the base variant
+void testCpuVariants() {
+    const NnUint nBatches = 3;
+    const NnUint n = 256;
+    const NnUint d = 64;
+
+    std::vector<float> x(nBatches * n);
+    std::vector<float> w(n * d);
+    std::vector<NnBlockQ80> xQ((nBatches * n) / Q80_BLOCK_SIZE);
+    std::vector<NnBlockQ40> wQ((n * d) / Q40_BLOCK_SIZE);
+    std::vector<NnFp16> wF16(n * d);
+    std::vector<float> o0(nBatches * d);
+    std::vector<float> o1(nBatches * d);
+    rand(x.data(), nBatches * n, 7);
+    rand(w.data(), n * d, 8);
+    quantizeF32toQ80(x.data(), xQ.data(), nBatches * n, 1, 0);
+    quantizeF32toQ40(w.data(), wQ.data(), n * d, 1, 0);
+    for (NnUint i = 0; i < n * d; i++)
+        wF16[i] = CONVERT_F32_TO_F16(w[i]);
+
+    float *inputF32[nBatches];
+    NnBlockQ80 *input[nBatches];
+    float *output[nBatches];
+    for (NnUint b = 0; b < nBatches; b++) {
+        inputF32[b] = &x[b * n];
+        input[b] = &xQ[b * n / Q80_BLOCK_SIZE];
+        output[b] = &o1[b * d];
+    }
+
+    NnCpuChunkCounter counters[nBatches];
+    NnMatmulOpConfig config;
+    NnCpuOpContext context;
+    context.name = "matmul";
+    context.nBatches = nBatches;
+    context.opConfig = &config;
+    context.input = (NnByte **)input;
+    context.inputSize = size2D(F_Q80, nBatches, n);
+    // The batches are not contiguous, llamafile is skipped and every variant runs its own kernel
+    context.hasInputContinuousMemory = false;
+    context.output = (NnByte **)output;
+    context.outputSize = size2D(F_32, nBatches, d);
+    context.hasOutputContinuousMemory = true;
+    context.weight = (NnByte *)wQ.data();
+    context.weightSize = size2D(F_Q40, n, d);
+    context.weightRepack = nullptr;
+    context.splitMode = SPLIT_STATIC;
+    context.chunkCounters = counters;
+    compareCpuVariants("matmul_Q80_Q40_F32", OP_MATMUL, Q80_Q40_F32, &context, o1.data(), nBatches * d, 0.0001f);
+
+    for (NnUint b = 0; b < nBatches; b++)
+        output[b] = &o0[b * d];
+    getCpuOpForward_base(OP_MATMUL, Q80_Q40_F32)(1, 0, nBatches, &context);
+    for (const NnCpuVariant &variant : cpuVariants) {
+        if (!variant.isSupported())
+            continue;
+        // The variant reads the weight in the layout of its own repack
+        NnCpuOpContext repackedContext = context;
+        repackedContext.weightRepack = variant.getWeightRepack(OP_MATMUL, Q80_Q40_F32, context.weightSize);
+        if (repackedContext.weightRepack == nullptr)
+            continue;
+        for (NnUint b = 0; b < nBatches; b++)
+            output[b] = &o1[b * d];
+        repackedContext.weight = allocAligned(wQ.size() * sizeof(NnBlockQ40));
+        repackedContext.weightRepack(repackedContext.weight, (NnByte *)wQ.data(), &context.weightSize);
+        std::fill(o1.begin(), o1.end(), 0.0f);
+        variant.getOpForward(OP_MATMUL, Q80_Q40_F32)(1, 0, nBatches, &repackedContext);
+        std::free(repackedContext.weight);
+        char name[64];
+        snprintf(name, sizeof(name), "cpuVariant_%s.matmul_Q80_Q40_F32.repacked", variant.name);
+        compare_F32(name, o0.data(), o1.data(), nBatches * d, 0.0001f);
+    }
+    for (NnUint b = 0; b < nBatches; b++)
+        output[b] = &o1[b * d];
+
+    context.input = (NnByte **)inputF32;
+    context.inputSize = size2D(F_32, nBatches, n);
+    context.weight = (NnByte *)w.data();
+    context.weightSize = size2D(F_32, n, d);
+    compareCpuVariants("matmul_F32_F32_F32", OP_MATMUL, F32_F32_F32, &context, o1.data(), nBatches * d, 0.0001f);
+
+    context.weight = (NnByte *)wF16.data();
+    context.weightSize = size2D(F_16, n, d);
+    compareCpuVariants("matmul_F32_F16_F32", OP_MATMUL, F32_F16_F32, &context, o1.data(), nBatches * d, 0.0001f);
+
+    context.input = (NnByte **)input;
+    context.inputSize = size2D(F_Q80, nBatches, n);
+    compareCpuVariants("matmul_Q80_F16_F32", OP_MATMUL, Q80_F16_F32, &context, o1.data(), nBatches * d, 0.0001f);
+
+    // Both attention types over every KV cache type, the last position needs a second span of the flash attention
+    const NnUint nHeads = 8;
+    const NnUint nKvHeads = 2;
+    const NnUint headSize = 64;
+    const NnUint seqLen = ATT_FLASH_SPAN + 100;
+    const NnUint kvDim0 = nKvHeads * headSize;
+    const NnUint qDim = nHeads * headSize;
+    float positions[nBatches] = { 5.0f, ATT_FLASH_SPAN + 20.0f, seqLen - 1.0f };
+    const NnMultiHeadAttSlice attSlice = sliceMultiHeadAtt(nHeads, headSize, seqLen, 1, nBatches);
+    std::vector<float> q(nBatches * qDim);
+    std::vector<float> keyCache(seqLen * kvDim0);
+    std::vector<float> valueCache(seqLen * kvDim0);
+    std::vector<float> att(std::max(attSlice.attSize.length, attSlice.flashAttSize.length));
+    std::vector<float> attOutput(nBatches * qDim);
+    float *attOutputs[nBatches];
+    for (NnUint b = 0; b < nBatches; b++)
+        attOutputs[b] = &attOutput[b * qDim];
+    for (NnUint i = 0; i < nBatches * qDim; i++)
+        q[i] = sinf(i * 0.29f);
+    for (NnUint i = 0; i < seqLen * kvDim0; i++) {
+        keyCache[i] = cosf(i * 0.13f) * (1.0f + (i / kvDim0) * 0.002f);
+        valueCache[i] = sinf(i * 0.07f);
+    }
+
+    for (NnFloatType kvType : { F_32, F_16, F_Q80 })
+    for (NnAttentionType type : { ATT_FULL_SCORES, ATT_FLASH }) {
+        const NnKvCacheSlice kvSlice = sliceKvCache(kvType, kvDim0, seqLen, 1);
+        std::vector<NnByte> quantKeyCache(kvSlice.keySize.nBytes);
+        std::vector<NnByte> quantValueCache(kvSlice.valueSize.nBytes);
+        convertKvCache(kvType, keyCache.data(), quantKeyCache.data(), seqLen * kvDim0);
+        convertKvCache(kvType, valueCache.data(), quantValueCache.data(), seqLen * kvDim0);
+
+        NnMultiHeadAttOpConfig attConfig = { nHeads, nHeads, nKvHeads, headSize, seqLen, qDim, kvDim0, 0, 0, 1, 2, 3, type };
+        NnByte *buffers[4] = { (NnByte *)q.data(), quantKeyCache.data(), quantValueCache.data(), (NnByte *)att.data() };
+        NnBufferConfig bufferConfigs[4] = {
+            { (char *)"q", size2D(F_32, nBatches, qDim) },
+            { (char *)"k", kvSlice.keySize },
+            { (char *)"v", kvSlice.valueSize },
+            { (char *)"att", type == ATT_FLASH ? attSlice.flashAttSize : attSlice.attSize },
+        };
+        NnByte *pipes[1] = { (NnByte *)positions };
+        NnCpuOpContext attContext;
+        attContext.name = "multihead_att";
+        attContext.nBatches = nBatches;
+        attContext.buffers = buffers;
+        attContext.bufferConfigs = bufferConfigs;
+        attContext.pipes = pipes;
+        attContext.opConfig = &attConfig;
+        attContext.input = (NnByte **)attOutputs;
+        attContext.inputSize = size2D(F_32, nBatches, qDim);
+        attContext.hasInputContinuousMemory = true;
+        attContext.output = (NnByte **)attOutputs;
+        attContext.outputSize = size2D(F_32, nBatches, qDim);
+        attContext.hasOutputContinuousMemory = true;
+        attContext.weight = nullptr;
+        attContext.weightSize = size2D(F_32, 0, 0);
+        attContext.weightRepack = nullptr;
+        attContext.splitMode = SPLIT_STATIC;
+        attContext.chunkCounters = counters;
+        char name[64];
+        snprintf(name, sizeof(name), "multiheadAtt.%s.%s", type == ATT_FLASH ? "flash" : "full", floatTypeToString(kvType));
+        compareCpuVariants(name, OP_MULTIHEAD_ATT, F32_F32_F32, &attContext, attOutput.data(), nBatches * qDim, 0.0001f);
+    }
 }
+#endif
 
 int main() {
     initQuants();
@@ -308,9 +1772,52 @@ int main() {
     testAdd(1);
     testSoftmax();
     testSilu();
+    testRope();
+    testMergeAddRmsNorm(32);
+    testMergeAddRmsNorm(1);
+    testMergeAddRmsNormForward(4, 1);
+    testMergeAddRmsNormForward(4, 3);
+    testMergeAddRmsNormForward(3, 3);
+    testSiluMul(32);
+    testSiluMul(1);
+    testMatmulRope(1);
+    testMatmulRope(3);
     testMatmul_F32_Q40_F32(32);
     testMatmul_F32_Q40_F32(2);
     testMatmul_F32_Q40_F32(1);
+    testMatmul_F16(8);
+    testMatmul_F16(1);
+    testChunkedMatmul_Q80_Q40_F32(1);
+    testChunkedMatmul_Q80_Q40_F32(3);
+    testMatmulKernels_Q80_Q40_F32(8);
+    testMatmulKernels_Q80_Q40_F32(3);
+    testMatmulKernels_Q80_Q40_F32(1);
+    testMatmulKernels_Q80_Q80_F32(8);
+    testMatmulKernels_Q80_Q80_F32(1);
+    testMatmul_Q80_QK_F32(4);
+    testMatmul_Q80_QK_F32(1);
+    testBatchMatmul(5);
+    testBatchMatmul(2);
+    testBatchMatmul(1);
     testLlamafileSgemm();
+#if defined(NN_CPU_VARIANTS)
+    testCpuVariants();
+#endif
+#if defined(NN_Q40_REPACK)
+    testRepackedMatmul_Q80_Q40_F32(1);
+    testRepackedMatmul_Q80_Q40_F32(3);
+#endif
+    testMultiheadAttFlash(1);
+    testMultiheadAttFlash(3);
+    testMultiheadAttKvCache(1);
+    testMultiheadAttKvCache(3);
+    benchmarkSyncTypes();
+    benchmarkSplitModes_Q80_Q40_F32();
+    benchmarkMatmulKernels_Q80_Q40_F32();
+    benchmarkBatchMatmul_Q80_Q40_F32();
+#if defined(NN_Q40_REPACK)
+    benchmarkRepackedMatmul_Q80_Q40_F32();
+#endif
+    benchmarkMultiheadAtt();
     return 0;
 }
@@ -2,14 +2,31 @@
 #include <cassert>
 #include <cstring>
 #include <cstdio>
+#include <thread>
 #if defined(__ARM_NEON)
     #include <arm_neon.h>
-#elif defined(__AVX2__) || defined(__AVX512F__)
+#elif defined(__SSSE3__)
     #include <immintrin.h>
 #endif
 #include "nn-cpu-ops.hpp"
 #include "nn-quants.hpp"
 #include "llamafile/sgemm.hpp"
+#if defined(NN_CPU_VARIANTS) && !defined(NN_CPU_VARIANT) && defined(__aarch64__)
+    #if defined(__linux__)
+        #include <sys/auxv.h>
+        #include <asm/hwcap.h>
+    #elif defined(__APPLE__)
+        #include <sys/sysctl.h>
+    #endif
+#endif
+
+#if defined(NN_CPU_VARIANTS) && !defined(NN_CPU_VARIANT)
+// The kernels of this build are the base variant, the public entry points dispatch to the variant picked for the CPU
+#define printCpuInstructionSet printCpuInstructionSet_base
+#define getCpuOpForwardInit getCpuOpForwardInit_base
+#define getCpuOpForward getCpuOpForward_base
+#define getCpuWeightRepack getCpuWeightRepack_base
+#endif
 
 #define DEBUG_OP_INPUT_OUTPUT false
 
@@ -39,9 +56,9 @@ static inline float32x4_t expf_neon(float32x4_t x) {
     x = vminq_f32(x, vdupq_n_f32(88.0f));
     x = vmaxq_f32(x, vdupq_n_f32(-88.0f));
 
-    float32x4_t kf = vaddq_f32(vmulq_f32(x, inv_ln2), vdupq_n_f32(0.5f));
-    int32x4_t k = vcvtq_s32_f32(kf);
-    kf = vcvtq_f32_s32(k);
+    // k = round(x / ln2), so |f| <= ln2 / 2 also for negative x, e.g. the scores of a softmax
+    int32x4_t k = vcvtnq_s32_f32(vmulq_f32(x, inv_ln2));
+    float32x4_t kf = vcvtq_f32_s32(k);
 
     float32x4_t f = vmlsq_f32(x, kf, ln2);
     float32x4_t f2 = vmulq_f32(f, f);
@@ -179,8 +196,53 @@ static void rmsNorm_Q80_F32_F32(float *output, const NnBlockQ80 *x, const float
     }
 }
 
-static void matmul_F32_F32_F32(float *output, const float *x, const float *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
-    SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+// work partitioning
+
+#define CHUNKS_PER_THREAD 8
+
+static inline NnUint getChunkSize(const NnUint rangeLen, const NnUint nThreads) {
+    const NnUint chunkSize = rangeLen / (nThreads * CHUNKS_PER_THREAD);
+    return chunkSize > 0 ? chunkSize : 1;
+}
+
+// Claims the next chunk of <0; rangeLen). Every thread must call it until it returns false,
+// the last thread that runs out of chunks resets the counter for the next use
+static bool claimChunk(NnCpuChunkCounter *counter, const NnUint rangeLen, const NnUint chunkSize, const NnUint nThreads, NnUint *start, NnUint *end) {
+    const NnUint chunkStart = counter->nextChunk.fetch_add(1) * chunkSize;
+    if (chunkStart >= rangeLen) {
+        if (counter->nDoneThreads.fetch_add(1) == nThreads - 1) {
+            counter->nextChunk.store(0);
+            counter->nDoneThreads.store(0);
+        }
+        return false;
+    }
+    *start = chunkStart;
+    *end = chunkStart + chunkSize < rangeLen ? chunkStart + chunkSize : rangeLen;
+    return true;
+}
+
+// Blocks until all nThreads threads reach it, the counter is ready for the next call when it returns
+static void waitForThreads(NnCpuChunkCounter *counter, const NnUint nThreads) {
+    const NnUint generation = counter->generation.load();
+    if (counter->nDoneThreads.fetch_add(1) == nThreads - 1) {
+        counter->nDoneThreads.store(0);
+        counter->generation.fetch_add(1);
+        return;
+    }
+    while (counter->generation.load() == generation)
+        std::this_thread::yield();
+}
+
+// Marks one of nChunks chunks as computed, returns true only for the thread that computed the last one
+static bool completeChunk(NnCpuChunkCounter *counter, const NnUint nChunks) {
+    if (counter->nComputedChunks.fetch_add(1) == nChunks - 1) {
+        counter->nComputedChunks.store(0);
+        return true;
+    }
+    return false;
+}
+
+static void matmulRows_F32_F32_F32(float *output, const float *x, const float *w, const NnUint n, const NnUint start, const NnUint end) {
     unsigned int i, j;
 #if defined(__ARM_NEON)
     assert(n % 4 == 0);
@@ -219,16 +281,393 @@ static void matmul_F32_F32_F32(float *output, const float *x, const float *w, co
 #endif
 }
 
-static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
+// Weight rows of the F32 matmul reused by all batches while they are still in the cache
+#define F32_BLOCK_ROWS 8
+
+// Multiplies the rows <start; end) of the weight by all batches of the input, the batches may lay anywhere in memory
+static void matmulBatchRows_F32_F32_F32(float *const *output, const float *const *x, const float *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    for (NnUint i = start; i < end; i += F32_BLOCK_ROWS) {
+        const NnUint blockEnd = i + F32_BLOCK_ROWS < end ? i + F32_BLOCK_ROWS : end;
+        for (NnUint b = 0; b < nBatches; b++)
+            matmulRows_F32_F32_F32(output[b], x[b], w, n, i, blockEnd);
+    }
+}
+
+[[maybe_unused]] static void matmul_F32_F32_F32(float *output, const float *x, const float *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
     SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+    matmulRows_F32_F32_F32(output, x, w, n, start, end);
+}
+
+// F16 weights are widened to F32 while they are loaded, the products and the sums stay in F32
+static void matmulRows_F32_F16_F32(float *output, const float *x, const NnFp16 *w, const NnUint n, const NnUint start, const NnUint end) {
+#if defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    assert(n % 8 == 0);
+    for (NnUint i = start; i < end; i++) {
+        const NnFp16 *row = &w[i * n];
+        float32x4_t z0 = vmovq_n_f32(0);
+        float32x4_t z1 = vmovq_n_f32(0);
+        for (NnUint j = 0; j < n; j += 8) {
+            const float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(&row[j]));
+            z0 = vfmaq_f32(z0, vcvt_f32_f16(vget_low_f16(h)), vld1q_f32(&x[j]));
+            z1 = vfmaq_f32(z1, vcvt_f32_f16(vget_high_f16(h)), vld1q_f32(&x[j + 4]));
+        }
+        output[i] = vaddvq_f32(vaddq_f32(z0, z1));
+    }
+#elif defined(__AVX2__) && defined(__F16C__)
+    assert(n % 8 == 0);
+    for (NnUint i = start; i < end; i++) {
+        const NnFp16 *row = &w[i * n];
+        __m256 u0 = _mm256_setzero_ps();
+        __m256 u1 = _mm256_setzero_ps();
+        NnUint j = 0;
+        for (; j + 16 <= n; j += 16) {
+            u0 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&row[j])), _mm256_loadu_ps(&x[j]), u0);
+            u1 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&row[j + 8])), _mm256_loadu_ps(&x[j + 8]), u1);
+        }
+        if (j < n)
+            u0 = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&row[j])), _mm256_loadu_ps(&x[j]), u0);
+        output[i] = horizontalSum_avx2(_mm256_add_ps(u0, u1));
+    }
+#else
+    for (NnUint i = start; i < end; i++) {
+        float val = 0.0f;
+        for (NnUint j = 0; j < n; j++)
+            val += CONVERT_F16_TO_F32(w[i * n + j]) * x[j];
+        output[i] = val;
+    }
+#endif
+}
+
+// The Q80 input is widened block by block, the scale of the block is applied to the block sum
+static void matmulRows_Q80_F16_F32(float *output, const NnBlockQ80 *x, const NnFp16 *w, const NnUint n, const NnUint start, const NnUint end) {
+    assert(n % Q80_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+#if defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    for (NnUint i = start; i < end; i++) {
+        float32x4_t acc = vmovq_n_f32(0);
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnFp16 *wb = &w[i * n + j * Q80_BLOCK_SIZE];
+            const NnBlockQ80 *xb = &x[j];
+            float32x4_t sum = vmovq_n_f32(0);
+            for (NnUint k = 0; k < Q80_BLOCK_SIZE; k += 8) {
+                const int16x8_t xq = vmovl_s8(vld1_s8(&xb->qs[k]));
+                const float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(&wb[k]));
+                sum = vfmaq_f32(sum, vcvt_f32_f16(vget_low_f16(h)), vcvtq_f32_s32(vmovl_s16(vget_low_s16(xq))));
+                sum = vfmaq_f32(sum, vcvt_f32_f16(vget_high_f16(h)), vcvtq_f32_s32(vmovl_s16(vget_high_s16(xq))));
+            }
+            acc = vfmaq_n_f32(acc, sum, CONVERT_F16_TO_F32(xb->d));
+        }
+        output[i] = vaddvq_f32(acc);
+    }
+#elif defined(__AVX2__) && defined(__F16C__)
+    for (NnUint i = start; i < end; i++) {
+        __m256 acc = _mm256_setzero_ps();
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnFp16 *wb = &w[i * n + j * Q80_BLOCK_SIZE];
+            const NnBlockQ80 *xb = &x[j];
+            __m256 sum = _mm256_setzero_ps();
+            for (NnUint k = 0; k < Q80_BLOCK_SIZE; k += 8) {
+                const __m256 xf = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)&xb->qs[k])));
+                sum = _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&wb[k])), xf, sum);
+            }
+            acc = _mm256_fmadd_ps(sum, _mm256_set1_ps(CONVERT_F16_TO_F32(xb->d)), acc);
+        }
+        output[i] = horizontalSum_avx2(acc);
+    }
+#else
+    for (NnUint i = start; i < end; i++) {
+        float val = 0.0f;
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnFp16 *wb = &w[i * n + j * Q80_BLOCK_SIZE];
+            const NnBlockQ80 *xb = &x[j];
+            float sum = 0.0f;
+            for (NnUint k = 0; k < Q80_BLOCK_SIZE; k++)
+                sum += CONVERT_F16_TO_F32(wb[k]) * xb->qs[k];
+            val += sum * CONVERT_F16_TO_F32(xb->d);
+        }
+        output[i] = val;
+    }
+#endif
+}
+
+static void matmulBatchRows_F32_F16_F32(float *const *output, const float *const *x, const NnFp16 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    for (NnUint i = start; i < end; i += F32_BLOCK_ROWS) {
+        const NnUint blockEnd = i + F32_BLOCK_ROWS < end ? i + F32_BLOCK_ROWS : end;
+        for (NnUint b = 0; b < nBatches; b++)
+            matmulRows_F32_F16_F32(output[b], x[b], w, n, i, blockEnd);
+    }
+}
+
+static void matmulBatchRows_Q80_F16_F32(float *const *output, const NnBlockQ80 *const *x, const NnFp16 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    for (NnUint i = start; i < end; i += F32_BLOCK_ROWS) {
+        const NnUint blockEnd = i + F32_BLOCK_ROWS < end ? i + F32_BLOCK_ROWS : end;
+        for (NnUint b = 0; b < nBatches; b++)
+            matmulRows_Q80_F16_F32(output[b], x[b], w, n, i, blockEnd);
+    }
+}
+
+[[maybe_unused]] static void matmulRows_Q80_Q40_F32_ref(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    for (NnUint i = start; i < end; i++) {
+        float sum = 0.0;
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ40 *wb = &w[i * nBlocks + j];
+            const NnBlockQ80 *xb = &x[j];
+            const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
+            for (NnUint k = 0; k < Q40_BLOCK_SIZE / 2; k++) {
+                const int w0 = (wb->qs[k] & 0x0F) - 8;
+                const int w1 = (wb->qs[k] >> 4) - 8;
+                const int i1 = xb->qs[k];
+                const int i2 = xb->qs[k + Q80_BLOCK_SIZE / 2];
+                sum += (w0 * i1 + w1 * i2) * s;
+            }
+        }
+        output[i] = sum;
+    }
+}
+
+// Output rows of the Q80 x Q40 matmul computed together
+#define Q40_TILE_ROWS 4
+// Batches computed together by the Q80 x Q40 matmul, each unpacked weight block is reused from registers by all of them
+#define Q40_TILE_COLS 2
+// How far ahead the weight rows are prefetched, in Q40 blocks
+#define Q40_PREFETCH_BLOCKS 16
+
+#if defined(__ARM_NEON)
+static inline void unpackQ40_neon(const std::uint8_t *qs, int8x16_t *wl, int8x16_t *wh) {
+    const uint8x16_t wqs = vld1q_u8(qs);
+    *wl = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(wqs, vdupq_n_u8(0x0F))), vdupq_n_s8(0x8));
+    *wh = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(wqs, 4)), vdupq_n_s8(0x8));
+}
+
+static inline int32x4_t dotQ40Q80_neon(const int8x16_t wl, const int8x16_t wh, const int8x16_t xl, const int8x16_t xh) {
+#if defined(__ARM_FEATURE_DOTPROD)
+    return vdotq_s32(vdotq_s32(vdupq_n_s32(0), wl, xl), wh, xh);
+#else
+    const int16x8_t pll = vmull_s8(vget_low_s8(wl), vget_low_s8(xl));
+    const int16x8_t plh = vmull_s8(vget_high_s8(wl), vget_high_s8(xl));
+    const int16x8_t phl = vmull_s8(vget_low_s8(wh), vget_low_s8(xh));
+    const int16x8_t phh = vmull_s8(vget_high_s8(wh), vget_high_s8(xh));
+    const int32x4_t pl = vaddq_s32(vpaddlq_s16(pll), vpaddlq_s16(plh));
+    const int32x4_t ph = vaddq_s32(vpaddlq_s16(phl), vpaddlq_s16(phh));
+    return vaddq_s32(pl, ph);
+#endif
+}
+
+// Computes nRows outputs of nCols batches at once, every input block is loaded once and reused from registers by all rows,
+// every weight block is unpacked once and reused by all batches. w points to the first row of the tile
+template <NnUint nRows, NnUint nCols>
+static inline void matmulTile_Q80_Q40_F32_neon(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ40 *w, const NnUint nBlocks, const NnUint row) {
+    float32x4_t acc[nRows][nCols];
+    for (NnUint r = 0; r < nRows; r++)
+        for (NnUint c = 0; c < nCols; c++)
+            acc[r][c] = vmovq_n_f32(0.0f);
+    for (NnUint j = 0; j < nBlocks; j++) {
+        int8x16_t xl[nCols];
+        int8x16_t xh[nCols];
+        float xd[nCols];
+        for (NnUint c = 0; c < nCols; c++) {
+            xl[c] = vld1q_s8(x[c][j].qs);
+            xh[c] = vld1q_s8(x[c][j].qs + 16);
+            xd[c] = CONVERT_F16_TO_F32(x[c][j].d);
+        }
+        for (NnUint r = 0; r < nRows; r++) {
+            const NnBlockQ40 *wb = &w[r * nBlocks + j];
+            __builtin_prefetch(wb + Q40_PREFETCH_BLOCKS);
+            int8x16_t wl, wh;
+            unpackQ40_neon(wb->qs, &wl, &wh);
+            const float wd = CONVERT_F16_TO_F32(wb->d);
+            for (NnUint c = 0; c < nCols; c++)
+                acc[r][c] = vmlaq_n_f32(acc[r][c], vcvtq_f32_s32(dotQ40Q80_neon(wl, wh, xl[c], xh[c])), wd * xd[c]);
+        }
+    }
+    for (NnUint r = 0; r < nRows; r++)
+        for (NnUint c = 0; c < nCols; c++)
+            output[c][row + r] = vaddvq_f32(acc[r][c]);
+}
+
+// A tile of weight rows stays in the cache while all batches pass over it
+static void matmulBatchRows_Q80_Q40_F32_neon(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ40 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    NnUint i = start;
+    for (; i + Q40_TILE_ROWS <= end; i += Q40_TILE_ROWS) {
+        NnUint b = 0;
+        for (; b + Q40_TILE_COLS <= nBatches; b += Q40_TILE_COLS)
+            matmulTile_Q80_Q40_F32_neon<Q40_TILE_ROWS, Q40_TILE_COLS>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+        for (; b < nBatches; b++)
+            matmulTile_Q80_Q40_F32_neon<Q40_TILE_ROWS, 1>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+    }
+    for (; i < end; i++) {
+        NnUint b = 0;
+        for (; b + Q40_TILE_COLS <= nBatches; b += Q40_TILE_COLS)
+            matmulTile_Q80_Q40_F32_neon<1, Q40_TILE_COLS>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+        for (; b < nBatches; b++)
+            matmulTile_Q80_Q40_F32_neon<1, 1>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+    }
+}
+#endif
+
+#if defined(__AVX2__)
+// 32 weights as unsigned nibbles in the order of the Q80 block: the low nibbles first, then the high nibbles.
+// The offset of 8 is applied later as -8 * sum(x), which is computed once per input block
+static inline __m256i unpackQ40_avx2(const NnBlockQ40 *b) {
+    const __m128i packed = _mm_loadu_si128((const __m128i *)b->qs);
+    return _mm256_and_si256(_mm256_set_m128i(_mm_srli_epi16(packed, 4), packed), _mm256_set1_epi8(0x0F));
+}
+
+// -8 * the sum of every 4 neighbouring inputs, in the lane layout of the dot product below
+static inline __m256i offsetQ80_avx2(const __m256i x) {
+    const __m256i sum = _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_set1_epi8(1), x), _mm256_set1_epi16(1));
+    return _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_slli_epi32(sum, 3));
+}
+
+// The int16 pair sums of maddubs cannot saturate: w <= 15 and |x| <= 127
+static inline __m256i dotQ40Q80_avx2(const __m256i w, const __m256i x, const __m256i offset) {
+    const __m256i p = _mm256_madd_epi16(_mm256_maddubs_epi16(w, x), _mm256_set1_epi16(1));
+    return _mm256_add_epi32(p, offset);
+}
+
+// Computes nRows outputs of nCols batches at once: every input block is loaded once and reused from registers by all rows,
+// every weight block is unpacked once and reused by all batches. Partial sums stay in vector registers over the whole row
+// and the horizontal sum runs once per output. w points to the first row of the tile
+template <NnUint nRows, NnUint nCols, __m256i (*dot)(const __m256i, const __m256i, const __m256i)>
+static inline __attribute__((always_inline)) void matmulTile_Q80_Q40_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ40 *w, const NnUint nBlocks, const NnUint row) {
+    __m256 acc[nRows][nCols];
+    for (NnUint r = 0; r < nRows; r++)
+        for (NnUint c = 0; c < nCols; c++)
+            acc[r][c] = _mm256_setzero_ps();
+    for (NnUint j = 0; j < nBlocks; j++) {
+        __m256i xq[nCols];
+        __m256i xo[nCols];
+        float xd[nCols];
+        for (NnUint c = 0; c < nCols; c++) {
+            xq[c] = _mm256_loadu_si256((const __m256i *)x[c][j].qs);
+            xo[c] = offsetQ80_avx2(xq[c]);
+            xd[c] = CONVERT_F16_TO_F32(x[c][j].d);
+        }
+        for (NnUint r = 0; r < nRows; r++) {
+            const NnBlockQ40 *wb = &w[r * nBlocks + j];
+            _mm_prefetch((const char *)(wb + Q40_PREFETCH_BLOCKS), _MM_HINT_T0);
+            const __m256i wq = unpackQ40_avx2(wb);
+            const float wd = CONVERT_F16_TO_F32(wb->d);
+            for (NnUint c = 0; c < nCols; c++)
+                acc[r][c] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot(wq, xq[c], xo[c])), _mm256_set1_ps(wd * xd[c]), acc[r][c]);
+        }
+    }
+    for (NnUint r = 0; r < nRows; r++)
+        for (NnUint c = 0; c < nCols; c++)
+            output[c][row + r] = horizontalSum_avx2(acc[r][c]);
+}
+
+// A tile of weight rows stays in the cache while all batches pass over it
+template <__m256i (*dot)(const __m256i, const __m256i, const __m256i)>
+static inline __attribute__((always_inline)) void matmulBatchRowsTiled_Q80_Q40_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ40 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    NnUint i = start;
+    for (; i + Q40_TILE_ROWS <= end; i += Q40_TILE_ROWS) {
+        NnUint b = 0;
+        for (; b + Q40_TILE_COLS <= nBatches; b += Q40_TILE_COLS)
+            matmulTile_Q80_Q40_F32_avx2<Q40_TILE_ROWS, Q40_TILE_COLS, dot>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+        for (; b < nBatches; b++)
+            matmulTile_Q80_Q40_F32_avx2<Q40_TILE_ROWS, 1, dot>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+    }
+    for (; i < end; i++) {
+        NnUint b = 0;
+        for (; b + Q40_TILE_COLS <= nBatches; b += Q40_TILE_COLS)
+            matmulTile_Q80_Q40_F32_avx2<1, Q40_TILE_COLS, dot>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+        for (; b < nBatches; b++)
+            matmulTile_Q80_Q40_F32_avx2<1, 1, dot>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+    }
+}
+
+static void matmulBatchRows_Q80_Q40_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ40 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    matmulBatchRowsTiled_Q80_Q40_F32_avx2<dotQ40Q80_avx2>(output, x, w, n, nBatches, start, end);
+}
+
+static void matmulRows_Q80_Q40_F32_avx2(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint start, const NnUint end) {
+    matmulBatchRows_Q80_Q40_F32_avx2(&output, &x, w, n, 1, start, end);
+}
+
+#if !defined(_MSC_VER) && (defined(__AVXVNNI__) || (defined(__clang__) && __clang_major__ >= 16) || (!defined(__clang__) && __GNUC__ >= 11))
+#define NN_AVX_VNNI
+#if defined(__AVXVNNI__)
+static bool hasAvxVnni() {
+    return true;
+}
+#else
+static bool hasAvxVnni() {
+    static const bool supported = __builtin_cpu_supports("avxvnni");
+    return supported;
+}
+#endif
+
+// dpbusd replaces maddubs + madd and starts from the offset
+__attribute__((target("avxvnni")))
+static inline __m256i dotQ40Q80_avxvnni(const __m256i w, const __m256i x, const __m256i offset) {
+    return _mm256_dpbusd_avx_epi32(offset, w, x);
+}
+
+__attribute__((target("avxvnni")))
+static void matmulBatchRows_Q80_Q40_F32_avxvnni(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ40 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    matmulBatchRowsTiled_Q80_Q40_F32_avx2<dotQ40Q80_avxvnni>(output, x, w, n, nBatches, start, end);
+}
+
+static void matmulRows_Q80_Q40_F32_avxvnni(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint start, const NnUint end) {
+    matmulBatchRows_Q80_Q40_F32_avxvnni(&output, &x, w, n, 1, start, end);
+}
+#endif
+#endif
+
+#if defined(__SSSE3__)
+// 128-bit form of the AVX2 kernel for x86 CPUs without AVX2, it is the matmul of the sse4 variant
+static inline __m128i dotQ40Q80_ssse3(const __m128i w, const __m128i x) {
+    return _mm_madd_epi16(_mm_maddubs_epi16(w, x), _mm_set1_epi16(1));
+}
+
+[[maybe_unused]] static void matmulRows_Q80_Q40_F32_ssse3(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    const __m128i lowMask = _mm_set1_epi8(0x0F);
+    const __m128i ones = _mm_set1_epi8(1);
+    for (NnUint i = start; i < end; i++) {
+        __m128 acc = _mm_setzero_ps();
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ40 *wb = &w[i * nBlocks + j];
+            const NnBlockQ80 *xb = &x[j];
+            _mm_prefetch((const char *)(wb + Q40_PREFETCH_BLOCKS), _MM_HINT_T0);
+            const __m128i packed = _mm_loadu_si128((const __m128i *)wb->qs);
+            const __m128i wl = _mm_and_si128(packed, lowMask);
+            const __m128i wh = _mm_and_si128(_mm_srli_epi16(packed, 4), lowMask);
+            const __m128i xl = _mm_loadu_si128((const __m128i *)xb->qs);
+            const __m128i xh = _mm_loadu_si128((const __m128i *)(xb->qs + 16));
+            // The weights are unsigned nibbles, the offset of 8 is applied as -8 * sum(x)
+            const __m128i sumX = _mm_add_epi32(dotQ40Q80_ssse3(ones, xl), dotQ40Q80_ssse3(ones, xh));
+            const __m128i p = _mm_sub_epi32(
+                _mm_add_epi32(dotQ40Q80_ssse3(wl, xl), dotQ40Q80_ssse3(wh, xh)),
+                _mm_slli_epi32(sumX, 3));
+            const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_cvtepi32_ps(p), _mm_set1_ps(s)));
+        }
+        acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+        acc = _mm_add_ss(acc, _mm_movehdup_ps(acc));
+        output[i] = _mm_cvtss_f32(acc);
+    }
+}
+#endif
+
+static void matmulRows_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint start, const NnUint end) {
     assert(n % Q40_BLOCK_SIZE == 0);
-    const unsigned int nBlocks = n / Q40_BLOCK_SIZE;
 
 #if defined(__ARM_NEON)
+    const unsigned int nBlocks = n / Q40_BLOCK_SIZE;
+    unsigned int di = start;
+    for (; di + Q40_TILE_ROWS <= end; di += Q40_TILE_ROWS)
+        matmulTile_Q80_Q40_F32_neon<Q40_TILE_ROWS, 1>(&output, &x, &w[di * nBlocks], nBlocks, di);
+
+    // The remaining rows, one at a time
     const uint8x16_t m4b = vdupq_n_u8(0x0F);
     const int8x16_t s8b = vdupq_n_s8(0x8);
 
-    for (unsigned int di = start; di < end; di++) {
+    for (; di < end; di++) {
         float32x4_t sumv0 = vmovq_n_f32(0.0f);
         float32x4_t sumv1 = vmovq_n_f32(0.0f);
         float32x4_t sumv2 = vmovq_n_f32(0.0f);
@@ -348,97 +787,804 @@ static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlock
 
         output[di] = vaddvq_f32(sumv0) + vaddvq_f32(sumv1) + vaddvq_f32(sumv2) + vaddvq_f32(sumv3);
     }
-#elif defined(__AVX512F__)
+#elif defined(__AVX2__)
+#if defined(NN_AVX_VNNI)
+    if (hasAvxVnni()) {
+        matmulRows_Q80_Q40_F32_avxvnni(output, x, w, n, start, end);
+        return;
+    }
+#endif
+    matmulRows_Q80_Q40_F32_avx2(output, x, w, n, start, end);
+#elif defined(__SSSE3__)
+    matmulRows_Q80_Q40_F32_ssse3(output, x, w, n, start, end);
+#else
+    matmulRows_Q80_Q40_F32_ref(output, x, w, n, start, end);
+#endif
+}
+
+// Multiplies the rows <start; end) of the weight by all batches of the input, the batches may lay anywhere in memory
+static void matmulBatchRows_Q80_Q40_F32(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ40 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    assert(n % Q40_BLOCK_SIZE == 0);
+    if (nBatches == 1) {
+        matmulRows_Q80_Q40_F32(output[0], x[0], w, n, start, end);
+        return;
+    }
+#if defined(__ARM_NEON)
+    matmulBatchRows_Q80_Q40_F32_neon(output, x, w, n, nBatches, start, end);
+#elif defined(__AVX2__)
+#if defined(NN_AVX_VNNI)
+    if (hasAvxVnni()) {
+        matmulBatchRows_Q80_Q40_F32_avxvnni(output, x, w, n, nBatches, start, end);
+        return;
+    }
+#endif
+    matmulBatchRows_Q80_Q40_F32_avx2(output, x, w, n, nBatches, start, end);
+#else
+    for (NnUint i = start; i < end; i += Q40_TILE_ROWS) {
+        const NnUint tileEnd = i + Q40_TILE_ROWS < end ? i + Q40_TILE_ROWS : end;
+        for (NnUint b = 0; b < nBatches; b++)
+            matmulRows_Q80_Q40_F32(output[b], x[b], w, n, i, tileEnd);
+    }
+#endif
+}
+
+[[maybe_unused]] static void matmul_Q80_Q40_F32(float *output, const NnBlockQ80 *x, const NnBlockQ40 *w, const NnUint n, const NnUint d, const NnUint nThreads, const NnUint threadIndex) {
+    SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+    matmulRows_Q80_Q40_F32(output, x, w, n, start, end);
+}
+
+#if defined(__ARM_NEON) || (defined(__AVX2__) && defined(__F16C__))
+// The Q40 weight of a matmul may be repacked at load time into tiles of Q40_TILE_ROWS rows. The nibbles of all tiles
+// come first: for every block of a tile the 16 bytes of its rows follow each other, so a tile is one aligned stream
+// of 64-byte groups. The scales follow all nibbles in the same order, the scales of a group are loaded at once
+#define NN_Q40_REPACK
+#define Q40_REPACK_GROUP_BYTES (Q40_TILE_ROWS * Q40_BLOCK_SIZE / 2)
+
+static void repackWeight_Q40(NnByte *output, const NnByte *weight, const NnSize2D *weightSize) {
+    const NnUint nBlocks = weightSize->y / Q40_BLOCK_SIZE;
+    const NnUint d = weightSize->x;
+    assert(d % Q40_TILE_ROWS == 0);
+    const NnBlockQ40 *w = (const NnBlockQ40 *)weight;
+    NnByte *qs = output;
+    NnFp16 *scales = (NnFp16 *)&output[(NnSize)(d / Q40_TILE_ROWS) * nBlocks * Q40_REPACK_GROUP_BYTES];
+    // The output is written in order, the rows of a tile are read side by side
+    for (NnUint row = 0; row < d; row += Q40_TILE_ROWS) {
+        for (NnUint j = 0; j < nBlocks; j++) {
+            for (NnUint r = 0; r < Q40_TILE_ROWS; r++) {
+                const NnBlockQ40 *wb = &w[(NnSize)(row + r) * nBlocks + j];
+                std::memcpy(qs, wb->qs, Q40_BLOCK_SIZE / 2);
+                qs += Q40_BLOCK_SIZE / 2;
+                *scales++ = wb->d;
+            }
+        }
+    }
+}
+
+#if defined(__ARM_NEON)
+// Computes the Q40_TILE_ROWS rows of a repacked tile for nCols batches, the dot products of the rows are reduced
+// into one vector that holds all outputs of the tile
+template <NnUint nCols>
+static inline void matmulTileRepacked_Q80_Q40_F32_neon(float *const *output, const NnBlockQ80 *const *x, const NnByte *qs, const NnFp16 *scales, const NnUint nBlocks, const NnUint row) {
+    static_assert(Q40_TILE_ROWS == 4, "The kernel reduces 4 rows into one vector");
+    float32x4_t acc[nCols];
+    for (NnUint c = 0; c < nCols; c++)
+        acc[c] = vmovq_n_f32(0.0f);
+    for (NnUint j = 0; j < nBlocks; j++) {
+        int8x16_t xl[nCols];
+        int8x16_t xh[nCols];
+        float xd[nCols];
+        for (NnUint c = 0; c < nCols; c++) {
+            xl[c] = vld1q_s8(x[c][j].qs);
+            xh[c] = vld1q_s8(x[c][j].qs + 16);
+            xd[c] = CONVERT_F16_TO_F32(x[c][j].d);
+        }
+        const NnByte *group = &qs[(NnSize)j * Q40_REPACK_GROUP_BYTES];
+        __builtin_prefetch(group + Q40_PREFETCH_BLOCKS * Q40_REPACK_GROUP_BYTES);
+        int8x16_t wl[Q40_TILE_ROWS];
+        int8x16_t wh[Q40_TILE_ROWS];
+        for (NnUint r = 0; r < Q40_TILE_ROWS; r++)
+            unpackQ40_neon(&group[r * (Q40_BLOCK_SIZE / 2)], &wl[r], &wh[r]);
+        const float32x4_t wd = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(&scales[j * Q40_TILE_ROWS])));
+        for (NnUint c = 0; c < nCols; c++) {
+            const int32x4_t p = vpaddq_s32(
+                vpaddq_s32(dotQ40Q80_neon(wl[0], wh[0], xl[c], xh[c]), dotQ40Q80_neon(wl[1], wh[1], xl[c], xh[c])),
+                vpaddq_s32(dotQ40Q80_neon(wl[2], wh[2], xl[c], xh[c]), dotQ40Q80_neon(wl[3], wh[3], xl[c], xh[c])));
+            acc[c] = vmlaq_f32(acc[c], vcvtq_f32_s32(p), vmulq_n_f32(wd, xd[c]));
+        }
+    }
+    for (NnUint c = 0; c < nCols; c++)
+        vst1q_f32(&output[c][row], acc[c]);
+}
+
+static void matmulBatchTiles_Q80_Q40_F32_neon(float *const *output, const NnBlockQ80 *const *x, const NnByte *qs, const NnFp16 *scales, const NnUint nBlocks, const NnUint nBatches, const NnUint tileStart, const NnUint tileEnd) {
+    for (NnUint t = tileStart; t < tileEnd; t++) {
+        const NnByte *tileQs = &qs[(NnSize)t * nBlocks * Q40_REPACK_GROUP_BYTES];
+        const NnFp16 *tileScales = &scales[(NnSize)t * nBlocks * Q40_TILE_ROWS];
+        NnUint b = 0;
+        for (; b + Q40_TILE_COLS <= nBatches; b += Q40_TILE_COLS)
+            matmulTileRepacked_Q80_Q40_F32_neon<Q40_TILE_COLS>(&output[b], &x[b], tileQs, tileScales, nBlocks, t * Q40_TILE_ROWS);
+        for (; b < nBatches; b++)
+            matmulTileRepacked_Q80_Q40_F32_neon<1>(&output[b], &x[b], tileQs, tileScales, nBlocks, t * Q40_TILE_ROWS);
+    }
+}
+#else
+// -8 * the sum of every 4 neighbouring inputs of both halves of the block, in the lane layout of the dot product below
+static inline __m256i offsetQ80x2_avx2(const __m256i xl, const __m256i xh) {
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i pairs = _mm256_add_epi16(_mm256_maddubs_epi16(ones, xl), _mm256_maddubs_epi16(ones, xh));
+    const __m256i sum = _mm256_madd_epi16(pairs, _mm256_set1_epi16(1));
+    return _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_slli_epi32(sum, 3));
+}
+
+// wl and wh hold the low and the high nibbles of two rows, one row per 128-bit lane, xl and xh hold the halves
+// of the input block broadcast to both lanes. The int16 sums cannot saturate: they are at most 4 * 15 * 127
+static inline __m256i dotQ40x2Q80_avx2(const __m256i wl, const __m256i wh, const __m256i xl, const __m256i xh, const __m256i offset) {
+    const __m256i p = _mm256_add_epi16(_mm256_maddubs_epi16(wl, xl), _mm256_maddubs_epi16(wh, xh));
+    return _mm256_add_epi32(_mm256_madd_epi16(p, _mm256_set1_epi16(1)), offset);
+}
+
+// Computes the Q40_TILE_ROWS rows of a repacked tile for nCols batches, every accumulator holds two rows
+template <NnUint nCols, __m256i (*dot2)(const __m256i, const __m256i, const __m256i, const __m256i, const __m256i)>
+static inline __attribute__((always_inline)) void matmulTileRepacked_Q80_Q40_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnByte *qs, const NnFp16 *scales, const NnUint nBlocks, const NnUint row) {
+    static_assert(Q40_TILE_ROWS == 4, "The kernel holds 4 rows in two accumulators");
+    const __m256i lowMask = _mm256_set1_epi8(0x0F);
+    const __m256i lanes01 = _mm256_set_epi32(1, 1, 1, 1, 0, 0, 0, 0);
+    const __m256i lanes23 = _mm256_set_epi32(3, 3, 3, 3, 2, 2, 2, 2);
+    __m256 acc01[nCols];
+    __m256 acc23[nCols];
+    for (NnUint c = 0; c < nCols; c++) {
+        acc01[c] = _mm256_setzero_ps();
+        acc23[c] = _mm256_setzero_ps();
+    }
+    for (NnUint j = 0; j < nBlocks; j++) {
+        __m256i xl[nCols];
+        __m256i xh[nCols];
+        __m256i xo[nCols];
+        float xd[nCols];
+        for (NnUint c = 0; c < nCols; c++) {
+            xl[c] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)x[c][j].qs));
+            xh[c] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(x[c][j].qs + 16)));
+            xo[c] = offsetQ80x2_avx2(xl[c], xh[c]);
+            xd[c] = CONVERT_F16_TO_F32(x[c][j].d);
+        }
+        const NnByte *group = &qs[(NnSize)j * Q40_REPACK_GROUP_BYTES];
+        _mm_prefetch((const char *)(group + Q40_PREFETCH_BLOCKS * Q40_REPACK_GROUP_BYTES), _MM_HINT_T0);
+        const __m256i w01 = _mm256_load_si256((const __m256i *)group);
+        const __m256i w23 = _mm256_load_si256((const __m256i *)(group + 32));
+        const __m256i wl01 = _mm256_and_si256(w01, lowMask);
+        const __m256i wh01 = _mm256_and_si256(_mm256_srli_epi16(w01, 4), lowMask);
+        const __m256i wl23 = _mm256_and_si256(w23, lowMask);
+        const __m256i wh23 = _mm256_and_si256(_mm256_srli_epi16(w23, 4), lowMask);
+        const __m256 wd = _mm256_castps128_ps256(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)&scales[j * Q40_TILE_ROWS])));
+        const __m256 wd01 = _mm256_permutevar8x32_ps(wd, lanes01);
+        const __m256 wd23 = _mm256_permutevar8x32_ps(wd, lanes23);
+        for (NnUint c = 0; c < nCols; c++) {
+            const __m256 xds = _mm256_set1_ps(xd[c]);
+            acc01[c] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot2(wl01, wh01, xl[c], xh[c], xo[c])), _mm256_mul_ps(wd01, xds), acc01[c]);
+            acc23[c] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot2(wl23, wh23, xl[c], xh[c], xo[c])), _mm256_mul_ps(wd23, xds), acc23[c]);
+        }
+    }
+    for (NnUint c = 0; c < nCols; c++) {
+        // [row 0, row 2, row 0, row 2 | row 1, row 3, row 1, row 3]
+        __m256 sum = _mm256_hadd_ps(acc01[c], acc23[c]);
+        sum = _mm256_hadd_ps(sum, sum);
+        _mm_storeu_ps(&output[c][row], _mm_unpacklo_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1)));
+    }
+}
+
+template <__m256i (*dot2)(const __m256i, const __m256i, const __m256i, const __m256i, const __m256i)>
+static inline __attribute__((always_inline)) void matmulBatchTilesT_Q80_Q40_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnByte *qs, const NnFp16 *scales, const NnUint nBlocks, const NnUint nBatches, const NnUint tileStart, const NnUint tileEnd) {
+    for (NnUint t = tileStart; t < tileEnd; t++) {
+        const NnByte *tileQs = &qs[(NnSize)t * nBlocks * Q40_REPACK_GROUP_BYTES];
+        const NnFp16 *tileScales = &scales[(NnSize)t * nBlocks * Q40_TILE_ROWS];
+        NnUint b = 0;
+        for (; b + Q40_TILE_COLS <= nBatches; b += Q40_TILE_COLS)
+            matmulTileRepacked_Q80_Q40_F32_avx2<Q40_TILE_COLS, dot2>(&output[b], &x[b], tileQs, tileScales, nBlocks, t * Q40_TILE_ROWS);
+        for (; b < nBatches; b++)
+            matmulTileRepacked_Q80_Q40_F32_avx2<1, dot2>(&output[b], &x[b], tileQs, tileScales, nBlocks, t * Q40_TILE_ROWS);
+    }
+}
+
+static void matmulBatchTiles_Q80_Q40_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnByte *qs, const NnFp16 *scales, const NnUint nBlocks, const NnUint nBatches, const NnUint tileStart, const NnUint tileEnd) {
+    matmulBatchTilesT_Q80_Q40_F32_avx2<dotQ40x2Q80_avx2>(output, x, qs, scales, nBlocks, nBatches, tileStart, tileEnd);
+}
+
+#if defined(NN_AVX_VNNI)
+__attribute__((target("avxvnni")))
+static inline __m256i dotQ40x2Q80_avxvnni(const __m256i wl, const __m256i wh, const __m256i xl, const __m256i xh, const __m256i offset) {
+    return _mm256_dpbusd_avx_epi32(_mm256_dpbusd_avx_epi32(offset, wl, xl), wh, xh);
+}
+
+__attribute__((target("avxvnni")))
+static void matmulBatchTiles_Q80_Q40_F32_avxvnni(float *const *output, const NnBlockQ80 *const *x, const NnByte *qs, const NnFp16 *scales, const NnUint nBlocks, const NnUint nBatches, const NnUint tileStart, const NnUint tileEnd) {
+    matmulBatchTilesT_Q80_Q40_F32_avx2<dotQ40x2Q80_avxvnni>(output, x, qs, scales, nBlocks, nBatches, tileStart, tileEnd);
+}
+#endif
+#endif
+
+// Multiplies the tiles <tileStart; tileEnd) of a repacked weight with d rows by all batches
+static void matmulBatchTiles_Q80_Q40_F32(float *const *output, const NnBlockQ80 *const *x, const NnByte *w, const NnUint n, const NnUint d, const NnUint nBatches, const NnUint tileStart, const NnUint tileEnd) {
+    assert(n % Q40_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    const NnFp16 *scales = (const NnFp16 *)&w[(NnSize)(d / Q40_TILE_ROWS) * nBlocks * Q40_REPACK_GROUP_BYTES];
+#if defined(__ARM_NEON)
+    matmulBatchTiles_Q80_Q40_F32_neon(output, x, w, scales, nBlocks, nBatches, tileStart, tileEnd);
+#else
+#if defined(NN_AVX_VNNI)
+    if (hasAvxVnni()) {
+        matmulBatchTiles_Q80_Q40_F32_avxvnni(output, x, w, scales, nBlocks, nBatches, tileStart, tileEnd);
+        return;
+    }
+#endif
+    matmulBatchTiles_Q80_Q40_F32_avx2(output, x, w, scales, nBlocks, nBatches, tileStart, tileEnd);
+#endif
+}
+#endif
+
+[[maybe_unused]] static void matmulRows_Q80_Q80_F32_ref(float *output, const NnBlockQ80 *x, const NnBlockQ80 *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
     for (NnUint i = start; i < end; i++) {
-        float sum = 0.0f;
+        float sum = 0.0;
         for (NnUint j = 0; j < nBlocks; j++) {
-            const NnBlockQ40 *wb = &w[i * nBlocks + j];
+            const NnBlockQ80 *wb = &w[i * nBlocks + j];
             const NnBlockQ80 *xb = &x[j];
-            const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
+            int p = 0;
+            for (NnUint k = 0; k < Q80_BLOCK_SIZE; k++)
+                p += wb->qs[k] * xb->qs[k];
+            sum += p * CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
+        }
+        output[i] = sum;
+    }
+}
 
-            __m128i w8 = _mm_loadu_si128((const __m128i*)wb->qs);
-            __m128i v_w0 = _mm_and_si128(w8, _mm_set1_epi8(0x0F));
-            __m128i v_w1 = _mm_srli_epi16(w8, 4);
-            v_w1 = _mm_and_si128(v_w1, _mm_set1_epi8(0x0F));
-            
-            v_w0 = _mm_sub_epi8(v_w0, _mm_set1_epi8(8));
-            v_w1 = _mm_sub_epi8(v_w1, _mm_set1_epi8(8));
+// Output rows of the Q80 x Q80 matmul computed together
+#define Q80_TILE_ROWS 4
+// Batches computed together by the Q80 x Q80 matmul
+#define Q80_TILE_COLS 2
+// How far ahead the weight rows are prefetched, in Q80 blocks
+#define Q80_PREFETCH_BLOCKS 8
 
-            __m256i w8_combined = _mm256_set_m128i(v_w1, v_w0);
-            __m512i w16 = _mm512_cvtepi8_epi16(w8_combined);
+#if defined(__ARM_NEON)
+// w points to the first row of the tile, the int8 dot product is the one of the unpacked Q40 weights
+template <NnUint nRows, NnUint nCols>
+static inline void matmulTile_Q80_Q80_F32_neon(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ80 *w, const NnUint nBlocks, const NnUint row) {
+    float32x4_t acc[nRows][nCols];
+    for (NnUint r = 0; r < nRows; r++)
+        for (NnUint c = 0; c < nCols; c++)
+            acc[r][c] = vmovq_n_f32(0.0f);
+    for (NnUint j = 0; j < nBlocks; j++) {
+        int8x16_t xl[nCols];
+        int8x16_t xh[nCols];
+        float xd[nCols];
+        for (NnUint c = 0; c < nCols; c++) {
+            xl[c] = vld1q_s8(x[c][j].qs);
+            xh[c] = vld1q_s8(x[c][j].qs + 16);
+            xd[c] = CONVERT_F16_TO_F32(x[c][j].d);
+        }
+        for (NnUint r = 0; r < nRows; r++) {
+            const NnBlockQ80 *wb = &w[r * nBlocks + j];
+            __builtin_prefetch(wb + Q80_PREFETCH_BLOCKS);
+            const int8x16_t wl = vld1q_s8(wb->qs);
+            const int8x16_t wh = vld1q_s8(wb->qs + 16);
+            const float wd = CONVERT_F16_TO_F32(wb->d);
+            for (NnUint c = 0; c < nCols; c++)
+                acc[r][c] = vmlaq_n_f32(acc[r][c], vcvtq_f32_s32(dotQ40Q80_neon(wl, wh, xl[c], xh[c])), wd * xd[c]);
+        }
+    }
+    for (NnUint r = 0; r < nRows; r++)
+        for (NnUint c = 0; c < nCols; c++)
+            output[c][row + r] = vaddvq_f32(acc[r][c]);
+}
+
+static void matmulBatchRows_Q80_Q80_F32_neon(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ80 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+    NnUint i = start;
+    for (; i + Q80_TILE_ROWS <= end; i += Q80_TILE_ROWS) {
+        NnUint b = 0;
+        for (; b + Q80_TILE_COLS <= nBatches; b += Q80_TILE_COLS)
+            matmulTile_Q80_Q80_F32_neon<Q80_TILE_ROWS, Q80_TILE_COLS>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+        for (; b < nBatches; b++)
+            matmulTile_Q80_Q80_F32_neon<Q80_TILE_ROWS, 1>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+    }
+    for (; i < end; i++) {
+        NnUint b = 0;
+        for (; b + Q80_TILE_COLS <= nBatches; b += Q80_TILE_COLS)
+            matmulTile_Q80_Q80_F32_neon<1, Q80_TILE_COLS>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+        for (; b < nBatches; b++)
+            matmulTile_Q80_Q80_F32_neon<1, 1>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+    }
+}
+#endif
 
-            __m256i x8 = _mm256_loadu_si256((const __m256i*)xb->qs);
-            __m512i x16 = _mm512_cvtepi8_epi16(x8);
+#if defined(__AVX2__)
+// maddubs needs one unsigned operand: |w| is multiplied by x with the sign of w. The int16 pair sums cannot
+// saturate because the quantization keeps |q| <= 127
+static inline __m256i dotQ80Q80_avx2(const __m256i w, const __m256i x) {
+    const __m256i p = _mm256_maddubs_epi16(_mm256_sign_epi8(w, w), _mm256_sign_epi8(x, w));
+    return _mm256_madd_epi16(p, _mm256_set1_epi16(1));
+}
 
-            __m512i products = _mm512_madd_epi16(w16, x16);
-            sum += _mm512_reduce_add_epi32(products) * s;
+// The same tiling as the Q80 x Q40 matmul, w points to the first row of the tile
+template <NnUint nRows, NnUint nCols, __m256i (*dot)(const __m256i, const __m256i)>
+static inline __attribute__((always_inline)) void matmulTile_Q80_Q80_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ80 *w, const NnUint nBlocks, const NnUint row) {
+    __m256 acc[nRows][nCols];
+    for (NnUint r = 0; r < nRows; r++)
+        for (NnUint c = 0; c < nCols; c++)
+            acc[r][c] = _mm256_setzero_ps();
+    for (NnUint j = 0; j < nBlocks; j++) {
+        __m256i xq[nCols];
+        float xd[nCols];
+        for (NnUint c = 0; c < nCols; c++) {
+            xq[c] = _mm256_loadu_si256((const __m256i *)x[c][j].qs);
+            xd[c] = CONVERT_F16_TO_F32(x[c][j].d);
+        }
+        for (NnUint r = 0; r < nRows; r++) {
+            const NnBlockQ80 *wb = &w[r * nBlocks + j];
+            _mm_prefetch((const char *)(wb + Q80_PREFETCH_BLOCKS), _MM_HINT_T0);
+            const __m256i wq = _mm256_loadu_si256((const __m256i *)wb->qs);
+            const float wd = CONVERT_F16_TO_F32(wb->d);
+            for (NnUint c = 0; c < nCols; c++)
+                acc[r][c] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot(wq, xq[c])), _mm256_set1_ps(wd * xd[c]), acc[r][c]);
         }
-        output[i] = sum;
     }
-#elif defined(__AVX2__)
+    for (NnUint r = 0; r < nRows; r++)
+        for (NnUint c = 0; c < nCols; c++)
+            output[c][row + r] = horizontalSum_avx2(acc[r][c]);
+}
+
+template <__m256i (*dot)(const __m256i, const __m256i)>
+static inline __attribute__((always_inline)) void matmulBatchRowsTiled_Q80_Q80_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ80 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+    NnUint i = start;
+    for (; i + Q80_TILE_ROWS <= end; i += Q80_TILE_ROWS) {
+        NnUint b = 0;
+        for (; b + Q80_TILE_COLS <= nBatches; b += Q80_TILE_COLS)
+            matmulTile_Q80_Q80_F32_avx2<Q80_TILE_ROWS, Q80_TILE_COLS, dot>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+        for (; b < nBatches; b++)
+            matmulTile_Q80_Q80_F32_avx2<Q80_TILE_ROWS, 1, dot>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+    }
+    for (; i < end; i++) {
+        NnUint b = 0;
+        for (; b + Q80_TILE_COLS <= nBatches; b += Q80_TILE_COLS)
+            matmulTile_Q80_Q80_F32_avx2<1, Q80_TILE_COLS, dot>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+        for (; b < nBatches; b++)
+            matmulTile_Q80_Q80_F32_avx2<1, 1, dot>(&output[b], &x[b], &w[i * nBlocks], nBlocks, i);
+    }
+}
+
+static void matmulBatchRows_Q80_Q80_F32_avx2(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ80 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    matmulBatchRowsTiled_Q80_Q80_F32_avx2<dotQ80Q80_avx2>(output, x, w, n, nBatches, start, end);
+}
+
+static void matmulRows_Q80_Q80_F32_avx2(float *output, const NnBlockQ80 *x, const NnBlockQ80 *w, const NnUint n, const NnUint start, const NnUint end) {
+    matmulBatchRows_Q80_Q80_F32_avx2(&output, &x, w, n, 1, start, end);
+}
+
+#if defined(NN_AVX_VNNI)
+__attribute__((target("avxvnni")))
+static inline __m256i dotQ80Q80_avxvnni(const __m256i w, const __m256i x) {
+    return _mm256_dpbusd_avx_epi32(_mm256_setzero_si256(), _mm256_sign_epi8(w, w), _mm256_sign_epi8(x, w));
+}
+
+__attribute__((target("avxvnni")))
+static void matmulBatchRows_Q80_Q80_F32_avxvnni(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ80 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    matmulBatchRowsTiled_Q80_Q80_F32_avx2<dotQ80Q80_avxvnni>(output, x, w, n, nBatches, start, end);
+}
+
+static void matmulRows_Q80_Q80_F32_avxvnni(float *output, const NnBlockQ80 *x, const NnBlockQ80 *w, const NnUint n, const NnUint start, const NnUint end) {
+    matmulBatchRows_Q80_Q80_F32_avxvnni(&output, &x, w, n, 1, start, end);
+}
+#endif
+#endif
+
+#if defined(__SSSE3__)
+[[maybe_unused]] static void matmulRows_Q80_Q80_F32_ssse3(float *output, const NnBlockQ80 *x, const NnBlockQ80 *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
     for (NnUint i = start; i < end; i++) {
-        float sum = 0.0f;
+        __m128 acc = _mm_setzero_ps();
         for (NnUint j = 0; j < nBlocks; j++) {
-            const NnBlockQ40 *wb = &w[i * nBlocks + j];
+            const NnBlockQ80 *wb = &w[i * nBlocks + j];
             const NnBlockQ80 *xb = &x[j];
+            _mm_prefetch((const char *)(wb + Q80_PREFETCH_BLOCKS), _MM_HINT_T0);
+            const __m128i wl = _mm_loadu_si128((const __m128i *)wb->qs);
+            const __m128i wh = _mm_loadu_si128((const __m128i *)(wb->qs + 16));
+            const __m128i xl = _mm_loadu_si128((const __m128i *)xb->qs);
+            const __m128i xh = _mm_loadu_si128((const __m128i *)(xb->qs + 16));
+            const __m128i p = _mm_add_epi32(
+                dotQ40Q80_ssse3(_mm_sign_epi8(wl, wl), _mm_sign_epi8(xl, wl)),
+                dotQ40Q80_ssse3(_mm_sign_epi8(wh, wh), _mm_sign_epi8(xh, wh)));
             const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_cvtepi32_ps(p), _mm_set1_ps(s)));
+        }
+        acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+        acc = _mm_add_ss(acc, _mm_movehdup_ps(acc));
+        output[i] = _mm_cvtss_f32(acc);
+    }
+}
+#endif
 
-            __m128i w_packed = _mm_loadu_si128((const __m128i*)wb->qs);
+static void matmulRows_Q80_Q80_F32(float *output, const NnBlockQ80 *x, const NnBlockQ80 *w, const NnUint n, const NnUint start, const NnUint end) {
+    assert(n % Q80_BLOCK_SIZE == 0);
+#if defined(__ARM_NEON)
+    matmulBatchRows_Q80_Q80_F32_neon(&output, &x, w, n, 1, start, end);
+#elif defined(__AVX2__)
+#if defined(NN_AVX_VNNI)
+    if (hasAvxVnni()) {
+        matmulRows_Q80_Q80_F32_avxvnni(output, x, w, n, start, end);
+        return;
+    }
+#endif
+    matmulRows_Q80_Q80_F32_avx2(output, x, w, n, start, end);
+#elif defined(__SSSE3__)
+    matmulRows_Q80_Q80_F32_ssse3(output, x, w, n, start, end);
+#else
+    matmulRows_Q80_Q80_F32_ref(output, x, w, n, start, end);
+#endif
+}
 
-            __m128i w0_low = _mm_and_si128(w_packed, _mm_set1_epi8(0x0F));
-            __m128i w0 = _mm_sub_epi8(w0_low, _mm_set1_epi8(8));
+static void matmulBatchRows_Q80_Q80_F32(float *const *output, const NnBlockQ80 *const *x, const NnBlockQ80 *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    assert(n % Q80_BLOCK_SIZE == 0);
+    if (nBatches == 1) {
+        matmulRows_Q80_Q80_F32(output[0], x[0], w, n, start, end);
+        return;
+    }
+#if defined(__ARM_NEON)
+    matmulBatchRows_Q80_Q80_F32_neon(output, x, w, n, nBatches, start, end);
+#elif defined(__AVX2__)
+#if defined(NN_AVX_VNNI)
+    if (hasAvxVnni()) {
+        matmulBatchRows_Q80_Q80_F32_avxvnni(output, x, w, n, nBatches, start, end);
+        return;
+    }
+#endif
+    matmulBatchRows_Q80_Q80_F32_avx2(output, x, w, n, nBatches, start, end);
+#else
+    for (NnUint i = start; i < end; i += Q80_TILE_ROWS) {
+        const NnUint tileEnd = i + Q80_TILE_ROWS < end ? i + Q80_TILE_ROWS : end;
+        for (NnUint b = 0; b < nBatches; b++)
+            matmulRows_Q80_Q80_F32(output[b], x[b], w, n, i, tileEnd);
+    }
+#endif
+}
 
-            __m128i w1_high = _mm_srli_epi16(w_packed, 4);
-            w1_high = _mm_and_si128(w1_high, _mm_set1_epi8(0x0F));
-            __m128i w1 = _mm_sub_epi8(w1_high, _mm_set1_epi8(8));
+// Q80 blocks of the input per super-block of the Q4K and Q6K weights
+#define QK_SUB_BLOCKS (Q4K_BLOCK_SIZE / Q80_BLOCK_SIZE)
 
-            __m256i w0_16 = _mm256_cvtepi8_epi16(w0);
-            __m256i w1_16 = _mm256_cvtepi8_epi16(w1);
+[[maybe_unused]] static void matmulRows_Q80_Q4K_F32_ref(float *output, const NnBlockQ80 *x, const NnBlockQ4K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q4K_BLOCK_SIZE;
+    for (NnUint i = start; i < end; i++) {
+        float sum = 0.0f;
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ4K *wb = &w[i * nBlocks + j];
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            const float dmin = CONVERT_F16_TO_F32(wb->dmin);
+            for (NnUint s = 0; s < QK_SUB_BLOCKS; s++) {
+                const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + s];
+                std::uint8_t ls, lm;
+                getScaleMinQ4K(wb, s, &ls, &lm);
+                int dot = 0;
+                int sumX = 0;
+                for (NnUint k = 0; k < Q80_BLOCK_SIZE; k++) {
+                    const int q = (wb->qs[(s / 2) * Q80_BLOCK_SIZE + k] >> (4 * (s % 2))) & 0xF;
+                    dot += q * xb->qs[k];
+                    sumX += xb->qs[k];
+                }
+                sum += CONVERT_F16_TO_F32(xb->d) * (d * ls * dot - dmin * lm * sumX);
+            }
+        }
+        output[i] = sum;
+    }
+}
 
-            __m128i i1_8 = _mm_loadu_si128((const __m128i*)xb->qs);
-            __m128i i2_8 = _mm_loadu_si128((const __m128i*)(xb->qs + Q40_BLOCK_SIZE / 2));
+[[maybe_unused]] static void matmulRows_Q80_Q6K_F32_ref(float *output, const NnBlockQ80 *x, const NnBlockQ6K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q6K_BLOCK_SIZE;
+    for (NnUint i = start; i < end; i++) {
+        float sum = 0.0f;
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ6K *wb = &w[i * nBlocks + j];
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            for (NnUint c = 0; c < QK_SUB_BLOCKS; c++) {
+                const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + c];
+                int dot[2] = { 0, 0 };
+                for (NnUint k = 0; k < Q80_BLOCK_SIZE; k++) {
+                    const int low = (wb->ql[16 * c + k % 16] >> (4 * (k / 16))) & 0xF;
+                    const int high = (wb->qh[8 * c + k % 8] >> (2 * (k / 8))) & 3;
+                    dot[k / 16] += ((low | (high << 4)) - 32) * xb->qs[k];
+                }
+                sum += CONVERT_F16_TO_F32(xb->d) * d * (wb->scales[2 * c] * dot[0] + wb->scales[2 * c + 1] * dot[1]);
+            }
+        }
+        output[i] = sum;
+    }
+}
+
+[[maybe_unused]] static void matmulRows_Q80_Q2K_F32_ref(float *output, const NnBlockQ80 *x, const NnBlockQ2K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q2K_BLOCK_SIZE;
+    for (NnUint i = start; i < end; i++) {
+        float sum = 0.0f;
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ2K *wb = &w[i * nBlocks + j];
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            const float dmin = CONVERT_F16_TO_F32(wb->dmin);
+            for (NnUint c = 0; c < QK_SUB_BLOCKS; c++) {
+                const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + c];
+                int dot = 0;
+                int dotMin = 0;
+                for (NnUint k = 0; k < Q80_BLOCK_SIZE; k++) {
+                    const std::uint8_t sm = wb->scales[2 * c + k / 16];
+                    const int q = (wb->qs[8 * c + k % 8] >> (2 * (k / 8))) & 3;
+                    dot += (sm & 0xF) * q * xb->qs[k];
+                    dotMin += (sm >> 4) * xb->qs[k];
+                }
+                sum += CONVERT_F16_TO_F32(xb->d) * (d * dot - dmin * dotMin);
+            }
+        }
+        output[i] = sum;
+    }
+}
+
+#if defined(__ARM_NEON)
+static inline int32x4_t dotI8_neon(const int8x16_t w, const int8x16_t x) {
+#if defined(__ARM_FEATURE_DOTPROD)
+    return vdotq_s32(vdupq_n_s32(0), w, x);
+#else
+    return vaddq_s32(
+        vpaddlq_s16(vmull_s8(vget_low_s8(w), vget_low_s8(x))),
+        vpaddlq_s16(vmull_s8(vget_high_s8(w), vget_high_s8(x))));
+#endif
+}
+
+static void matmulRows_Q80_Q4K_F32_neon(float *output, const NnBlockQ80 *x, const NnBlockQ4K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q4K_BLOCK_SIZE;
+    const uint8x16_t lowMask = vdupq_n_u8(0x0F);
+    for (NnUint i = start; i < end; i++) {
+        float32x4_t acc = vmovq_n_f32(0.0f);
+        float sumMin = 0.0f;
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ4K *wb = &w[i * nBlocks + j];
+            __builtin_prefetch(wb + 2);
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            const float dmin = CONVERT_F16_TO_F32(wb->dmin);
+            for (NnUint p = 0; p < QK_SUB_BLOCKS / 2; p++) {
+                const uint8x16_t p0 = vld1q_u8(&wb->qs[p * Q80_BLOCK_SIZE]);
+                const uint8x16_t p1 = vld1q_u8(&wb->qs[p * Q80_BLOCK_SIZE + 16]);
+                // The nibbles are at most 15, they fit into int8
+                const int8x16_t q[2][2] = {
+                    { vreinterpretq_s8_u8(vandq_u8(p0, lowMask)), vreinterpretq_s8_u8(vandq_u8(p1, lowMask)) },
+                    { vreinterpretq_s8_u8(vshrq_n_u8(p0, 4)), vreinterpretq_s8_u8(vshrq_n_u8(p1, 4)) },
+                };
+                for (NnUint h = 0; h < 2; h++) {
+                    const NnUint s = 2 * p + h;
+                    const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + s];
+                    std::uint8_t ls, lm;
+                    getScaleMinQ4K(wb, s, &ls, &lm);
+                    const int8x16_t xl = vld1q_s8(xb->qs);
+                    const int8x16_t xh = vld1q_s8(xb->qs + 16);
+                    const float xd = CONVERT_F16_TO_F32(xb->d);
+                    const int32x4_t dot = vaddq_s32(dotI8_neon(q[h][0], xl), dotI8_neon(q[h][1], xh));
+                    acc = vmlaq_n_f32(acc, vcvtq_f32_s32(dot), d * ls * xd);
+                    sumMin += dmin * lm * xd * (vaddlvq_s8(xl) + vaddlvq_s8(xh));
+                }
+            }
+        }
+        output[i] = vaddvq_f32(acc) - sumMin;
+    }
+}
 
-            __m256i i1_16 = _mm256_cvtepi8_epi16(i1_8);
-            __m256i i2_16 = _mm256_cvtepi8_epi16(i2_8);
+// 32 2-bit values of a chunk, the value k is in q[k % 8] at the bit 2 * (k / 8)
+static inline void unpack2Bits_neon(const std::uint8_t *q, uint8x16_t *low, uint8x16_t *high) {
+    const uint8x8_t v = vld1_u8(q);
+    const uint8x8_t mask = vdup_n_u8(3);
+    *low = vcombine_u8(vand_u8(v, mask), vand_u8(vshr_n_u8(v, 2), mask));
+    *high = vcombine_u8(vand_u8(vshr_n_u8(v, 4), mask), vshr_n_u8(v, 6));
+}
+
+static void matmulRows_Q80_Q6K_F32_neon(float *output, const NnBlockQ80 *x, const NnBlockQ6K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q6K_BLOCK_SIZE;
+    const uint8x16_t lowMask = vdupq_n_u8(0x0F);
+    const int8x16_t offset = vdupq_n_s8(32);
+    for (NnUint i = start; i < end; i++) {
+        float32x4_t acc = vmovq_n_f32(0.0f);
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ6K *wb = &w[i * nBlocks + j];
+            __builtin_prefetch(wb + 2);
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            for (NnUint c = 0; c < QK_SUB_BLOCKS; c++) {
+                const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + c];
+                const uint8x16_t ql = vld1q_u8(&wb->ql[16 * c]);
+                uint8x16_t h0, h1;
+                unpack2Bits_neon(&wb->qh[8 * c], &h0, &h1);
+                const int8x16_t q0 = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vandq_u8(ql, lowMask), vshlq_n_u8(h0, 4))), offset);
+                const int8x16_t q1 = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(ql, 4), vshlq_n_u8(h1, 4))), offset);
+                const int32x4_t dot = vaddq_s32(
+                    vmulq_n_s32(dotI8_neon(q0, vld1q_s8(xb->qs)), wb->scales[2 * c]),
+                    vmulq_n_s32(dotI8_neon(q1, vld1q_s8(xb->qs + 16)), wb->scales[2 * c + 1]));
+                acc = vmlaq_n_f32(acc, vcvtq_f32_s32(dot), d * CONVERT_F16_TO_F32(xb->d));
+            }
+        }
+        output[i] = vaddvq_f32(acc);
+    }
+}
 
-            __m256i prod0 = _mm256_mullo_epi16(w0_16, i1_16);
-            __m256i prod1 = _mm256_mullo_epi16(w1_16, i2_16);
-            __m256i sum_prod = _mm256_add_epi16(prod0, prod1);
+static void matmulRows_Q80_Q2K_F32_neon(float *output, const NnBlockQ80 *x, const NnBlockQ2K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q2K_BLOCK_SIZE;
+    for (NnUint i = start; i < end; i++) {
+        float32x4_t acc = vmovq_n_f32(0.0f);
+        float sumMin = 0.0f;
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ2K *wb = &w[i * nBlocks + j];
+            __builtin_prefetch(wb + 4);
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            const float dmin = CONVERT_F16_TO_F32(wb->dmin);
+            for (NnUint c = 0; c < QK_SUB_BLOCKS; c++) {
+                const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + c];
+                uint8x16_t q0, q1;
+                unpack2Bits_neon(&wb->qs[8 * c], &q0, &q1);
+                const int8x16_t xl = vld1q_s8(xb->qs);
+                const int8x16_t xh = vld1q_s8(xb->qs + 16);
+                const std::uint8_t sm0 = wb->scales[2 * c];
+                const std::uint8_t sm1 = wb->scales[2 * c + 1];
+                const int32x4_t dot = vaddq_s32(
+                    vmulq_n_s32(dotI8_neon(vreinterpretq_s8_u8(q0), xl), sm0 & 0xF),
+                    vmulq_n_s32(dotI8_neon(vreinterpretq_s8_u8(q1), xh), sm1 & 0xF));
+                const float xd = CONVERT_F16_TO_F32(xb->d);
+                acc = vmlaq_n_f32(acc, vcvtq_f32_s32(dot), d * xd);
+                sumMin += dmin * xd * ((sm0 >> 4) * vaddlvq_s8(xl) + (sm1 >> 4) * vaddlvq_s8(xh));
+            }
+        }
+        output[i] = vaddvq_f32(acc) - sumMin;
+    }
+}
+#endif
 
-            __m256i ones = _mm256_set1_epi16(1);
-            __m256i sum32 = _mm256_madd_epi16(sum_prod, ones);
+#if defined(__AVX2__)
+// 32 2-bit values of a chunk, the value k is in q[k % 8] at the bit 2 * (k / 8). Every 64-bit lane holds the 8 bytes,
+// the lane k / 8 shifts the bits of the value k down
+static inline __m256i unpack2Bits_avx2(const std::uint8_t *q) {
+    std::uint64_t v;
+    std::memcpy(&v, q, sizeof(v));
+    const __m256i shifted = _mm256_srlv_epi64(_mm256_set1_epi64x((long long)v), _mm256_set_epi64x(6, 4, 2, 0));
+    return _mm256_and_si256(shifted, _mm256_set1_epi8(3));
+}
 
-            __m128i sum_low = _mm256_castsi256_si128(sum32);
-            __m128i sum_high = _mm256_extracti128_si256(sum32, 1);
-            sum_low = _mm_add_epi32(sum_low, sum_high);
-            sum_low = _mm_hadd_epi32(sum_low, sum_low);
-            sum_low = _mm_hadd_epi32(sum_low, sum_low);
-            int32_t block_sum = _mm_extract_epi32(sum_low, 0);
+static void matmulRows_Q80_Q4K_F32_avx2(float *output, const NnBlockQ80 *x, const NnBlockQ4K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q4K_BLOCK_SIZE;
+    const __m256i lowMask = _mm256_set1_epi8(0x0F);
+    const __m256i ones8 = _mm256_set1_epi8(1);
+    const __m256i ones16 = _mm256_set1_epi16(1);
+    for (NnUint i = start; i < end; i++) {
+        __m256 acc = _mm256_setzero_ps();
+        __m256 accMin = _mm256_setzero_ps();
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ4K *wb = &w[i * nBlocks + j];
+            _mm_prefetch((const char *)(wb + 2), _MM_HINT_T0);
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            const float dmin = CONVERT_F16_TO_F32(wb->dmin);
+            for (NnUint p = 0; p < QK_SUB_BLOCKS / 2; p++) {
+                const __m256i packed = _mm256_loadu_si256((const __m256i *)&wb->qs[p * Q80_BLOCK_SIZE]);
+                const __m256i q[2] = { _mm256_and_si256(packed, lowMask), _mm256_and_si256(_mm256_srli_epi16(packed, 4), lowMask) };
+                for (NnUint h = 0; h < 2; h++) {
+                    const NnUint s = 2 * p + h;
+                    const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + s];
+                    std::uint8_t ls, lm;
+                    getScaleMinQ4K(wb, s, &ls, &lm);
+                    const __m256i xq = _mm256_loadu_si256((const __m256i *)xb->qs);
+                    const float xd = CONVERT_F16_TO_F32(xb->d);
+                    // The nibbles are unsigned, maddubs takes them as they are
+                    const __m256i dot = _mm256_madd_epi16(_mm256_maddubs_epi16(q[h], xq), ones16);
+                    const __m256i sumX = _mm256_madd_epi16(_mm256_maddubs_epi16(ones8, xq), ones16);
+                    acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot), _mm256_set1_ps(d * ls * xd), acc);
+                    accMin = _mm256_fmadd_ps(_mm256_cvtepi32_ps(sumX), _mm256_set1_ps(dmin * lm * xd), accMin);
+                }
+            }
+        }
+        output[i] = horizontalSum_avx2(_mm256_sub_ps(acc, accMin));
+    }
+}
 
-            sum += block_sum * s;
+static void matmulRows_Q80_Q6K_F32_avx2(float *output, const NnBlockQ80 *x, const NnBlockQ6K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q6K_BLOCK_SIZE;
+    const __m256i lowMask = _mm256_set1_epi8(0x0F);
+    const __m256i offset = _mm256_set1_epi8(32);
+    for (NnUint i = start; i < end; i++) {
+        __m256 acc = _mm256_setzero_ps();
+        for (NnUint j = 0; j < nBlocks; j++) {
+            const NnBlockQ6K *wb = &w[i * nBlocks + j];
+            _mm_prefetch((const char *)(wb + 2), _MM_HINT_T0);
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            for (NnUint c = 0; c < QK_SUB_BLOCKS; c++) {
+                const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + c];
+                const __m128i ql = _mm_loadu_si128((const __m128i *)&wb->ql[16 * c]);
+                const __m256i low = _mm256_and_si256(_mm256_set_m128i(_mm_srli_epi16(ql, 4), ql), lowMask);
+                const __m256i q = _mm256_or_si256(low, _mm256_slli_epi16(unpack2Bits_avx2(&wb->qh[8 * c]), 4));
+                const __m256i xq = _mm256_loadu_si256((const __m256i *)xb->qs);
+                // q * x - 32 * x fits into int16, the lanes of the 16-weight sub-blocks are scaled separately
+                const __m256i p = _mm256_sub_epi16(_mm256_maddubs_epi16(q, xq), _mm256_maddubs_epi16(offset, xq));
+                const __m256i scales = _mm256_set_m128i(_mm_set1_epi16(wb->scales[2 * c + 1]), _mm_set1_epi16(wb->scales[2 * c]));
+                const __m256i dot = _mm256_madd_epi16(p, scales);
+                acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot), _mm256_set1_ps(d * CONVERT_F16_TO_F32(xb->d)), acc);
+            }
         }
-        output[i] = sum;
+        output[i] = horizontalSum_avx2(acc);
     }
-#else
+}
+
+static void matmulRows_Q80_Q2K_F32_avx2(float *output, const NnBlockQ80 *x, const NnBlockQ2K *w, const NnUint n, const NnUint start, const NnUint end) {
+    const NnUint nBlocks = n / Q2K_BLOCK_SIZE;
+    const __m256i ones8 = _mm256_set1_epi8(1);
     for (NnUint i = start; i < end; i++) {
-        float sum = 0.0;
+        __m256 acc = _mm256_setzero_ps();
+        __m256 accMin = _mm256_setzero_ps();
         for (NnUint j = 0; j < nBlocks; j++) {
-            const NnBlockQ40 *wb = &w[i * nBlocks + j];
-            const NnBlockQ80 *xb = &x[j];
-            const float s = CONVERT_F16_TO_F32(wb->d) * CONVERT_F16_TO_F32(xb->d);
-            for (NnUint k = 0; k < Q40_BLOCK_SIZE / 2; k++) {
-                const int w0 = (wb->qs[k] & 0x0F) - 8;
-                const int w1 = (wb->qs[k] >> 4) - 8;
-                const int i1 = xb->qs[k];
-                const int i2 = xb->qs[k + Q80_BLOCK_SIZE / 2];
-                sum += (w0 * i1 + w1 * i2) * s;
+            const NnBlockQ2K *wb = &w[i * nBlocks + j];
+            _mm_prefetch((const char *)(wb + 4), _MM_HINT_T0);
+            const float d = CONVERT_F16_TO_F32(wb->d);
+            const float dmin = CONVERT_F16_TO_F32(wb->dmin);
+            for (NnUint c = 0; c < QK_SUB_BLOCKS; c++) {
+                const NnBlockQ80 *xb = &x[j * QK_SUB_BLOCKS + c];
+                const __m256i q = unpack2Bits_avx2(&wb->qs[8 * c]);
+                const __m256i xq = _mm256_loadu_si256((const __m256i *)xb->qs);
+                const std::uint8_t sm0 = wb->scales[2 * c];
+                const std::uint8_t sm1 = wb->scales[2 * c + 1];
+                // The lanes of the two 16-weight sub-blocks get their own scales and mins
+                const __m256i scales = _mm256_set_m128i(_mm_set1_epi16(sm1 & 0xF), _mm_set1_epi16(sm0 & 0xF));
+                const __m256i mins = _mm256_set_m128i(_mm_set1_epi16(sm1 >> 4), _mm_set1_epi16(sm0 >> 4));
+                const __m256i dot = _mm256_madd_epi16(_mm256_maddubs_epi16(q, xq), scales);
+                const __m256i dotMin = _mm256_madd_epi16(_mm256_maddubs_epi16(ones8, xq), mins);
+                const float xd = CONVERT_F16_TO_F32(xb->d);
+                acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot), _mm256_set1_ps(d * xd), acc);
+                accMin = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dotMin), _mm256_set1_ps(dmin * xd), accMin);
             }
         }
-        output[i] = sum;
+        output[i] = horizontalSum_avx2(_mm256_sub_ps(acc, accMin));
     }
+}
+#endif
+
+static void matmulRows_Q80_Q4K_F32(float *output, const NnBlockQ80 *x, const NnBlockQ4K *w, const NnUint n, const NnUint start, const NnUint end) {
+    assert(n % Q4K_BLOCK_SIZE == 0);
+#if defined(__ARM_NEON)
+    matmulRows_Q80_Q4K_F32_neon(output, x, w, n, start, end);
+#elif defined(__AVX2__)
+    matmulRows_Q80_Q4K_F32_avx2(output, x, w, n, start, end);
+#else
+    matmulRows_Q80_Q4K_F32_ref(output, x, w, n, start, end);
+#endif
+}
+
+static void matmulRows_Q80_Q6K_F32(float *output, const NnBlockQ80 *x, const NnBlockQ6K *w, const NnUint n, const NnUint start, const NnUint end) {
+    assert(n % Q6K_BLOCK_SIZE == 0);
+#if defined(__ARM_NEON)
+    matmulRows_Q80_Q6K_F32_neon(output, x, w, n, start, end);
+#elif defined(__AVX2__)
+    matmulRows_Q80_Q6K_F32_avx2(output, x, w, n, start, end);
+#else
+    matmulRows_Q80_Q6K_F32_ref(output, x, w, n, start, end);
+#endif
+}
+
+static void matmulRows_Q80_Q2K_F32(float *output, const NnBlockQ80 *x, const NnBlockQ2K *w, const NnUint n, const NnUint start, const NnUint end) {
+    assert(n % Q2K_BLOCK_SIZE == 0);
+#if defined(__ARM_NEON)
+    matmulRows_Q80_Q2K_F32_neon(output, x, w, n, start, end);
+#elif defined(__AVX2__)
+    matmulRows_Q80_Q2K_F32_avx2(output, x, w, n, start, end);
+#else
+    matmulRows_Q80_Q2K_F32_ref(output, x, w, n, start, end);
 #endif
 }
 
+// Every batch runs the GEMV over Q40_TILE_ROWS rows before the next rows are read, so the few rows stay in the
+// cache for all batches. The super-block kernels have no register tiling over the batches
+template <typename TBlock, void (*matmulRows)(float *, const NnBlockQ80 *, const TBlock *, const NnUint, const NnUint, const NnUint)>
+static void matmulBatchRowGroupsT_Q80_QK_F32(float *const *output, const NnBlockQ80 *const *x, const TBlock *w, const NnUint n, const NnUint nBatches, const NnUint start, const NnUint end) {
+    for (NnUint i = start; i < end; i += Q40_TILE_ROWS) {
+        const NnUint groupEnd = i + Q40_TILE_ROWS < end ? i + Q40_TILE_ROWS : end;
+        for (NnUint b = 0; b < nBatches; b++)
+            matmulRows(output[b], x[b], w, n, i, groupEnd);
+    }
+}
+
 #define SQRT_2_OVER_PI 0.79788456080286535587989211986876f
 #define GELU_COEF_A 0.044715f
 
@@ -490,6 +1636,39 @@ static void silu_F32(float *output, const unsigned int n, const NnUint nThreads,
     }
 }
 
+// Rotates the interleaved pairs (x[i], x[i + 1]) of <start; end) by the (cos, sin) pairs of the cache, start must be even
+static void rope_F32(float *x, const float *posCache, const NnUint start, const NnUint end) {
+    NnUint i = start;
+#if defined(__ARM_NEON)
+    for (; i + 8 <= end; i += 8) {
+        float32x4x2_t v = vld2q_f32(&x[i]);
+        const float32x4x2_t c = vld2q_f32(&posCache[i]);
+        const float32x4_t v0 = v.val[0];
+        v.val[0] = vmlsq_f32(vmulq_f32(v0, c.val[0]), v.val[1], c.val[1]);
+        v.val[1] = vmlaq_f32(vmulq_f32(v0, c.val[1]), v.val[1], c.val[0]);
+        vst2q_f32(&x[i], v);
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= end; i += 8) {
+        const __m256 v = _mm256_loadu_ps(&x[i]);
+        const __m256 c = _mm256_loadu_ps(&posCache[i]);
+        const __m256 fcr = _mm256_moveldup_ps(c);
+        const __m256 fci = _mm256_movehdup_ps(c);
+        const __m256 swapped = _mm256_permute_ps(v, 0xB1);
+        // even lanes: v0 * fcr - v1 * fci, odd lanes: v1 * fcr + v0 * fci
+        _mm256_storeu_ps(&x[i], _mm256_fmaddsub_ps(v, fcr, _mm256_mul_ps(swapped, fci)));
+    }
+#endif
+    for (; i < end; i += 2) {
+        const float fcr = posCache[i];
+        const float fci = posCache[i + 1];
+        const float v0 = x[i];
+        const float v1 = x[i + 1];
+        x[i] = v0 * fcr - v1 * fci;
+        x[i + 1] = v0 * fci + v1 * fcr;
+    }
+}
+
 static void add_F32(float *output, const float *x, const unsigned int n, const NnUint nThreads, const NnUint threadIndex) {
     SPLIT_THREADS(start, end, n, nThreads, threadIndex);
     for (unsigned int i = start; i < end; i++) {
@@ -583,6 +1762,57 @@ static void add_Q80_F32(float *y, const NnBlockQ80 *x, const NnUint n, const NnU
 #endif
 }
 
+// The Q40 partial sums exchanged between nodes are widened block by block and added to the F32 rows
+#if defined(__ARM_NEON)
+static inline void dequantizeQ40_neon(const NnBlockQ40 *b, float32x4_t *v) {
+    int8x16_t wl, wh;
+    unpackQ40_neon(b->qs, &wl, &wh);
+    const float d = CONVERT_F16_TO_F32(b->d);
+    const int16x8_t w[4] = { vmovl_s8(vget_low_s8(wl)), vmovl_s8(vget_high_s8(wl)), vmovl_s8(vget_low_s8(wh)), vmovl_s8(vget_high_s8(wh)) };
+    for (NnUint j = 0; j < 4; j++) {
+        v[j * 2] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(w[j]))), d);
+        v[j * 2 + 1] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(w[j]))), d);
+    }
+}
+#elif defined(__AVX2__)
+static inline void dequantizeQ40_avx2(const NnBlockQ40 *b, __m256 *v) {
+    const __m256i w = _mm256_sub_epi8(unpackQ40_avx2(b), _mm256_set1_epi8(8));
+    const __m128i lo = _mm256_castsi256_si128(w);
+    const __m128i hi = _mm256_extracti128_si256(w, 1);
+    const __m256 d = _mm256_set1_ps(CONVERT_F16_TO_F32(b->d));
+    v[0] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(lo)), d);
+    v[1] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(lo, 8))), d);
+    v[2] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(hi)), d);
+    v[3] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(hi, 8))), d);
+}
+#endif
+
+static void add_Q40_F32(float *y, const NnBlockQ40 *x, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        float *yi = &y[i * Q40_BLOCK_SIZE];
+#if defined(__ARM_NEON)
+        float32x4_t v[8];
+        dequantizeQ40_neon(&x[i], v);
+        for (NnUint j = 0; j < 8; j++)
+            vst1q_f32(&yi[j * 4], vaddq_f32(vld1q_f32(&yi[j * 4]), v[j]));
+#elif defined(__AVX2__)
+        __m256 v[4];
+        dequantizeQ40_avx2(&x[i], v);
+        for (NnUint j = 0; j < 4; j++)
+            _mm256_storeu_ps(&yi[j * 8], _mm256_add_ps(_mm256_loadu_ps(&yi[j * 8]), v[j]));
+#else
+        const float d = CONVERT_F16_TO_F32(x[i].d);
+        for (NnUint j = 0; j < Q40_BLOCK_SIZE / 2; j++) {
+            yi[j] += ((x[i].qs[j] & 0x0F) - 8) * d;
+            yi[j + Q40_BLOCK_SIZE / 2] += ((x[i].qs[j] >> 4) - 8) * d;
+        }
+#endif
+    }
+}
+
 void softmax_F32(float *x, const NnUint size) {
     if (size == 0)
         return;
@@ -746,25 +1976,135 @@ static float dotProduct_F32(const float *a, const float *b, const unsigned int s
 #endif
 }
 
-static void multiheadAtt_F32(
-    float *x, const float *q, float *att, float *keyCache, float *valueCache,
-    const NnUint pos, const NnUint nHeads, const NnUint nHeads0, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headSize, const NnUint seqLen,
-    const NnUint nThreads, const NnUint threadIndex) 
+// The KV cache is F32, F16 or Q80. The attention reads the rows in place and widens them to F32 in registers,
+// so a quantized cache halves or quarters the bytes read per position, and the scores and the sums stay in F32
+
+static float dotProduct_F32_Q80(const float *a, const NnBlockQ80 *b, const NnUint size) {
+    assert(size % Q80_BLOCK_SIZE == 0);
+    const NnUint nBlocks = size / Q80_BLOCK_SIZE;
+#if defined(__ARM_NEON)
+    float32x4_t acc = vmovq_n_f32(0);
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const float *ab = &a[j * Q80_BLOCK_SIZE];
+        float32x4_t sum = vmovq_n_f32(0);
+        for (NnUint k = 0; k < Q80_BLOCK_SIZE; k += 8) {
+            const int16x8_t bq = vmovl_s8(vld1_s8(&b[j].qs[k]));
+            sum = vmlaq_f32(sum, vld1q_f32(&ab[k]), vcvtq_f32_s32(vmovl_s16(vget_low_s16(bq))));
+            sum = vmlaq_f32(sum, vld1q_f32(&ab[k + 4]), vcvtq_f32_s32(vmovl_s16(vget_high_s16(bq))));
+        }
+        acc = vmlaq_n_f32(acc, sum, CONVERT_F16_TO_F32(b[j].d));
+    }
+    return vaddvq_f32(acc);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const float *ab = &a[j * Q80_BLOCK_SIZE];
+        __m256 sum = _mm256_setzero_ps();
+        for (NnUint k = 0; k < Q80_BLOCK_SIZE; k += 8) {
+            const __m256 bf = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)&b[j].qs[k])));
+            sum = _mm256_fmadd_ps(_mm256_loadu_ps(&ab[k]), bf, sum);
+        }
+        acc = _mm256_fmadd_ps(sum, _mm256_set1_ps(CONVERT_F16_TO_F32(b[j].d)), acc);
+    }
+    return horizontalSum_avx2(acc);
+#else
+    float val = 0.0f;
+    for (NnUint j = 0; j < nBlocks; j++) {
+        float sum = 0.0f;
+        for (NnUint k = 0; k < Q80_BLOCK_SIZE; k++)
+            sum += a[j * Q80_BLOCK_SIZE + k] * b[j].qs[k];
+        val += sum * CONVERT_F16_TO_F32(b[j].d);
+    }
+    return val;
+#endif
+}
+
+static float dotProductKv_F32(const float *q, const NnByte *k, const NnFloatType kvType, const NnUint headSize) {
+    if (kvType == F_Q80)
+        return dotProduct_F32_Q80(q, (const NnBlockQ80 *)k, headSize);
+    if (kvType == F_16) {
+        // An F16 row is one row of an F16 matmul
+        float score;
+        matmulRows_F32_F16_F32(&score, q, (const NnFp16 *)k, headSize, 0, 1);
+        return score;
+    }
+    return dotProduct_F32(q, (const float *)k, headSize);
+}
+
+static void mulAdd_F16(float *y, const NnFp16 *x, const float a, const NnUint n) {
+    NnUint i = 0;
+#if defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    for (; i + 8 <= n; i += 8) {
+        const float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(&x[i]));
+        vst1q_f32(&y[i], vfmaq_n_f32(vld1q_f32(&y[i]), vcvt_f32_f16(vget_low_f16(h)), a));
+        vst1q_f32(&y[i + 4], vfmaq_n_f32(vld1q_f32(&y[i + 4]), vcvt_f32_f16(vget_high_f16(h)), a));
+    }
+#elif defined(__AVX2__) && defined(__F16C__)
+    const __m256 av = _mm256_set1_ps(a);
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(&y[i], _mm256_fmadd_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&x[i])), av, _mm256_loadu_ps(&y[i])));
+#endif
+    for (; i < n; i++)
+        y[i] += a * CONVERT_F16_TO_F32(x[i]);
+}
+
+static void mulAdd_Q80(float *y, const NnBlockQ80 *x, const float a, const NnUint n) {
+    assert(n % Q80_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+    for (NnUint j = 0; j < nBlocks; j++) {
+        const float s = a * CONVERT_F16_TO_F32(x[j].d);
+        float *yb = &y[j * Q80_BLOCK_SIZE];
+#if defined(__ARM_NEON)
+        for (NnUint k = 0; k < Q80_BLOCK_SIZE; k += 8) {
+            const int16x8_t xq = vmovl_s8(vld1_s8(&x[j].qs[k]));
+            vst1q_f32(&yb[k], vmlaq_n_f32(vld1q_f32(&yb[k]), vcvtq_f32_s32(vmovl_s16(vget_low_s16(xq))), s));
+            vst1q_f32(&yb[k + 4], vmlaq_n_f32(vld1q_f32(&yb[k + 4]), vcvtq_f32_s32(vmovl_s16(vget_high_s16(xq))), s));
+        }
+#elif defined(__AVX2__)
+        const __m256 sv = _mm256_set1_ps(s);
+        for (NnUint k = 0; k < Q80_BLOCK_SIZE; k += 8) {
+            const __m256 xf = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)&x[j].qs[k])));
+            _mm256_storeu_ps(&yb[k], _mm256_fmadd_ps(xf, sv, _mm256_loadu_ps(&yb[k])));
+        }
+#else
+        for (NnUint k = 0; k < Q80_BLOCK_SIZE; k++)
+            yb[k] += s * x[j].qs[k];
+#endif
+    }
+}
+
+static void mulAddKv_F32(float *y, const NnByte *v, const NnFloatType kvType, const float a, const NnUint headSize) {
+    if (kvType == F_Q80) {
+        mulAdd_Q80(y, (const NnBlockQ80 *)v, a, headSize);
+    } else if (kvType == F_16) {
+        mulAdd_F16(y, (const NnFp16 *)v, a, headSize);
+    } else {
+        const float *vf = (const float *)v;
+        for (NnUint i = 0; i < headSize; i++)
+            y[i] += a * vf[i];
+    }
+}
+
+static void multiheadAttHeads_F32(
+    float *x, const float *q, float *att, const NnByte *keyCache, const NnByte *valueCache, const NnFloatType kvType,
+    const NnUint pos, const NnUint nHeads, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headSize, const NnUint seqLen,
+    const NnUint h0Start, const NnUint h0End)
 {
-    SPLIT_THREADS(h0Start, h0End, nHeads0, nThreads, threadIndex);
     const NnUint kvMul = nHeads / nKvHeads;
     const float headSizeRoot = sqrtf(headSize);
+    const NnSize rowBytes = getBytes(kvType, kvDim0);
+    const NnSize headBytes = getBytes(kvType, headSize);
 
     for (NnUint h0 = h0Start; h0 < h0End; h0++) {
         const float *hQ = &q[h0 * headSize];
         const NnUint headIndex = h0 / kvMul;
-        const float *hKc = &keyCache[headIndex * headSize];
-        const float *hVc = &valueCache[headIndex * headSize];
+        const NnByte *hKc = &keyCache[headIndex * headBytes];
+        const NnByte *hVc = &valueCache[headIndex * headBytes];
         float *hAtt = &att[h0 * seqLen];
 
         for (NnUint t = 0; t <= pos; t++) {
-            const float *posK = &hKc[t * kvDim0];
-            const float score = dotProduct_F32(hQ, posK, headSize) / headSizeRoot;
+            const NnByte *posK = &hKc[t * rowBytes];
+            const float score = dotProductKv_F32(hQ, posK, kvType, headSize) / headSizeRoot;
             hAtt[t] = score;
         }
 
@@ -774,11 +2114,335 @@ static void multiheadAtt_F32(
         std::memset(hX, 0, headSize * sizeof(float));
 
         for (NnUint t = 0; t <= pos; t++) {
-            const float *posV = &hVc[t * kvDim0];
-            const float posA = hAtt[t];
-            for (int i = 0; i < headSize; i++) {
-                hX[i] += posA * posV[i];
+            const NnByte *posV = &hVc[t * rowBytes];
+            mulAddKv_F32(hX, posV, kvType, hAtt[t], headSize);
+        }
+    }
+}
+
+static void multiheadAtt_F32(
+    float *x, const float *q, float *att, const NnByte *keyCache, const NnByte *valueCache, const NnFloatType kvType,
+    const NnUint pos, const NnUint nHeads, const NnUint nHeads0, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headSize, const NnUint seqLen,
+    const NnUint nThreads, const NnUint threadIndex)
+{
+    SPLIT_THREADS(h0Start, h0End, nHeads0, nThreads, threadIndex);
+    multiheadAttHeads_F32(x, q, att, keyCache, valueCache, kvType, pos, nHeads, nKvHeads, kvDim0, headSize, seqLen, h0Start, h0End);
+}
+
+// Number of cache positions scored at once by the flash attention, the K and V rows of a tile stay in L1/L2
+#define ATT_FLASH_TILE 64
+// Queries (query heads of a KV head for each batch) scored together against every tile
+#define ATT_FLASH_QUERIES 16
+// Shorter runs of queries are scored with dot products, the GEMM does not pay off for them
+#define ATT_FLASH_GEMM_QUERIES 8
+
+static void scale_F32(float *y, const float a, const NnUint n) {
+    NnUint i = 0;
+#if defined(__ARM_NEON)
+    const float32x4_t av = vdupq_n_f32(a);
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(&y[i], vmulq_f32(vld1q_f32(&y[i]), av));
+#elif defined(__AVX2__)
+    const __m256 av = _mm256_set1_ps(a);
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(&y[i], _mm256_mul_ps(_mm256_loadu_ps(&y[i]), av));
+#endif
+    for (; i < n; i++)
+        y[i] *= a;
+}
+
+static void mulAdd_F32(float *y, const float *x, const float a, const NnUint n) {
+    NnUint i = 0;
+#if defined(__ARM_NEON)
+    const float32x4_t av = vdupq_n_f32(a);
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(&y[i], vmlaq_f32(vld1q_f32(&y[i]), vld1q_f32(&x[i]), av));
+#elif defined(__AVX2__)
+    const __m256 av = _mm256_set1_ps(a);
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(&y[i], _mm256_fmadd_ps(_mm256_loadu_ps(&x[i]), av, _mm256_loadu_ps(&y[i])));
+#endif
+    for (; i < n; i++)
+        y[i] += a * x[i];
+}
+
+static void mulAddRows_F32(float *y, const float *x, const NnUint xStride, const float *a, const NnUint nRows, const NnUint n) {
+    // y += sum of a[r] * x[r * xStride], a slice of y stays in registers over all rows
+    NnUint i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16) {
+        float32x4_t y0 = vld1q_f32(&y[i]);
+        float32x4_t y1 = vld1q_f32(&y[i + 4]);
+        float32x4_t y2 = vld1q_f32(&y[i + 8]);
+        float32x4_t y3 = vld1q_f32(&y[i + 12]);
+        for (NnUint r = 0; r < nRows; r++) {
+            const float *xr = &x[r * xStride + i];
+            const float32x4_t av = vdupq_n_f32(a[r]);
+            y0 = vmlaq_f32(y0, vld1q_f32(&xr[0]), av);
+            y1 = vmlaq_f32(y1, vld1q_f32(&xr[4]), av);
+            y2 = vmlaq_f32(y2, vld1q_f32(&xr[8]), av);
+            y3 = vmlaq_f32(y3, vld1q_f32(&xr[12]), av);
+        }
+        vst1q_f32(&y[i], y0);
+        vst1q_f32(&y[i + 4], y1);
+        vst1q_f32(&y[i + 8], y2);
+        vst1q_f32(&y[i + 12], y3);
+    }
+#elif defined(__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        __m256 y0 = _mm256_loadu_ps(&y[i]);
+        __m256 y1 = _mm256_loadu_ps(&y[i + 8]);
+        __m256 y2 = _mm256_loadu_ps(&y[i + 16]);
+        __m256 y3 = _mm256_loadu_ps(&y[i + 24]);
+        for (NnUint r = 0; r < nRows; r++) {
+            const float *xr = &x[r * xStride + i];
+            const __m256 av = _mm256_set1_ps(a[r]);
+            y0 = _mm256_fmadd_ps(_mm256_loadu_ps(&xr[0]), av, y0);
+            y1 = _mm256_fmadd_ps(_mm256_loadu_ps(&xr[8]), av, y1);
+            y2 = _mm256_fmadd_ps(_mm256_loadu_ps(&xr[16]), av, y2);
+            y3 = _mm256_fmadd_ps(_mm256_loadu_ps(&xr[24]), av, y3);
+        }
+        _mm256_storeu_ps(&y[i], y0);
+        _mm256_storeu_ps(&y[i + 8], y1);
+        _mm256_storeu_ps(&y[i + 16], y2);
+        _mm256_storeu_ps(&y[i + 24], y3);
+    }
+#endif
+    for (; i < n; i++) {
+        float sum = y[i];
+        for (NnUint r = 0; r < nRows; r++)
+            sum += a[r] * x[r * xStride + i];
+        y[i] = sum;
+    }
+}
+
+static float expSub_F32(float *x, const float maxVal, const NnUint n) {
+    // x = exp(x - maxVal), returns the sum of x
+    NnUint i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    const float32x4_t maxv = vdupq_n_f32(maxVal);
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t val = expf_neon(vsubq_f32(vld1q_f32(&x[i]), maxv));
+        vst1q_f32(&x[i], val);
+        sumv = vaddq_f32(sumv, val);
+    }
+    sum = vaddvq_f32(sumv);
+#elif defined(__AVX2__)
+    const __m256 maxv = _mm256_set1_ps(maxVal);
+    __m256 sumv = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        const __m256 val = expf_avx2(_mm256_sub_ps(_mm256_loadu_ps(&x[i]), maxv));
+        _mm256_storeu_ps(&x[i], val);
+        sumv = _mm256_add_ps(sumv, val);
+    }
+    sum = horizontalSum_avx2(sumv);
+#endif
+    for (; i < n; i++) {
+        x[i] = expf(x[i] - maxVal);
+        sum += x[i];
+    }
+    return sum;
+}
+
+// Returns the rows <t0; t0 + nRows) of one head of the cache as F32 rows lying *stride apart.
+// The rows of an F32 cache are read in place, the rows of a quantized cache are widened into the tile
+static const float *loadKvTile_F32(float *tile, NnUint *stride, const NnByte *cache, const NnFloatType kvType,
+    const NnUint kvDim0, const NnUint headSize, const NnUint t0, const NnUint nRows)
+{
+    if (kvType == F_32) {
+        *stride = kvDim0;
+        return &((const float *)cache)[t0 * kvDim0];
+    }
+    const NnSize rowBytes = getBytes(kvType, kvDim0);
+    for (NnUint t = 0; t < nRows; t++) {
+        const NnByte *row = &cache[(t0 + t) * rowBytes];
+        float *y = &tile[t * headSize];
+        if (kvType == F_Q80) {
+            dequantizeQ80toF32((const NnBlockQ80 *)row, y, headSize, 1, 0);
+        } else {
+            std::memset(y, 0, headSize * sizeof(float));
+            mulAdd_F16(y, (const NnFp16 *)row, 1.0f, headSize);
+        }
+    }
+    *stride = headSize;
+    return tile;
+}
+
+static void multiheadAttFlashQueries_F32(
+    float *const *x, float *maxScores, float *sums, const float *const *q, const NnUint qStride, const NnUint *tEnds, const NnUint nQueries,
+    const NnByte *kvKc, const NnByte *kvVc, const NnFloatType kvType, const NnUint kvDim0, const NnUint headSize, const NnUint tStart, const NnUint tEnd)
+{
+    // Online softmax for several queries attending one KV head (query heads of a group, batches of a chunk),
+    // the query i attends <tStart; tEnds[i]) (causal mask). Every K and V tile is loaded once for all queries,
+    // the scores of a run of queries lying qStride apart are one small GEMM.
+    // The outputs are not normalized, they are weighted relative to maxScores and sum to sums
+    assert(nQueries <= ATT_FLASH_QUERIES);
+    assert(kvType == F_32 || headSize <= ATT_FLASH_MAX_HEAD_SIZE);
+    const float invHeadSizeRoot = 1.0f / sqrtf(headSize);
+    float scores[ATT_FLASH_QUERIES * ATT_FLASH_TILE];
+    // K and V of a quantized cache take turns in the tile, all scores of a tile are computed before V is read
+    float kvTile[ATT_FLASH_TILE * ATT_FLASH_MAX_HEAD_SIZE];
+
+    for (NnUint i = 0; i < nQueries; i++) {
+        std::memset(x[i], 0, headSize * sizeof(float));
+        maxScores[i] = -INFINITY;
+        sums[i] = 0.0f;
+    }
+
+    for (NnUint t0 = tStart; t0 < tEnd; t0 += ATT_FLASH_TILE) {
+        const NnUint tileLen = tEnd - t0 < ATT_FLASH_TILE ? tEnd - t0 : ATT_FLASH_TILE;
+        NnUint kStride;
+        const float *tileK = loadKvTile_F32(kvTile, &kStride, kvKc, kvType, kvDim0, headSize, t0, tileLen);
+
+        for (NnUint i0 = 0; i0 < nQueries;) {
+            NnUint i1 = i0 + 1;
+            while (i1 < nQueries && q[i1] == q[i1 - 1] + qStride)
+                i1++;
+            if (i1 - i0 < ATT_FLASH_GEMM_QUERIES ||
+                !llamafile_sgemm(tileLen, i1 - i0, headSize, tileK, kStride, q[i0], qStride, &scores[i0 * ATT_FLASH_TILE], ATT_FLASH_TILE,
+                    0, 1, 0, F_32, F_32, F_32)) {
+                for (NnUint i = i0; i < i1; i++)
+                    for (NnUint t = 0; t < tileLen; t++)
+                        scores[i * ATT_FLASH_TILE + t] = dotProduct_F32(q[i], &tileK[t * kStride], headSize);
+            }
+            i0 = i1;
+        }
+
+        NnUint vStride;
+        const float *tileV = loadKvTile_F32(kvTile, &vStride, kvVc, kvType, kvDim0, headSize, t0, tileLen);
+
+        for (NnUint i = 0; i < nQueries; i++) {
+            if (tEnds[i] <= t0)
+                continue;
+            const NnUint len = tEnds[i] - t0 < tileLen ? tEnds[i] - t0 : tileLen;
+            float *qScores = &scores[i * ATT_FLASH_TILE];
+            scale_F32(qScores, invHeadSizeRoot, len);
+
+            float tileMax = maxScores[i];
+            for (NnUint t = 0; t < len; t++)
+                tileMax = fmaxf(tileMax, qScores[t]);
+            if (tileMax > maxScores[i]) {
+                if (sums[i] > 0.0f) {
+                    const float correction = expf(maxScores[i] - tileMax);
+                    sums[i] *= correction;
+                    scale_F32(x[i], correction, headSize);
+                }
+                maxScores[i] = tileMax;
+            }
+
+            sums[i] += expSub_F32(qScores, maxScores[i], len);
+            mulAddRows_F32(x[i], tileV, vStride, qScores, len, headSize);
+        }
+    }
+}
+
+static inline NnUint getFlashAttSpans(const NnUint pos) {
+    return pos / ATT_FLASH_SPAN + 1;
+}
+
+static NnUint getMaxPosition(const float *positions, const NnUint nBatches) {
+    NnUint maxPos = 0;
+    for (NnUint batchIndex = 0; batchIndex < nBatches; batchIndex++) {
+        const NnUint pos = (NnUint)positions[batchIndex];
+        if (pos > maxPos)
+            maxPos = pos;
+    }
+    return maxPos;
+}
+
+static void mergeFlashAttSpans_F32(float *x, const float *partials, const NnUint nSpans, const NnUint nStoredSpans, const NnUint nHeads0, const NnUint headSize) {
+    // Merges the first nSpans of nStoredSpans spans
+    const float *spanX = partials;
+    const float *spanMax = &partials[nStoredSpans * nHeads0 * headSize];
+    const float *spanSum = &spanMax[nStoredSpans * nHeads0];
+
+    for (NnUint h0 = 0; h0 < nHeads0; h0++) {
+        float maxScore = -INFINITY;
+        for (NnUint span = 0; span < nSpans; span++)
+            maxScore = fmaxf(maxScore, spanMax[span * nHeads0 + h0]);
+
+        float *hX = &x[h0 * headSize];
+        std::memset(hX, 0, headSize * sizeof(float));
+        float sum = 0.0f;
+        for (NnUint span = 0; span < nSpans; span++) {
+            const float weight = expf(spanMax[span * nHeads0 + h0] - maxScore);
+            sum += spanSum[span * nHeads0 + h0] * weight;
+            mulAdd_F32(hX, &spanX[(span * nHeads0 + h0) * headSize], weight, headSize);
+        }
+        scale_F32(hX, 1.0f / sum, headSize);
+    }
+}
+
+static void multiheadAttFlashItems_F32(
+    float *const *x, const float *query, float *partials, const NnByte *keyCache, const NnByte *valueCache, const NnFloatType kvType, const float *positions,
+    const NnUint nBatches, const NnUint qSliceD0, const NnUint partialsStride,
+    const NnUint nHeads, const NnUint nHeads0, const NnUint nKvHeads, const NnUint kvDim0, const NnUint headSize,
+    NnCpuChunkCounter *counter, const NnUint itemStart, const NnUint itemEnd)
+{
+    // An item is one span of the sequence for one KV head, all query heads sharing it and all batches.
+    // With more than one span every item stores its partial softmax, the thread finishing the last item merges them
+    const NnUint kvMul = nHeads / nKvHeads;
+    const NnUint nKvHeads0 = nHeads0 / kvMul;
+    const NnUint nSpans = getFlashAttSpans(getMaxPosition(positions, nBatches));
+    const NnUint nItems = nKvHeads0 * nSpans;
+    const NnSize headBytes = getBytes(kvType, headSize);
+
+    const NnUint nQueries = nBatches * kvMul;
+    float *queryX[ATT_FLASH_QUERIES];
+    const float *queryQ[ATT_FLASH_QUERIES];
+    float queryMax[ATT_FLASH_QUERIES];
+    float querySum[ATT_FLASH_QUERIES];
+    NnUint queryEnds[ATT_FLASH_QUERIES];
+
+    for (NnUint item = itemStart; item < itemEnd; item++) {
+        const NnUint kvHead0 = item % nKvHeads0;
+        const NnUint span = item / nKvHeads0;
+        const NnUint tStart = span * ATT_FLASH_SPAN;
+        const NnByte *kvKc = &keyCache[kvHead0 * headBytes];
+        const NnByte *kvVc = &valueCache[kvHead0 * headBytes];
+
+        // The query j is the head kvHead0 * kvMul + j / nBatches of the batch j % nBatches. A decoded token
+        // scores the heads of the group in one run, a prefill chunk scores the batches of every head in one run
+        for (NnUint j0 = 0; j0 < nQueries; j0 += ATT_FLASH_QUERIES) {
+            const NnUint nBlockQueries = nQueries - j0 < ATT_FLASH_QUERIES ? nQueries - j0 : ATT_FLASH_QUERIES;
+            NnUint tEnd = tStart;
+            for (NnUint i = 0; i < nBlockQueries; i++) {
+                const NnUint batchIndex = (j0 + i) % nBatches;
+                const NnUint h0 = kvHead0 * kvMul + (j0 + i) / nBatches;
+                const NnUint pos = (NnUint)positions[batchIndex];
+                queryEnds[i] = tStart + ATT_FLASH_SPAN <= pos + 1 ? tStart + ATT_FLASH_SPAN : pos + 1;
+                if (queryEnds[i] > tEnd)
+                    tEnd = queryEnds[i];
+                queryQ[i] = &query[batchIndex * qSliceD0 + h0 * headSize];
+                queryX[i] = nSpans == 1
+                    ? &x[batchIndex][h0 * headSize]
+                    : &partials[batchIndex * partialsStride + (span * nHeads0 + h0) * headSize];
             }
+            if (tEnd == tStart)
+                continue;
+
+            multiheadAttFlashQueries_F32(queryX, queryMax, querySum, queryQ, nBatches > 1 ? qSliceD0 : headSize, queryEnds, nBlockQueries,
+                kvKc, kvVc, kvType, kvDim0, headSize, tStart, tEnd);
+
+            for (NnUint i = 0; i < nBlockQueries; i++) {
+                if (nSpans == 1) {
+                    scale_F32(queryX[i], 1.0f / querySum[i], headSize);
+                } else if (queryEnds[i] > tStart) {
+                    const NnUint batchIndex = (j0 + i) % nBatches;
+                    const NnUint h0 = kvHead0 * kvMul + (j0 + i) / nBatches;
+                    float *spanMax = &partials[batchIndex * partialsStride + nSpans * nHeads0 * headSize];
+                    spanMax[span * nHeads0 + h0] = queryMax[i];
+                    spanMax[(nSpans + span) * nHeads0 + h0] = querySum[i];
+                }
+            }
+        }
+
+        if (nSpans > 1 && completeChunk(counter, nItems)) {
+            for (NnUint batchIndex = 0; batchIndex < nBatches; batchIndex++)
+                mergeFlashAttSpans_F32(x[batchIndex], &partials[batchIndex * partialsStride],
+                    getFlashAttSpans((NnUint)positions[batchIndex]), nSpans, nHeads0, headSize);
         }
     }
 }
@@ -806,20 +2470,219 @@ static void mul_F32(float *y, const float *x, const float *m, const NnUint n, co
         _mm256_storeu_ps(&y[i], res_vec);
     }
 #endif
-    for (; i < end; i++)
-        y[i] = x[i] * m[i];
+    for (; i < end; i++)
+        y[i] = x[i] * m[i];
+}
+
+static void mul_Q80_F32(float *y, const float *x, const NnBlockQ80 *m, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+    for (NnUint i = start; i < end; i++) {
+        const NnBlockQ80 *b = &m[i];
+        float d = CONVERT_F16_TO_F32(b->d);
+        for (NnUint j = 0; j < Q80_BLOCK_SIZE; j++) {
+            NnUint k = i * Q80_BLOCK_SIZE + j;
+            y[k] = x[k] * d * b->qs[j];
+        }
+    }
+}
+
+// x += all slices of input, returns the sum of squares of the new x. The slices are sliceSize apart,
+// n <= sliceSize columns are merged, so a thread may merge its own columns of a row
+static float mergeAddSquares_F32(float *x, const float *input, const NnUint nSlices, const NnUint sliceSize, const NnUint n) {
+    NnUint i = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t fs = vmovq_n_f32(0);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vld1q_f32(&x[i]);
+        for (NnUint s = 0; s < nSlices; s++)
+            v = vaddq_f32(v, vld1q_f32(&input[s * sliceSize + i]));
+        vst1q_f32(&x[i], v);
+        fs = vmlaq_f32(fs, v, v);
+    }
+    sum = vaddvq_f32(fs);
+#elif defined(__AVX2__)
+    __m256 u = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(&x[i]);
+        for (NnUint s = 0; s < nSlices; s++)
+            v = _mm256_add_ps(v, _mm256_loadu_ps(&input[s * sliceSize + i]));
+        _mm256_storeu_ps(&x[i], v);
+        u = _mm256_fmadd_ps(v, v, u);
+    }
+    sum = horizontalSum_avx2(u);
+#endif
+    for (; i < n; i++) {
+        float v = x[i];
+        for (NnUint s = 0; s < nSlices; s++)
+            v += input[s * sliceSize + i];
+        x[i] = v;
+        sum += v * v;
+    }
+    return sum;
+}
+
+static float mergeAddSquares_Q80_F32(float *x, const NnBlockQ80 *input, const NnUint nSlices, const NnUint sliceSize, const NnUint n) {
+    assert(n % Q80_BLOCK_SIZE == 0);
+    assert(sliceSize % Q80_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+    const NnUint sliceBlocks = sliceSize / Q80_BLOCK_SIZE;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t fs = vmovq_n_f32(0);
+    for (NnUint b = 0; b < nBlocks; b++) {
+        for (NnUint j = 0; j < Q80_BLOCK_SIZE; j += 8) {
+            float *xp = &x[b * Q80_BLOCK_SIZE + j];
+            float32x4_t v0 = vld1q_f32(xp);
+            float32x4_t v1 = vld1q_f32(xp + 4);
+            for (NnUint s = 0; s < nSlices; s++) {
+                const NnBlockQ80 *block = &input[s * sliceBlocks + b];
+                const float d = CONVERT_F16_TO_F32(block->d);
+                const int16x8_t q16 = vmovl_s8(vld1_s8(block->qs + j));
+                v0 = vmlaq_n_f32(v0, vcvtq_f32_s32(vmovl_s16(vget_low_s16(q16))), d);
+                v1 = vmlaq_n_f32(v1, vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16))), d);
+            }
+            vst1q_f32(xp, v0);
+            vst1q_f32(xp + 4, v1);
+            fs = vmlaq_f32(fs, v0, v0);
+            fs = vmlaq_f32(fs, v1, v1);
+        }
+    }
+    sum = vaddvq_f32(fs);
+#elif defined(__AVX2__)
+    __m256 u = _mm256_setzero_ps();
+    for (NnUint b = 0; b < nBlocks; b++) {
+        for (NnUint j = 0; j < Q80_BLOCK_SIZE; j += 8) {
+            float *xp = &x[b * Q80_BLOCK_SIZE + j];
+            __m256 v = _mm256_loadu_ps(xp);
+            for (NnUint s = 0; s < nSlices; s++) {
+                const NnBlockQ80 *block = &input[s * sliceBlocks + b];
+                const __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(block->qs + j))));
+                v = _mm256_add_ps(v, _mm256_mul_ps(q, _mm256_set1_ps(CONVERT_F16_TO_F32(block->d))));
+            }
+            _mm256_storeu_ps(xp, v);
+            u = _mm256_fmadd_ps(v, v, u);
+        }
+    }
+    sum = horizontalSum_avx2(u);
+#else
+    for (NnUint b = 0; b < nBlocks; b++) {
+        for (NnUint j = 0; j < Q80_BLOCK_SIZE; j++) {
+            const NnUint k = b * Q80_BLOCK_SIZE + j;
+            float v = x[k];
+            for (NnUint s = 0; s < nSlices; s++) {
+                const NnBlockQ80 *block = &input[s * sliceBlocks + b];
+                v += CONVERT_F16_TO_F32(block->d) * block->qs[j];
+            }
+            x[k] = v;
+            sum += v * v;
+        }
+    }
+#endif
+    return sum;
+}
+
+static float mergeAddSquares_Q40_F32(float *x, const NnBlockQ40 *input, const NnUint nSlices, const NnUint sliceSize, const NnUint n) {
+    assert(n % Q40_BLOCK_SIZE == 0);
+    assert(sliceSize % Q40_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q40_BLOCK_SIZE;
+    const NnUint sliceBlocks = sliceSize / Q40_BLOCK_SIZE;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t fs = vmovq_n_f32(0);
+    for (NnUint b = 0; b < nBlocks; b++) {
+        float *xp = &x[b * Q40_BLOCK_SIZE];
+        float32x4_t v[8];
+        float32x4_t u[8];
+        for (NnUint j = 0; j < 8; j++)
+            v[j] = vld1q_f32(&xp[j * 4]);
+        for (NnUint s = 0; s < nSlices; s++) {
+            dequantizeQ40_neon(&input[s * sliceBlocks + b], u);
+            for (NnUint j = 0; j < 8; j++)
+                v[j] = vaddq_f32(v[j], u[j]);
+        }
+        for (NnUint j = 0; j < 8; j++) {
+            vst1q_f32(&xp[j * 4], v[j]);
+            fs = vmlaq_f32(fs, v[j], v[j]);
+        }
+    }
+    sum = vaddvq_f32(fs);
+#elif defined(__AVX2__)
+    __m256 fs = _mm256_setzero_ps();
+    for (NnUint b = 0; b < nBlocks; b++) {
+        float *xp = &x[b * Q40_BLOCK_SIZE];
+        __m256 v[4];
+        __m256 u[4];
+        for (NnUint j = 0; j < 4; j++)
+            v[j] = _mm256_loadu_ps(&xp[j * 8]);
+        for (NnUint s = 0; s < nSlices; s++) {
+            dequantizeQ40_avx2(&input[s * sliceBlocks + b], u);
+            for (NnUint j = 0; j < 4; j++)
+                v[j] = _mm256_add_ps(v[j], u[j]);
+        }
+        for (NnUint j = 0; j < 4; j++) {
+            _mm256_storeu_ps(&xp[j * 8], v[j]);
+            fs = _mm256_fmadd_ps(v[j], v[j], fs);
+        }
+    }
+    sum = horizontalSum_avx2(fs);
+#else
+    for (NnUint b = 0; b < nBlocks; b++) {
+        for (NnUint j = 0; j < Q40_BLOCK_SIZE / 2; j++) {
+            const NnUint k = b * Q40_BLOCK_SIZE + j;
+            float v0 = x[k];
+            float v1 = x[k + Q40_BLOCK_SIZE / 2];
+            for (NnUint s = 0; s < nSlices; s++) {
+                const NnBlockQ40 *block = &input[s * sliceBlocks + b];
+                const float d = CONVERT_F16_TO_F32(block->d);
+                v0 += ((block->qs[j] & 0x0F) - 8) * d;
+                v1 += ((block->qs[j] >> 4) - 8) * d;
+            }
+            x[k] = v0;
+            x[k + Q40_BLOCK_SIZE / 2] = v1;
+            sum += v0 * v0 + v1 * v1;
+        }
+    }
+#endif
+    return sum;
 }
 
-static void mul_Q80_F32(float *y, const float *x, const NnBlockQ80 *m, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+static void rmsNormQuantize_F32_Q80(NnBlockQ80 *output, float *y, const float *x, const float invRms, const float *w, const NnUint n) {
+    assert(n % Q80_BLOCK_SIZE == 0);
     const NnUint nBlocks = n / Q80_BLOCK_SIZE;
-    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
-    for (NnUint i = start; i < end; i++) {
-        const NnBlockQ80 *b = &m[i];
-        float d = CONVERT_F16_TO_F32(b->d);
-        for (NnUint j = 0; j < Q80_BLOCK_SIZE; j++) {
-            NnUint k = i * Q80_BLOCK_SIZE + j;
-            y[k] = x[k] * d * b->qs[j];
-        }
+    for (NnUint b = 0; b < nBlocks; b++) {
+        // The block is still in L1 when it is quantized
+        const NnUint k = b * Q80_BLOCK_SIZE;
+        rmsNorm_F32(&y[k], &x[k], invRms, &w[k], Q80_BLOCK_SIZE, 1, 0);
+        quantizeF32toQ80(&y[k], &output[b], Q80_BLOCK_SIZE, 1, 0);
+    }
+}
+
+// y = silu(x) * m
+static void siluMul_F32(float *y, const float *x, const float *m, const NnUint n) {
+    NnUint i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vld1q_f32(&x[i]);
+        float32x4_t denominator = vaddq_f32(expf_neon(vnegq_f32(v)), vdupq_n_f32(1.0f));
+        float32x4_t recip = vrecpeq_f32(denominator);
+        recip = vmulq_f32(recip, vsubq_f32(vdupq_n_f32(2.0f), vmulq_f32(denominator, recip)));
+        vst1q_f32(&y[i], vmulq_f32(vmulq_f32(v, recip), vld1q_f32(&m[i])));
+    }
+#elif defined(__AVX2__)
+    const __m256 ones = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(&x[i]);
+        __m256 denominator = _mm256_add_ps(ones, expf_avx2(_mm256_sub_ps(zero, v)));
+        __m256 silu = _mm256_div_ps(v, denominator);
+        _mm256_storeu_ps(&y[i], _mm256_mul_ps(silu, _mm256_loadu_ps(&m[i])));
+    }
+#endif
+    for (; i < n; i++) {
+        float v = x[i];
+        y[i] = (v / (1.0f + expf(-v))) * m[i];
     }
 }
 
@@ -871,6 +2734,26 @@ static void mergeAddForward_Q80_F32(NnUint nThreads, NnUint threadIndex, NnUint
     }
 }
 
+static void mergeAddForward_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    assert(context->inputSize.floatType == F_Q40);
+    assert(context->outputSize.floatType == F_32);
+
+    NnUint nSlices = context->inputSize.x / context->outputSize.x;
+    NnUint xSize = context->outputSize.x / Q40_BLOCK_SIZE;
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        float *output = (float *)context->output[batchIndex];
+        NnBlockQ40 *input = (NnBlockQ40 *)context->input[batchIndex];
+        for (NnUint sliceIndex = 0; sliceIndex < nSlices; sliceIndex++) {
+            add_Q40_F32(
+                output,
+                &input[sliceIndex * xSize],
+                context->outputSize.x,
+                nThreads,
+                threadIndex);
+        }
+    }
+}
+
 static void initEmbeddingForward(NnCpuOpContext *context) {
     ASSERT_EQ(context->inputSize.x, 1);
     ASSERT_EQ(context->inputSize.y, context->nBatches);
@@ -1020,38 +2903,132 @@ static void matmulForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUin
         return;
 
     const float *weight = (float *)context->weight;
-    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
-        float *input = (float *)context->input[batchIndex];
-        float *output = (float *)context->output[batchIndex];
-        DEBUG_VECTOR(context, "input", input);
-        matmul_F32_F32_F32(
-            output,
-            input,
-            weight,
-            context->weightSize.y,
-            context->weightSize.x,
-            nThreads,
-            threadIndex);
-        DEBUG_VECTOR(context, "output", output);
+    float **input = (float **)context->input;
+    float **output = (float **)context->output;
+    const NnUint n = context->weightSize.y;
+    const NnUint d = context->weightSize.x;
+    DEBUG_VECTOR(context, "input", input[0]);
+    if (context->splitMode == SPLIT_CHUNKED) {
+        const NnUint chunkSize = getChunkSize(d, nThreads);
+        NnUint start, end;
+        while (claimChunk(&context->chunkCounters[0], d, chunkSize, nThreads, &start, &end))
+            matmulBatchRows_F32_F32_F32(output, input, weight, n, batchSize, start, end);
+    } else {
+        SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+        matmulBatchRows_F32_F32_F32(output, input, weight, n, batchSize, start, end);
+    }
+    DEBUG_VECTOR(context, "output", output[0]);
+}
+
+// Multiplies the rows <start; end) of the weight of the op by all batches, a repacked weight needs whole tiles
+static void matmulBatchRowsOfOp_Q80_Q40_F32(float *const *output, const NnBlockQ80 *const *x, const NnCpuOpContext *context, const NnUint nBatches, const NnUint start, const NnUint end) {
+    const NnUint n = context->weightSize.y;
+#if defined(NN_Q40_REPACK)
+    if (context->weightRepack != nullptr) {
+        assert(start % Q40_TILE_ROWS == 0 && end % Q40_TILE_ROWS == 0);
+        matmulBatchTiles_Q80_Q40_F32(output, x, context->weight, n, context->weightSize.x, nBatches, start / Q40_TILE_ROWS, end / Q40_TILE_ROWS);
+        return;
     }
+#endif
+    matmulBatchRows_Q80_Q40_F32(output, x, (const NnBlockQ40 *)context->weight, n, nBatches, start, end);
 }
 
 static void matmulForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    // llamafile reads the weight only as it is stored in the model file
+    const bool isRepacked = context->weightRepack != nullptr;
+    if (!isRepacked && matmulForward_llamafile(nThreads, threadIndex, batchSize, context))
+        return;
+
+    NnBlockQ80 **input = (NnBlockQ80 **)context->input;
+    float **output = (float **)context->output;
+    const NnUint d = context->weightSize.x;
+    const NnUint rowUnit = isRepacked ? Q40_TILE_ROWS : 1;
+    const NnUint nUnits = d / rowUnit;
+    if (context->splitMode == SPLIT_CHUNKED) {
+        const NnUint chunkSize = getChunkSize(nUnits, nThreads);
+        NnUint start, end;
+        while (claimChunk(&context->chunkCounters[0], nUnits, chunkSize, nThreads, &start, &end))
+            matmulBatchRowsOfOp_Q80_Q40_F32(output, input, context, batchSize, start * rowUnit, end * rowUnit);
+    } else {
+        SPLIT_THREADS(start, end, nUnits, nThreads, threadIndex);
+        matmulBatchRowsOfOp_Q80_Q40_F32(output, input, context, batchSize, start * rowUnit, end * rowUnit);
+    }
+}
+
+static void matmulForward_Q80_Q80_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     if (matmulForward_llamafile(nThreads, threadIndex, batchSize, context))
         return;
 
-    const NnBlockQ40 *weight = (NnBlockQ40 *)context->weight;
-    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
-        NnBlockQ80 *input = (NnBlockQ80 *)context->input[batchIndex];
-        float *output = (float *)context->output[batchIndex];
-        matmul_Q80_Q40_F32(
-            output,
-            input,
-            weight,
-            context->weightSize.y,
-            context->weightSize.x,
-            nThreads,
-            threadIndex);
+    const NnBlockQ80 *weight = (NnBlockQ80 *)context->weight;
+    NnBlockQ80 **input = (NnBlockQ80 **)context->input;
+    float **output = (float **)context->output;
+    const NnUint n = context->weightSize.y;
+    const NnUint d = context->weightSize.x;
+    if (context->splitMode == SPLIT_CHUNKED) {
+        const NnUint chunkSize = getChunkSize(d, nThreads);
+        NnUint start, end;
+        while (claimChunk(&context->chunkCounters[0], d, chunkSize, nThreads, &start, &end))
+            matmulBatchRows_Q80_Q80_F32(output, input, weight, n, batchSize, start, end);
+    } else {
+        SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+        matmulBatchRows_Q80_Q80_F32(output, input, weight, n, batchSize, start, end);
+    }
+}
+
+// llamafile has no kernels for the super-block formats
+template <typename TBlock, void (*matmulRows)(float *, const NnBlockQ80 *, const TBlock *, const NnUint, const NnUint, const NnUint)>
+static void matmulForwardT_Q80_QK_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    const TBlock *weight = (TBlock *)context->weight;
+    NnBlockQ80 **input = (NnBlockQ80 **)context->input;
+    float **output = (float **)context->output;
+    const NnUint n = context->weightSize.y;
+    const NnUint d = context->weightSize.x;
+    if (context->splitMode == SPLIT_CHUNKED) {
+        const NnUint chunkSize = getChunkSize(d, nThreads);
+        NnUint start, end;
+        while (claimChunk(&context->chunkCounters[0], d, chunkSize, nThreads, &start, &end))
+            matmulBatchRowGroupsT_Q80_QK_F32<TBlock, matmulRows>(output, input, weight, n, batchSize, start, end);
+    } else {
+        SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+        matmulBatchRowGroupsT_Q80_QK_F32<TBlock, matmulRows>(output, input, weight, n, batchSize, start, end);
+    }
+}
+
+static void matmulForward_F32_F16_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    if (matmulForward_llamafile(nThreads, threadIndex, batchSize, context))
+        return;
+
+    const NnFp16 *weight = (NnFp16 *)context->weight;
+    float **input = (float **)context->input;
+    float **output = (float **)context->output;
+    const NnUint n = context->weightSize.y;
+    const NnUint d = context->weightSize.x;
+    if (context->splitMode == SPLIT_CHUNKED) {
+        const NnUint chunkSize = getChunkSize(d, nThreads);
+        NnUint start, end;
+        while (claimChunk(&context->chunkCounters[0], d, chunkSize, nThreads, &start, &end))
+            matmulBatchRows_F32_F16_F32(output, input, weight, n, batchSize, start, end);
+    } else {
+        SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+        matmulBatchRows_F32_F16_F32(output, input, weight, n, batchSize, start, end);
+    }
+}
+
+static void matmulForward_Q80_F16_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    // llamafile has no kernel for F16 weights with Q80 inputs
+    const NnFp16 *weight = (NnFp16 *)context->weight;
+    NnBlockQ80 **input = (NnBlockQ80 **)context->input;
+    float **output = (float **)context->output;
+    const NnUint n = context->weightSize.y;
+    const NnUint d = context->weightSize.x;
+    if (context->splitMode == SPLIT_CHUNKED) {
+        const NnUint chunkSize = getChunkSize(d, nThreads);
+        NnUint start, end;
+        while (claimChunk(&context->chunkCounters[0], d, chunkSize, nThreads, &start, &end))
+            matmulBatchRows_Q80_F16_F32(output, input, weight, n, batchSize, start, end);
+    } else {
+        SPLIT_THREADS(start, end, d, nThreads, threadIndex);
+        matmulBatchRows_Q80_F16_F32(output, input, weight, n, batchSize, start, end);
     }
 }
 
@@ -1077,8 +3054,7 @@ static void geluForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint
     }
 }
 
-static void initRopeLlama3Forward(NnCpuOpContext *context) {
-    const NnRopeLlamaOpConfig *config = (NnRopeLlamaOpConfig *)context->opConfig;
+static void initRopeLlama3Cache(NnCpuOpContext *context, const NnRopeLlamaOpConfig *config) {
     if (context->bufferFlags[config->ropeCacheBufferIndex] == 1)
         return;
     context->bufferFlags[config->ropeCacheBufferIndex] = 1;
@@ -1087,6 +3063,10 @@ static void initRopeLlama3Forward(NnCpuOpContext *context) {
     fullfillRopeLlama3Cache(config, cache);
 }
 
+static void initRopeLlama3Forward(NnCpuOpContext *context) {
+    initRopeLlama3Cache(context, (NnRopeLlamaOpConfig *)context->opConfig);
+}
+
 static void ropeLlamaForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     const NnRopeLlamaOpConfig *config = (NnRopeLlamaOpConfig *)context->opConfig;
     const NnRopeSlice *slice = &config->slice;
@@ -1103,19 +3083,105 @@ static void ropeLlamaForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint
     for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
         float *x = (float *)context->input[batchIndex];
         const NnUint pos = (NnUint)positions[batchIndex];
-        const float *posCache = &cache[pos * slice->sliceDim + shift];
+        rope_F32(x, &cache[pos * slice->sliceDim + shift], iStart, iEnd);
+    }
+}
+
+static void initMatmulRopeForward(NnCpuOpContext *context) {
+    const NnMatmulRopeOpConfig *config = (NnMatmulRopeOpConfig *)context->opConfig;
+    const NnRopeSlice *slice = &config->rope.slice;
+    const NnUint dim0 = config->rope.isQ ? slice->qDim0 : slice->kvDim0;
+    initMatmulForward(context);
+    ASSERT_EQ(context->outputSize.x, dim0);
+    if (config->hasShift) {
+        NnSize2D *shiftSize = &context->bufferConfigs[config->shiftBufferIndex].size;
+        assert(shiftSize->floatType == F_32 || shiftSize->floatType == F_16 || shiftSize->floatType == F_Q80);
+        ASSERT_EQ(shiftSize->y, slice->seqLen);
+        ASSERT_EQ(shiftSize->x, context->outputSize.x);
+        ASSERT_EQ(shiftSize->x % (NnUint)getBlockSize(shiftSize->floatType), 0);
+    }
+    initRopeLlama3Cache(context, &config->rope);
+}
+
+// Rope rotates pairs of rows and a Q80 shift buffer is quantized in whole blocks, so the rows of the op are
+// split in units of the returned size, a multiple of minUnit that never splits a pair or a block between threads
+static NnUint getMatmulRopeRowUnit(const NnCpuOpContext *context, const NnUint minUnit) {
+    const NnMatmulRopeOpConfig *config = (NnMatmulRopeOpConfig *)context->opConfig;
+    assert(minUnit % 2 == 0 && Q80_BLOCK_SIZE % minUnit == 0);
+    if (config->hasShift && context->bufferConfigs[config->shiftBufferIndex].size.floatType == F_Q80)
+        return Q80_BLOCK_SIZE;
+    return minUnit;
+}
+
+// Rotates the rows <start; end) of all batches just computed by the matmul, and writes them into the shift buffer
+static void matmulRopeRows_F32(float *const *output, const NnUint d, const NnUint batchSize, const NnUint start, const NnUint end, NnCpuOpContext *context) {
+    const NnMatmulRopeOpConfig *config = (NnMatmulRopeOpConfig *)context->opConfig;
+    const NnRopeSlice *slice = &config->rope.slice;
+    const NnUint shift = config->rope.isQ ? slice->qShift : 0;
+    const float *cache = (float *)context->buffers[config->rope.ropeCacheBufferIndex];
+    const float *positions = (float *)context->pipes[config->rope.positionPipeIndex];
+    NnByte *shiftBuffer = config->hasShift ? context->buffers[config->shiftBufferIndex] : nullptr;
+    const NnFloatType shiftType = config->hasShift ? context->bufferConfigs[config->shiftBufferIndex].size.floatType : F_32;
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        float *y = output[batchIndex];
+        const NnUint pos = (NnUint)positions[batchIndex];
+        rope_F32(y, &cache[pos * slice->sliceDim + shift], start, end);
+        if (shiftBuffer == nullptr)
+            continue;
+        const NnSize offset = (NnSize)pos * d + start;
+        if (shiftType == F_Q80) {
+            quantizeF32toQ80(&y[start], &((NnBlockQ80 *)shiftBuffer)[offset / Q80_BLOCK_SIZE], end - start, 1, 0);
+        } else if (shiftType == F_16) {
+            NnFp16 *row = &((NnFp16 *)shiftBuffer)[offset];
+            for (NnUint i = start; i < end; i++)
+                row[i - start] = CONVERT_F32_TO_F16(y[i]);
+        } else {
+            std::memcpy(&((float *)shiftBuffer)[offset], &y[start], (end - start) * sizeof(float));
+        }
+    }
+}
 
-        for (NnUint i = iStart; i < iEnd; i += 2) {
-            const float fcr = posCache[i];
-            const float fci = posCache[i + 1];
-            const float v0 = x[i];
-            const float v1 = x[i + 1];
+static void matmulRopeForward_F32_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    const float *weight = (float *)context->weight;
+    float **input = (float **)context->input;
+    float **output = (float **)context->output;
+    const NnUint n = context->weightSize.y;
+    const NnUint d = context->weightSize.x;
+    const NnUint rowUnit = getMatmulRopeRowUnit(context, 2);
+    const NnUint nUnits = d / rowUnit;
+    if (context->splitMode == SPLIT_CHUNKED) {
+        const NnUint chunkSize = getChunkSize(nUnits, nThreads);
+        NnUint s, e;
+        while (claimChunk(&context->chunkCounters[0], nUnits, chunkSize, nThreads, &s, &e)) {
+            matmulBatchRows_F32_F32_F32(output, input, weight, n, batchSize, s * rowUnit, e * rowUnit);
+            matmulRopeRows_F32(output, d, batchSize, s * rowUnit, e * rowUnit, context);
+        }
+    } else {
+        SPLIT_THREADS(s, e, nUnits, nThreads, threadIndex);
+        matmulBatchRows_F32_F32_F32(output, input, weight, n, batchSize, s * rowUnit, e * rowUnit);
+        matmulRopeRows_F32(output, d, batchSize, s * rowUnit, e * rowUnit, context);
+    }
+}
 
-            float x0 = v0 * fcr - v1 * fci;
-            float x1 = v0 * fci + v1 * fcr;
-            x[i] = x0;
-            x[i + 1] = x1;
+static void matmulRopeForward_Q80_Q40_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    NnBlockQ80 **input = (NnBlockQ80 **)context->input;
+    float **output = (float **)context->output;
+    const NnUint d = context->weightSize.x;
+    // A tile of a repacked weight is never split either
+    const NnUint rowUnit = getMatmulRopeRowUnit(context, context->weightRepack != nullptr ? Q40_TILE_ROWS : 2);
+    const NnUint nUnits = d / rowUnit;
+    if (context->splitMode == SPLIT_CHUNKED) {
+        const NnUint chunkSize = getChunkSize(nUnits, nThreads);
+        NnUint s, e;
+        while (claimChunk(&context->chunkCounters[0], nUnits, chunkSize, nThreads, &s, &e)) {
+            matmulBatchRowsOfOp_Q80_Q40_F32(output, input, context, batchSize, s * rowUnit, e * rowUnit);
+            matmulRopeRows_F32(output, d, batchSize, s * rowUnit, e * rowUnit, context);
         }
+    } else {
+        SPLIT_THREADS(s, e, nUnits, nThreads, threadIndex);
+        matmulBatchRowsOfOp_Q80_Q40_F32(output, input, context, batchSize, s * rowUnit, e * rowUnit);
+        matmulRopeRows_F32(output, d, batchSize, s * rowUnit, e * rowUnit, context);
     }
 }
 
@@ -1130,17 +3196,49 @@ static void initMultiHeadAttForward(NnCpuOpContext *context) {
     NnSize2D *posSize = &context->pipeConfigs[config->positionPipeIndex].size;
     ASSERT_EQ(posSize->x, 1);
     ASSERT_EQ(posSize->y, context->nBatches);
+    const NnFloatType kvType = context->bufferConfigs[config->keyCacheBufferIndex].size.floatType;
+    ASSERT_EQ(context->bufferConfigs[config->valueCacheBufferIndex].size.floatType, kvType);
+    assert(kvType == F_32 || kvType == F_16 || kvType == F_Q80);
+    // A head is read from its own blocks
+    ASSERT_EQ(config->headSize % (NnUint)getBlockSize(kvType), 0);
+    if (config->attentionType == ATT_FLASH && kvType != F_32)
+        assert(config->headSize <= ATT_FLASH_MAX_HEAD_SIZE);
 }
 
 static void multiHeadAttForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)context->opConfig;
 
     float *query = (float *)context->buffers[config->queryBufferIndex];
-    float *keyCache = (float *)context->buffers[config->keyCacheBufferIndex];
-    float *valueCache = (float *)context->buffers[config->valueCacheBufferIndex];
+    const NnByte *keyCache = context->buffers[config->keyCacheBufferIndex];
+    const NnByte *valueCache = context->buffers[config->valueCacheBufferIndex];
+    const NnFloatType kvType = context->bufferConfigs[config->keyCacheBufferIndex].size.floatType;
     float *att = (float *)context->buffers[config->attBufferIndex];
     const float *positions = (float *)context->pipes[config->positionPipeIndex];
 
+    if (config->attentionType == ATT_FLASH) {
+        // All batches at once, the queries of a prefill chunk share every K and V tile
+        assert(getMaxPosition(positions, batchSize) < config->seqLen);
+        const NnUint nKvHeads0 = config->nHeads0 / (config->nHeads / config->nKvHeads);
+        const NnUint nItems = nKvHeads0 * getFlashAttSpans(getMaxPosition(positions, batchSize));
+        const NnUint partialsStride = context->bufferConfigs[config->attBufferIndex].size.x;
+        if (context->splitMode == SPLIT_CHUNKED) {
+            NnUint itemStart, itemEnd;
+            while (claimChunk(&context->chunkCounters[0], nItems, 1, nThreads, &itemStart, &itemEnd))
+                multiheadAttFlashItems_F32((float *const *)context->input, query, att, keyCache, valueCache, kvType, positions,
+                    batchSize, config->qSliceD0, partialsStride,
+                    config->nHeads, config->nHeads0, config->nKvHeads, config->kvDim0, config->headSize,
+                    &context->chunkCounters[0], itemStart, itemEnd);
+        } else {
+            SPLIT_THREADS(itemStart, itemEnd, nItems, nThreads, threadIndex);
+            multiheadAttFlashItems_F32((float *const *)context->input, query, att, keyCache, valueCache, kvType, positions,
+                batchSize, config->qSliceD0, partialsStride,
+                config->nHeads, config->nHeads0, config->nKvHeads, config->kvDim0, config->headSize,
+                &context->chunkCounters[0], itemStart, itemEnd);
+        }
+        // The merge may still run on another thread, the output is complete after the op
+        return;
+    }
+
     for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
         float *i = (float *)context->input[batchIndex];
         float *q = &query[batchIndex * config->qSliceD0];
@@ -1150,11 +3248,19 @@ static void multiHeadAttForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnU
         DEBUG_VECTOR(context, "input", i);
         DEBUG_VECTOR(context, "q", q);
 
-        multiheadAtt_F32(i, q, 
-            &att[batchIndex * config->nHeads0 * config->seqLen],
-            keyCache, valueCache, pos,
-            config->nHeads, config->nHeads0,
-            config->nKvHeads, config->kvDim0, config->headSize, config->seqLen, nThreads, threadIndex);
+        float *bAtt = &att[batchIndex * config->nHeads0 * config->seqLen];
+        if (context->splitMode == SPLIT_CHUNKED) {
+            // One head per chunk, the cost of a head grows with the position
+            NnUint h0Start, h0End;
+            while (claimChunk(&context->chunkCounters[batchIndex], config->nHeads0, 1, nThreads, &h0Start, &h0End))
+                multiheadAttHeads_F32(i, q, bAtt, keyCache, valueCache, kvType, pos,
+                    config->nHeads, config->nKvHeads, config->kvDim0, config->headSize, config->seqLen, h0Start, h0End);
+        } else {
+            multiheadAtt_F32(i, q, bAtt,
+                keyCache, valueCache, kvType, pos,
+                config->nHeads, config->nHeads0,
+                config->nKvHeads, config->kvDim0, config->headSize, config->seqLen, nThreads, threadIndex);
+        }
 
         DEBUG_VECTOR(context, "output", i);
     }
@@ -1234,6 +3340,22 @@ static void castForward_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint batc
     }
 }
 
+static void castForward_F32_Q40(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.floatType, F_Q40);
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        float *input = (float *)context->input[batchIndex];
+        NnBlockQ40 *output = (NnBlockQ40 *)context->output[batchIndex];
+        quantizeF32toQ40(
+            input,
+            output,
+            context->outputSize.x,
+            nThreads,
+            threadIndex);
+    }
+}
+
 static void castForward_Q80_F32(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
     ASSERT_EQ(context->inputSize.floatType, F_Q80);
     ASSERT_EQ(context->outputSize.floatType, F_32);
@@ -1274,6 +3396,179 @@ static void shiftForward_F32_F32(NnUint nThreads, NnUint threadIndex, NnUint bat
     }
 }
 
+// A quantized KV cache is written row by row, the row of a position is converted when it is shifted in
+
+static void shiftForward_F32_F16(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->hasInputContinuousMemory, true);
+    ASSERT_EQ(context->hasOutputContinuousMemory, true);
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.floatType, F_16);
+    ASSERT_EQ(context->outputSize.y, 1);
+
+    const NnShiftOpCodeConfig *config = (NnShiftOpCodeConfig *)context->opConfig;
+    const float *indexes = (float *)context->pipes[config->indexPipeIndex];
+    const NnUint dim = context->inputSize.x;
+    NnFp16 *output = (NnFp16 *)context->output[0];
+    SPLIT_THREADS(start, end, dim, nThreads, threadIndex);
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        const NnSize index = (NnSize)indexes[batchIndex];
+        assert((index + 1) * dim <= context->outputSize.x);
+        const float *x = (float *)context->input[batchIndex];
+        NnFp16 *y = &output[index * dim];
+        for (NnUint i = start; i < end; i++)
+            y[i] = CONVERT_F32_TO_F16(x[i]);
+    }
+}
+
+static void shiftForward_F32_Q80(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    ASSERT_EQ(context->hasInputContinuousMemory, true);
+    ASSERT_EQ(context->hasOutputContinuousMemory, true);
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->outputSize.floatType, F_Q80);
+    ASSERT_EQ(context->outputSize.y, 1);
+
+    const NnShiftOpCodeConfig *config = (NnShiftOpCodeConfig *)context->opConfig;
+    const float *indexes = (float *)context->pipes[config->indexPipeIndex];
+    const NnUint dim = context->inputSize.x;
+    NnBlockQ80 *output = (NnBlockQ80 *)context->output[0];
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        const NnSize index = (NnSize)indexes[batchIndex];
+        assert((index + 1) * dim <= context->outputSize.x);
+        quantizeF32toQ80(
+            (float *)context->input[batchIndex],
+            &output[index * dim / Q80_BLOCK_SIZE],
+            dim,
+            nThreads,
+            threadIndex);
+    }
+}
+
+static void initMergeAddRmsNormForward(NnCpuOpContext *context) {
+    const NnMergeAddRmsNormOpConfig *config = (NnMergeAddRmsNormOpConfig *)context->opConfig;
+    NnBufferConfig *xConfig = &context->bufferConfigs[config->xBufferIndex];
+    NnBufferConfig *invRmsConfig = &context->bufferConfigs[config->invRmsBufferIndex];
+    NnBufferConfig *normConfig = &context->bufferConfigs[config->normBufferIndex];
+    ASSERT_EQ(context->inputSize.y, context->nBatches);
+    ASSERT_EQ(context->outputSize.y, context->nBatches);
+    ASSERT_EQ(context->weightSize.floatType, F_32);
+    ASSERT_EQ(context->weightSize.x, context->outputSize.x);
+    ASSERT_EQ(xConfig->size.floatType, F_32);
+    ASSERT_EQ(xConfig->size.x, context->outputSize.x);
+    ASSERT_EQ(invRmsConfig->size.floatType, F_32);
+    ASSERT_EQ(invRmsConfig->size.x, 1);
+    ASSERT_EQ(normConfig->size.floatType, F_32);
+    ASSERT_EQ(normConfig->size.x, context->outputSize.x);
+    ASSERT_EQ(context->inputSize.x % context->outputSize.x, 0);
+}
+
+// Merges this thread's columns of the row into x, returns their sum of squares
+static float mergeAddSquaresColumns(NnCpuOpContext *context, float *xRow, const NnUint batchIndex, const NnUint nSlices, const NnUint start, const NnUint end) {
+    const NnUint dim = context->outputSize.x;
+    if (context->inputSize.floatType == F_Q80)
+        return mergeAddSquares_Q80_F32(&xRow[start], &((NnBlockQ80 *)context->input[batchIndex])[start / Q80_BLOCK_SIZE], nSlices, dim, end - start);
+    if (context->inputSize.floatType == F_Q40)
+        return mergeAddSquares_Q40_F32(&xRow[start], &((NnBlockQ40 *)context->input[batchIndex])[start / Q40_BLOCK_SIZE], nSlices, dim, end - start);
+    return mergeAddSquares_F32(&xRow[start], &((float *)context->input[batchIndex])[start], nSlices, dim, end - start);
+}
+
+static void rmsNormColumns(NnCpuOpContext *context, float *normRow, const float *xRow, const float rms, const NnUint batchIndex, const NnUint start, const NnUint end) {
+    const float *weight = (float *)context->weight;
+    if (context->outputSize.floatType == F_Q80)
+        rmsNormQuantize_F32_Q80(&((NnBlockQ80 *)context->output[batchIndex])[start / Q80_BLOCK_SIZE], &normRow[start], &xRow[start], rms, &weight[start], end - start);
+    else
+        rmsNorm_F32(&normRow[start], &xRow[start], rms, &weight[start], end - start, 1, 0);
+}
+
+static void mergeAddRmsNormForward_ANY(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    const NnMergeAddRmsNormOpConfig *config = (NnMergeAddRmsNormOpConfig *)context->opConfig;
+    const NnUint dim = context->outputSize.x;
+    const NnUint nSlices = config->hasMergeAdd ? context->inputSize.x / dim : 0;
+    float *x = (float *)context->buffers[config->xBufferIndex];
+    float *invRms = (float *)context->buffers[config->invRmsBufferIndex];
+    float *norm = (float *)context->buffers[config->normBufferIndex];
+
+    if (batchSize >= nThreads) {
+        // A row needs only its own sum of squares, so threads split rows and need no barrier
+        SPLIT_THREADS(start, end, batchSize, nThreads, threadIndex);
+        for (NnUint batchIndex = start; batchIndex < end; batchIndex++) {
+            float *xRow = &x[batchIndex * dim];
+            float *normRow = &norm[batchIndex * dim];
+            const float sum = mergeAddSquaresColumns(context, xRow, batchIndex, nSlices, 0, dim);
+            const float rms = 1.0f / sqrtf(sum / dim + config->epsilon);
+            invRms[batchIndex] = rms;
+            rmsNormColumns(context, normRow, xRow, rms, batchIndex, 0, dim);
+            DEBUG_VECTOR(context, "output", normRow);
+        }
+        return;
+    }
+
+    // Fewer rows than threads (decode): threads split the columns of every row, each thread stores its
+    // partial sums of squares, and one barrier separates the merge from the normalization
+    const NnUint unitSize = dim % Q80_BLOCK_SIZE == 0 ? Q80_BLOCK_SIZE : 1;
+    SPLIT_THREADS(unitStart, unitEnd, dim / unitSize, nThreads, threadIndex);
+    const NnUint start = unitStart * unitSize;
+    const NnUint end = unitEnd * unitSize;
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        context->threadSums[batchIndex * nThreads + threadIndex] = start < end
+            ? mergeAddSquaresColumns(context, &x[batchIndex * dim], batchIndex, nSlices, start, end)
+            : 0.0f;
+    }
+    waitForThreads(&context->chunkCounters[0], nThreads);
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        // Every thread adds the partial sums in the same order, so all threads get the same rms
+        float sum = 0.0f;
+        for (NnUint i = 0; i < nThreads; i++)
+            sum += context->threadSums[batchIndex * nThreads + i];
+        const float rms = 1.0f / sqrtf(sum / dim + config->epsilon);
+        if (threadIndex == 0)
+            invRms[batchIndex] = rms;
+        if (start < end)
+            rmsNormColumns(context, &norm[batchIndex * dim], &x[batchIndex * dim], rms, batchIndex, start, end);
+    }
+}
+
+static void initSiluMulForward(NnCpuOpContext *context) {
+    const NnSiluMulOpConfig *config = (NnSiluMulOpConfig *)context->opConfig;
+    NnBufferConfig *multiplierConfig = &context->bufferConfigs[config->multiplierBufferIndex];
+    NnBufferConfig *activationConfig = &context->bufferConfigs[config->activationBufferIndex];
+    ASSERT_EQ(context->inputSize.floatType, F_32);
+    ASSERT_EQ(context->inputSize.x, context->outputSize.x);
+    ASSERT_EQ(context->inputSize.y, context->outputSize.y);
+    ASSERT_EQ(multiplierConfig->size.floatType, F_32);
+    ASSERT_EQ(multiplierConfig->size.x, context->outputSize.x);
+    ASSERT_EQ(activationConfig->size.floatType, F_32);
+    ASSERT_EQ(activationConfig->size.x, context->outputSize.x);
+}
+
+static void siluMulForward_F32_ANY(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context) {
+    const NnSiluMulOpConfig *config = (NnSiluMulOpConfig *)context->opConfig;
+    const NnUint dim = context->outputSize.x;
+    const float *multiplier = (float *)context->buffers[config->multiplierBufferIndex];
+    float *activation = (float *)context->buffers[config->activationBufferIndex];
+
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++) {
+        const float *input = (float *)context->input[batchIndex];
+        const float *m = &multiplier[batchIndex * dim];
+        float *a = &activation[batchIndex * dim];
+
+        if (context->outputSize.floatType == F_Q80) {
+            NnBlockQ80 *output = (NnBlockQ80 *)context->output[batchIndex];
+            SPLIT_THREADS(start, end, dim / Q80_BLOCK_SIZE, nThreads, threadIndex);
+            for (NnUint b = start; b < end; b++) {
+                const NnUint k = b * Q80_BLOCK_SIZE;
+                siluMul_F32(&a[k], &input[k], &m[k], Q80_BLOCK_SIZE);
+                quantizeF32toQ80(&a[k], &output[b], Q80_BLOCK_SIZE, 1, 0);
+            }
+        } else {
+            SPLIT_THREADS(start, end, dim, nThreads, threadIndex);
+            siluMul_F32(&a[start], &input[start], &m[start], end - start);
+        }
+    }
+}
+
 // device
 
 void printCpuInstructionSet() {
@@ -1287,15 +3582,30 @@ void printCpuInstructionSet() {
     printf(" fp16");
 #endif
 #endif
+#if defined(__SSE4_2__) && !defined(__AVX2__)
+    printf(" sse4.2");
+#endif
 #if defined(__AVX2__)
     printf(" avx2");
 #endif
 #if defined(__AVX512F__)
     printf(" avx512f");
+#endif
+#if defined(NN_AVX_VNNI)
+    if (hasAvxVnni())
+        printf(" avxvnni");
 #endif
     printf("\n");
 }
 
+#if !defined(NN_CPU_VARIANT)
+const char *splitModeToString(NnCpuSplitMode mode) {
+    if (mode == SPLIT_STATIC) return "static";
+    if (mode == SPLIT_CHUNKED) return "chunked";
+    return "unknown";
+}
+#endif
+
 NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType) {
     if (code == OP_EMBEDDING)
         return initEmbeddingForward;
@@ -1309,6 +3619,12 @@ NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType) {
         return initMatmulForward;
     if (code == OP_CAST)
         return initCastForward;
+    if (code == OP_MERGE_ADD_RMS_NORM)
+        return initMergeAddRmsNormForward;
+    if (code == OP_SILU_MUL)
+        return initSiluMulForward;
+    if (code == OP_MATMUL_ROPE)
+        return initMatmulRopeForward;
     return nullptr;
 }
 
@@ -1316,6 +3632,7 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     if (code == OP_MERGE_ADD) {
         if (quantType == F32_F32_F32) return mergeAddForward_F32_F32;
         if (quantType == Q80_Q80_F32) return mergeAddForward_Q80_F32;
+        if (quantType == Q40_Q40_F32) return mergeAddForward_Q40_F32;
     }
     if (code == OP_EMBEDDING) {
         if (quantType == F32_F32_F32) return embeddingForward_F32_F32_F32;
@@ -1331,6 +3648,12 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
     if (code == OP_MATMUL) {
         if (quantType == F32_F32_F32) return matmulForward_F32_F32_F32;
         if (quantType == Q80_Q40_F32) return matmulForward_Q80_Q40_F32;
+        if (quantType == Q80_Q80_F32) return matmulForward_Q80_Q80_F32;
+        if (quantType == Q80_Q4K_F32) return matmulForwardT_Q80_QK_F32<NnBlockQ4K, matmulRows_Q80_Q4K_F32>;
+        if (quantType == Q80_Q6K_F32) return matmulForwardT_Q80_QK_F32<NnBlockQ6K, matmulRows_Q80_Q6K_F32>;
+        if (quantType == Q80_Q2K_F32) return matmulForwardT_Q80_QK_F32<NnBlockQ2K, matmulRows_Q80_Q2K_F32>;
+        if (quantType == F32_F16_F32) return matmulForward_F32_F16_F32;
+        if (quantType == Q80_F16_F32) return matmulForward_Q80_F16_F32;
     }
     if (code == OP_ROPE_LLAMA) {
         if (quantType == F32_F32_F32) return ropeLlamaForward_F32_F32;
@@ -1353,9 +3676,157 @@ NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
         if (quantType == F32_F32_Q80) return castForward_F32_Q80;
         if (quantType == Q80_Q80_Q80) return castForward_ANY;
         if (quantType == Q80_Q80_F32) return castForward_Q80_F32;
+        if (quantType == F32_F32_Q40) return castForward_F32_Q40;
     }
     if (code == OP_SHIFT) {
         if (quantType == F32_F32_F32) return shiftForward_F32_F32;
+        if (quantType == F32_F32_F16) return shiftForward_F32_F16;
+        if (quantType == F32_F32_Q80) return shiftForward_F32_Q80;
+    }
+    if (code == OP_MERGE_ADD_RMS_NORM) {
+        if (quantType == F32_F32_F32) return mergeAddRmsNormForward_ANY;
+        if (quantType == F32_F32_Q80) return mergeAddRmsNormForward_ANY;
+        if (quantType == Q80_F32_F32) return mergeAddRmsNormForward_ANY;
+        if (quantType == Q80_F32_Q80) return mergeAddRmsNormForward_ANY;
+        if (quantType == Q40_F32_F32) return mergeAddRmsNormForward_ANY;
+        if (quantType == Q40_F32_Q80) return mergeAddRmsNormForward_ANY;
+    }
+    if (code == OP_SILU_MUL) {
+        if (quantType == F32_F32_F32) return siluMulForward_F32_ANY;
+        if (quantType == F32_F32_Q80) return siluMulForward_F32_ANY;
+    }
+    if (code == OP_MATMUL_ROPE) {
+        if (quantType == F32_F32_F32) return matmulRopeForward_F32_F32_F32;
+        if (quantType == Q80_Q40_F32) return matmulRopeForward_Q80_Q40_F32;
+    }
+    return nullptr;
+}
+
+NnCpuWeightRepack getCpuWeightRepack(NnOpCode code, NnOpQuantType quantType, NnSize2D weightSize) {
+#if defined(NN_Q40_REPACK)
+    if ((code == OP_MATMUL || code == OP_MATMUL_ROPE) && quantType == Q80_Q40_F32 && weightSize.x % Q40_TILE_ROWS == 0)
+        return repackWeight_Q40;
+#endif
+    return nullptr;
+}
+
+#if defined(NN_CPU_VARIANTS) && !defined(NN_CPU_VARIANT)
+#undef printCpuInstructionSet
+#undef getCpuOpForwardInit
+#undef getCpuOpForward
+#undef getCpuWeightRepack
+
+// dispatch
+
+typedef struct {
+    const char *name;
+    bool (*isSupported)();
+    void (*printInstructionSet)();
+    NnCpuOpForwardInit (*getOpForwardInit)(NnOpCode code, NnOpQuantType quantType);
+    NnCpuOpForward (*getOpForward)(NnOpCode code, NnOpQuantType quantType);
+    NnCpuWeightRepack (*getWeightRepack)(NnOpCode code, NnOpQuantType quantType, NnSize2D weightSize);
+} NnCpuVariant;
+
+#define DECLARE_CPU_VARIANT(variant) \
+    void printCpuInstructionSet_##variant(); \
+    NnCpuOpForwardInit getCpuOpForwardInit_##variant(NnOpCode code, NnOpQuantType quantType); \
+    NnCpuOpForward getCpuOpForward_##variant(NnOpCode code, NnOpQuantType quantType); \
+    NnCpuWeightRepack getCpuWeightRepack_##variant(NnOpCode code, NnOpQuantType quantType, NnSize2D weightSize);
+#define CPU_VARIANT(variant, isSupported) \
+    { #variant, isSupported, printCpuInstructionSet_##variant, getCpuOpForwardInit_##variant, getCpuOpForward_##variant, \
+      getCpuWeightRepack_##variant }
+
+static bool isBaseSupported() {
+    return true;
+}
+
+// The checks must cover every flag the Makefile compiles the variant with
+#if defined(__x86_64__) || defined(__i386__)
+DECLARE_CPU_VARIANT(avx512)
+DECLARE_CPU_VARIANT(avx2)
+DECLARE_CPU_VARIANT(sse4)
+
+static bool isAvx2Supported() {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+}
+
+static bool isAvx512Supported() {
+    return isAvx2Supported() &&
+        __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq");
+}
+
+static bool isSse4Supported() {
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static const NnCpuVariant cpuVariants[] = {
+    CPU_VARIANT(avx512, isAvx512Supported),
+    CPU_VARIANT(avx2, isAvx2Supported),
+    CPU_VARIANT(sse4, isSse4Supported),
+    CPU_VARIANT(base, isBaseSupported),
+};
+#elif defined(__aarch64__)
+DECLARE_CPU_VARIANT(dotprod)
+
+static bool isDotprodSupported() {
+#if defined(__linux__)
+    const unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_ASIMDDP) && (hwcap & HWCAP_FPHP) && (hwcap & HWCAP_ASIMDHP);
+#elif defined(__APPLE__)
+    int dotprod = 0;
+    int fp16 = 0;
+    size_t size = sizeof(int);
+    if (sysctlbyname("hw.optional.arm.FEAT_DotProd", &dotprod, &size, NULL, 0) != 0)
+        return false;
+    size = sizeof(int);
+    if (sysctlbyname("hw.optional.arm.FEAT_FP16", &fp16, &size, NULL, 0) != 0)
+        return false;
+    return dotprod == 1 && fp16 == 1;
+#else
+    return false;
+#endif
+}
+
+static const NnCpuVariant cpuVariants[] = {
+    CPU_VARIANT(dotprod, isDotprodSupported),
+    CPU_VARIANT(base, isBaseSupported),
+};
+#else
+static const NnCpuVariant cpuVariants[] = {
+    CPU_VARIANT(base, isBaseSupported),
+};
+#endif
+
+// The variants are ordered from the best one, the base variant runs everywhere
+static const NnCpuVariant *selectCpuVariant() {
+    for (const NnCpuVariant &variant : cpuVariants) {
+        if (variant.isSupported())
+            return &variant;
     }
     return nullptr;
 }
+
+static const NnCpuVariant *getCpuVariant() {
+    static const NnCpuVariant *variant = selectCpuVariant();
+    return variant;
+}
+
+void printCpuInstructionSet() {
+    const NnCpuVariant *variant = getCpuVariant();
+    variant->printInstructionSet();
+    printf("🧠 Kernels: %s variant\n", variant->name);
+}
+
+NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType) {
+    return getCpuVariant()->getOpForwardInit(code, quantType);
+}
+
+NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType) {
+    return getCpuVariant()->getOpForward(code, quantType);
+}
+
+NnCpuWeightRepack getCpuWeightRepack(NnOpCode code, NnOpQuantType quantType, NnSize2D weightSize) {
+    return getCpuVariant()->getWeightRepack(code, quantType, weightSize);
+}
+#endif
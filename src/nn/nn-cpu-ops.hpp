@@ -1,6 +1,7 @@
 #ifndef NN_CPU_OPS_H
 #define NN_CPU_OPS_H
 
+#include <atomic>
 #include "nn-core.hpp"
 
 #define ASSERT_EQ(a, b) \
@@ -9,6 +10,21 @@
         exit(-1); \
     }
 
+enum NnCpuSplitMode {
+    SPLIT_STATIC, // every thread gets an equal contiguous range of rows
+    SPLIT_CHUNKED, // threads claim small chunks of rows until the range is exhausted
+};
+
+typedef struct {
+    std::atomic_uint nextChunk;
+    std::atomic_uint nDoneThreads;
+    std::atomic_uint nComputedChunks;
+    std::atomic_uint generation; // bumped every time all threads pass waitForThreads
+} NnCpuChunkCounter;
+
+// Rewrites the weight of an op, as it is stored in the model file, into the layout the forward of the op reads
+typedef void (*NnCpuWeightRepack)(NnByte *output, const NnByte *weight, const NnSize2D *weightSize);
+
 typedef struct {
     const char *name;
     NnByte nBatches;
@@ -29,14 +45,30 @@ typedef struct {
 
     NnByte *weight;
     NnSize2D weightSize;
+    NnCpuWeightRepack weightRepack; // nullptr if the weight is kept as it was loaded
+
+    NnCpuSplitMode splitMode;
+    NnCpuChunkCounter *chunkCounters; // one per batch
+    float *threadSums; // nThreads partial sums per batch, nullptr if the op does not reduce a row across threads
 } NnCpuOpContext;
 
 typedef void (*NnCpuOpForwardInit)(NnCpuOpContext *context);
 typedef void (*NnCpuOpForward)(NnUint nThreads, NnUint threadIndex, NnUint batchSize, NnCpuOpContext *context);
 
+#if defined(NN_CPU_VARIANT)
+    #define printCpuInstructionSet NN_CPU_VARIANT_NAME(printCpuInstructionSet)
+    #define getCpuOpForwardInit NN_CPU_VARIANT_NAME(getCpuOpForwardInit)
+    #define getCpuOpForward NN_CPU_VARIANT_NAME(getCpuOpForward)
+    #define getCpuWeightRepack NN_CPU_VARIANT_NAME(getCpuWeightRepack)
+    #define softmax_F32 NN_CPU_VARIANT_NAME(softmax_F32)
+#endif
+
 void printCpuInstructionSet();
+const char *splitModeToString(NnCpuSplitMode mode);
 NnCpuOpForwardInit getCpuOpForwardInit(NnOpCode code, NnOpQuantType quantType);
 NnCpuOpForward getCpuOpForward(NnOpCode code, NnOpQuantType quantType);
+// Returns the repack of the weight the op reads faster on this CPU, or nullptr if the op reads the weight as it is stored
+NnCpuWeightRepack getCpuWeightRepack(NnOpCode code, NnOpQuantType quantType, NnSize2D weightSize);
 
 void softmax_F32(float *x, const NnUint size);
 
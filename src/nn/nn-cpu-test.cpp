@@ -1,7 +1,15 @@
 #include "nn-core.hpp"
 #include "nn-config-builder.hpp"
 #include "nn-cpu.hpp"
+#include "nn-topology.hpp"
+#include "nn-network.hpp"
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+#include <vector>
 
 #define DIM 32
 #define N_BATCHES 2
@@ -43,10 +51,652 @@ void print2D(const char *name, NnUint x, NnUint y, float *w) {
     }
 }
 
+void testBarrierElision(NnUint nThreads) {
+    // Multiple of 32 columns per thread, so the element split of silu matches the block split of the cast
+    const NnUint dim = 256;
+    NnNetConfigBuilder netBuilder(1, N_BATCHES);
+    NnNodeConfigBuilder nodeBuilder(0);
+    NnUint dBufferIndex = nodeBuilder.addBuffer("d", size2D(F_32, N_BATCHES, dim));
+    NnUint lBufferIndex = nodeBuilder.addBuffer("l", size2D(F_32, N_BATCHES, dim));
+    NnUint dqBufferIndex = nodeBuilder.addBuffer("dq", size2D(F_Q80, N_BATCHES, dim));
+    NnUint invRmsBufferIndex = nodeBuilder.addBuffer("inv_rms", size2D(F_32, N_BATCHES, 1));
+
+    // silu, mul and cast stay on the same columns of each thread, the inv_rms reads whole rows
+    NnSegmentConfigBuilder segmentBuilder;
+    segmentBuilder.addOp(OP_SILU, "silu", 0,
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        size0(),
+        NnSiluOpCodeConfig{});
+    segmentBuilder.addOp(OP_MUL, "mul", 0,
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        size0(),
+        NnMulOpCodeConfig{lBufferIndex});
+    segmentBuilder.addOp(OP_CAST, "cast", 0,
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, dqBufferIndex),
+        size0(),
+        NnCastOpCodeConfig{});
+    segmentBuilder.addOp(OP_INV_RMS, "inv_rms", 0,
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, invRmsBufferIndex),
+        size0(),
+        NnInvRmsOpConfig{1e-5f});
+    nodeBuilder.addSegment(segmentBuilder.build());
+
+    NnNetConfig netConfig = netBuilder.build();
+    NnNodeConfig nodeConfig = nodeBuilder.build();
+    NnNetExecution execution(nThreads, &netConfig);
+    NnCpuDevice device(&netConfig, &nodeConfig, &execution);
+    NnFakeNodeSynchronizer synchronizer;
+    NnExecutor executor(&netConfig, &nodeConfig, &device, &execution, &synchronizer, false);
+
+    float *d = (float *)device.buffers[dBufferIndex];
+    float *l = (float *)device.buffers[lBufferIndex];
+    std::vector<float> expected(N_BATCHES * dim);
+    for (NnUint i = 0; i < N_BATCHES * dim; i++) {
+        d[i] = 4.0f * sinf(i * 0.31f);
+        l[i] = cosf(i * 0.17f);
+        expected[i] = (d[i] / (1.0f + expf(-d[i]))) * l[i];
+    }
+
+    execution.setBatchSize(N_BATCHES);
+    executor.forward();
+
+    std::vector<float> dq(N_BATCHES * dim);
+    dequantizeQ80toF32((NnBlockQ80 *)device.buffers[dqBufferIndex], dq.data(), N_BATCHES * dim, 1, 0);
+    for (NnUint i = 0; i < N_BATCHES * dim; i++) {
+        if (fabsf(d[i] - expected[i]) > 0.00001f || fabsf(dq[i] - expected[i]) > 0.05f) {
+            printf("❌ barrierElision failed at %u: %f != %f\n", i, d[i], expected[i]);
+            exit(1);
+        }
+    }
+    ASSERT_EQ(executor.getNElidedBarriers(), 2);
+    ASSERT_EQ(executor.getNBarriers(), 2);
+    printf("✅ barrierElision passed (%u threads)\n", nThreads);
+
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+}
+
+static void assertPointer(const char *name, const NnPointerConfig *pointer, NnPointerSource source, NnUint pointerIndex) {
+    if (pointer->source != source || pointer->pointerIndex != pointerIndex || pointer->type != PNTR_BATCH) {
+        printf("❌ %s points to %d/%u, expected %d/%u\n", name, pointer->source, pointer->pointerIndex, source, pointerIndex);
+        exit(1);
+    }
+}
+
+void testFuseCpuOps() {
+    NnNetConfigBuilder netBuilder(1, N_BATCHES);
+    NnUint yPipeIndex = netBuilder.addPipe("Y", size2D(F_32, N_BATCHES, DIM));
+    NnUint posPipeIndex = netBuilder.addPipe("POS", size2D(F_32, N_BATCHES, 1));
+    NnNetConfig netConfig = netBuilder.build();
+
+    NnNodeConfigBuilder nodeBuilder(0);
+    NnUint xBufferIndex = nodeBuilder.addBuffer("x", size2D(F_32, N_BATCHES, DIM));
+    NnUint invRmsBufferIndex = nodeBuilder.addBuffer("inv_rms", size2D(F_32, N_BATCHES, 1));
+    NnUint normBufferIndex = nodeBuilder.addBuffer("norm", size2D(F_32, N_BATCHES, DIM));
+    NnUint normQBufferIndex = nodeBuilder.addBuffer("norm_q", size2D(F_Q80, N_BATCHES, DIM));
+    NnUint dBufferIndex = nodeBuilder.addBuffer("d", size2D(F_32, N_BATCHES, DIM));
+    NnUint lBufferIndex = nodeBuilder.addBuffer("l", size2D(F_32, N_BATCHES, DIM));
+    NnUint dqBufferIndex = nodeBuilder.addBuffer("dq", size2D(F_Q80, N_BATCHES, DIM));
+    NnUint kBufferIndex = nodeBuilder.addBuffer("k", size2D(F_32, N_BATCHES, DIM));
+    NnUint ropeCacheBufferIndex = nodeBuilder.addBuffer("rope_cache", size2D(F_32, 1, DIM));
+    NnUint keyCacheBufferIndex = nodeBuilder.addBuffer("key_cache", size2D(F_16, 4, DIM));
+
+    NnSegmentConfigBuilder segmentBuilder;
+    // merge_add -> inv_rms -> rms_norm -> cast
+    segmentBuilder.addOp(OP_MERGE_ADD, "merge_add", 0,
+        pointerBatchConfig(SRC_PIPE, yPipeIndex),
+        pointerBatchConfig(SRC_BUFFER, xBufferIndex),
+        size0(),
+        NnMergeAddOpCodeConfig{});
+    segmentBuilder.addOp(OP_INV_RMS, "inv_rms", 0,
+        pointerBatchConfig(SRC_BUFFER, xBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, invRmsBufferIndex),
+        size0(),
+        NnInvRmsOpConfig{1e-5f});
+    segmentBuilder.addOp(OP_RMS_NORM, "rms_norm", 0,
+        pointerBatchConfig(SRC_BUFFER, xBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, normBufferIndex),
+        size1D(F_32, DIM),
+        NnRmsNormOpConfig{invRmsBufferIndex});
+    segmentBuilder.addOp(OP_CAST, "cast_norm", 0,
+        pointerBatchConfig(SRC_BUFFER, normBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, normQBufferIndex),
+        size0(),
+        NnCastOpCodeConfig{});
+    // silu -> mul -> cast
+    segmentBuilder.addOp(OP_SILU, "silu", 0,
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        size0(),
+        NnSiluOpCodeConfig{});
+    segmentBuilder.addOp(OP_MUL, "mul", 0,
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        size0(),
+        NnMulOpCodeConfig{lBufferIndex});
+    segmentBuilder.addOp(OP_CAST, "cast_d", 0,
+        pointerBatchConfig(SRC_BUFFER, dBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, dqBufferIndex),
+        size0(),
+        NnCastOpCodeConfig{});
+    // matmul -> rope -> shift
+    segmentBuilder.addOp(OP_MATMUL, "matmul", 0,
+        pointerBatchConfig(SRC_BUFFER, dqBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, kBufferIndex),
+        size2D(F_Q40, DIM, DIM),
+        NnMatmulOpConfig{});
+    NnRopeLlamaOpConfig ropeConfig;
+    std::memset(&ropeConfig, 0, sizeof(ropeConfig));
+    ropeConfig.isQ = false;
+    ropeConfig.positionPipeIndex = posPipeIndex;
+    ropeConfig.ropeCacheBufferIndex = ropeCacheBufferIndex;
+    segmentBuilder.addOp(OP_ROPE_LLAMA, "rope", 0,
+        pointerBatchConfig(SRC_BUFFER, kBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, kBufferIndex),
+        size0(),
+        ropeConfig);
+    segmentBuilder.addOp(OP_SHIFT, "shift", 0,
+        pointerBatchConfig(SRC_BUFFER, kBufferIndex),
+        pointerRawConfig(SRC_BUFFER, keyCacheBufferIndex),
+        size0(),
+        NnShiftOpCodeConfig{posPipeIndex});
+    // A lone inv_rms has nothing to fuse with
+    segmentBuilder.addOp(OP_INV_RMS, "inv_rms_final", 0,
+        pointerBatchConfig(SRC_BUFFER, xBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, invRmsBufferIndex),
+        size0(),
+        NnInvRmsOpConfig{1e-6f});
+    nodeBuilder.addSegment(segmentBuilder.build());
+    NnNodeConfig nodeConfig = nodeBuilder.build();
+
+    NnSegmentConfig *segment = &nodeConfig.segments[0];
+    // The fused ops take over the names of the weighted ops, the other names and all configs are freed
+    const char *rmsNormName = segment->ops[2].name;
+    const char *siluName = segment->ops[4].name;
+    const char *matmulName = segment->ops[7].name;
+    NnByte *lastConfig = segment->ops[10].config;
+
+    ASSERT_EQ(fuseCpuOps(&nodeConfig), 7);
+    ASSERT_EQ(segment->nOps, 4);
+    NnOpConfig *norm = &segment->ops[0];
+    NnOpConfig *siluMul = &segment->ops[1];
+    NnOpConfig *matmulRope = &segment->ops[2];
+    NnOpConfig *last = &segment->ops[3];
+
+    if (norm->name != rmsNormName || siluMul->name != siluName || matmulRope->name != matmulName || last->config != lastConfig) {
+        printf("❌ fuseCpuOps did not move the names and configs\n");
+        exit(1);
+    }
+
+    ASSERT_EQ(norm->code, OP_MERGE_ADD_RMS_NORM);
+    ASSERT_EQ(norm->weightSize.floatType, F_32);
+    ASSERT_EQ(norm->weightSize.x, DIM);
+    ASSERT_EQ((NnUint)norm->configSize, (NnUint)sizeof(NnMergeAddRmsNormOpConfig));
+    assertPointer("merge_add_rms_norm input", &norm->input, SRC_PIPE, yPipeIndex);
+    assertPointer("merge_add_rms_norm output", &norm->output, SRC_BUFFER, normQBufferIndex);
+    const NnMergeAddRmsNormOpConfig *normConfig = (NnMergeAddRmsNormOpConfig *)norm->config;
+    ASSERT_EQ(normConfig->hasMergeAdd, true);
+    if (normConfig->epsilon != 1e-5f) {
+        printf("❌ fuseCpuOps lost the epsilon of inv_rms\n");
+        exit(1);
+    }
+    ASSERT_EQ(normConfig->xBufferIndex, xBufferIndex);
+    ASSERT_EQ(normConfig->invRmsBufferIndex, invRmsBufferIndex);
+    ASSERT_EQ(normConfig->normBufferIndex, normBufferIndex);
+
+    ASSERT_EQ(siluMul->code, OP_SILU_MUL);
+    ASSERT_EQ((NnUint)siluMul->weightSize.nBytes, 0);
+    assertPointer("silu_mul input", &siluMul->input, SRC_BUFFER, dBufferIndex);
+    assertPointer("silu_mul output", &siluMul->output, SRC_BUFFER, dqBufferIndex);
+    const NnSiluMulOpConfig *siluMulConfig = (NnSiluMulOpConfig *)siluMul->config;
+    ASSERT_EQ(siluMulConfig->multiplierBufferIndex, lBufferIndex);
+    ASSERT_EQ(siluMulConfig->activationBufferIndex, dBufferIndex);
+
+    ASSERT_EQ(matmulRope->code, OP_MATMUL_ROPE);
+    ASSERT_EQ(matmulRope->weightSize.floatType, F_Q40);
+    assertPointer("matmul_rope input", &matmulRope->input, SRC_BUFFER, dqBufferIndex);
+    assertPointer("matmul_rope output", &matmulRope->output, SRC_BUFFER, kBufferIndex);
+    const NnMatmulRopeOpConfig *matmulRopeConfig = (NnMatmulRopeOpConfig *)matmulRope->config;
+    ASSERT_EQ(matmulRopeConfig->hasShift, true);
+    ASSERT_EQ(matmulRopeConfig->shiftBufferIndex, keyCacheBufferIndex);
+    ASSERT_EQ(matmulRopeConfig->rope.positionPipeIndex, posPipeIndex);
+    ASSERT_EQ(matmulRopeConfig->rope.ropeCacheBufferIndex, ropeCacheBufferIndex);
+
+    // The unfused op is moved as it is
+    ASSERT_EQ(last->code, OP_INV_RMS);
+    ASSERT_EQ(std::strcmp(last->name, "inv_rms_final"), 0);
+
+    // A second pass finds nothing to fuse
+    ASSERT_EQ(fuseCpuOps(&nodeConfig), 0);
+    printf("✅ fuseCpuOps passed\n");
+
+    releaseNodeConfig(&nodeConfig);
+    releaseNetConfig(&netConfig);
+}
+
+void testBufferPlan() {
+    NnNodeConfigBuilder nodeBuilder(0);
+    NnUint xBufferIndex = nodeBuilder.addBuffer("x", size2D(F_32, N_BATCHES, DIM));
+    NnUint aBufferIndex = nodeBuilder.addBuffer("a", size2D(F_32, N_BATCHES, DIM));
+    NnUint bBufferIndex = nodeBuilder.addBuffer("b", size2D(F_32, N_BATCHES, DIM));
+    NnUint cBufferIndex = nodeBuilder.addBuffer("c", size2D(F_32, N_BATCHES, DIM));
+
+    // x is read before it is written, so it keeps its value between forwards.
+    // a dies when b is written, b dies when c is written, so a and c may share memory
+    NnSegmentConfigBuilder segmentBuilder;
+    segmentBuilder.addOp(OP_CAST, "cast_a", 0,
+        pointerBatchConfig(SRC_BUFFER, xBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, aBufferIndex),
+        size0(),
+        NnCastOpCodeConfig{});
+    segmentBuilder.addOp(OP_CAST, "cast_b", 0,
+        pointerBatchConfig(SRC_BUFFER, aBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, bBufferIndex),
+        size0(),
+        NnCastOpCodeConfig{});
+    segmentBuilder.addOp(OP_CAST, "cast_c", 0,
+        pointerBatchConfig(SRC_BUFFER, bBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, cBufferIndex),
+        size0(),
+        NnCastOpCodeConfig{});
+    segmentBuilder.addOp(OP_MERGE_ADD, "merge_add", 0,
+        pointerBatchConfig(SRC_BUFFER, cBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, xBufferIndex),
+        size0(),
+        NnMergeAddOpCodeConfig{});
+    nodeBuilder.addSegment(segmentBuilder.build());
+    NnNodeConfig nodeConfig = nodeBuilder.build();
+
+    NnBufferPlan plan = planNodeBuffers(&nodeConfig, BUFFER_ALIGNMENT);
+    const NnSize bufferBytes = nodeConfig.buffers[0].size.nBytes;
+    ASSERT_EQ((NnUint)plan.offsets[aBufferIndex], (NnUint)plan.offsets[cBufferIndex]);
+    ASSERT_EQ((NnUint)plan.nBytes, (NnUint)(3 * bufferBytes));
+    ASSERT_EQ(plan.nAliasedBuffers, 2);
+    if (plan.offsets[aBufferIndex] == plan.offsets[bBufferIndex] ||
+        plan.offsets[xBufferIndex] == plan.offsets[aBufferIndex] ||
+        plan.offsets[xBufferIndex] == plan.offsets[cBufferIndex]) {
+        printf("❌ bufferPlan shares memory between live buffers\n");
+        exit(1);
+    }
+    printf("✅ bufferPlan passed\n");
+
+    releaseNodeConfig(&nodeConfig);
+}
+
+static void assertCpus(const char *name, std::vector<NnUint> actual, std::vector<NnUint> expected) {
+    if (actual != expected) {
+        printf("❌ %s: got", name);
+        for (NnUint cpu : actual)
+            printf(" %u", cpu);
+        printf(", expected");
+        for (NnUint cpu : expected)
+            printf(" %u", cpu);
+        printf("\n");
+        exit(1);
+    }
+}
+
+void testParseCpuList() {
+    assertCpus("range", parseCpuList("0-3"), {0, 1, 2, 3});
+    assertCpus("list", parseCpuList("0-3,8,10-11"), {0, 1, 2, 3, 8, 10, 11});
+    assertCpus("unsorted", parseCpuList("7, 2,2,1-2"), {1, 2, 7});
+    assertCpus("empty", parseCpuList(""), {});
+
+    const char *invalidLists[] = { "a", "3-1", "1-", "-1", "1--2", "1;2", "1-2x" };
+    for (const char *list : invalidLists) {
+        try {
+            parseCpuList(list);
+            printf("❌ parseCpuList accepted \"%s\"\n", list);
+            exit(1);
+        } catch (const std::invalid_argument &) {}
+    }
+    printf("✅ parseCpuList passed\n");
+}
+
+void testSelectExecutorCpus() {
+    // 4 cores with 2 hardware threads each, CPUs 4-7 are the siblings of 0-3.
+    // Cores 0 and 1 are performance cores, 2 and 3 are efficiency cores, the last core is on NUMA node 1
+    NnCpuTopology topology;
+    for (NnUint cpuIndex = 0; cpuIndex < 8; cpuIndex++) {
+        NnUint coreId = cpuIndex % 4;
+        bool isPerformance = coreId < 2;
+        topology.cpus.push_back(NnCpuInfo{
+            cpuIndex, coreId, cpuIndex / 4, coreId, 0, coreId == 3 ? 1u : 0u,
+            isPerformance ? 1024u : 512u,
+            isPerformance ? CORE_PERFORMANCE : CORE_EFFICIENCY});
+    }
+    topology.nCores = 4;
+    topology.nNumaNodes = 2;
+    topology.isHybrid = true;
+
+    NnCpuSelectionPolicy policy;
+    policy.skipSmtSiblings = true;
+    assertCpus("skip smt", selectExecutorCpus(&topology, 3, &policy), {0, 1, 2});
+    // Node 0 has only 3 physical cores, so the fourth thread spills to node 1
+    assertCpus("skip smt, all cores", selectExecutorCpus(&topology, 4, &policy), {0, 1, 2, 3});
+
+    policy.skipSmtSiblings = false;
+    // The siblings of the performance cores go before the efficiency cores
+    assertCpus("smt", selectExecutorCpus(&topology, 4, &policy), {0, 1, 4, 5});
+    // Node 0 has 6 CPUs, so CPU 3 of node 1 is skipped in favour of the sibling 6
+    assertCpus("smt, numa", selectExecutorCpus(&topology, 6, &policy), {0, 1, 4, 5, 2, 6});
+
+    policy.skipSmtSiblings = true;
+    policy.excludedCpus = parseCpuList("0,2");
+    assertCpus("excluded", selectExecutorCpus(&topology, 2, &policy), {1, 3});
+    try {
+        selectExecutorCpus(&topology, 3, &policy);
+        printf("❌ selectExecutorCpus accepted more threads than available CPUs\n");
+        exit(1);
+    } catch (const std::invalid_argument &) {}
+    printf("✅ selectExecutorCpus passed\n");
+}
+
+// Full mesh of socket pairs, the socket s of the node k connects to the node s when s < k, otherwise to the node s + 1
+static std::vector<std::unique_ptr<NnNetwork>> createLoopbackNetworks(NnUint nNodes) {
+    std::vector<std::vector<int>> sockets(nNodes, std::vector<int>(nNodes - 1));
+    for (NnUint i = 0; i < nNodes; i++) {
+        for (NnUint j = i + 1; j < nNodes; j++) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+                throw std::runtime_error("Cannot create a socket pair");
+            sockets[i][j - 1] = pair[0];
+            sockets[j][i] = pair[1];
+        }
+    }
+    std::vector<std::unique_ptr<NnNetwork>> networks;
+    for (NnUint k = 0; k < nNodes; k++) {
+        int *nodeSockets = new int[nNodes - 1];
+        std::copy(sockets[k].begin(), sockets[k].end(), nodeSockets);
+        networks.push_back(std::unique_ptr<NnNetwork>(new NnNetwork(nNodes - 1, nodeSockets)));
+    }
+    return networks;
+}
+
+template <typename NodeFunc>
+static void runLoopbackNodes(NnUint nNodes, NodeFunc nodeFunc) {
+    std::vector<std::thread> threads;
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++)
+        threads.emplace_back(nodeFunc, nodeIndex);
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+void testNodeSynchronizers(bool useIoThreads) {
+    const NnUint nNodes = 3;
+    const NnUint dim = 96;
+    NnNetConfigBuilder netBuilder(nNodes, N_BATCHES);
+    NnUint xPipeIndex = netBuilder.addPipe("X", size2D(F_32, N_BATCHES, dim));
+    NnUint yPipeIndex = netBuilder.addPipe("Y", size2D(F_32, N_BATCHES, dim));
+    NnUint zPipeIndex = netBuilder.addPipe("Z", size2D(F_32, N_BATCHES, dim));
+    NnNetConfig netConfig = netBuilder.build();
+
+    std::vector<std::unique_ptr<NnNetwork>> networks = createLoopbackNetworks(nNodes);
+    std::vector<std::unique_ptr<NnNetExecution>> executions(nNodes);
+    const NnUint sliceDim = dim / nNodes;
+
+    runLoopbackNodes(nNodes, [&](NnUint nodeIndex) {
+        NnNodeConfigBuilder nodeBuilder(nodeIndex);
+        NnSegmentConfigBuilder segmentBuilder;
+        segmentBuilder.addSync(xPipeIndex, SYNC_NODE_SLICES);
+        segmentBuilder.addSync(yPipeIndex, SYNC_WITH_ROOT);
+        segmentBuilder.addSync(zPipeIndex, SYNC_NODE_SLICES_EXCEPT_ROOT);
+        nodeBuilder.addSegment(segmentBuilder.build());
+        NnNodeConfig nodeConfig = nodeBuilder.build();
+
+        NnNetExecution *execution = new NnNetExecution(1, &netConfig);
+        executions[nodeIndex].reset(execution);
+        execution->setBatchSize(N_BATCHES);
+        float *x = (float *)execution->pipes[xPipeIndex];
+        float *y = (float *)execution->pipes[yPipeIndex];
+        float *z = (float *)execution->pipes[zPipeIndex];
+        for (NnUint i = 0; i < N_BATCHES * dim; i++) {
+            bool isOwnSlice = (i % dim) / sliceDim == nodeIndex;
+            x[i] = isOwnSlice ? (float)i : -1.0f;
+            y[i] = nodeIndex == 0 ? (float)(i + 7) : -1.0f;
+            z[i] = isOwnSlice ? (float)(i + 13) : -1.0f;
+        }
+
+        std::unique_ptr<NnNodeSynchronizer> synchronizer(useIoThreads
+            ? (NnNodeSynchronizer *)new NnIoNodeSynchronizer(networks[nodeIndex].get(), execution, &netConfig, &nodeConfig)
+            : (NnNodeSynchronizer *)new NnNetworkNodeSynchronizer(networks[nodeIndex].get(), execution, &netConfig, &nodeConfig));
+        synchronizer->sync(0, 1, 0);
+        synchronizer.reset();
+        releaseNodeConfig(&nodeConfig);
+    });
+
+    for (NnUint nodeIndex = 0; nodeIndex < nNodes; nodeIndex++) {
+        float *x = (float *)executions[nodeIndex]->pipes[xPipeIndex];
+        float *y = (float *)executions[nodeIndex]->pipes[yPipeIndex];
+        float *z = (float *)executions[nodeIndex]->pipes[zPipeIndex];
+        for (NnUint i = 0; i < N_BATCHES * dim; i++) {
+            bool hasZ = nodeIndex == 0 || (i % dim) / sliceDim == nodeIndex;
+            if (x[i] != (float)i || y[i] != (float)(i + 7) || (hasZ && z[i] != (float)(i + 13))) {
+                printf("❌ nodeSynchronizers failed at node %u, %u: %f %f %f\n", nodeIndex, i, x[i], y[i], z[i]);
+                exit(1);
+            }
+        }
+    }
+    printf("✅ nodeSynchronizers passed (%s)\n", useIoThreads ? "I/O threads" : "compute threads");
+
+    networks.clear();
+    releaseNetConfig(&netConfig);
+}
+
+void testAllReduce(NnSyncType syncType, NnFloatType floatType, NnUint nNodes, NnUint dim, bool useIoThreads) {
+    NnNetConfigBuilder netBuilder(nNodes, N_BATCHES);
+    NnUint xPipeIndex = netBuilder.addPipe("X", size2D(floatType, N_BATCHES, dim));
+    NnNetConfig netConfig = netBuilder.build();
+    const NnUint n = N_BATCHES * dim;
+
+    // Partial sums of every node as the pipe holds them, and their plain sum
+    std::vector<std::vector<float>> inputs(nNodes, std::vector<float>(n));
+    std::vector<float> expected(n, 0.0f);
+    std::vector<NnBlockQ80> q80(n / Q80_BLOCK_SIZE);
+    for (NnUint k = 0; k < nNodes; k++) {
+        for (NnUint i = 0; i < n; i++)
+            inputs[k][i] = sinf(i * 0.13f + k * 1.7f) / (1.0f + k);
+        if (floatType == F_Q80) {
+            quantizeF32toQ80(inputs[k].data(), q80.data(), n, 1, 0);
+            dequantizeQ80toF32(q80.data(), inputs[k].data(), n, 1, 0);
+        }
+        for (NnUint i = 0; i < n; i++)
+            expected[i] += inputs[k][i];
+    }
+
+    std::vector<std::unique_ptr<NnNetwork>> networks = createLoopbackNetworks(nNodes);
+    std::vector<std::vector<float>> outputs(nNodes, std::vector<float>(n));
+    runLoopbackNodes(nNodes, [&](NnUint nodeIndex) {
+        NnNodeConfigBuilder nodeBuilder(nodeIndex);
+        NnSegmentConfigBuilder segmentBuilder;
+        segmentBuilder.addSync(xPipeIndex, syncType);
+        nodeBuilder.addSegment(segmentBuilder.build());
+        NnNodeConfig nodeConfig = nodeBuilder.build();
+
+        NnNetExecution execution(1, &netConfig);
+        execution.setBatchSize(N_BATCHES);
+        NnByte *x = execution.pipes[xPipeIndex];
+        if (floatType == F_Q80)
+            quantizeF32toQ80(inputs[nodeIndex].data(), (NnBlockQ80 *)x, n, 1, 0);
+        else
+            std::memcpy(x, inputs[nodeIndex].data(), n * sizeof(float));
+
+        std::unique_ptr<NnNodeSynchronizer> synchronizer(useIoThreads
+            ? (NnNodeSynchronizer *)new NnIoNodeSynchronizer(networks[nodeIndex].get(), &execution, &netConfig, &nodeConfig)
+            : (NnNodeSynchronizer *)new NnNetworkNodeSynchronizer(networks[nodeIndex].get(), &execution, &netConfig, &nodeConfig));
+        synchronizer->sync(0, 1, 0);
+        synchronizer.reset();
+
+        if (floatType == F_Q80)
+            dequantizeQ80toF32((NnBlockQ80 *)x, outputs[nodeIndex].data(), n, 1, 0);
+        else
+            std::memcpy(outputs[nodeIndex].data(), x, n * sizeof(float));
+        releaseNodeConfig(&nodeConfig);
+    });
+
+    // Q80 partial sums are requantized after every hop
+    const float tolerance = floatType == F_Q80 ? 0.05f : 0.00001f;
+    const char *name = syncType == SYNC_ALL_REDUCE_RING ? "ring" : "halving";
+    for (NnUint k = 0; k < nNodes; k++) {
+        for (NnUint i = 0; i < n; i++) {
+            if (fabsf(outputs[k][i] - expected[i]) > tolerance) {
+                printf("❌ allReduce %s %s failed at node %u, %u: %f != %f\n",
+                    name, floatTypeToString(floatType), k, i, outputs[k][i], expected[i]);
+                exit(1);
+            }
+        }
+    }
+    printf("✅ allReduce %s %s passed (%u nodes, dim %u, %s)\n",
+        name, floatTypeToString(floatType), nNodes, dim, useIoThreads ? "I/O threads" : "compute threads");
+
+    networks.clear();
+    releaseNetConfig(&netConfig);
+}
+
+// Thread 0 throws in the sync of the first forward only, like a worker losing the root node
+class NnThrowingNodeSynchronizer : public NnNodeSynchronizer {
+public:
+    NnUint nThrows = 1;
+    void sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) override {
+        if (threadIndex == 0 && nThrows > 0) {
+            nThrows--;
+            throw std::runtime_error("Lost node");
+        }
+    }
+};
+
+void testForwardException(NnUint nThreads) {
+    NnNetConfigBuilder netBuilder(2, 1);
+    NnUint xPipeIndex = netBuilder.addPipe("X", size2D(F_32, 1, DIM));
+    NnNodeConfigBuilder nodeBuilder(0);
+    NnUint aBufferIndex = nodeBuilder.addBuffer("a", size2D(F_32, 1, DIM));
+    for (NnUint s = 0; s < 2; s++) {
+        NnSegmentConfigBuilder segmentBuilder;
+        segmentBuilder.addOp(OP_CAST, "cast", s,
+            pointerBatchConfig(SRC_BUFFER, aBufferIndex),
+            pointerBatchConfig(SRC_PIPE, xPipeIndex),
+            size0(),
+            NnCastOpCodeConfig{});
+        if (s == 0)
+            segmentBuilder.addSync(xPipeIndex, SYNC_WITH_ROOT);
+        nodeBuilder.addSegment(segmentBuilder.build());
+    }
+
+    NnNetConfig netConfig = netBuilder.build();
+    NnNodeConfig nodeConfig = nodeBuilder.build();
+    {
+        NnNetExecution execution(nThreads, &netConfig);
+        NnCpuDevice device(&netConfig, &nodeConfig, &execution);
+        NnThrowingNodeSynchronizer synchronizer;
+        NnExecutor executor(&netConfig, &nodeConfig, &device, &execution, &synchronizer, false);
+        execution.setBatchSize(1);
+
+        bool hasThrown = false;
+        try {
+            executor.forward();
+        } catch (const std::runtime_error &e) {
+            hasThrown = true;
+        }
+        if (!hasThrown) {
+            printf("❌ forwardException failed: the exception of thread 0 was lost\n");
+            exit(1);
+        }
+        // The pool is released, so the next forward runs and the destructor joins the threads
+        executor.forward();
+    }
+    printf("✅ forwardException passed (%u threads)\n", nThreads);
+
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+}
+
+static void *emptyThreadHandler(void *arg) {
+    return nullptr;
+}
+
+void benchmarkForwardOverhead(NnUint nThreads) {
+    const NnUint nForwards = 2000;
+
+    // A single cast of a 1x32 row, the op work is negligible so a forward is the pool wake,
+    // the step barrier and the wait for the pool threads
+    NnNetConfigBuilder netBuilder(1, 1);
+    NnNodeConfigBuilder nodeBuilder(0);
+    NnUint aBufferIndex = nodeBuilder.addBuffer("a", size2D(F_32, 1, DIM));
+    NnUint bBufferIndex = nodeBuilder.addBuffer("b", size2D(F_32, 1, DIM));
+    NnSegmentConfigBuilder segmentBuilder;
+    segmentBuilder.addOp(OP_CAST, "cast", 0,
+        pointerBatchConfig(SRC_BUFFER, aBufferIndex),
+        pointerBatchConfig(SRC_BUFFER, bBufferIndex),
+        size0(),
+        NnCastOpCodeConfig{});
+    nodeBuilder.addSegment(segmentBuilder.build());
+
+    NnNetConfig netConfig = netBuilder.build();
+    NnNodeConfig nodeConfig = nodeBuilder.build();
+    NnNetExecution execution(nThreads, &netConfig);
+    NnCpuDevice device(&netConfig, &nodeConfig, &execution);
+    NnFakeNodeSynchronizer synchronizer;
+    NnExecutor executor(&netConfig, &nodeConfig, &device, &execution, &synchronizer, false);
+    execution.setBatchSize(1);
+    executor.forward(); // warm up the pool
+
+    // Per-forward spawn and join of threads 1..nThreads-1, this was the cost before the thread pool
+    std::vector<PthreadHandler> handlers(nThreads);
+    Timer spawnTimer;
+    for (NnUint i = 0; i < nForwards; i++) {
+        for (NnUint threadIndex = 1; threadIndex < nThreads; threadIndex++)
+            pthread_create(&handlers[threadIndex], NULL, (PthreadFunc)emptyThreadHandler, NULL);
+        for (NnUint threadIndex = 1; threadIndex < nThreads; threadIndex++)
+            pthread_join(handlers[threadIndex], NULL);
+    }
+    NnUint spawnTime = spawnTimer.elapsedMicroseconds();
+
+    Timer forwardTimer;
+    for (NnUint i = 0; i < nForwards; i++)
+        executor.forward();
+    NnUint forwardTime = forwardTimer.elapsedMicroseconds();
+
+    printf("⏱️ trivial graph: spawn+join %.2f us/forward, pool round trip %.2f us/forward (%u threads)\n",
+        spawnTime / (float)nForwards,
+        forwardTime / (float)nForwards,
+        nThreads);
+    printf("⏱️ barrier of last forward: spin %u us, sleep %u us\n",
+        executor.getSpinTime(),
+        executor.getSleepTime());
+
+    releaseNetConfig(&netConfig);
+    releaseNodeConfig(&nodeConfig);
+}
+
 int main() {
     initQuants();
 
     NnUint nThreads = 2;
+    testParseCpuList();
+    testSelectExecutorCpus();
+    testBufferPlan();
+    testFuseCpuOps();
+    testNodeSynchronizers(false);
+    testNodeSynchronizers(true);
+    // 7 blocks of 32 values do not split evenly between the nodes
+    for (NnFloatType floatType : { F_32, F_Q80 }) {
+        for (bool useIoThreads : { false, true }) {
+            testAllReduce(SYNC_ALL_REDUCE_RING, floatType, 3, 224, useIoThreads);
+            testAllReduce(SYNC_ALL_REDUCE_RING, floatType, 4, 224, useIoThreads);
+            testAllReduce(SYNC_ALL_REDUCE_HALVING, floatType, 2, 224, useIoThreads);
+            testAllReduce(SYNC_ALL_REDUCE_HALVING, floatType, 4, 224, useIoThreads);
+        }
+    }
+    // Every step of the batch is larger than the socket buffers, both partners send at the same time
+    testAllReduce(SYNC_ALL_REDUCE_HALVING, F_32, 2, 262144, false);
+    testAllReduce(SYNC_ALL_REDUCE_RING, F_32, 2, 262144, true);
+    testBarrierElision(nThreads);
+    testForwardException(4);
+
     NnNetConfig netConfig;
     NnNodeConfig nodeConfig;
     buildConfig(&netConfig, &nodeConfig);
@@ -78,5 +728,7 @@ int main() {
 
     releaseNetConfig(&netConfig);
     releaseNodeConfig(&nodeConfig);
+
+    benchmarkForwardOverhead(nThreads);
     return 0;
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "nn-cpu.hpp"
 #include "nn-cpu-ops.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
@@ -14,8 +15,6 @@
 
 #define DEBUG_CPU_OP_QUANTS false
 
-#define BUFFER_ALIGNMENT 64
-
 static NnByte *allocAlignedBuffer(NnSize size) {
     NnByte *buffer;
 #ifdef _WIN32
@@ -38,28 +37,244 @@ static void releaseAlignedBuffer(NnByte *buffer) {
 #endif
 }
 
-NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution) {
+// fusion
+
+static bool isSamePointer(const NnPointerConfig *a, const NnPointerConfig *b) {
+    return a->source == b->source && a->pointerIndex == b->pointerIndex && a->type == b->type;
+}
+
+static bool isBatchBuffer(const NnPointerConfig *pointer, NnNodeConfig *nodeConfig, NnFloatType floatType) {
+    if (pointer->source != SRC_BUFFER || pointer->type != PNTR_BATCH)
+        return false;
+    NnFloatType bufferType = nodeConfig->buffers[pointer->pointerIndex].size.floatType;
+    if (floatType == F_UNK)
+        return bufferType == F_32 || bufferType == F_Q80;
+    return bufferType == floatType;
+}
+
+template <typename T>
+static NnByte *cloneOpConfig(const T &config) {
+    NnByte *copy = new NnByte[sizeof(T)];
+    std::memcpy(copy, &config, sizeof(T));
+    return copy;
+}
+
+// Optional cast of the chain output into another batch buffer, e.g. F32 -> Q80
+static NnOpConfig *matchCast(NnSegmentConfig *segment, NnUint opIndex, NnPointerConfig *chainOutput, NnNodeConfig *nodeConfig) {
+    if (opIndex >= segment->nOps)
+        return nullptr;
+    NnOpConfig *cast = &segment->ops[opIndex];
+    if (cast->code != OP_CAST || !isSamePointer(&cast->input, chainOutput) || !isBatchBuffer(&cast->output, nodeConfig, F_UNK))
+        return nullptr;
+    return cast;
+}
+
+// [merge_add] -> inv_rms -> rms_norm -> [cast]
+static NnUint fuseMergeAddRmsNorm(NnSegmentConfig *segment, NnUint opIndex, NnNodeConfig *nodeConfig, NnOpConfig *fused) {
+    NnOpConfig *merge = nullptr;
+    NnUint i = opIndex;
+    if (segment->ops[i].code == OP_MERGE_ADD)
+        merge = &segment->ops[i++];
+    if (i + 1 >= segment->nOps)
+        return 0;
+    NnOpConfig *invRms = &segment->ops[i];
+    NnOpConfig *rmsNorm = &segment->ops[i + 1];
+    if (invRms->code != OP_INV_RMS || rmsNorm->code != OP_RMS_NORM)
+        return 0;
+
+    NnPointerConfig *x = &invRms->input;
+    const NnRmsNormOpConfig *rmsNormConfig = (NnRmsNormOpConfig *)rmsNorm->config;
+    if (!isBatchBuffer(x, nodeConfig, F_32) ||
+        !isBatchBuffer(&invRms->output, nodeConfig, F_32) ||
+        !isSamePointer(&rmsNorm->input, x) ||
+        !isBatchBuffer(&rmsNorm->output, nodeConfig, F_32) ||
+        rmsNormConfig->invRmsBufferIndex != invRms->output.pointerIndex ||
+        rmsNorm->weightSize.floatType != F_32)
+        return 0;
+    if (merge != nullptr && (!isSamePointer(&merge->output, x) || merge->input.type != PNTR_BATCH))
+        return 0;
+    i += 2;
+    NnOpConfig *cast = matchCast(segment, i, &rmsNorm->output, nodeConfig);
+    if (cast != nullptr)
+        i++;
+
+    NnMergeAddRmsNormOpConfig config;
+    config.hasMergeAdd = merge != nullptr;
+    config.epsilon = ((NnInvRmsOpConfig *)invRms->config)->epsilon;
+    config.xBufferIndex = x->pointerIndex;
+    config.invRmsBufferIndex = invRms->output.pointerIndex;
+    config.normBufferIndex = rmsNorm->output.pointerIndex;
+
+    // The fused op keeps the name of the rms norm op, the weight is loaded by this name
+    fused->code = OP_MERGE_ADD_RMS_NORM;
+    fused->name = rmsNorm->name;
+    fused->index = rmsNorm->index;
+    fused->input = merge != nullptr ? merge->input : *x;
+    fused->output = cast != nullptr ? cast->output : rmsNorm->output;
+    fused->weightSize = rmsNorm->weightSize;
+    fused->config = cloneOpConfig(config);
+    fused->configSize = sizeof(config);
+    rmsNorm->name = nullptr;
+    return i - opIndex;
+}
+
+// silu -> mul -> [cast]
+static NnUint fuseSiluMul(NnSegmentConfig *segment, NnUint opIndex, NnNodeConfig *nodeConfig, NnOpConfig *fused) {
+    if (opIndex + 1 >= segment->nOps)
+        return 0;
+    NnOpConfig *silu = &segment->ops[opIndex];
+    NnOpConfig *mul = &segment->ops[opIndex + 1];
+    if (silu->code != OP_SILU || mul->code != OP_MUL)
+        return 0;
+
+    NnPointerConfig *d = &silu->input;
+    const NnMulOpCodeConfig *mulConfig = (NnMulOpCodeConfig *)mul->config;
+    if (!isBatchBuffer(d, nodeConfig, F_32) ||
+        !isSamePointer(&silu->output, d) ||
+        !isSamePointer(&mul->input, d) ||
+        !isSamePointer(&mul->output, d) ||
+        nodeConfig->buffers[mulConfig->multiplierBufferIndex].size.floatType != F_32)
+        return 0;
+    NnUint i = opIndex + 2;
+    NnOpConfig *cast = matchCast(segment, i, d, nodeConfig);
+    if (cast != nullptr)
+        i++;
+
+    NnSiluMulOpConfig config;
+    config.multiplierBufferIndex = mulConfig->multiplierBufferIndex;
+    config.activationBufferIndex = d->pointerIndex;
+
+    fused->code = OP_SILU_MUL;
+    fused->name = silu->name;
+    fused->index = silu->index;
+    fused->input = *d;
+    fused->output = cast != nullptr ? cast->output : *d;
+    fused->weightSize = size0();
+    fused->config = cloneOpConfig(config);
+    fused->configSize = sizeof(config);
+    silu->name = nullptr;
+    return i - opIndex;
+}
+
+// matmul -> rope -> [shift]
+static NnUint fuseMatmulRope(NnSegmentConfig *segment, NnUint opIndex, NnNodeConfig *nodeConfig, NnOpConfig *fused) {
+    if (opIndex + 1 >= segment->nOps)
+        return 0;
+    NnOpConfig *matmul = &segment->ops[opIndex];
+    NnOpConfig *rope = &segment->ops[opIndex + 1];
+    if (matmul->code != OP_MATMUL || rope->code != OP_ROPE_LLAMA)
+        return 0;
+
+    NnPointerConfig *y = &matmul->output;
+    if (!isBatchBuffer(&matmul->input, nodeConfig, F_UNK) ||
+        !isBatchBuffer(y, nodeConfig, F_32) ||
+        !isSamePointer(&rope->input, y) ||
+        !isSamePointer(&rope->output, y))
+        return 0;
+    // Only the quant types with a fused CPU kernel
+    const NnFloatType inputType = nodeConfig->buffers[matmul->input.pointerIndex].size.floatType;
+    const NnFloatType weightType = matmul->weightSize.floatType;
+    if (!(inputType == F_32 && weightType == F_32) && !(inputType == F_Q80 && weightType == F_Q40))
+        return 0;
+    const NnRopeLlamaOpConfig *ropeConfig = (NnRopeLlamaOpConfig *)rope->config;
+    NnUint i = opIndex + 2;
+
+    NnOpConfig *shift = nullptr;
+    if (i < segment->nOps && segment->ops[i].code == OP_SHIFT) {
+        NnOpConfig *op = &segment->ops[i];
+        const NnShiftOpCodeConfig *shiftConfig = (NnShiftOpCodeConfig *)op->config;
+        // The fused op writes every KV cache type the shift op does
+        const NnFloatType shiftType = op->output.source == SRC_BUFFER ? nodeConfig->buffers[op->output.pointerIndex].size.floatType : F_UNK;
+        if (isSamePointer(&op->input, y) &&
+            op->output.source == SRC_BUFFER &&
+            op->output.type == PNTR_RAW &&
+            (shiftType == F_32 || shiftType == F_16 || shiftType == F_Q80) &&
+            shiftConfig->indexPipeIndex == ropeConfig->positionPipeIndex) {
+            shift = op;
+            i++;
+        }
+    }
+
+    NnMatmulRopeOpConfig config;
+    config.rope = *ropeConfig;
+    config.hasShift = shift != nullptr;
+    config.shiftBufferIndex = shift != nullptr ? shift->output.pointerIndex : 0;
+
+    // The fused op keeps the name of the matmul op, the weight is loaded by this name
+    fused->code = OP_MATMUL_ROPE;
+    fused->name = matmul->name;
+    fused->index = matmul->index;
+    fused->input = matmul->input;
+    fused->output = *y;
+    fused->weightSize = matmul->weightSize;
+    fused->config = cloneOpConfig(config);
+    fused->configSize = sizeof(config);
+    matmul->name = nullptr;
+    return i - opIndex;
+}
+
+NnUint fuseCpuOps(NnNodeConfig *nodeConfig) {
+    NnUint nRemovedOps = 0;
+    for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segment = &nodeConfig->segments[segmentIndex];
+        std::vector<NnOpConfig> ops;
+        NnUint opIndex = 0;
+        while (opIndex < segment->nOps) {
+            NnOpConfig fused;
+            NnUint nOps = fuseMergeAddRmsNorm(segment, opIndex, nodeConfig, &fused);
+            if (nOps == 0)
+                nOps = fuseSiluMul(segment, opIndex, nodeConfig, &fused);
+            if (nOps == 0)
+                nOps = fuseMatmulRope(segment, opIndex, nodeConfig, &fused);
+            if (nOps == 0) {
+                ops.push_back(segment->ops[opIndex++]);
+                continue;
+            }
+            for (NnUint i = opIndex; i < opIndex + nOps; i++) {
+                // The name taken over by the fused op was already detached
+                delete[] segment->ops[i].name;
+                delete[] segment->ops[i].config;
+            }
+            ops.push_back(fused);
+            opIndex += nOps;
+        }
+
+        if (ops.size() == segment->nOps)
+            continue;
+        nRemovedOps += segment->nOps - ops.size();
+        delete[] segment->ops;
+        segment->nOps = ops.size();
+        segment->ops = new NnOpConfig[segment->nOps];
+        std::copy(ops.begin(), ops.end(), segment->ops);
+    }
+    return nRemovedOps;
+}
+
+NnCpuDevice::NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, NnCpuSplitMode splitMode, bool repackWeights) {
     this->netConfig = netConfig;
     this->nodeConfig = nodeConfig;
     this->netExecution = netExecution;
+    this->splitMode = splitMode;
+    // The repacked weight is written into the buffer of the op, a mapped weight is read as it is
+    this->repackWeights = repackWeights && !DEBUG_USE_MMAP_FOR_WEIGHTS;
 
     printCpuInstructionSet();
+    printf("🧩 Split: %s, weight repack: %s\n", splitModeToString(splitMode), this->repackWeights ? "on" : "off");
 
+    // All buffers live in one arena, buffers that are never live at the same time share memory
+    NnBufferPlan plan = planNodeBuffers(nodeConfig, BUFFER_ALIGNMENT);
+    arena = allocAlignedBuffer(plan.nBytes > 0 ? plan.nBytes : BUFFER_ALIGNMENT);
     nBuffers = nodeConfig->nBuffers;
     buffers = new NnByte *[nBuffers];
-    for (NnUint bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++) {
-        NnBufferConfig *config = &nodeConfig->buffers[bufferIndex];
-        NnByte *buffer = allocAlignedBuffer(config->size.nBytes);
-        buffers[bufferIndex] = buffer;
-    }
+    for (NnUint bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++)
+        buffers[bufferIndex] = &arena[plan.offsets[bufferIndex]];
 
     bufferFlags = new NnByte[nBuffers];
     std::memset(bufferFlags, 0, nBuffers * sizeof(NnByte));
 }
 
 NnCpuDevice::~NnCpuDevice() {
-    for (NnUint bufferIndex = 0; bufferIndex < nBuffers; bufferIndex++)
-        releaseAlignedBuffer(buffers[bufferIndex]);
+    releaseAlignedBuffer(arena);
     delete[] buffers;
     delete[] bufferFlags;
 }
@@ -121,6 +336,9 @@ NnDeviceSegment *NnCpuDevice::createSegment(NnUint segmentIndex) {
         opContext->name = opConfig->name;
         opContext->opConfig = opConfig->config;
         opContext->weightSize = opConfig->weightSize;
+        opContext->weightRepack = repackWeights && opConfig->weightSize.nBytes > 0
+            ? getCpuWeightRepack(opConfig->code, opQuants[opIndex], opConfig->weightSize)
+            : nullptr;
         opContext->nBatches = netConfig->nBatches;
         opContext->pipes = netExecution->pipes;
         opContext->pipeConfigs = netConfig->pipes;
@@ -136,6 +354,18 @@ NnDeviceSegment *NnCpuDevice::createSegment(NnUint segmentIndex) {
         opContext->outputSize = outputSizes[opIndex];
         opContext->hasOutputContinuousMemory = hasPointerContinuousMemory(&opConfig->output);
 
+        opContext->splitMode = splitMode;
+        opContext->chunkCounters = new NnCpuChunkCounter[netConfig->nBatches];
+        for (NnUint batchIndex = 0; batchIndex < netConfig->nBatches; batchIndex++) {
+            opContext->chunkCounters[batchIndex].nextChunk.store(0);
+            opContext->chunkCounters[batchIndex].nDoneThreads.store(0);
+            opContext->chunkCounters[batchIndex].nComputedChunks.store(0);
+            opContext->chunkCounters[batchIndex].generation.store(0);
+        }
+        opContext->threadSums = opConfig->code == OP_MERGE_ADD_RMS_NORM
+            ? new float[netConfig->nBatches * netExecution->nThreads]
+            : nullptr;
+
 #if not(DEBUG_USE_MMAP_FOR_WEIGHTS)
         if (opContext->weightSize.nBytes > 0)
             opContext->weight = allocAlignedBuffer(opContext->weightSize.nBytes);
@@ -147,7 +377,7 @@ NnDeviceSegment *NnCpuDevice::createSegment(NnUint segmentIndex) {
             opInit(opContext);
         opForward[opIndex] = opForwardLocal[opIndex];
     }
-    return new NnCpuDeviceSegment(opForward, opContexts, segmentConfig->nOps);
+    return new NnCpuDeviceSegment(opForward, opContexts, segmentConfig->ops, segmentConfig->nOps);
 }
 
 NnCpuDeviceSegment::~NnCpuDeviceSegment() {
@@ -161,6 +391,9 @@ NnCpuDeviceSegment::~NnCpuDeviceSegment() {
         if (context->weightSize.nBytes > 0)
             releaseAlignedBuffer(context->weight);
 #endif
+        delete[] context->chunkCounters;
+        if (context->threadSums != nullptr)
+            delete[] context->threadSums;
     }
     delete[] opForward;
     delete[] opContexts;
@@ -221,7 +454,10 @@ void NnCpuDeviceSegment::loadWeight(NnUint opIndex, NnSize nBytes, NnByte *weigh
 #if DEBUG_USE_MMAP_FOR_WEIGHTS
     context->weight = weight;
 #else
-    std::memcpy(context->weight, weight, nBytes);
+    if (context->weightRepack != nullptr)
+        context->weightRepack(context->weight, weight, &context->weightSize);
+    else
+        std::memcpy(context->weight, weight, nBytes);
 #endif
 }
 
@@ -230,3 +466,95 @@ void NnCpuDeviceSegment::forward(NnUint opIndex, NnUint nThreads, NnUint threadI
     // printf("forward: %d %s (%d/%d)\n", opIndex, context->name, threadIndex + 1, nThreads); fflush(stdout);
     opForward[opIndex](nThreads, threadIndex, batchSize, context);
 }
+
+static void addSplitAccess(NnOpSplit *split, NnCpuOpContext *context, NnPointerConfig pointer, bool isWrite, bool isSplit) {
+    const bool isBuffer = pointer.source == SRC_BUFFER;
+    split->accesses.push_back(NnOpAccess{
+        isBuffer ? context->buffers[pointer.pointerIndex] : context->pipes[pointer.pointerIndex],
+        isBuffer ? context->bufferConfigs[pointer.pointerIndex].size : context->pipeConfigs[pointer.pointerIndex].size,
+        pointer.type,
+        isWrite,
+        isSplit });
+}
+
+bool NnCpuDeviceSegment::getOpSplit(NnUint opIndex, NnOpSplit *split) {
+    // Only elementwise ops are described, each one splits the columns of every batch row with SPLIT_THREADS
+    NnOpConfig *opConfig = &opConfigs[opIndex];
+    NnCpuOpContext *context = &opContexts[opIndex];
+    const NnSize2D *inputSize = &context->inputSize;
+    const NnSize2D *outputSize = &context->outputSize;
+    const NnUint n = outputSize->x;
+    const NnUint nBlocks = n / Q80_BLOCK_SIZE;
+
+    split->accesses.clear();
+    switch (opConfig->code) {
+    case OP_SILU:
+    case OP_GELU:
+        if (inputSize->x != n || outputSize->floatType != F_32)
+            return false;
+        split->nUnits = n;
+        split->unitSize = 1;
+        addSplitAccess(split, context, opConfig->input, false, true);
+        addSplitAccess(split, context, opConfig->output, true, true);
+        return true;
+    case OP_MUL: {
+        const NnMulOpCodeConfig *config = (NnMulOpCodeConfig *)opConfig->config;
+        const NnSize2D *multiplierSize = &context->bufferConfigs[config->multiplierBufferIndex].size;
+        if (inputSize->x != n)
+            return false;
+        const bool isQ80 = multiplierSize->floatType == F_Q80;
+        split->nUnits = isQ80 ? nBlocks : n;
+        split->unitSize = isQ80 ? Q80_BLOCK_SIZE : 1;
+        addSplitAccess(split, context, opConfig->input, false, true);
+        addSplitAccess(split, context, opConfig->output, true, true);
+        addSplitAccess(split, context, pointerBatchConfig(SRC_BUFFER, config->multiplierBufferIndex), false, multiplierSize->x == n);
+        return true;
+    }
+    case OP_CAST: {
+        const bool isQuantize = inputSize->floatType == F_32 && (outputSize->floatType == F_Q80 || outputSize->floatType == F_Q40);
+        const bool isDequantize = inputSize->floatType == F_Q80 && outputSize->floatType == F_32;
+        if (!isQuantize && !isDequantize)
+            return false; // The byte copy is split by bytes, not by columns
+        static_assert(Q40_BLOCK_SIZE == Q80_BLOCK_SIZE, "Q40 and Q80 rows are split by the same blocks");
+        split->nUnits = nBlocks;
+        split->unitSize = Q80_BLOCK_SIZE;
+        addSplitAccess(split, context, opConfig->input, false, true);
+        addSplitAccess(split, context, opConfig->output, true, true);
+        return true;
+    }
+    case OP_MERGE_ADD: {
+        const bool isBlock = inputSize->floatType == F_Q80 || inputSize->floatType == F_Q40;
+        split->nUnits = isBlock ? nBlocks : n;
+        split->unitSize = isBlock ? Q80_BLOCK_SIZE : 1;
+        // Every thread reads its columns of all slices, the input row is wider than the split
+        addSplitAccess(split, context, opConfig->input, false, false);
+        addSplitAccess(split, context, opConfig->output, true, true);
+        return true;
+    }
+    case OP_RMS_NORM: {
+        const NnRmsNormOpConfig *config = (NnRmsNormOpConfig *)opConfig->config;
+        if (inputSize->x != n)
+            return false;
+        const bool isQ80 = inputSize->floatType == F_Q80;
+        split->nUnits = isQ80 ? nBlocks : n;
+        split->unitSize = isQ80 ? Q80_BLOCK_SIZE : 1;
+        addSplitAccess(split, context, opConfig->input, false, true);
+        addSplitAccess(split, context, opConfig->output, true, true);
+        addSplitAccess(split, context, pointerBatchConfig(SRC_BUFFER, config->invRmsBufferIndex), false, false);
+        return true;
+    }
+    case OP_SILU_MUL: {
+        const NnSiluMulOpConfig *config = (NnSiluMulOpConfig *)opConfig->config;
+        const bool isQ80 = outputSize->floatType == F_Q80;
+        split->nUnits = isQ80 ? nBlocks : n;
+        split->unitSize = isQ80 ? Q80_BLOCK_SIZE : 1;
+        addSplitAccess(split, context, opConfig->input, false, true);
+        addSplitAccess(split, context, opConfig->output, true, true);
+        addSplitAccess(split, context, pointerBatchConfig(SRC_BUFFER, config->multiplierBufferIndex), false, true);
+        addSplitAccess(split, context, pointerBatchConfig(SRC_BUFFER, config->activationBufferIndex), true, true);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
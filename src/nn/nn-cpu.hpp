@@ -7,6 +7,9 @@
 
 #define DEBUG_USE_MMAP_FOR_WEIGHTS false
 
+// Rewrites chains of small ops into fused CPU ops, returns the number of removed ops (and executor barriers)
+NnUint fuseCpuOps(NnNodeConfig *nodeConfig);
+
 class NnCpuDevice : public NnDevice {
 public:
     NnByte **buffers;
@@ -15,9 +18,12 @@ private:
     NnNodeConfig *nodeConfig;
     NnNetExecution *netExecution;
     NnUint nBuffers;
+    NnByte *arena;
     NnByte *bufferFlags;
+    NnCpuSplitMode splitMode;
+    bool repackWeights;
 public:
-    NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution);
+    NnCpuDevice(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnNetExecution *netExecution, NnCpuSplitMode splitMode = SPLIT_CHUNKED, bool repackWeights = true);
     ~NnCpuDevice() override;
     NnUint maxNThreads() override;
     NnDeviceSegment *createSegment(NnUint segmentIndex) override;
@@ -29,11 +35,13 @@ public:
     NnUint nOps;
     NnCpuOpForward *opForward;
     NnCpuOpContext *opContexts;
-    NnCpuDeviceSegment(NnCpuOpForward *opForward, NnCpuOpContext *opContexts, NnUint nOps)
-        : opForward(opForward), opContexts(opContexts), nOps(nOps) {}
+    NnOpConfig *opConfigs;
+    NnCpuDeviceSegment(NnCpuOpForward *opForward, NnCpuOpContext *opContexts, NnOpConfig *opConfigs, NnUint nOps)
+        : opForward(opForward), opContexts(opContexts), opConfigs(opConfigs), nOps(nOps) {}
     ~NnCpuDeviceSegment() override;
     void loadWeight(NnUint opIndex, NnSize nBytes, NnByte *weight) override;
     void forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) override;
+    bool getOpSplit(NnUint opIndex, NnOpSplit *split) override;
 };
 
 #endif
\ No newline at end of file
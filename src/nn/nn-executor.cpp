@@ -1,7 +1,24 @@
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 #include <stdexcept>
+#include <thread>
 #include "nn-executor.hpp"
+#ifdef __linux__
+#include <sched.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Spin iterations with a pause only, after them a spinning thread also yields its CPU
+#define SPIN_PAUSE_ITERATIONS 256
+
+// More threads than CPUs cannot all run at once, then a spinning thread only delays the others
+static NnUint getSpinBudget(const NnUint spinBudgetUs, const NnUint nThreads) {
+    const NnUint nCpus = std::thread::hardware_concurrency();
+    return nCpus > 0 && nThreads > nCpus ? 0 : spinBudgetUs;
+}
 
 void NnFakeNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) {
     // Nothing
@@ -50,19 +67,24 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnDevic
             segments[segmentIndex] = std::unique_ptr<NnDeviceSegment>(segment);
 
             for (NnUint opIndex = 0; opIndex < segmentConfig->nOps; opIndex++)
-                steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex, &segmentConfig->ops[opIndex] });
+                steps.push_back(NnExecutorStep{ STEP_EXECUTE_OP, segment, opIndex, &segmentConfig->ops[opIndex], true });
         }
         if (useSynchronizer && segmentConfig->nSyncs > 0)
-            steps.push_back(NnExecutorStep{ STEP_SYNC_NODES, nullptr, segmentIndex, nullptr });
+            steps.push_back(NnExecutorStep{ STEP_SYNC_NODES, nullptr, segmentIndex, nullptr, true });
     }
 
     steps.shrink_to_fit();
+    elideBarriers();
 
     context.nThreads = netExecution->nThreads;
     context.synchronizer = synchronizer;
     context.device = device;
     context.nSteps = (NnUint)steps.size();
     context.steps = steps.data();
+    context.spinBudgetUs = getSpinBudget(DEFAULT_SPIN_BUDGET_US, netExecution->nThreads);
+    context.isTracing = false;
+    context.maxTraceEventsPerThread = 0;
+    context.nSleepingThreads.exchange(0);
     if (benchmark)
         context.timer = new Timer();
     else
@@ -73,10 +95,21 @@ NnExecutor::NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnDevic
         NnExecutorThread *thread = &threads[threadIndex];
         thread->threadIndex = threadIndex;
         thread->context = &context;
+        thread->spinTime = 0;
+        thread->sleepTime = 0;
+    }
+    try {
+        startPool();
+    } catch (...) {
+        if (context.timer != nullptr)
+            delete context.timer;
+        delete[] threads;
+        throw;
     }
 }
 
 NnExecutor::~NnExecutor() {
+    stopPool();
     if (context.timer != nullptr)
         delete context.timer;
     delete[] threads;
@@ -98,6 +131,75 @@ void NnExecutor::loadWeight(const char *name, NnUint index, NnSize nBytes, NnByt
     throw std::invalid_argument("Cannot locate op by name: " + std::string(name));
 }
 
+static bool hasMemoryOverlap(const NnOpAccess *a, const NnOpAccess *b) {
+    return a->memory < b->memory + b->memorySize.nBytes && b->memory < a->memory + a->memorySize.nBytes;
+}
+
+static bool hasSameLayout(const NnOpAccess *a, const NnOpAccess *b) {
+    return a->memory == b->memory &&
+        a->pointerType == b->pointerType &&
+        a->memorySize.floatType == b->memorySize.floatType &&
+        a->memorySize.y == b->memorySize.y &&
+        a->memorySize.x == b->memorySize.x;
+}
+
+static NnUint getSplitStartColumn(const NnOpSplit *split, const NnUint nThreads, const NnUint threadIndex) {
+    SPLIT_THREADS(start, end, split->nUnits, nThreads, threadIndex);
+    assert(start <= end);
+    return start * split->unitSize;
+}
+
+static bool isSameSplit(const NnOpSplit *a, const NnOpSplit *b, const NnUint nThreads) {
+    if (a->nUnits * a->unitSize != b->nUnits * b->unitSize)
+        return false;
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+        if (getSplitStartColumn(a, nThreads, threadIndex) != getSplitStartColumn(b, nThreads, threadIndex))
+            return false;
+    }
+    return true;
+}
+
+static bool hasCrossThreadHazard(const NnOpSplit *a, const NnOpSplit *b, const NnUint nThreads) {
+    const bool sameSplit = isSameSplit(a, b, nThreads);
+    for (const NnOpAccess &x : a->accesses) {
+        for (const NnOpAccess &y : b->accesses) {
+            if (!hasMemoryOverlap(&x, &y) || (!x.isWrite && !y.isWrite))
+                continue;
+            // Both ops see the same rows and each thread stays on its own columns
+            if (sameSplit && x.isSplit && y.isSplit && hasSameLayout(&x, &y))
+                continue;
+            return true;
+        }
+    }
+    return false;
+}
+
+void NnExecutor::elideBarriers() {
+    // A thread may run the next op without a barrier if no op since the last barrier
+    // touches, on another thread, memory that the next op touches on this thread
+    const NnUint nThreads = netExecution->nThreads;
+    std::vector<NnOpSplit> splits(steps.size());
+    std::vector<bool> hasSplit(steps.size());
+    for (NnUint stepIndex = 0; stepIndex < steps.size(); stepIndex++) {
+        NnExecutorStep *step = &steps[stepIndex];
+        hasSplit[stepIndex] = step->type == STEP_EXECUTE_OP && step->segment->getOpSplit(step->arg0, &splits[stepIndex]);
+    }
+
+    nElidedBarriers = 0;
+    NnUint groupStart = 0;
+    for (NnUint stepIndex = 1; stepIndex < steps.size(); stepIndex++) {
+        bool canJoin = hasSplit[stepIndex - 1] && hasSplit[stepIndex];
+        for (NnUint i = groupStart; canJoin && i < stepIndex; i++)
+            canJoin = !hasCrossThreadHazard(&splits[i], &splits[stepIndex], nThreads);
+        if (canJoin) {
+            steps[stepIndex - 1].needsBarrier = false;
+            nElidedBarriers++;
+        } else {
+            groupStart = stepIndex;
+        }
+    }
+}
+
 inline void executeStep(NnExecutorStep *step, NnUint nThreads, NnExecutorThread *thread, NnExecutorContext *context) {
     if (step->type == STEP_EXECUTE_OP) {
         step->segment->forward(step->arg0, nThreads, thread->threadIndex, context->batchSize);
@@ -108,6 +210,65 @@ inline void executeStep(NnExecutorStep *step, NnUint nThreads, NnExecutorThread
     }
 }
 
+static inline NnUint elapsedMicroseconds(std::chrono::steady_clock::time_point start) {
+    return (NnUint)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static inline std::uint64_t elapsedNanoseconds(std::chrono::steady_clock::time_point start) {
+    return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static inline void spinPause() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void waitForStep(NnExecutorThread *thread, NnExecutorContext *context, const NnUint stepIndex) {
+    if (context->currentStepIndex.load() != stepIndex)
+        return;
+
+    // Spin while the wait is likely short, the clock is checked every 64 iterations only.
+    // The pause keeps the spin from taking the core from its SMT sibling, and after a short spin the
+    // thread yields, so the thread it waits for runs also if the CPUs are oversubscribed
+    const std::chrono::steady_clock::time_point spinStart = std::chrono::steady_clock::now();
+    NnUint nIterations = 0;
+    while (context->spinBudgetUs > 0 && context->currentStepIndex.load() == stepIndex) {
+        if (++nIterations % 64 == 0 && elapsedMicroseconds(spinStart) >= context->spinBudgetUs)
+            break;
+        spinPause();
+        if (nIterations > SPIN_PAUSE_ITERATIONS)
+            std::this_thread::yield();
+    }
+    thread->spinTime += elapsedMicroseconds(spinStart);
+    if (context->currentStepIndex.load() != stepIndex)
+        return;
+
+    // Then park, e.g. while another thread is blocked in a slow node sync
+    const std::chrono::steady_clock::time_point sleepStart = std::chrono::steady_clock::now();
+    {
+        std::unique_lock<std::mutex> lock(context->stepMutex);
+        context->nSleepingThreads.fetch_add(1);
+        context->stepCond.wait(lock, [&] {
+            return context->currentStepIndex.load() != stepIndex;
+        });
+        context->nSleepingThreads.fetch_sub(1);
+    }
+    thread->sleepTime += elapsedMicroseconds(sleepStart);
+}
+
+static void advanceStep(NnExecutorContext *context, const NnUint nextStepIndex) {
+    context->doneThreadCount.store(0);
+    context->currentStepIndex.store(nextStepIndex);
+    if (context->nSleepingThreads.load() > 0) {
+        // The lock orders the notify after a sleeper has checked the step index
+        { std::lock_guard<std::mutex> lock(context->stepMutex); }
+        context->stepCond.notify_all();
+    }
+}
+
 static inline void *executorThreadHandler(void *arg) {
     NnExecutorThread *thread = (NnExecutorThread *)arg;
     NnExecutorContext *context = thread->context;
@@ -119,8 +280,22 @@ static inline void *executorThreadHandler(void *arg) {
         if (currentStepIndex == context->nSteps)
             break;
 
-        NnExecutorStep *step = &context->steps[currentStepIndex];
-        executeStep(step, nThreads, thread, context);
+        // Steps without a barrier between them run back-to-back, only the last one is awaited
+        NnUint stepIndex = currentStepIndex;
+        NnExecutorStep *step;
+        while (true) {
+            step = &context->steps[stepIndex];
+            if (context->isTracing && thread->traceEvents.size() < context->maxTraceEventsPerThread) {
+                std::uint64_t startNs = elapsedNanoseconds(context->traceStart);
+                executeStep(step, nThreads, thread, context);
+                thread->traceEvents.push_back({ stepIndex, startNs, elapsedNanoseconds(context->traceStart) });
+            } else {
+                executeStep(step, nThreads, thread, context);
+            }
+            if (step->needsBarrier)
+                break;
+            stepIndex++;
+        }
 
         NnUint currentCount = context->doneThreadCount.fetch_add(1);
         if (currentCount == doneCount) {
@@ -130,15 +305,66 @@ static inline void *executorThreadHandler(void *arg) {
                 context->timer->reset();
             }
 
-            context->doneThreadCount.store(0);
-            context->currentStepIndex.fetch_add(1);
+            advanceStep(context, stepIndex + 1);
         } else {
-            while (context->currentStepIndex.load() == currentStepIndex);
+            waitForStep(thread, context, currentStepIndex);
+        }
+    }
+    return nullptr;
+}
+
+static inline void *executorPoolThreadHandler(void *arg) {
+    NnExecutorThread *thread = (NnExecutorThread *)arg;
+    NnExecutorContext *context = thread->context;
+    NnUint generation = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(context->poolMutex);
+            context->poolStartCond.wait(lock, [&] {
+                return !context->isPoolAlive || context->poolGeneration != generation;
+            });
+            if (!context->isPoolAlive)
+                break;
+            generation = context->poolGeneration;
+        }
+
+        executorThreadHandler(arg);
+
+        {
+            std::lock_guard<std::mutex> lock(context->poolMutex);
+            context->poolDoneThreadCount++;
         }
+        context->poolDoneCond.notify_one();
     }
     return nullptr;
 }
 
+void NnExecutor::startPool() {
+    context.poolGeneration = 0;
+    context.poolDoneThreadCount = 0;
+    context.isPoolAlive = true;
+
+    for (NnUint threadIndex = 1; threadIndex < context.nThreads; threadIndex++) {
+        int result = pthread_create(&threads[threadIndex].handler, NULL, (PthreadFunc)executorPoolThreadHandler, (void *)&threads[threadIndex]);
+        if (result != 0) {
+            context.nThreads = threadIndex; // Join only started threads
+            stopPool();
+            throw std::runtime_error("Failed to create thread");
+        }
+    }
+}
+
+void NnExecutor::stopPool() {
+    {
+        std::lock_guard<std::mutex> lock(context.poolMutex);
+        context.isPoolAlive = false;
+    }
+    context.poolStartCond.notify_all();
+    for (NnUint threadIndex = 1; threadIndex < context.nThreads; threadIndex++)
+        pthread_join(threads[threadIndex].handler, NULL);
+}
+
 void NnExecutor::forward() {
     assert(netExecution->batchSize > 0);
 
@@ -151,19 +377,150 @@ void NnExecutor::forward() {
         std::memset(context.totalTime, 0, sizeof(context.totalTime));
         context.timer->reset();
     }
+    for (NnUint threadIndex = 0; threadIndex < nThreads; threadIndex++) {
+        threads[threadIndex].spinTime = 0;
+        threads[threadIndex].sleepTime = 0;
+    }
 
-    NnUint threadIndex;
-    for (threadIndex = 1; threadIndex < nThreads; threadIndex++) {
-        int result = pthread_create(&threads[threadIndex].handler, NULL, (PthreadFunc)executorThreadHandler, (void *)&threads[threadIndex]);
-        if (result != 0)
-            throw std::runtime_error("Failed to create thread");
+    if (nThreads > 1) {
+        {
+            std::lock_guard<std::mutex> lock(context.poolMutex);
+            context.poolDoneThreadCount = 0;
+            context.poolGeneration++;
+        }
+        context.poolStartCond.notify_all();
     }
-    executorThreadHandler((void *)&threads[0]);
-    for (threadIndex = 1; threadIndex < nThreads; threadIndex++)
-        pthread_join(threads[threadIndex].handler, NULL);
+
+    try {
+        executorThreadHandler((void *)&threads[0]);
+    } catch (...) {
+        // E.g. a lost node in the sync, the other threads wait for a step thread 0 never finishes.
+        // Jumping to the end releases them, so the caller may retry or stop the pool
+        if (nThreads > 1) {
+            advanceStep(&context, context.nSteps);
+            waitForPool();
+        }
+        throw;
+    }
+
+    if (nThreads > 1)
+        waitForPool();
+}
+
+void NnExecutor::waitForPool() {
+    // Workers may still be leaving the step loop, the next forward must not reset the context before that
+    std::unique_lock<std::mutex> lock(context.poolMutex);
+    context.poolDoneCond.wait(lock, [&] {
+        return context.poolDoneThreadCount == netExecution->nThreads - 1;
+    });
+}
+
+void NnExecutor::setSpinBudget(NnUint spinBudgetUs) {
+    context.spinBudgetUs = getSpinBudget(spinBudgetUs, context.nThreads);
+}
+
+static bool setThreadAffinity(PthreadHandler handler, NnUint cpuIndex) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpuIndex, &set);
+    return pthread_setaffinity_np(handler, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    return SetThreadAffinityMask(handler, (DWORD_PTR)1 << cpuIndex) != 0;
+#else
+    return false;
+#endif
+}
+
+void NnExecutor::pinThreads(const std::vector<NnUint> &cpuIndexes) {
+    // Thread 0 runs on the thread that calls forward(), so the caller is pinned as well
+    if (cpuIndexes.size() < context.nThreads)
+        throw std::invalid_argument("Expected " + std::to_string(context.nThreads) + " CPUs to pin threads");
+#ifdef _WIN32
+    PthreadHandler current = GetCurrentThread();
+#else
+    PthreadHandler current = pthread_self();
+#endif
+    for (NnUint threadIndex = 0; threadIndex < context.nThreads; threadIndex++) {
+        PthreadHandler handler = threadIndex == 0 ? current : threads[threadIndex].handler;
+        if (!setThreadAffinity(handler, cpuIndexes[threadIndex])) {
+            printf("⚠️ Cannot pin thread %u to CPU %u\n", threadIndex, cpuIndexes[threadIndex]);
+            return;
+        }
+    }
+    printf("📌 Pinned %u threads to CPUs:", context.nThreads);
+    for (NnUint threadIndex = 0; threadIndex < context.nThreads; threadIndex++)
+        printf(" %u", cpuIndexes[threadIndex]);
+    printf("\n");
+}
+
+void NnExecutor::startTrace(NnSize maxEventsPerThread) {
+    for (NnUint threadIndex = 0; threadIndex < context.nThreads; threadIndex++) {
+        threads[threadIndex].traceEvents.clear();
+        threads[threadIndex].traceEvents.reserve(maxEventsPerThread < 65536 ? maxEventsPerThread : 65536);
+    }
+    context.maxTraceEventsPerThread = maxEventsPerThread;
+    context.traceStart = std::chrono::steady_clock::now();
+    context.isTracing = true;
+}
+
+void NnExecutor::stopTrace() {
+    context.isTracing = false;
+}
+
+void NnExecutor::writeChromeTrace(const char *path) {
+    FILE *fd = fopen(path, "w");
+    if (fd == NULL)
+        throw std::runtime_error("Cannot open trace file: " + std::string(path));
+
+    // Chrome trace / Perfetto format, one complete event ("ph": "X") per executed step
+    fprintf(fd, "{\"traceEvents\":[\n");
+    bool isFirst = true;
+    for (NnUint threadIndex = 0; threadIndex < context.nThreads; threadIndex++) {
+        for (const NnExecutorTraceEvent &event : threads[threadIndex].traceEvents) {
+            const NnExecutorStep *step = &steps[event.stepIndex];
+            const bool isOp = step->type == STEP_EXECUTE_OP;
+            fprintf(fd, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{\"%s\":%u,\"step\":%u}}",
+                isFirst ? "" : ",\n",
+                isOp ? step->opConfig->name : "sync_nodes",
+                isOp ? opCodeToString(step->opConfig->code) : "SYNC",
+                event.startNs / 1000.0,
+                (event.endNs - event.startNs) / 1000.0,
+                nodeConfig->nodeIndex,
+                threadIndex,
+                isOp ? "layer" : "segment",
+                isOp ? step->opConfig->index : step->arg0,
+                event.stepIndex);
+            isFirst = false;
+        }
+    }
+    fprintf(fd, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(fd);
 }
 
 NnUint NnExecutor::getTotalTime(NnExecutorStepType type) {
     assert((NnUint)type < N_STEP_TYPES);
     return context.totalTime[type];
 }
+
+NnUint NnExecutor::getSpinTime() {
+    NnUint total = 0;
+    for (NnUint threadIndex = 0; threadIndex < context.nThreads; threadIndex++)
+        total += threads[threadIndex].spinTime;
+    return total;
+}
+
+NnUint NnExecutor::getNBarriers() {
+    return (NnUint)steps.size() - nElidedBarriers;
+}
+
+NnUint NnExecutor::getNElidedBarriers() {
+    return nElidedBarriers;
+}
+
+NnUint NnExecutor::getSleepTime() {
+    NnUint total = 0;
+    for (NnUint threadIndex = 0; threadIndex < context.nThreads; threadIndex++)
+        total += threads[threadIndex].sleepTime;
+    return total;
+}
@@ -3,14 +3,32 @@
 
 #include "nn-core.hpp"
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <vector>
 #include "pthread.h"
 
+typedef struct {
+    const NnByte *memory; // the whole buffer or pipe, buffers may share memory with other buffers
+    NnSize2D memorySize;
+    NnPointerType pointerType;
+    bool isWrite;
+    bool isSplit; // the thread touches only the columns of its own split range
+} NnOpAccess;
+
+typedef struct {
+    NnUint nUnits; // the columns of every row are split between threads by SPLIT_THREADS over units
+    NnUint unitSize; // columns per unit
+    std::vector<NnOpAccess> accesses;
+} NnOpSplit;
+
 class NnDeviceSegment {
 public:
     virtual ~NnDeviceSegment() {};
     virtual void loadWeight(NnUint opIndex, NnSize nBytes, NnByte *weight) = 0;
     virtual void forward(NnUint opIndex, NnUint nThreads, NnUint threadIndex, NnUint batchSize) = 0;
+    // Describes which memory the op touches per thread, false if unknown, then the op is always surrounded by barriers
+    virtual bool getOpSplit(NnUint opIndex, NnOpSplit *split) { return false; }
 };
 
 class NnDevice {
@@ -51,13 +69,27 @@ enum NnExecutorStepType {
 
 #define N_STEP_TYPES STEP_SYNC_NODES + 1
 
+// Cap of recorded profiler events per thread, about 24 MB per thread
+#define DEFAULT_MAX_TRACE_EVENTS_PER_THREAD (1 << 20)
+
+// How long a thread spins on the step barrier before it parks, in microseconds. Most steps of a decode
+// finish within this time, a longer spin mostly burns the CPU of a thread waiting for a slow sync
+#define DEFAULT_SPIN_BUDGET_US 50
+
 typedef struct {
     NnExecutorStepType type;
     NnDeviceSegment *segment;
     NnUint arg0;
     NnOpConfig *opConfig;
+    bool needsBarrier; // false if threads may start the next step before all threads finish this one
 } NnExecutorStep;
 
+typedef struct {
+    NnUint stepIndex;
+    std::uint64_t startNs;
+    std::uint64_t endNs;
+} NnExecutorTraceEvent;
+
 typedef struct {
     NnUint nThreads;
     NnUint nSteps;
@@ -69,12 +101,34 @@ typedef struct {
     NnUint batchSize;
     Timer *timer;
     NnUint totalTime[N_STEP_TYPES];
+
+    // profiler, every thread records its steps into its own event list
+    bool isTracing;
+    NnSize maxTraceEventsPerThread;
+    std::chrono::steady_clock::time_point traceStart;
+
+    // step barrier, threads spin up to spinBudgetUs and then sleep on stepCond
+    NnUint spinBudgetUs;
+    std::atomic_uint nSleepingThreads;
+    std::mutex stepMutex;
+    std::condition_variable stepCond;
+
+    // thread pool, threads 1..nThreads-1 are parked between forwards
+    std::mutex poolMutex;
+    std::condition_variable poolStartCond;
+    std::condition_variable poolDoneCond;
+    NnUint poolGeneration;
+    NnUint poolDoneThreadCount;
+    bool isPoolAlive;
 } NnExecutorContext;
 
 typedef struct {
     NnUint threadIndex;
     NnExecutorContext *context;
     PthreadHandler handler;
+    NnUint spinTime;
+    NnUint sleepTime;
+    std::vector<NnExecutorTraceEvent> traceEvents;
 } NnExecutorThread;
 
 class NnExecutor {
@@ -85,12 +139,26 @@ private:
     std::vector<NnExecutorStep> steps;
     NnExecutorThread *threads;
     NnExecutorContext context;
+    NnUint nElidedBarriers;
+    void elideBarriers();
+    void startPool();
+    void stopPool();
+    void waitForPool();
 public:
     NnExecutor(NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnDevice *device, NnNetExecution *netExecution, NnNodeSynchronizer *synchronizer, bool benchmark);
     ~NnExecutor();
     void loadWeight(const char *name, NnUint index, NnSize nBytes, NnByte *weight);
+    void setSpinBudget(NnUint spinBudgetUs);
+    void pinThreads(const std::vector<NnUint> &cpuIndexes);
+    void startTrace(NnSize maxEventsPerThread);
+    void stopTrace();
+    void writeChromeTrace(const char *path);
     void forward();
     NnUint getTotalTime(NnExecutorStepType type);
+    NnUint getSpinTime();
+    NnUint getSleepTime();
+    NnUint getNBarriers();
+    NnUint getNElidedBarriers();
 };
 
 #endif
\ No newline at end of file
@@ -11,7 +11,9 @@ typedef SSIZE_T ssize_t;
 #include <unistd.h>
 #endif
 #include "nn-network.hpp"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <stdexcept>
 #include <vector>
@@ -552,7 +554,199 @@ static void syncNodeSlices(bool onlyFromWorkerToRoot, NnNetwork *network, NnUint
     }
 }
 
-NnNetworkNodeSynchronizer::NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig) {
+static bool isAllReduceSync(NnSyncType syncType) {
+    return syncType == SYNC_ALL_REDUCE_RING || syncType == SYNC_ALL_REDUCE_HALVING;
+}
+
+NnAllReduce::NnAllReduce(NnNetwork *network, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnAllReduceTransport *transport) {
+    this->network = network;
+    this->transport = transport;
+    this->nodeIndex = nodeConfig->nodeIndex;
+    this->nNodes = netConfig->nNodes;
+
+    NnUint maxLength = 0;
+    NnSize maxBytes = 0;
+    for (NnUint segmentIndex = 0; segmentIndex < nodeConfig->nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+        for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
+            NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
+            if (!isAllReduceSync(syncConfig->syncType))
+                continue;
+            if (syncConfig->syncType == SYNC_ALL_REDUCE_HALVING && (nNodes & (nNodes - 1)) != 0)
+                throw std::invalid_argument("Recursive halving all-reduce requires a power of two nodes");
+            NnSize2D *size = &netConfig->pipes[syncConfig->pipeIndex].size;
+            maxLength = std::max(maxLength, size->x);
+            maxBytes = std::max(maxBytes, getBytes(size->floatType, size->x));
+        }
+    }
+    // A step moves at most one row of every batch
+    sendBuffer.resize(maxBytes * netConfig->nBatches);
+    recvBuffer.resize(maxBytes * netConfig->nBatches);
+    sumBuffer.resize(2 * maxLength);
+}
+
+void NnAllReduce::reduce(NnSyncType syncType, NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize) {
+    if (nNodes == 1 || batchSize == 0)
+        return;
+    if (syncType == SYNC_ALL_REDUCE_RING)
+        ring(pipe, floatType, n, batchSize);
+    else if (syncType == SYNC_ALL_REDUCE_HALVING)
+        halving(pipe, floatType, n, batchSize);
+    else
+        throw std::invalid_argument("Unknown all-reduce type");
+}
+
+void NnAllReduce::exchange(NnUint sendNodeIndex, const NnByte *sendData, NnSize sendSize, NnUint recvNodeIndex, NnByte *recvData, NnSize recvSize) {
+    // Socket s of the node k connects to the node s when s < k, otherwise to the node s + 1
+    NnUint sendSocketIndex = sendNodeIndex < nodeIndex ? sendNodeIndex : sendNodeIndex - 1;
+    NnUint recvSocketIndex = recvNodeIndex < nodeIndex ? recvNodeIndex : recvNodeIndex - 1;
+    if (transport != nullptr) {
+        transport->exchange(sendSocketIndex, sendData, sendSize, recvSocketIndex, recvData, recvSize);
+        return;
+    }
+    // Pieces of the send and the receive alternate, so two nodes sending to each other
+    // never both block on full socket buffers, whatever the batch size
+    for (NnSize offset = 0; offset < sendSize || offset < recvSize; offset += MAX_CHUNK_SIZE) {
+        if (offset < sendSize)
+            network->write(sendSocketIndex, &sendData[offset], std::min((NnSize)MAX_CHUNK_SIZE, sendSize - offset));
+        if (offset < recvSize)
+            network->read(recvSocketIndex, &recvData[offset], std::min((NnSize)MAX_CHUNK_SIZE, recvSize - offset));
+    }
+}
+
+void NnAllReduce::add(NnFloatType floatType, NnByte *output, const NnByte *input, NnUint n) {
+    if (floatType == F_32) {
+        float *o = (float *)output;
+        const float *i = (const float *)input;
+        for (NnUint j = 0; j < n; j++)
+            o[j] += i[j];
+    } else if (floatType == F_Q80) {
+        // Partial sums are requantized after every hop
+        float *o = sumBuffer.data();
+        float *i = &o[n];
+        dequantizeQ80toF32((const NnBlockQ80 *)output, o, n, 1, 0);
+        dequantizeQ80toF32((const NnBlockQ80 *)input, i, n, 1, 0);
+        for (NnUint j = 0; j < n; j++)
+            o[j] += i[j];
+        quantizeF32toQ80(o, (NnBlockQ80 *)output, n, 1, 0);
+    } else if (floatType == F_Q40) {
+        float *o = sumBuffer.data();
+        float *i = &o[n];
+        dequantizeQ40toF32((const NnBlockQ40 *)output, o, n, 1, 0);
+        dequantizeQ40toF32((const NnBlockQ40 *)input, i, n, 1, 0);
+        for (NnUint j = 0; j < n; j++)
+            o[j] += i[j];
+        quantizeF32toQ40(o, (NnBlockQ40 *)output, n, 1, 0);
+    } else {
+        throw std::invalid_argument("Unsupported all-reduce float type");
+    }
+}
+
+const NnByte *NnAllReduce::packRows(NnByte *pipe, NnSize rowBytes, NnUint batchSize, NnSize offset, NnSize bytes) {
+    // The same range of every row is sent as one message
+    if (batchSize == 1)
+        return &pipe[offset];
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++)
+        std::memcpy(&sendBuffer[batchIndex * bytes], &pipe[batchIndex * rowBytes + offset], bytes);
+    return sendBuffer.data();
+}
+
+void NnAllReduce::reduceStep(NnUint sendNodeIndex, NnUint recvNodeIndex, NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize,
+    NnUint sendStart, NnUint sendEnd, NnUint recvStart, NnUint recvEnd) {
+    // Ranges are in blocks, the received range is added to the own partial sums
+    const NnUint blockSize = getBlockSize(floatType);
+    const NnSize rowBytes = getBytes(floatType, n);
+    const NnSize sendBytes = getBytes(floatType, (sendEnd - sendStart) * blockSize);
+    const NnSize recvOffset = getBytes(floatType, recvStart * blockSize);
+    const NnUint recvLength = (recvEnd - recvStart) * blockSize;
+    const NnSize recvBytes = getBytes(floatType, recvLength);
+    const NnByte *sendData = packRows(pipe, rowBytes, batchSize, getBytes(floatType, sendStart * blockSize), sendBytes);
+    exchange(sendNodeIndex, sendData, batchSize * sendBytes, recvNodeIndex, recvBuffer.data(), batchSize * recvBytes);
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++)
+        add(floatType, &pipe[batchIndex * rowBytes + recvOffset], &recvBuffer[batchIndex * recvBytes], recvLength);
+}
+
+void NnAllReduce::gatherStep(NnUint sendNodeIndex, NnUint recvNodeIndex, NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize,
+    NnUint sendStart, NnUint sendEnd, NnUint recvStart, NnUint recvEnd) {
+    // The received range is already summed, it replaces the own partial sums
+    const NnUint blockSize = getBlockSize(floatType);
+    const NnSize rowBytes = getBytes(floatType, n);
+    const NnSize sendBytes = getBytes(floatType, (sendEnd - sendStart) * blockSize);
+    const NnSize recvOffset = getBytes(floatType, recvStart * blockSize);
+    const NnSize recvBytes = getBytes(floatType, (recvEnd - recvStart) * blockSize);
+    const NnByte *sendData = packRows(pipe, rowBytes, batchSize, getBytes(floatType, sendStart * blockSize), sendBytes);
+    if (batchSize == 1) {
+        exchange(sendNodeIndex, sendData, sendBytes, recvNodeIndex, &pipe[recvOffset], recvBytes);
+        return;
+    }
+    exchange(sendNodeIndex, sendData, batchSize * sendBytes, recvNodeIndex, recvBuffer.data(), batchSize * recvBytes);
+    for (NnUint batchIndex = 0; batchIndex < batchSize; batchIndex++)
+        std::memcpy(&pipe[batchIndex * rowBytes + recvOffset], &recvBuffer[batchIndex * recvBytes], recvBytes);
+}
+
+void NnAllReduce::ring(NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize) {
+    // The row is split into nNodes chunks, every step moves one chunk to the next node
+    const NnUint nBlocks = n / getBlockSize(floatType);
+    const NnUint next = (nodeIndex + 1) % nNodes;
+    const NnUint prev = (nodeIndex + nNodes - 1) % nNodes;
+    // The chunk c covers the blocks from chunkStart(c) to chunkStart(c + 1)
+    auto chunkStart = [&](NnUint chunkIndex) {
+        SPLIT_THREADS(start, end, nBlocks, nNodes, chunkIndex);
+        (void)end;
+        return start;
+    };
+
+    for (NnUint step = 0; step < nNodes - 1; step++) {
+        NnUint sendChunk = (nodeIndex + nNodes - step) % nNodes;
+        NnUint recvChunk = (nodeIndex + nNodes - step - 1) % nNodes;
+        reduceStep(next, prev, pipe, floatType, n, batchSize,
+            chunkStart(sendChunk), chunkStart(sendChunk + 1), chunkStart(recvChunk), chunkStart(recvChunk + 1));
+    }
+    // Now the node k holds the complete sum of the chunk k + 1
+    for (NnUint step = 0; step < nNodes - 1; step++) {
+        NnUint sendChunk = (nodeIndex + 1 + nNodes - step) % nNodes;
+        NnUint recvChunk = (nodeIndex + nNodes - step) % nNodes;
+        gatherStep(next, prev, pipe, floatType, n, batchSize,
+            chunkStart(sendChunk), chunkStart(sendChunk + 1), chunkStart(recvChunk), chunkStart(recvChunk + 1));
+    }
+}
+
+void NnAllReduce::halving(NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize) {
+    // Every step exchanges half of the current range with the partner differing in one bit of the node index
+    NnUint start = 0;
+    NnUint end = n / getBlockSize(floatType);
+    std::vector<NnUint> history;
+
+    for (NnUint distance = nNodes / 2; distance > 0; distance /= 2) {
+        NnUint partner = nodeIndex ^ distance;
+        NnUint mid = start + (end - start) / 2;
+        bool keepLow = (nodeIndex & distance) == 0;
+        NnUint keepStart = keepLow ? start : mid;
+        NnUint keepEnd = keepLow ? mid : end;
+        NnUint sendStart = keepLow ? mid : start;
+        NnUint sendEnd = keepLow ? end : mid;
+        reduceStep(partner, partner, pipe, floatType, n, batchSize, sendStart, sendEnd, keepStart, keepEnd);
+        history.push_back(start);
+        history.push_back(end);
+        start = keepStart;
+        end = keepEnd;
+    }
+    for (NnUint distance = 1; distance < nNodes; distance *= 2) {
+        NnUint partner = nodeIndex ^ distance;
+        NnUint parentEnd = history.back();
+        history.pop_back();
+        NnUint parentStart = history.back();
+        history.pop_back();
+        NnUint otherStart = start == parentStart ? end : parentStart;
+        NnUint otherEnd = start == parentStart ? parentEnd : start;
+        gatherStep(partner, partner, pipe, floatType, n, batchSize, start, end, otherStart, otherEnd);
+        start = parentStart;
+        end = parentEnd;
+    }
+}
+
+NnNetworkNodeSynchronizer::NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig)
+    : allReduce(network, netConfig, nodeConfig) {
     this->network = network;
     this->execution = execution;
     this->netConfig = netConfig;
@@ -568,6 +762,13 @@ void NnNetworkNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUin
         NnPipeConfig *pipeConfig = &netConfig->pipes[syncConfig->pipeIndex];
         NnSize batchBytes = getBytes(pipeConfig->size.floatType, pipeConfig->size.x);
 
+        if (isAllReduceSync(syncConfig->syncType)) {
+            // Every step depends on the previous one, so a single thread drives the whole exchange for all batch rows
+            if (threadIndex == 0)
+                allReduce.reduce(syncConfig->syncType, pipe, pipeConfig->size.floatType, pipeConfig->size.x, execution->batchSize);
+            continue;
+        }
+
         for (NnUint batchIndex = 0; batchIndex < execution->batchSize; batchIndex++) {
             NnByte *pipeBatch = &pipe[batchIndex * batchBytes];
 
@@ -584,6 +785,277 @@ void NnNetworkNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUin
     }
 }
 
+NnIoQueue::NnIoQueue() {
+    head.exchange(0);
+    tail.exchange(0);
+}
+
+bool NnIoQueue::push(const NnIoTask *task) {
+    NnUint t = tail.load();
+    if (t - head.load() == IO_QUEUE_CAPACITY)
+        return false;
+    tasks[t & (IO_QUEUE_CAPACITY - 1)] = *task;
+    tail.store(t + 1);
+    return true;
+}
+
+bool NnIoQueue::pop(NnIoTask *task) {
+    NnUint h = head.load();
+    if (h == tail.load())
+        return false;
+    *task = tasks[h & (IO_QUEUE_CAPACITY - 1)];
+    head.store(h + 1);
+    return true;
+}
+
+bool NnIoQueue::isEmpty() {
+    return head.load() == tail.load();
+}
+
+template <typename Predicate>
+static bool spinFor(NnUint budgetUs, Predicate predicate) {
+    auto start = std::chrono::steady_clock::now();
+    for (NnUint i = 1; ; i++) {
+        if (predicate())
+            return true;
+        if ((i & 63) == 0) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            if (elapsed.count() >= budgetUs)
+                return false;
+        }
+    }
+}
+
+static void *ioThreadHandler(void *arg) {
+    NnIoThread *thread = (NnIoThread *)arg;
+    NnIoContext *context = thread->context;
+    NnIoQueue *queue = thread->queue;
+
+    while (true) {
+        NnIoTask task;
+        if (!queue->pop(&task)) {
+            if (!context->isAlive.load())
+                break;
+            if (!spinFor(IO_SPIN_BUDGET_US, [&] { return !queue->isEmpty() || !context->isAlive.load(); })) {
+                std::unique_lock<std::mutex> lock(context->ioMutex);
+                context->nSleepingIoThreads++;
+                context->ioCond.wait(lock, [&] { return !queue->isEmpty() || !context->isAlive.load(); });
+                context->nSleepingIoThreads--;
+            }
+            continue;
+        }
+
+        // After a failure the remaining tasks are only counted down, the stream is out of sync anyway
+        if (!context->hasError.load()) {
+            try {
+                if (task.type == IO_TASK_WRITE)
+                    context->network->write(thread->socketIndex, task.data, task.size);
+                else
+                    context->network->read(thread->socketIndex, task.data, task.size);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(context->errorMutex);
+                if (!context->hasError.exchange(true))
+                    context->error = std::current_exception();
+            }
+        }
+
+        if (context->nPendingTasks.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(context->doneMutex);
+            context->doneCond.notify_one();
+        }
+    }
+    return 0;
+}
+
+NnIoNodeSynchronizer::NnIoNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig)
+    : allReduce(network, netConfig, nodeConfig, this) {
+    this->execution = execution;
+    this->netConfig = netConfig;
+    this->nodeConfig = nodeConfig;
+
+    context.network = network;
+    context.nPendingTasks.exchange(0);
+    context.isAlive.exchange(true);
+    context.hasError.exchange(false);
+    context.nSleepingIoThreads.exchange(0);
+
+    ioThreads = new NnIoThread[network->nSockets];
+    for (NnUint i = 0; i < network->nSockets; i++) {
+        NnIoThread *thread = &ioThreads[i];
+        thread->socketIndex = i;
+        thread->context = &context;
+        thread->queue = new NnIoQueue();
+    }
+    nIoThreads = 0;
+    for (NnUint i = 0; i < network->nSockets; i++) {
+        int result = pthread_create(&ioThreads[i].handler, NULL, (PthreadFunc)ioThreadHandler, (void *)&ioThreads[i]);
+        if (result != 0) {
+            stopIoThreads();
+            throw std::runtime_error("Failed to create I/O thread");
+        }
+        nIoThreads++;
+    }
+    printf("🔌 I/O threads: %u\n", nIoThreads);
+}
+
+NnIoNodeSynchronizer::~NnIoNodeSynchronizer() {
+    stopIoThreads();
+}
+
+void NnIoNodeSynchronizer::stopIoThreads() {
+    // Joins the threads started so far, the constructor calls it when a later thread fails to start
+    context.isAlive.store(false);
+    {
+        std::lock_guard<std::mutex> lock(context.ioMutex);
+    }
+    context.ioCond.notify_all();
+    for (NnUint i = 0; i < nIoThreads; i++)
+        pthread_join(ioThreads[i].handler, NULL);
+    for (NnUint i = 0; i < context.network->nSockets; i++)
+        delete ioThreads[i].queue;
+    delete[] ioThreads;
+    nIoThreads = 0;
+    ioThreads = nullptr;
+}
+
+void NnIoNodeSynchronizer::enqueue(NnUint socketIndex, NnIoTaskType type, NnByte *data, NnSize size) {
+    NnIoTask task;
+    task.type = type;
+    task.data = data;
+    task.size = size;
+    while (!ioThreads[socketIndex].queue->push(&task))
+        wakeUpIoThreads();
+}
+
+void NnIoNodeSynchronizer::wakeUpIoThreads() {
+    if (context.nSleepingIoThreads.load() > 0) {
+        {
+            std::lock_guard<std::mutex> lock(context.ioMutex);
+        }
+        context.ioCond.notify_all();
+    }
+}
+
+void NnIoNodeSynchronizer::waitForIoThreads() {
+    auto isDone = [&] { return context.nPendingTasks.load() == 0; };
+    if (!spinFor(IO_SPIN_BUDGET_US, isDone)) {
+        std::unique_lock<std::mutex> lock(context.doneMutex);
+        context.doneCond.wait(lock, isDone);
+    }
+    if (context.hasError.load()) {
+        std::exception_ptr error = context.error;
+        context.error = nullptr;
+        context.hasError.store(false);
+        std::rethrow_exception(error);
+    }
+}
+
+void NnIoNodeSynchronizer::sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) {
+    // Other compute threads go straight to the step barrier and park there, leaving the cores to the I/O threads.
+    // The sync step still ends when every transfer of the segment is done: sockets are served in parallel,
+    // but no op of the next segment starts on a slice that has already arrived
+    if (threadIndex != 0)
+        return;
+
+    NnSegmentConfig *segmentConfig = &nodeConfig->segments[segmentIndex];
+    bool isWorker = nodeConfig->nodeIndex != 0;
+    NnUint nSockets = context.network->nSockets;
+
+    // The counter must cover every task before the first one is published
+    NnUint nTasks = 0;
+    for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
+        NnSyncType syncType = segmentConfig->syncs[syncIndex].syncType;
+        NnUint nTasksPerBatch;
+        if (syncType == SYNC_WITH_ROOT)
+            nTasksPerBatch = isWorker ? 1 : nSockets;
+        else if (syncType == SYNC_NODE_SLICES)
+            nTasksPerBatch = 2 * nSockets;
+        else if (syncType == SYNC_NODE_SLICES_EXCEPT_ROOT)
+            nTasksPerBatch = isWorker ? 1 : nSockets;
+        else if (isAllReduceSync(syncType))
+            nTasksPerBatch = 0;
+        else
+            throw std::invalid_argument("Unknown sync type");
+        nTasks += nTasksPerBatch * execution->batchSize;
+    }
+
+    if (nTasks > 0) {
+        context.nPendingTasks.store(nTasks);
+        enqueueSyncs(segmentConfig);
+        wakeUpIoThreads();
+        waitForIoThreads();
+    }
+
+    // All-reduce steps depend on each other, so they run here once the queued transfers are done.
+    // Every step of all batch rows is one exchange served by the I/O threads, see exchange()
+    for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
+        NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
+        if (!isAllReduceSync(syncConfig->syncType))
+            continue;
+        NnPipeConfig *pipeConfig = &netConfig->pipes[syncConfig->pipeIndex];
+        allReduce.reduce(syncConfig->syncType, execution->pipes[syncConfig->pipeIndex], pipeConfig->size.floatType, pipeConfig->size.x, execution->batchSize);
+    }
+}
+
+void NnIoNodeSynchronizer::exchange(NnUint sendSocketIndex, const NnByte *sendData, NnSize sendSize, NnUint recvSocketIndex, NnByte *recvData, NnSize recvSize) {
+    // The same pieces as the direct exchange of NnAllReduce, queued in turn, so a socket
+    // that both sends and receives in this step never blocks on a full buffer
+    NnUint nTasks = (NnUint)((sendSize + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE + (recvSize + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE);
+    if (nTasks == 0)
+        return;
+    context.nPendingTasks.store(nTasks);
+    for (NnSize offset = 0; offset < sendSize || offset < recvSize; offset += MAX_CHUNK_SIZE) {
+        if (offset < sendSize)
+            enqueue(sendSocketIndex, IO_TASK_WRITE, (NnByte *)&sendData[offset], std::min((NnSize)MAX_CHUNK_SIZE, sendSize - offset));
+        if (offset < recvSize)
+            enqueue(recvSocketIndex, IO_TASK_READ, &recvData[offset], std::min((NnSize)MAX_CHUNK_SIZE, recvSize - offset));
+    }
+    wakeUpIoThreads();
+    waitForIoThreads();
+}
+
+void NnIoNodeSynchronizer::enqueueSyncs(NnSegmentConfig *segmentConfig) {
+    NnUint nodeIndex = nodeConfig->nodeIndex;
+    NnUint nNodes = netConfig->nNodes;
+    bool isWorker = nodeIndex != 0;
+    NnUint nSockets = context.network->nSockets;
+
+    for (NnUint syncIndex = 0; syncIndex < segmentConfig->nSyncs; syncIndex++) {
+        NnSyncConfig *syncConfig = &segmentConfig->syncs[syncIndex];
+        if (isAllReduceSync(syncConfig->syncType))
+            continue;
+        NnByte *pipe = execution->pipes[syncConfig->pipeIndex];
+        NnPipeConfig *pipeConfig = &netConfig->pipes[syncConfig->pipeIndex];
+        NnSize batchBytes = getBytes(pipeConfig->size.floatType, pipeConfig->size.x);
+        NnSize sliceBytes = batchBytes / nNodes;
+
+        for (NnUint batchIndex = 0; batchIndex < execution->batchSize; batchIndex++) {
+            NnByte *pipeBatch = &pipe[batchIndex * batchBytes];
+
+            if (syncConfig->syncType == SYNC_WITH_ROOT) {
+                if (isWorker) {
+                    enqueue(ROOT_SOCKET_INDEX, IO_TASK_READ, pipeBatch, batchBytes);
+                } else {
+                    for (NnUint socketIndex = 0; socketIndex < nSockets; socketIndex++)
+                        enqueue(socketIndex, IO_TASK_WRITE, pipeBatch, batchBytes);
+                }
+            } else {
+                bool onlyFromWorkerToRoot = syncConfig->syncType == SYNC_NODE_SLICES_EXCEPT_ROOT;
+                if (onlyFromWorkerToRoot && isWorker) {
+                    enqueue(ROOT_SOCKET_INDEX, IO_TASK_WRITE, &pipeBatch[sliceBytes * nodeIndex], sliceBytes);
+                    continue;
+                }
+                for (NnUint socketIndex = 0; socketIndex < nSockets; socketIndex++) {
+                    NnUint sliceIndex = socketIndex >= nodeIndex ? socketIndex + 1 : socketIndex;
+                    if (!onlyFromWorkerToRoot)
+                        enqueue(socketIndex, IO_TASK_WRITE, &pipeBatch[sliceBytes * nodeIndex], sliceBytes);
+                    enqueue(socketIndex, IO_TASK_READ, &pipeBatch[sliceBytes * sliceIndex], sliceBytes);
+                }
+            }
+        }
+    }
+}
+
 static void writeString(NnNetwork *network, NnUint socketIndex, char *str) {
     NnUint bytes = std::strlen(str) + 1;
     network->write(socketIndex, &bytes, sizeof(NnUint));
@@ -709,8 +1181,8 @@ NnNodeConfig NnWorkerConfigReader::readNode() {
         bufferConfig->name = readString(network, ROOT_SOCKET_INDEX);
     }
 
-    for (NnUint segmentIndex = 0; segmentIndex < config->nSegments; segmentIndex++) {
-        NnSegmentConfig *segmentConfig = &config->segments[segmentIndex];
+    for (NnUint segmentIndex = 0; segmentIndex < config.nSegments; segmentIndex++) {
+        NnSegmentConfig *segmentConfig = &config.segments[segmentIndex];
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->nSyncs, sizeof(segmentConfig->nSyncs));
         network->read(ROOT_SOCKET_INDEX, &segmentConfig->nOps, sizeof(segmentConfig->nOps));
 
@@ -2,9 +2,16 @@
 #define NN_NETWORK_H
 
 #include "nn-executor.hpp"
+#include <exception>
 
 #define ROOT_SOCKET_INDEX 0
 
+// Must be a power of two
+#define IO_QUEUE_CAPACITY 1024
+
+// How long an I/O thread or the waiting compute thread spins before it parks, in microseconds
+#define IO_SPIN_BUDGET_US 200
+
 void initSockets();
 void cleanupSockets();
 int acceptSocket(int serverSocket);
@@ -62,18 +69,126 @@ public:
     void resetStats();
 };
 
+// Moves the data of one all-reduce step, node indexes are already mapped to socket indexes
+class NnAllReduceTransport {
+public:
+    virtual ~NnAllReduceTransport() {};
+    virtual void exchange(NnUint sendSocketIndex, const NnByte *sendData, NnSize sendSize, NnUint recvSocketIndex, NnByte *recvData, NnSize recvSize) = 0;
+};
+
+// Sums the pipe rows over all nodes in place: reduce-scatter followed by all-gather.
+// All batch rows move together, so every step is one exchange whatever the batch size
+class NnAllReduce {
+private:
+    NnNetwork *network;
+    NnAllReduceTransport *transport;
+    NnUint nodeIndex;
+    NnUint nNodes;
+    std::vector<NnByte> sendBuffer;
+    std::vector<NnByte> recvBuffer;
+    std::vector<float> sumBuffer;
+public:
+    // Without a transport the calling thread reads and writes the sockets
+    NnAllReduce(NnNetwork *network, NnNetConfig *netConfig, NnNodeConfig *nodeConfig, NnAllReduceTransport *transport = nullptr);
+    void reduce(NnSyncType syncType, NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize);
+private:
+    void ring(NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize);
+    void halving(NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize);
+    void reduceStep(NnUint partnerIndex, NnUint recvPartnerIndex, NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize,
+        NnUint sendStart, NnUint sendEnd, NnUint recvStart, NnUint recvEnd);
+    void gatherStep(NnUint partnerIndex, NnUint recvPartnerIndex, NnByte *pipe, NnFloatType floatType, NnUint n, NnUint batchSize,
+        NnUint sendStart, NnUint sendEnd, NnUint recvStart, NnUint recvEnd);
+    const NnByte *packRows(NnByte *pipe, NnSize rowBytes, NnUint batchSize, NnSize offset, NnSize bytes);
+    void exchange(NnUint sendNodeIndex, const NnByte *sendData, NnSize sendSize, NnUint recvNodeIndex, NnByte *recvData, NnSize recvSize);
+    void add(NnFloatType floatType, NnByte *output, const NnByte *input, NnUint n);
+};
+
 class NnNetworkNodeSynchronizer : public NnNodeSynchronizer {
 private:
     NnNetwork *network;
     NnNetExecution *execution;
     NnNetConfig *netConfig;
     NnNodeConfig *nodeConfig;
+    NnAllReduce allReduce;
 public:
     NnNetworkNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig);
     ~NnNetworkNodeSynchronizer() override {};
     void sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) override;
 };
 
+enum NnIoTaskType {
+    IO_TASK_WRITE,
+    IO_TASK_READ,
+};
+
+typedef struct {
+    NnIoTaskType type;
+    NnByte *data;
+    NnSize size;
+} NnIoTask;
+
+// Lock-free ring buffer, one compute thread pushes and one I/O thread pops
+class NnIoQueue {
+private:
+    NnIoTask tasks[IO_QUEUE_CAPACITY];
+    std::atomic_uint head;
+    std::atomic_uint tail;
+public:
+    NnIoQueue();
+    bool push(const NnIoTask *task);
+    bool pop(NnIoTask *task);
+    bool isEmpty();
+};
+
+typedef struct {
+    NnNetwork *network;
+    std::atomic_uint nPendingTasks;
+    std::atomic_bool isAlive;
+
+    // idle I/O threads park on ioCond, the compute thread waiting for the transfers parks on doneCond
+    std::atomic_uint nSleepingIoThreads;
+    std::mutex ioMutex;
+    std::condition_variable ioCond;
+    std::mutex doneMutex;
+    std::condition_variable doneCond;
+
+    std::atomic_bool hasError;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+} NnIoContext;
+
+typedef struct {
+    NnUint socketIndex;
+    NnIoContext *context;
+    NnIoQueue *queue;
+    PthreadHandler handler;
+} NnIoThread;
+
+// Every socket is owned by its own I/O thread, compute threads only enqueue transfers and wait for them.
+// This offloads the socket work from the compute threads, it does not overlap it with compute:
+// the next segment starts only after every transfer of the sync step is done
+class NnIoNodeSynchronizer : public NnNodeSynchronizer, private NnAllReduceTransport {
+private:
+    NnNetExecution *execution;
+    NnNetConfig *netConfig;
+    NnNodeConfig *nodeConfig;
+    NnUint nIoThreads;
+    NnIoThread *ioThreads;
+    NnIoContext context;
+    NnAllReduce allReduce;
+public:
+    NnIoNodeSynchronizer(NnNetwork *network, NnNetExecution *execution, NnNetConfig *netConfig, NnNodeConfig *nodeConfig);
+    ~NnIoNodeSynchronizer() override;
+    void sync(NnUint segmentIndex, NnUint nThreads, NnUint threadIndex) override;
+private:
+    void exchange(NnUint sendSocketIndex, const NnByte *sendData, NnSize sendSize, NnUint recvSocketIndex, NnByte *recvData, NnSize recvSize) override;
+    void stopIoThreads();
+    void enqueueSyncs(NnSegmentConfig *segmentConfig);
+    void enqueue(NnUint socketIndex, NnIoTaskType type, NnByte *data, NnSize size);
+    void wakeUpIoThreads();
+    void waitForIoThreads();
+};
+
 class NnRootConfigWriter {
 private:
     NnNetwork *network;
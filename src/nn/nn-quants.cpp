@@ -5,6 +5,8 @@
 #include <stdexcept>
 #include <cstdio>
 
+// The lookup table and the scalar conversions are shared by all variants, only the base build defines them
+#if !defined(NN_CPU_VARIANT)
 #if defined(CONVERT_F16_TO_F32_LOOKUP)
 float f16ToF32Lookup[65536];
 #endif
@@ -64,6 +66,8 @@ NnFp16 convertF32ToF16Impl(const float x) {
     return s | (e << 10) | (m >> 13);
 }
 
+#endif
+
 void quantizeF32toQ80(const float *input, NnBlockQ80 *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
     assert(n % Q80_BLOCK_SIZE == 0);
     const NnUint nBlocks = n / Q80_BLOCK_SIZE;
@@ -193,9 +197,81 @@ void dequantizeQ80toF32(const NnBlockQ80 *input, float* output, const NnUint k,
 void quantizeF32toQ40(const float *x, NnBlockQ40 *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
     assert(n % Q40_BLOCK_SIZE == 0);
     const NnUint nBlocks = n / Q40_BLOCK_SIZE;
-    const NnUint halfSize = Q40_BLOCK_SIZE / 2;
     SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
 
+#if defined(__ARM_NEON)
+    for (NnUint i = start; i < end; i++) {
+        const float *xi = &x[i * Q40_BLOCK_SIZE];
+        float32x4_t v[8];
+        float32x4_t maxVec = vld1q_f32(xi);
+        float32x4_t minVec = maxVec;
+        for (NnUint j = 0; j < 8; j++) {
+            v[j] = vld1q_f32(&xi[j * 4]);
+            maxVec = vmaxq_f32(maxVec, v[j]);
+            minVec = vminq_f32(minVec, v[j]);
+        }
+        // The value of the largest magnitude keeps its sign, the block uses the levels -8..7 of it
+        const float vMax = vmaxvq_f32(maxVec);
+        const float vMin = vminvq_f32(minVec);
+        const float max = -vMin > vMax ? vMin : vMax;
+
+        const float d = max / -8.0f;
+        const float id = d ? 1.0f / d : 0.0f;
+
+        NnBlockQ40 *o = &output[i];
+        o->d = CONVERT_F32_TO_F16(d);
+        const float32x4_t offset = vdupq_n_f32(8.5f);
+        const float32x4_t top = vdupq_n_f32(15.0f);
+        uint16x4_t q[4];
+        for (NnUint j = 0; j < 4; j++) {
+            const uint32x4_t lo = vcvtq_u32_f32(vminq_f32(vaddq_f32(vmulq_n_f32(v[j], id), offset), top));
+            const uint32x4_t hi = vcvtq_u32_f32(vminq_f32(vaddq_f32(vmulq_n_f32(v[j + 4], id), offset), top));
+            q[j] = vmovn_u32(vorrq_u32(lo, vshlq_n_u32(hi, 4)));
+        }
+        vst1q_u8(o->qs, vcombine_u8(vmovn_u16(vcombine_u16(q[0], q[1])), vmovn_u16(vcombine_u16(q[2], q[3]))));
+    }
+#elif defined(__AVX2__)
+    for (NnUint i = start; i < end; i++) {
+        const float *xi = &x[i * Q40_BLOCK_SIZE];
+        __m256 v[4];
+        __m256 maxVec = _mm256_loadu_ps(xi);
+        __m256 minVec = maxVec;
+        for (NnUint j = 0; j < 4; j++) {
+            v[j] = _mm256_loadu_ps(&xi[j * 8]);
+            maxVec = _mm256_max_ps(maxVec, v[j]);
+            minVec = _mm256_min_ps(minVec, v[j]);
+        }
+        __m128 m = _mm_max_ps(_mm256_castps256_ps128(maxVec), _mm256_extractf128_ps(maxVec, 1));
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+        __m128 n = _mm_min_ps(_mm256_castps256_ps128(minVec), _mm256_extractf128_ps(minVec, 1));
+        n = _mm_min_ps(n, _mm_movehl_ps(n, n));
+        n = _mm_min_ss(n, _mm_shuffle_ps(n, n, _MM_SHUFFLE(1, 1, 1, 1)));
+        // The value of the largest magnitude keeps its sign, the block uses the levels -8..7 of it
+        const float vMax = _mm_cvtss_f32(m);
+        const float vMin = _mm_cvtss_f32(n);
+        const float max = -vMin > vMax ? vMin : vMax;
+
+        const float d = max / -8.0f;
+        const float id = d ? 1.0f / d : 0.0f;
+
+        NnBlockQ40 *o = &output[i];
+        o->d = CONVERT_F32_TO_F16(d);
+        const __m256 idVec = _mm256_set1_ps(id);
+        const __m256 offset = _mm256_set1_ps(8.5f);
+        const __m256 top = _mm256_set1_ps(15.0f);
+        __m256i q[4];
+        for (NnUint j = 0; j < 4; j++)
+            q[j] = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(v[j], idVec), offset), top));
+        // The values 0..15 go to the low nibbles, the values 16..31 to the high nibbles
+        const __m256i q16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(
+            _mm256_or_si256(q[0], _mm256_slli_epi32(q[2], 4)),
+            _mm256_or_si256(q[1], _mm256_slli_epi32(q[3], 4))), 0xD8);
+        _mm_storeu_si128((__m128i *)o->qs,
+            _mm_packus_epi16(_mm256_castsi256_si128(q16), _mm256_extracti128_si256(q16, 1)));
+    }
+#else
+    const NnUint halfSize = Q40_BLOCK_SIZE / 2;
     for (NnUint i = start; i < end; i++) {
         float amax = 0.0f;
         float max = 0.0f;
@@ -224,6 +300,7 @@ void quantizeF32toQ40(const float *x, NnBlockQ40 *output, const NnUint n, const
             o->qs[j] = xi0 | (xi1 << 4);
         }
     }
+#endif
 }
 
 void dequantizeQ40toF32(const NnBlockQ40 *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
@@ -245,11 +322,339 @@ void dequantizeQ40toF32(const NnBlockQ40 *x, float *output, const NnUint n, cons
     }
 }
 
+#if !defined(NN_CPU_VARIANT)
+// Fits x ~ scale * q - min with q in <0; nMax> and min >= 0, the error of every value is multiplied by its importance.
+// It tries the scales (max - min) / (nMax + rMin + 0.1 * step) and refines each of them by weighted least squares
+static float fitScaleMin(const float *x, const float *importance, const NnUint n, const int nMax, const float rMin, const int nSteps, float *min) {
+    float xMin = x[0];
+    float xMax = x[0];
+    float sumW = 0.0f;
+    float sumX = 0.0f;
+    for (NnUint i = 0; i < n; i++) {
+        if (x[i] < xMin) xMin = x[i];
+        if (x[i] > xMax) xMax = x[i];
+        sumW += importance[i];
+        sumX += importance[i] * x[i];
+    }
+    if (xMin > 0.0f)
+        xMin = 0.0f;
+    if (xMax == xMin) {
+        *min = -xMin;
+        return 0.0f;
+    }
+
+    float scale = (xMax - xMin) / nMax;
+    float bestError = 0.0f;
+    for (NnUint i = 0; i < n; i++) {
+        const float diff = scale * lrintf((x[i] - xMin) / scale) + xMin - x[i];
+        bestError += importance[i] * diff * diff;
+    }
+    float bestScale = scale;
+    float bestXMin = xMin;
+    for (int step = 0; step <= nSteps; step++) {
+        const float iscale = (rMin + 0.1f * step + nMax) / (xMax - xMin);
+        float sumL = 0.0f;
+        float sumL2 = 0.0f;
+        float sumXL = 0.0f;
+        for (NnUint i = 0; i < n; i++) {
+            long l = lrintf(iscale * (x[i] - xMin));
+            l = l < 0 ? 0 : (l > nMax ? nMax : l);
+            sumL += importance[i] * l;
+            sumL2 += importance[i] * l * l;
+            sumXL += importance[i] * l * x[i];
+        }
+        const float det = sumW * sumL2 - sumL * sumL;
+        if (det <= 0.0f)
+            continue;
+        float thisScale = (sumW * sumXL - sumX * sumL) / det;
+        float thisMin = (sumL2 * sumX - sumL * sumXL) / det;
+        if (thisMin > 0.0f) {
+            thisMin = 0.0f;
+            thisScale = sumXL / sumL2;
+        }
+        float error = 0.0f;
+        for (NnUint i = 0; i < n; i++) {
+            long l = lrintf(iscale * (x[i] - xMin));
+            l = l < 0 ? 0 : (l > nMax ? nMax : l);
+            const float diff = thisScale * l + thisMin - x[i];
+            error += importance[i] * diff * diff;
+        }
+        if (error < bestError) {
+            bestError = error;
+            bestScale = thisScale;
+            bestXMin = thisMin;
+        }
+    }
+    *min = -bestXMin;
+    return bestScale;
+}
+
+void quantizeF32toQ4K(const float *x, NnBlockQ4K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q4K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q4K_BLOCK_SIZE;
+    const NnUint subSize = Q4K_BLOCK_SIZE / 8;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const float *xb = &x[i * Q4K_BLOCK_SIZE];
+        NnBlockQ4K *o = &output[i];
+        float scales[8];
+        float mins[8];
+        float maxScale = 0.0f;
+        float maxMin = 0.0f;
+        for (NnUint s = 0; s < 8; s++) {
+            // The large values of the sub-block are more important
+            const float *xs = &xb[s * subSize];
+            float sumX2 = 0.0f;
+            for (NnUint k = 0; k < subSize; k++)
+                sumX2 += xs[k] * xs[k];
+            const float avX = sqrtf(sumX2 / subSize);
+            float importance[subSize];
+            for (NnUint k = 0; k < subSize; k++)
+                importance[k] = avX + fabsf(xs[k]);
+            scales[s] = fitScaleMin(xs, importance, subSize, 15, -1.0f, 20, &mins[s]);
+            if (scales[s] > maxScale) maxScale = scales[s];
+            if (mins[s] > maxMin) maxMin = mins[s];
+        }
+
+        const float iscale = maxScale > 0.0f ? 63.0f / maxScale : 0.0f;
+        const float imin = maxMin > 0.0f ? 63.0f / maxMin : 0.0f;
+        std::memset(o->scales, 0, sizeof(o->scales));
+        for (NnUint s = 0; s < 8; s++) {
+            long ls = lrintf(iscale * scales[s]);
+            long lm = lrintf(imin * mins[s]);
+            ls = ls < 0 ? 0 : (ls > 63 ? 63 : ls);
+            lm = lm < 0 ? 0 : (lm > 63 ? 63 : lm);
+            if (s < 4) {
+                o->scales[s] |= ls;
+                o->scales[s + 4] |= lm;
+            } else {
+                o->scales[s + 4] = (ls & 0xF) | ((lm & 0xF) << 4);
+                o->scales[s - 4] |= (ls >> 4) << 6;
+                o->scales[s] |= (lm >> 4) << 6;
+            }
+        }
+        o->d = CONVERT_F32_TO_F16(maxScale / 63.0f);
+        o->dmin = CONVERT_F32_TO_F16(maxMin / 63.0f);
+
+        // The weights are quantized with the scales as they are stored
+        const float d = CONVERT_F16_TO_F32(o->d);
+        const float dmin = CONVERT_F16_TO_F32(o->dmin);
+        std::memset(o->qs, 0, sizeof(o->qs));
+        for (NnUint s = 0; s < 8; s++) {
+            std::uint8_t ls, lm;
+            getScaleMinQ4K(o, s, &ls, &lm);
+            const float dl = d * ls;
+            const float ml = dmin * lm;
+            for (NnUint k = 0; k < subSize; k++) {
+                long q = dl != 0.0f ? lrintf((xb[s * subSize + k] + ml) / dl) : 0;
+                q = q < 0 ? 0 : (q > 15 ? 15 : q);
+                o->qs[(s / 2) * subSize + k] |= q << (4 * (s % 2));
+            }
+        }
+    }
+}
+
+void dequantizeQ4KtoF32(const NnBlockQ4K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q4K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q4K_BLOCK_SIZE;
+    const NnUint subSize = Q4K_BLOCK_SIZE / 8;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const NnBlockQ4K *b = &x[i];
+        const float d = CONVERT_F16_TO_F32(b->d);
+        const float dmin = CONVERT_F16_TO_F32(b->dmin);
+        for (NnUint s = 0; s < 8; s++) {
+            std::uint8_t ls, lm;
+            getScaleMinQ4K(b, s, &ls, &lm);
+            const float dl = d * ls;
+            const float ml = dmin * lm;
+            for (NnUint k = 0; k < subSize; k++) {
+                const int q = (b->qs[(s / 2) * subSize + k] >> (4 * (s % 2))) & 0xF;
+                output[i * Q4K_BLOCK_SIZE + s * subSize + k] = dl * q - ml;
+            }
+        }
+    }
+}
+
+// Fits x ~ scale * q with q in <-nMax; nMax - 1>. The value with the largest magnitude maps to about -nMax,
+// a few scales around it are refined by least squares
+static float fitScale(const float *x, const NnUint n, const int nMax) {
+    float max = 0.0f;
+    for (NnUint i = 0; i < n; i++) {
+        if (fabsf(x[i]) > fabsf(max))
+            max = x[i];
+    }
+    if (max == 0.0f)
+        return 0.0f;
+
+    float bestScale = max / -nMax;
+    float bestError = -1.0f;
+    for (int step = -9; step <= 9; step++) {
+        const float iscale = -(nMax + 0.1f * step) / max;
+        float sumXL = 0.0f;
+        float sumL2 = 0.0f;
+        for (NnUint i = 0; i < n; i++) {
+            long l = lrintf(iscale * x[i]);
+            l = l < -nMax ? -nMax : (l > nMax - 1 ? nMax - 1 : l);
+            sumXL += x[i] * l;
+            sumL2 += (float)(l * l);
+        }
+        if (sumL2 == 0.0f)
+            continue;
+        const float scale = sumXL / sumL2;
+        float error = 0.0f;
+        for (NnUint i = 0; i < n; i++) {
+            long l = lrintf(iscale * x[i]);
+            l = l < -nMax ? -nMax : (l > nMax - 1 ? nMax - 1 : l);
+            const float diff = x[i] - scale * l;
+            error += diff * diff;
+        }
+        if (bestError < 0.0f || error < bestError) {
+            bestError = error;
+            bestScale = scale;
+        }
+    }
+    return bestScale;
+}
+
+void quantizeF32toQ6K(const float *x, NnBlockQ6K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q6K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q6K_BLOCK_SIZE;
+    const NnUint nSubBlocks = Q6K_BLOCK_SIZE / 16;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const float *xb = &x[i * Q6K_BLOCK_SIZE];
+        NnBlockQ6K *o = &output[i];
+
+        float scales[nSubBlocks];
+        float maxScale = 0.0f;
+        for (NnUint s = 0; s < nSubBlocks; s++) {
+            scales[s] = fitScale(&xb[s * 16], 16, 32);
+            if (fabsf(scales[s]) > fabsf(maxScale))
+                maxScale = scales[s];
+        }
+
+        const float iscale = maxScale != 0.0f ? -128.0f / maxScale : 0.0f;
+        for (NnUint s = 0; s < nSubBlocks; s++) {
+            long l = lrintf(iscale * scales[s]);
+            o->scales[s] = (std::int8_t)(l > 127 ? 127 : (l < -128 ? -128 : l));
+        }
+        o->d = CONVERT_F32_TO_F16(iscale != 0.0f ? 1.0f / iscale : 0.0f);
+
+        const float d = CONVERT_F16_TO_F32(o->d);
+        std::memset(o->ql, 0, sizeof(o->ql));
+        std::memset(o->qh, 0, sizeof(o->qh));
+        for (NnUint j = 0; j < Q6K_BLOCK_SIZE; j++) {
+            const float dl = d * o->scales[j / 16];
+            long q = dl != 0.0f ? lrintf(xb[j] / dl) : 0;
+            q = (q < -32 ? -32 : (q > 31 ? 31 : q)) + 32;
+            const NnUint c = j / 32;
+            const NnUint k = j % 32;
+            o->ql[16 * c + k % 16] |= (q & 0xF) << (4 * (k / 16));
+            o->qh[8 * c + k % 8] |= (q >> 4) << (2 * (k / 8));
+        }
+    }
+}
+
+void dequantizeQ6KtoF32(const NnBlockQ6K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q6K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q6K_BLOCK_SIZE;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const NnBlockQ6K *b = &x[i];
+        const float d = CONVERT_F16_TO_F32(b->d);
+        for (NnUint j = 0; j < Q6K_BLOCK_SIZE; j++) {
+            const NnUint c = j / 32;
+            const NnUint k = j % 32;
+            const int low = (b->ql[16 * c + k % 16] >> (4 * (k / 16))) & 0xF;
+            const int high = (b->qh[8 * c + k % 8] >> (2 * (k / 8))) & 3;
+            output[i * Q6K_BLOCK_SIZE + j] = d * b->scales[j / 16] * ((low | (high << 4)) - 32);
+        }
+    }
+}
+
+void quantizeF32toQ2K(const float *x, NnBlockQ2K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q2K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q2K_BLOCK_SIZE;
+    const NnUint nSubBlocks = Q2K_BLOCK_SIZE / 16;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const float *xb = &x[i * Q2K_BLOCK_SIZE];
+        NnBlockQ2K *o = &output[i];
+
+        // With 4 levels the error of the large values dominates, they get the importance |x|
+        float importance[Q2K_BLOCK_SIZE];
+        for (NnUint j = 0; j < Q2K_BLOCK_SIZE; j++)
+            importance[j] = fabsf(xb[j]);
+        float scales[nSubBlocks];
+        float mins[nSubBlocks];
+        float maxScale = 0.0f;
+        float maxMin = 0.0f;
+        for (NnUint s = 0; s < nSubBlocks; s++) {
+            scales[s] = fitScaleMin(&xb[s * 16], &importance[s * 16], 16, 3, -0.5f, 15, &mins[s]);
+            if (scales[s] > maxScale) maxScale = scales[s];
+            if (mins[s] > maxMin) maxMin = mins[s];
+        }
+
+        const float iscale = maxScale > 0.0f ? 15.0f / maxScale : 0.0f;
+        const float imin = maxMin > 0.0f ? 15.0f / maxMin : 0.0f;
+        for (NnUint s = 0; s < nSubBlocks; s++) {
+            long ls = lrintf(iscale * scales[s]);
+            long lm = lrintf(imin * mins[s]);
+            ls = ls < 0 ? 0 : (ls > 15 ? 15 : ls);
+            lm = lm < 0 ? 0 : (lm > 15 ? 15 : lm);
+            o->scales[s] = ls | (lm << 4);
+        }
+        o->d = CONVERT_F32_TO_F16(maxScale / 15.0f);
+        o->dmin = CONVERT_F32_TO_F16(maxMin / 15.0f);
+
+        const float d = CONVERT_F16_TO_F32(o->d);
+        const float dmin = CONVERT_F16_TO_F32(o->dmin);
+        std::memset(o->qs, 0, sizeof(o->qs));
+        for (NnUint j = 0; j < Q2K_BLOCK_SIZE; j++) {
+            const float dl = d * (o->scales[j / 16] & 0xF);
+            const float ml = dmin * (o->scales[j / 16] >> 4);
+            long q = dl != 0.0f ? lrintf((xb[j] + ml) / dl) : 0;
+            q = q < 0 ? 0 : (q > 3 ? 3 : q);
+            const NnUint c = j / 32;
+            const NnUint k = j % 32;
+            o->qs[8 * c + k % 8] |= q << (2 * (k / 8));
+        }
+    }
+}
+
+void dequantizeQ2KtoF32(const NnBlockQ2K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex) {
+    assert(n % Q2K_BLOCK_SIZE == 0);
+    const NnUint nBlocks = n / Q2K_BLOCK_SIZE;
+    SPLIT_THREADS(start, end, nBlocks, nThreads, threadIndex);
+
+    for (NnUint i = start; i < end; i++) {
+        const NnBlockQ2K *b = &x[i];
+        const float d = CONVERT_F16_TO_F32(b->d);
+        const float dmin = CONVERT_F16_TO_F32(b->dmin);
+        for (NnUint j = 0; j < Q2K_BLOCK_SIZE; j++) {
+            const NnUint c = j / 32;
+            const NnUint k = j % 32;
+            const int q = (b->qs[8 * c + k % 8] >> (2 * (k / 8))) & 3;
+            output[i * Q2K_BLOCK_SIZE + j] = d * (b->scales[j / 16] & 0xF) * q - dmin * (b->scales[j / 16] >> 4);
+        }
+    }
+}
+
 const char *floatTypeToString(NnFloatType type) {
     if (type == F_UNK) return "F_UNK";
     if (type == F_32) return "F_32";
     if (type == F_16) return "F_16";
     if (type == F_Q40) return "F_Q40";
     if (type == F_Q80) return "F_Q80";
+    if (type == F_Q4K) return "F_Q4K";
+    if (type == F_Q6K) return "F_Q6K";
+    if (type == F_Q2K) return "F_Q2K";
     throw std::invalid_argument("Unknown float type");
 }
+#endif
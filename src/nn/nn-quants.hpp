@@ -9,6 +9,19 @@
     #include <immintrin.h>
 #endif
 
+// A portable build (DLLAMA_CPU_VARIANTS in the Makefile) compiles the CPU kernels once per instruction set,
+// every copy appends the name of its variant to the symbols it exports
+#if defined(NN_CPU_VARIANT)
+    #define NN_CPU_VARIANT_CONCAT(name, variant) name##_##variant
+    #define NN_CPU_VARIANT_EXPAND(name, variant) NN_CPU_VARIANT_CONCAT(name, variant)
+    #define NN_CPU_VARIANT_NAME(name) NN_CPU_VARIANT_EXPAND(name, NN_CPU_VARIANT)
+
+    #define quantizeF32toQ80 NN_CPU_VARIANT_NAME(quantizeF32toQ80)
+    #define dequantizeQ80toF32 NN_CPU_VARIANT_NAME(dequantizeQ80toF32)
+    #define quantizeF32toQ40 NN_CPU_VARIANT_NAME(quantizeF32toQ40)
+    #define dequantizeQ40toF32 NN_CPU_VARIANT_NAME(dequantizeQ40toF32)
+#endif
+
 typedef std::uint8_t NnByte;
 typedef std::uint32_t NnUint;
 typedef std::size_t NnSize;
@@ -52,6 +65,10 @@ NnFp16 convertF32ToF16Impl(const float x);
 
 #define Q40_BLOCK_SIZE 32
 #define Q80_BLOCK_SIZE 32
+// Super-block formats, every super-block holds 8 Q80-sized sub-blocks
+#define Q4K_BLOCK_SIZE 256
+#define Q6K_BLOCK_SIZE 256
+#define Q2K_BLOCK_SIZE 256
 
 enum NnFloatType {
     F_UNK = -1,
@@ -59,6 +76,9 @@ enum NnFloatType {
     F_16 = 1,
     F_Q40 = 2,
     F_Q80 = 3,
+    F_Q4K = 4,
+    F_Q6K = 5,
+    F_Q2K = 6,
 };
 
 typedef struct {
@@ -71,11 +91,58 @@ typedef struct {
     std::int8_t qs[Q80_BLOCK_SIZE];
 } NnBlockQ80;
 
+// 4.5 bits per weight: w = d * scale * q - dmin * min, 8 sub-blocks of 32 weights with 6-bit scales and mins.
+// The scales and mins of the sub-blocks 0..3 are the low 6 bits of scales[0..3] and scales[4..7], the ones of
+// the sub-blocks 4..7 are the nibbles of scales[8..11] with the top 2 bits of scales[0..7] above them.
+// qs[32 * i + k] holds the weight k of the sub-block 2 * i in the low nibble and of the sub-block 2 * i + 1 in the high one
+typedef struct {
+    std::uint16_t d;
+    std::uint16_t dmin;
+    std::uint8_t scales[12];
+    std::uint8_t qs[Q4K_BLOCK_SIZE / 2];
+} NnBlockQ4K;
+
+// 6.5625 bits per weight: w = d * scales[s] * (q - 32), 16 sub-blocks of 16 weights with 8-bit scales.
+// The weight k of the chunk c (32 weights) has its low 4 bits in ql[16 * c + k % 16] (the low nibble for k < 16)
+// and its high 2 bits in qh[8 * c + k % 8] at the bit 2 * (k / 8)
+typedef struct {
+    std::uint8_t ql[Q6K_BLOCK_SIZE / 2];
+    std::uint8_t qh[Q6K_BLOCK_SIZE / 4];
+    std::int8_t scales[Q6K_BLOCK_SIZE / 16];
+    std::uint16_t d;
+} NnBlockQ6K;
+
+// 2.625 bits per weight: w = d * scale * q - dmin * min, 16 sub-blocks of 16 weights with 4-bit scales (the low
+// nibbles of scales) and mins (the high nibbles). The weight k of the chunk c (32 weights) is in qs[8 * c + k % 8]
+// at the bit 2 * (k / 8), as the high bits of Q6K
+typedef struct {
+    std::uint8_t scales[Q2K_BLOCK_SIZE / 16];
+    std::uint8_t qs[Q2K_BLOCK_SIZE / 4];
+    std::uint16_t d;
+    std::uint16_t dmin;
+} NnBlockQ2K;
+
 void initQuants();
 void quantizeF32toQ80(const float *input, NnBlockQ80 *output, const NnUint k, const NnUint nThreads, const NnUint threadIndex);
 void dequantizeQ80toF32(const NnBlockQ80 *input, float* output, const NnUint k, const NnUint nThreads, const NnUint threadIndex);
 void quantizeF32toQ40(const float *x, NnBlockQ40 *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
 void dequantizeQ40toF32(const NnBlockQ40 *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void quantizeF32toQ4K(const float *x, NnBlockQ4K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void dequantizeQ4KtoF32(const NnBlockQ4K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void quantizeF32toQ6K(const float *x, NnBlockQ6K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void dequantizeQ6KtoF32(const NnBlockQ6K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void quantizeF32toQ2K(const float *x, NnBlockQ2K *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+void dequantizeQ2KtoF32(const NnBlockQ2K *x, float *output, const NnUint n, const NnUint nThreads, const NnUint threadIndex);
+
+static inline void getScaleMinQ4K(const NnBlockQ4K *b, const NnUint s, std::uint8_t *scale, std::uint8_t *min) {
+    if (s < 4) {
+        *scale = b->scales[s] & 63;
+        *min = b->scales[s + 4] & 63;
+    } else {
+        *scale = (b->scales[s + 4] & 0xF) | ((b->scales[s - 4] >> 6) << 4);
+        *min = (b->scales[s + 4] >> 4) | ((b->scales[s] >> 6) << 4);
+    }
+}
 
 const char *floatTypeToString(NnFloatType type);
 
@@ -0,0 +1,308 @@
+#include "nn-topology.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <dirent.h>
+#include <sched.h>
+#endif
+
+#define SYS_CPU_DIR "/sys/devices/system/cpu"
+#define SYS_NODE_DIR "/sys/devices/system/node"
+#define MAX_CACHE_INDEXES 8
+#define FULL_CAPACITY 1024
+
+static bool readSysFile(const char *path, char *out, NnSize outSize) {
+    FILE *fd = fopen(path, "r");
+    if (fd == NULL)
+        return false;
+    NnSize n = fread(out, 1, outSize - 1, fd);
+    fclose(fd);
+    out[n] = '\0';
+    while (n > 0 && (out[n - 1] == '\n' || out[n - 1] == ' '))
+        out[--n] = '\0';
+    return n > 0;
+}
+
+static bool readSysUint(const char *path, NnUint *out) {
+    char buffer[32];
+    if (!readSysFile(path, buffer, sizeof(buffer)))
+        return false;
+    *out = (NnUint)std::strtoul(buffer, NULL, 10);
+    return true;
+}
+
+static bool readSysCpuList(const char *path, std::vector<NnUint> *out) {
+    char buffer[4096];
+    if (!readSysFile(path, buffer, sizeof(buffer)))
+        return false;
+    *out = parseCpuList(buffer);
+    return !out->empty();
+}
+
+std::vector<NnUint> parseCpuList(const char *list) {
+    // Format used by sysfs and taskset, e.g. "0-3,8,10-11"
+    std::vector<NnUint> cpus;
+    const char *p = list;
+    while (*p != '\0') {
+        while (*p == ',' || *p == ' ')
+            p++;
+        if (*p == '\0')
+            break;
+        // strtoul accepts a sign and leading spaces, a CPU index starts with a digit
+        if (!std::isdigit((unsigned char)*p))
+            throw std::invalid_argument("Invalid CPU list: " + std::string(list));
+        char *end;
+        unsigned long first = std::strtoul(p, &end, 10);
+        if (end == p)
+            throw std::invalid_argument("Invalid CPU list: " + std::string(list));
+        unsigned long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            if (!std::isdigit((unsigned char)*p))
+                throw std::invalid_argument("Invalid CPU list: " + std::string(list));
+            last = std::strtoul(p, &end, 10);
+            if (end == p || last < first)
+                throw std::invalid_argument("Invalid CPU list: " + std::string(list));
+            p = end;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+            cpus.push_back((NnUint)cpu);
+        if (*p != ',' && *p != '\0')
+            throw std::invalid_argument("Invalid CPU list: " + std::string(list));
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+static NnCpuInfo *findCpu(NnCpuTopology *topology, NnUint cpuIndex) {
+    for (NnCpuInfo &cpu : topology->cpus) {
+        if (cpu.cpuIndex == cpuIndex)
+            return &cpu;
+    }
+    return nullptr;
+}
+
+static void detectSmt(NnCpuInfo *cpu) {
+    char path[256];
+    std::vector<NnUint> siblings;
+    snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%u/topology/thread_siblings_list", cpu->cpuIndex);
+    if (!readSysCpuList(path, &siblings)) {
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%u/topology/core_cpus_list", cpu->cpuIndex);
+        if (!readSysCpuList(path, &siblings))
+            return;
+    }
+    cpu->coreId = siblings[0];
+    for (NnUint i = 0; i < siblings.size(); i++) {
+        if (siblings[i] == cpu->cpuIndex)
+            cpu->smtIndex = i;
+    }
+}
+
+static void detectCaches(NnCpuInfo *cpu) {
+    char path[256];
+    NnUint llcLevel = 0;
+    for (NnUint cacheIndex = 0; cacheIndex < MAX_CACHE_INDEXES; cacheIndex++) {
+        NnUint level;
+        std::vector<NnUint> shared;
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%u/cache/index%u/level", cpu->cpuIndex, cacheIndex);
+        if (!readSysUint(path, &level))
+            break;
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%u/cache/index%u/shared_cpu_list", cpu->cpuIndex, cacheIndex);
+        if (!readSysCpuList(path, &shared))
+            continue;
+        if (level == 2)
+            cpu->l2GroupId = shared[0];
+        if (level >= llcLevel) {
+            llcLevel = level;
+            cpu->llcGroupId = shared[0];
+        }
+    }
+}
+
+static NnUint detectNumaNodes(NnCpuTopology *topology) {
+    NnUint nNodes = 0;
+#ifdef __linux__
+    DIR *dir = opendir(SYS_NODE_DIR);
+    if (dir == NULL)
+        return 1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (std::strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9')
+            continue;
+        NnUint node = (NnUint)std::strtoul(&entry->d_name[4], NULL, 10);
+        char path[256];
+        std::vector<NnUint> cpus;
+        snprintf(path, sizeof(path), SYS_NODE_DIR "/node%u/cpulist", node);
+        if (!readSysCpuList(path, &cpus))
+            continue;
+        for (NnUint cpuIndex : cpus) {
+            NnCpuInfo *cpu = findCpu(topology, cpuIndex);
+            if (cpu != nullptr)
+                cpu->numaNode = node;
+        }
+        nNodes++;
+    }
+    closedir(dir);
+#endif
+    return nNodes > 0 ? nNodes : 1;
+}
+
+static void detectCoreTypes(NnCpuTopology *topology) {
+    // Intel hybrid CPUs expose separate PMUs for P-cores and E-cores
+    std::vector<NnUint> performanceCpus;
+    std::vector<NnUint> efficiencyCpus;
+    bool hasIntelHybrid = readSysCpuList("/sys/devices/cpu_core/cpus", &performanceCpus) &&
+        readSysCpuList("/sys/devices/cpu_atom/cpus", &efficiencyCpus);
+    if (hasIntelHybrid) {
+        for (NnUint cpuIndex : performanceCpus) {
+            NnCpuInfo *cpu = findCpu(topology, cpuIndex);
+            if (cpu != nullptr)
+                cpu->coreType = CORE_PERFORMANCE;
+        }
+        for (NnUint cpuIndex : efficiencyCpus) {
+            NnCpuInfo *cpu = findCpu(topology, cpuIndex);
+            if (cpu != nullptr) {
+                cpu->coreType = CORE_EFFICIENCY;
+                cpu->capacity = FULL_CAPACITY / 2;
+            }
+        }
+        topology->isHybrid = true;
+        return;
+    }
+
+    // ARM big.LITTLE reports the relative capacity of every core
+    NnUint maxCapacity = 0;
+    NnUint minCapacity = FULL_CAPACITY;
+    for (NnCpuInfo &cpu : topology->cpus) {
+        char path[256];
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%u/cpu_capacity", cpu.cpuIndex);
+        readSysUint(path, &cpu.capacity);
+        maxCapacity = std::max(maxCapacity, cpu.capacity);
+        minCapacity = std::min(minCapacity, cpu.capacity);
+    }
+    if (maxCapacity == minCapacity)
+        return;
+    for (NnCpuInfo &cpu : topology->cpus)
+        cpu.coreType = cpu.capacity == maxCapacity ? CORE_PERFORMANCE : CORE_EFFICIENCY;
+    topology->isHybrid = true;
+}
+
+NnCpuTopology detectCpuTopology() {
+    NnCpuTopology topology;
+    topology.nCores = 0;
+    topology.nNumaNodes = 1;
+    topology.isHybrid = false;
+
+    std::vector<NnUint> online;
+    if (!readSysCpuList(SYS_CPU_DIR "/online", &online)) {
+        NnUint nCpus = std::thread::hardware_concurrency();
+        for (NnUint i = 0; i < nCpus; i++)
+            online.push_back(i);
+    }
+
+    for (NnUint cpuIndex : online) {
+        NnCpuInfo cpu;
+        cpu.cpuIndex = cpuIndex;
+        cpu.coreId = cpuIndex;
+        cpu.smtIndex = 0;
+        cpu.l2GroupId = cpuIndex;
+        cpu.llcGroupId = 0;
+        cpu.numaNode = 0;
+        cpu.capacity = FULL_CAPACITY;
+        cpu.coreType = CORE_UNKNOWN;
+        detectSmt(&cpu);
+        detectCaches(&cpu);
+        topology.cpus.push_back(cpu);
+        if (cpu.smtIndex == 0)
+            topology.nCores++;
+    }
+
+    topology.nNumaNodes = detectNumaNodes(&topology);
+    detectCoreTypes(&topology);
+    return topology;
+}
+
+const char *coreTypeToString(NnCpuCoreType type) {
+    if (type == CORE_PERFORMANCE) return "P";
+    if (type == CORE_EFFICIENCY) return "E";
+    return "-";
+}
+
+void printCpuTopology(NnCpuTopology *topology) {
+    printf("🧭 CPU topology: %zu threads, %u cores, %u NUMA nodes%s\n",
+        topology->cpus.size(), topology->nCores, topology->nNumaNodes, topology->isHybrid ? ", hybrid" : "");
+    for (NnCpuInfo &cpu : topology->cpus) {
+        printf("🧭 cpu%-3u core=%-3u smt=%u type=%s capacity=%-4u l2=%-3u llc=%-3u node=%u\n",
+            cpu.cpuIndex, cpu.coreId, cpu.smtIndex, coreTypeToString(cpu.coreType),
+            cpu.capacity, cpu.l2GroupId, cpu.llcGroupId, cpu.numaNode);
+    }
+}
+
+static NnUint getCoreTypeRank(NnCpuCoreType type) {
+    return type == CORE_EFFICIENCY ? 1 : 0;
+}
+
+std::vector<NnUint> selectExecutorCpus(NnCpuTopology *topology, NnUint nThreads, NnCpuSelectionPolicy *policy) {
+    std::vector<NnCpuInfo> candidates;
+    for (NnCpuInfo &cpu : topology->cpus) {
+        if (policy->skipSmtSiblings && cpu.smtIndex > 0)
+            continue;
+        if (std::find(policy->excludedCpus.begin(), policy->excludedCpus.end(), cpu.cpuIndex) != policy->excludedCpus.end())
+            continue;
+        candidates.push_back(cpu);
+    }
+    if (candidates.size() < nThreads)
+        throw std::invalid_argument("Only " + std::to_string(candidates.size()) + " CPUs are available for " + std::to_string(nThreads) + " threads");
+
+    // Fast cores first, every physical core once before any SMT sibling
+    std::sort(candidates.begin(), candidates.end(), [](const NnCpuInfo &a, const NnCpuInfo &b) {
+        if (getCoreTypeRank(a.coreType) != getCoreTypeRank(b.coreType))
+            return getCoreTypeRank(a.coreType) < getCoreTypeRank(b.coreType);
+        if (a.capacity != b.capacity)
+            return a.capacity > b.capacity;
+        if (a.smtIndex != b.smtIndex)
+            return a.smtIndex < b.smtIndex;
+        return a.cpuIndex < b.cpuIndex;
+    });
+
+    // Keep all threads on one NUMA node when it has enough CPUs, so buffers stay local
+    NnUint preferredNode = candidates[0].numaNode;
+    NnUint nPreferred = (NnUint)std::count_if(candidates.begin(), candidates.end(), [&](const NnCpuInfo &cpu) {
+        return cpu.numaNode == preferredNode;
+    });
+    if (nPreferred >= nThreads) {
+        std::stable_partition(candidates.begin(), candidates.end(), [&](const NnCpuInfo &cpu) {
+            return cpu.numaNode == preferredNode;
+        });
+    }
+
+    std::vector<NnUint> cpus(nThreads);
+    for (NnUint i = 0; i < nThreads; i++)
+        cpus[i] = candidates[i].cpuIndex;
+    return cpus;
+}
+
+void pinCurrentThread(NnUint cpuIndex) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpuIndex, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        throw std::runtime_error("Failed to pin the current thread to CPU " + std::to_string(cpuIndex));
+#elif defined(_WIN32)
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpuIndex) == 0)
+        throw std::runtime_error("Failed to pin the current thread to CPU " + std::to_string(cpuIndex));
+#else
+    printf("⚠️ Thread pinning is not supported on this platform\n");
+#endif
+}
@@ -0,0 +1,43 @@
+#ifndef NN_TOPOLOGY_H
+#define NN_TOPOLOGY_H
+
+#include <vector>
+#include "nn-core.hpp"
+
+enum NnCpuCoreType {
+    CORE_UNKNOWN,
+    CORE_PERFORMANCE,
+    CORE_EFFICIENCY,
+};
+
+typedef struct {
+    NnUint cpuIndex;
+    NnUint coreId; // index of the first logical CPU of the physical core
+    NnUint smtIndex; // 0 for the first hardware thread of the core, 1 for its sibling, ...
+    NnUint l2GroupId; // index of the first logical CPU sharing the same L2 cache
+    NnUint llcGroupId; // index of the first logical CPU sharing the same last level cache
+    NnUint numaNode;
+    NnUint capacity; // relative core capacity, 1024 is the fastest core
+    NnCpuCoreType coreType;
+} NnCpuInfo;
+
+typedef struct {
+    std::vector<NnCpuInfo> cpus;
+    NnUint nCores;
+    NnUint nNumaNodes;
+    bool isHybrid;
+} NnCpuTopology;
+
+typedef struct {
+    bool skipSmtSiblings;
+    std::vector<NnUint> excludedCpus; // e.g. the core serving network interrupts
+} NnCpuSelectionPolicy;
+
+std::vector<NnUint> parseCpuList(const char *list);
+NnCpuTopology detectCpuTopology();
+void printCpuTopology(NnCpuTopology *topology);
+const char *coreTypeToString(NnCpuCoreType type);
+std::vector<NnUint> selectExecutorCpus(NnCpuTopology *topology, NnUint nThreads, NnCpuSelectionPolicy *policy);
+void pinCurrentThread(NnUint cpuIndex);
+
+#endif
@@ -594,8 +594,8 @@ void testMultiheadAtt_F32_F32() {
             const NnUint seqLen = 4096;
             const NnUint qSliceD0 = 2048;
             const NnUint kvDim0 = 512;
-            const NnKvCacheSlice kvCacheSlice = sliceKvCache(kvDim0, seqLen, 1);
-            const NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(nHeads, seqLen, 1, N_BATCHES);
+            const NnKvCacheSlice kvCacheSlice = sliceKvCache(F_32, kvDim0, seqLen, 1);
+            const NnMultiHeadAttSlice multiHeadAttSlice = sliceMultiHeadAtt(nHeads, headSize, seqLen, 1, N_BATCHES);
 
             NnUint xPipeIndex = netBuilder->addPipe("X", size2D(F_32, N_BATCHES, MULTIHEAD_ATT_DIM));
             NnUint posPipeIndex = netBuilder->addPipe("POS", size2D(F_32, N_BATCHES, 1));
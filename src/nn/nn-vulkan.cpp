@@ -466,6 +466,11 @@ static void buildShaderLayout(std::vector<NnVulkanBuffer *> &buffers, NnVulkanDe
         } break;
         case OP_MULTIHEAD_ATT: {
             const NnMultiHeadAttOpConfig *config = (NnMultiHeadAttOpConfig *)opConfig->config;
+            if (config->attentionType != ATT_FULL_SCORES)
+                throw std::invalid_argument("Vulkan supports only the full-score attention");
+            NnPointerConfig keyCache = pointerRawConfig(SRC_BUFFER, config->keyCacheBufferIndex);
+            if (data->resolveBufferSize(&keyCache).floatType != F_32)
+                throw std::invalid_argument("Vulkan supports only the F32 KV cache");
             buffers.push_back(data->pipes[config->positionPipeIndex].get());
             buffers.push_back(data->buffers[config->queryBufferIndex].get());
             buffers.push_back(data->buffers[config->keyCacheBufferIndex].get());